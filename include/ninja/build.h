@@ -32,7 +32,11 @@
 namespace ninja {
 
 struct BuildLog;
+struct BuildEventStream;
 struct BuildStatus;
+struct Completion;
+struct CompletionQueue;
+struct Directory;
 struct DiskInterface;
 struct Edge;
 struct Node;
@@ -52,6 +56,11 @@ struct Plan {
   // Returns nullptr if there's no work to do.
   Edge* FindWork();
 
+  /// Fill |batch| with |edge|, which FindWork() just returned, followed by
+  /// up to |max_size| - 1 other ready edges of the same rule and scope,
+  /// taking them off the queue.
+  void FindBatch(Edge* edge, int max_size, std::vector<Edge*>* batch);
+
   /// Returns true if there's more work to be done.
   bool more_to_do() const { return wanted_edges_ > 0 && command_edges_ > 0; }
 
@@ -70,6 +79,10 @@ struct Plan {
   /// Number of edges with commands to run.
   int command_edge_count() const { return command_edges_; }
 
+  /// Store the directories of the outputs of the commands to run that
+  /// aren't known to exist yet in |dirs|, each once and ordered by id.
+  void GetOutputDirs(std::vector<Directory*>* dirs) const;
+
   /// Reset state.  Clears want and ready sets.
   void Reset();
 
@@ -89,18 +102,46 @@ struct Plan {
     kWantToFinish
   };
 
+  /// Per-edge bookkeeping, indexed by Edge::id().
+  struct EdgeState {
+    /// Whether the edge is part of the plan.  If it is not, we do not want to
+    /// build the edge or its dependents.
+    bool planned = false;
+    /// What we want for the edge if it is planned.
+    Want want = kWantNothing;
+    /// Number of inputs whose in-edge is not ready yet.  The edge is ready
+    /// once this drops to zero.
+    int pending_inputs = 0;
+    /// Number of dirty inputs (including order-only ones), or -1 if not yet
+    /// counted.  Only maintained by CleanNode().
+    int dirty_inputs = -1;
+  };
+
+  /// Return the state of |edge|, growing |edges_| if needed.
+  EdgeState& GetEdgeState(const Edge* edge);
+
+  bool IsPlanned(const Edge* edge) const;
+
   /// Submits a ready edge as a candidate for execution.
   /// The edge may be delayed from running, for example if it's a member of a
   /// currently-full pool.
-  void ScheduleWork(std::map<Edge*, Want>::iterator want_e);
+  void ScheduleWork(Edge* edge, EdgeState* state);
+
+  /// Add edges the pool of |edge| has released to |ready_|.
+  void RetrieveReadyEdges(Pool* pool);
 
-  /// Keep track of which edges we want to build in this plan.  If this map does
-  /// not contain an entry for an edge, we do not want to build the entry or its
-  /// dependents.  If it does contain an entry, the enumeration indicates what
-  /// we want for the edge.
-  std::map<Edge*, Want> want_;
+  /// Keep track of which edges we want to build in this plan.
+  std::vector<EdgeState> edges_;
 
-  std::set<Edge*> ready_;
+  /// Edges that are or have been part of the plan since the last Reset().
+  std::vector<Edge*> planned_;
+
+  /// Edges ready to run, kept as a min-heap on Edge::id() so that the order
+  /// in which they are handed out does not depend on allocation addresses.
+  std::vector<Edge*> ready_;
+
+  /// Scratch buffer for Pool::RetrieveReadyEdges().
+  std::vector<Edge*> released_;
 
   /// Total number of edges that have commands (not phony).
   int command_edges_;
@@ -117,17 +158,37 @@ struct CommandRunner {
   virtual bool CanRunMore() = 0;
   virtual bool StartCommand(Edge* edge) = 0;
 
+  /// Start the edges of |batch| as one command, see
+  /// Edge::EvaluateBatchCommand().  WaitForCommand() still returns a result
+  /// for each edge.  Runners that can't combine edges start them one by one.
+  virtual bool StartBatch(const std::vector<Edge*>& batch) {
+    for (Edge* edge : batch) {
+      if (!StartCommand(edge))
+        return false;
+    }
+    return true;
+  }
+
+  /// Return true if StartCommand() hands the response file of |edge| to
+  /// the command itself, so that it needn't be written to disk.
+  virtual bool PassesRspfile(Edge* edge) { return false; }
+
   /// The result of waiting for a command.
   struct Result {
-    Result() : edge(nullptr) {}
+    Result() : edge(nullptr), max_rss(0) {}
     Edge* edge;
     ExitStatus status;
     std::string output;
+    /// Peak resident set size of the command in bytes, 0 if unknown.
+    int64_t max_rss;
     bool success() const { return status == ExitSuccess; }
   };
   /// Wait for a command to complete, or return false if interrupted.
   virtual bool WaitForCommand(Result* result) = 0;
 
+  /// Return true if WaitForCommand() would return without blocking.
+  virtual bool HasFinishedCommand() { return true; }
+
   virtual std::vector<Edge*> GetActiveEdges() { return std::vector<Edge*>(); }
   virtual void Abort() {}
 };
@@ -136,7 +197,9 @@ struct CommandRunner {
 struct BuildConfig {
   BuildConfig()
       : verbosity(NORMAL), dry_run(false), parallelism(1), failures_allowed(1),
-        max_load_average(-0.0f) {}
+        max_load_average(-0.0f), max_pressure(-1.0), min_parallelism(1),
+        pipelined_scan(false),
+        rspfile_memfd(false), completion_threads(0), event_fd(-1) {}
 
   enum Verbosity {
     NORMAL,
@@ -150,10 +213,33 @@ struct BuildConfig {
   /// The maximum load average we must not exceed. A negative value
   /// means that we do not have any limit.
   double max_load_average;
+  /// The stall percentage reported by Linux pressure stall information
+  /// above which fewer jobs are run in parallel.  Parallelism is adapted
+  /// between 1 and |parallelism|.  A negative value disables adaptation.
+  double max_pressure;
+  /// The fewest jobs |max_pressure| may cut parallelism down to.  Values
+  /// outside [1, |parallelism|] are clamped.
+  int min_parallelism;
+  /// Start commands for dirty edges as soon as the scan has proven them
+  /// runnable, instead of waiting for the whole graph to be scanned.
+  bool pipelined_scan;
+  /// Pass response files to commands as sealed memfds, named by
+  /// /proc/self/fd/N in $rspfile, instead of writing them to disk.  Only
+  /// supported on Linux, and not with -d keeprsp, persistent workers or a
+  /// spawn server.
+  bool rspfile_memfd;
+  /// Threads that read depfiles and stat outputs of finished commands while
+  /// the main loop keeps starting commands.  The results are still applied
+  /// in the order the commands finished.  0 does all of it on the main
+  /// loop.  The DiskInterface must be safe to use from these threads, see
+  /// there.
+  int completion_threads;
+  /// File descriptor to write build events to as JSON lines, or -1.
+  int event_fd;
 };
 
 /// Builder wraps the build process: starting commands, updating status.
-struct Builder {
+struct Builder : public DependencyScanObserver {
   Builder(State* state, const BuildConfig& config, BuildLog* build_log,
           DiskInterface* disk_interface);
   ~Builder();
@@ -176,6 +262,11 @@ struct Builder {
 
   bool StartEdge(Edge* edge, std::string* err);
 
+  /// DependencyScanObserver implementation used with
+  /// BuildConfig::pipelined_scan: start edges while AddTarget() is still
+  /// scanning.
+  bool EdgeScanned(Edge* edge, std::string* err) override;
+
   /// Update status ninja logs following a command termination.
   /// @return false if the build can not proceed further due to a fatal error.
   bool FinishCommand(CommandRunner::Result* result, std::string* err);
@@ -190,13 +281,61 @@ struct Builder {
   std::unique_ptr<BuildStatus> status_;
 
  private:
-  bool ExtractDeps(CommandRunner::Result* result, const std::string& deps_type,
-                   const std::string& deps_prefix,
-                   std::vector<Node*>* deps_nodes, std::string* err);
+  /// Finishing a command is split into three steps, so that the middle one
+  /// can run on a completion thread.  PrepareCompletion() copies what
+  /// ProcessCompletion() needs out of the graph, ProcessCompletion() reads
+  /// the deps and stats outputs without touching the graph, and
+  /// CommitCompletion() applies the result to the plan, status and logs.
+  void PrepareCompletion(Completion* completion);
+  void ProcessCompletion(Completion* completion);
+  bool CommitCompletion(Completion* completion, std::string* err);
+
+  /// Read the deps of a finished command, filtering its output if needed.
+  bool ExtractDeps(Completion* completion, std::string* err);
+
+  /// Hand a finished command to the completion threads.
+  void QueueCompletion(CommandRunner::Result* result);
+  /// Commit the oldest queued completion, waiting for it if |wait|.
+  /// Sets |*committed| if there was one to commit.
+  bool CommitQueuedCompletion(bool wait, bool* committed, std::string* err);
+  /// Return true if there's work for ReapCommand() that doesn't block.
+  bool HasFinishedWork();
+
+  /// Set up the command runner and status for running commands, unless that
+  /// already happened.
+  void StartBuild();
+
+  /// Start |edge| if it's not phony, or finish it right away otherwise.
+  /// Edges of batchable rules take other ready edges along.
+  bool StartWork(Edge* edge, std::string* err);
+
+  /// Start the edges of |batch_| as one command.
+  bool StartBatch(std::string* err);
+
+  /// Wait for the next command to finish and process its result.
+  bool ReapCommand(std::string* err);
+
+  /// Start ready edges and process finished commands without blocking.
+  bool PumpCommands(std::string* err);
+
+  /// Clean up and report the end of the build to the status.
+  void AbortBuild();
 
   DiskInterface* disk_interface_;
   DependencyScan scan_;
 
+  /// Whether StartBuild() was called without the build being finished.
+  bool build_started_;
+  /// Number of edges started but not yet finished.
+  int pending_commands_;
+  /// Scratch buffer for Plan::FindBatch().
+  std::vector<Edge*> batch_;
+  /// Number of failing commands we may still tolerate.
+  int failures_allowed_;
+  /// Finished commands handed to BuildConfig::completion_threads, or
+  /// nullptr if they're processed on the main loop.
+  std::unique_ptr<CompletionQueue> completions_;
+
   // Unimplemented copy ctor and operator= ensure we don't copy the auto_ptr.
   Builder(const Builder& other);         // DO NOT IMPLEMENT
   void operator=(const Builder& other);  // DO NOT IMPLEMENT
@@ -205,12 +344,18 @@ struct Builder {
 /// Tracks the status of a build: completion fraction, printing updates.
 struct BuildStatus {
   explicit BuildStatus(const BuildConfig& config);
+  ~BuildStatus();
   void PlanHasTotalEdges(int total);
   void BuildEdgeStarted(Edge* edge);
-  void BuildEdgeFinished(Edge* edge, bool success, const std::string& output,
-                         int* start_time, int* end_time);
+  /// |restat_cleaned| says whether restat found outputs that the command
+  /// left unchanged.
+  void BuildEdgeFinished(const CommandRunner::Result& result,
+                         bool restat_cleaned, int* start_time, int* end_time);
   void BuildStarted();
-  void BuildFinished();
+  void BuildFinished(bool success);
+
+  /// The number of jobs allowed to run in parallel was changed to |limit|.
+  void ParallelismChanged(int limit);
 
   enum EdgeStatus {
     kEdgeStarted,
@@ -226,8 +371,25 @@ struct BuildStatus {
   std::string FormatProgressStatus(const char* progress_status_format,
                                    EdgeStatus status) const;
 
+  /// Like above, but append the progress status to |out|.
+  void FormatProgressStatus(const char* progress_status_format,
+                            EdgeStatus status, std::string* out) const;
+
+  /// Whether a status line was held back to limit the refresh rate.
+  bool has_pending_status() const { return pending_edge_ != nullptr; }
+
+  /// Print the status line that was held back, if any.
+  void PrintPendingStatus();
+
+  /// Whether status lines overprint each other.  This is detected from
+  /// stdout; tests set it.
+  void set_smart_terminal(bool smart) { printer_.set_smart_terminal(smart); }
+
  private:
-  void PrintStatus(Edge* edge, EdgeStatus status);
+  /// Print the status line of |edge|.  On a smart terminal, the line is held
+  /// back if the last one was printed less than |refresh_millis_| ago,
+  /// unless |force| is set.
+  void PrintStatus(Edge* edge, EdgeStatus status, bool force);
 
   const BuildConfig& config_;
 
@@ -236,6 +398,9 @@ struct BuildStatus {
 
   int started_edges_, finished_edges_, total_edges_;
 
+  /// Current number of jobs allowed to run in parallel.
+  int parallelism_limit_;
+
   /// Map of running edge to time the edge started running.
   typedef std::map<Edge*, int> RunningEdgeMap;
   RunningEdgeMap running_edges_;
@@ -243,9 +408,25 @@ struct BuildStatus {
   /// Prints progress output.
   LinePrinter printer_;
 
+  /// Events for tools following the build, if BuildConfig::event_fd is set.
+  std::unique_ptr<BuildEventStream> events_;
+
   /// The custom progress status format to use.
   const char* progress_status_format_;
 
+  /// Minimum time between two redraws of the status line.
+  int64_t refresh_millis_;
+
+  /// Time the status line was last redrawn.
+  int64_t last_refresh_millis_;
+
+  /// The edge and status of the status line that was held back, if any.
+  Edge* pending_edge_;
+  EdgeStatus pending_status_;
+
+  /// The status line, kept to reuse its buffer.
+  std::string status_line_;
+
   template <size_t S>
   void SnprintfRate(double rate, char (&buf)[S], const char* format) const {
     if (rate == -1)
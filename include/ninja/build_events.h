@@ -0,0 +1,79 @@
+// Copyright 2018 Frank Benkstein. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_BUILD_EVENTS_H_
+#define NINJA_BUILD_EVENTS_H_
+
+#include <ninja/build.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace ninja {
+
+struct Edge;
+
+/// Writes what happens during a build to a file descriptor, one JSON object
+/// per line, for tools that follow builds.  See the manual for the events.
+///
+/// The lines are written by a thread of their own, so a slow reader never
+/// holds up the build.  Should the reader fall too far behind, events are
+/// dropped and counted in the final event instead.
+struct BuildEventStream {
+  /// Write to |fd|, which is left open.
+  explicit BuildEventStream(int fd);
+  /// Wait until all events are written.
+  ~BuildEventStream();
+
+  void PlanHasTotalEdges(int total);
+  void EdgeStarted(const Edge* edge, int64_t start_millis);
+  void EdgeFinished(const CommandRunner::Result& result, bool restat_cleaned,
+                    int64_t start_millis, int64_t end_millis);
+  void BuildFinished(bool success, int64_t time_millis);
+
+  /// Limit of the bytes waiting to be written before events are dropped.
+  static const size_t kMaxPending = 1 << 20;
+
+ private:
+  /// Hand |line_| to the writer thread, unless there are too many bytes
+  /// waiting already and |force| isn't set.
+  void Emit(bool force);
+
+  /// Body of the writer thread.
+  void Run();
+
+  int fd_;
+  /// The event being formatted, kept to reuse its buffer.
+  std::string line_;
+  /// Last total reported, to leave out repeats.
+  int total_edges_;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  /// Guarded by |mutex_|: the lines waiting to be written, the number of
+  /// events dropped and whether the stream is shutting down.
+  std::string pending_;
+  uint64_t dropped_;
+  bool done_;
+
+  /// Last, so that it starts once everything else is set up.
+  std::thread writer_;
+};
+
+}  // namespace ninja
+
+#endif  // NINJA_BUILD_EVENTS_H_
@@ -16,7 +16,10 @@
 #define NINJA_BUILD_LOG_H_
 
 #include <stdio.h>
+#include <memory>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include <flatbuffers/flatbuffers.h>
 
@@ -31,6 +34,32 @@ struct Edge;
 struct Node;
 struct State;
 
+/// An immutable list of dependencies.  Outputs with byte-identical deps
+/// share one DepsSet, both in memory and in the log.
+struct DepsSet {
+  explicit DepsSet(std::vector<Node*> nodes) : nodes(std::move(nodes)) {}
+
+  std::vector<Node*> nodes;
+  /// Hash of |nodes|, see BuildLog::HashDeps().
+  uint64_t hash = 0;
+  /// Id of the set's record in the open log, -1 if not written yet.
+  int id = -1;
+
+  /// Results of the last DependencyScan over |nodes|, valid as long as
+  /// |scan_id| matches the scan.  This lets edges sharing the set skip
+  /// computing them again.
+  struct ScanResult {
+    uint64_t scan_id = 0;
+    /// The first dirty node, nullptr if none is dirty.
+    Node* dirty_input = nullptr;
+    /// The clean node with the latest mtime.
+    Node* most_recent_input = nullptr;
+    /// Whether all in-edges of |nodes| were ready.
+    bool ready = false;
+  };
+  mutable ScanResult scan;
+};
+
 /// Can answer questions about the manifest for the BuildLog.
 struct BuildLogUser {
   /// Return if a given output is no longer part of the build manifest.
@@ -58,24 +87,27 @@ struct BuildLog {
   bool OpenForWrite(const std::string& path, const BuildLogUser& user,
                     std::string* err);
   bool RecordCommand(Edge* edge, int start_time, int end_time,
-                     TimeStamp mtime = 0);
+                     TimeStamp mtime = 0, uint64_t max_rss = 0);
   bool RecordDeps(Node* node, TimeStamp mtime, const std::vector<Node*>& nodes);
   bool RecordDeps(Node* node, TimeStamp mtime, int node_count, Node** nodes);
   void Close();
 
   // Reading (startup-time) interface.
   struct Deps {
-    Deps(int64_t mtime, int node_count)
-        : mtime(mtime), node_count(node_count), nodes(new Node*[node_count]) {}
-    ~Deps() { delete[] nodes; }
+    Deps(int64_t mtime, DepsSet* set)
+        : mtime(mtime), node_count(static_cast<int>(set->nodes.size())),
+          nodes(set->nodes.data()), set(set) {}
     TimeStamp mtime;
     int node_count;
+    /// Points into |set|.
     Node** nodes;
+    DepsSet* set;
   };
   bool Load(const std::string& path, State* state, std::string* err);
   Deps* GetDeps(Node* node);
 
   static uint64_t HashCommand(std::string_view command);
+  static uint64_t HashDeps(int node_count, Node* const* nodes);
 
   using LogEntry = log::BuildEntryT;
 
@@ -93,16 +125,41 @@ struct BuildLog {
   /// Serialize an entry into a log file.
   bool WriteEntry(FILE* f, const LogEntry& entry);
 
-  /// Rewrite the known log entries, throwing away old data.
+  /// Rewrite the known log entries, throwing away old data, and index the
+  /// result for lazy loading.  Entries of outputs that the State passed to
+  /// Load() doesn't know are kept without adding nodes for them.
   bool Recompact(const std::string& path, const BuildLogUser& user,
                  std::string* err);
 
   typedef ExternalStringHashMap<std::unique_ptr<LogEntry>>::Type Entries;
   const Entries& entries() const { return entries_; }
 
+  /// Number of threads Load() verifies records on, 0 for one per usable
+  /// processor (see GetUsableProcessorCount()).
+  void set_load_threads(int threads) { load_threads_ = threads; }
+
+  /// If set, Load() keeps the indexed part of a recompacted log mapped and
+  /// only reads and decodes its records when LookupByOutput() or GetDeps()
+  /// first need them.  Records appended after recompaction are still
+  /// loaded.  Startup then reads the index, which has a few words per path,
+  /// but not the records.
+  void set_lazy_load(bool lazy_load) { lazy_load_ = lazy_load; }
+
+  /// Decode all records that a lazy Load() skipped.  Needed before
+  /// iterating over entries(), nodes() or deps().
+  void MaterializeAll();
+
+  /// The 90th percentile of the peak memory usage of logged commands, 0 if
+  /// unknown.  For a lazily loaded log this is the value at the time of the
+  /// last recompaction.
+  uint64_t TypicalMaxRss() const;
+
   /// Used for tests and tools.
   const std::vector<Node*>& nodes() const { return nodes_; }
   const std::vector<std::unique_ptr<Deps>>& deps() const { return deps_; }
+  const std::vector<std::unique_ptr<DepsSet>>& deps_sets() const {
+    return deps_sets_;
+  }
 
  private:
   // Updates the in-memory representation.  Takes ownership of |deps|.
@@ -110,18 +167,124 @@ struct BuildLog {
   bool UpdateDeps(int out_id, std::unique_ptr<Deps> deps);
   // Write a node name record, assigning it an id.
   bool RecordId(Node* node);
-  // Write a command record.
-  bool RecordCommand(const std::string& path, uint64_t command_hash,
-                     int start_time, int end_time, TimeStamp mtime);
+  // Write a deps set record, assigning it an id.
+  bool RecordDepsSet(DepsSet* set);
+  // Return the shared set for |nodes|, creating it if needed.
+  DepsSet* InternDeps(int node_count, Node* const* nodes);
+  // Write a command record for all outputs of an edge: |outputs| and, for
+  // outputs the State doesn't know, |unknown_outputs|.
+  bool RecordCommand(const std::vector<Node*>& outputs,
+                     const std::vector<std::string_view>& unknown_outputs,
+                     uint64_t command_hash, int start_time, int end_time,
+                     TimeStamp mtime, uint64_t max_rss);
+  // Write an edge record for the outputs with path ids |ids|.
+  bool WriteEdgeEntry(const std::vector<uint32_t>& ids, uint64_t command_hash,
+                      int start_time, int end_time, TimeStamp mtime,
+                      uint64_t max_rss);
+  // Write a path record for |path| with |id|.
+  bool WritePathEntry(std::string_view path, uint32_t id);
+  // Return the in-memory entry for |output|, creating it if needed.  Sets
+  // |added| if it was created.
+  LogEntry* FindOrAddEntry(HashedStringView output, bool* added);
+  // Replace the MurmurHash64A command hashes of logs older than version 6
+  // with the current hash, for the commands that didn't change.
+  void MigrateCommandHashes();
+  // Give |node| an id if it doesn't have one yet, either the id its path
+  // already has or a new one.  Sets |recorded| if a path record was written.
+  bool AssignId(Node* node, bool* recorded);
+  // Like AssignId(), for a |path| that the State has no node for.
+  bool AssignId(std::string_view path, uint32_t* id, bool* recorded);
+  // Give |node| the id its path already has in the log, if any.
+  void FindId(Node* node);
+  // Make |path| the path of |id|.  Returns false if the path already has an
+  // id.
+  bool AddPath(uint32_t id, std::string_view path);
+  // Return whether |id| has a path, decoding its path record if needed.
+  bool HasPath(uint32_t id);
+  // Return the path of |id|, which must have one.
+  std::string_view IdPath(uint32_t id) const;
+  // Return the node of |id|, adding it to the State if needed.  Only deps
+  // need nodes, so other paths are kept out of the State.
+  Node* PathNode(uint32_t id);
 
-  /// Maps id -> Node.
+  // Lazy loading.  All of these return nullptr if the record is missing or
+  // corrupt.
+  // Return the verified record at |offset| in the snapshot.
+  const log::EntryHolder* SnapshotRecord(uint64_t offset) const;
+  // Return the id of |path| in the snapshot, -1 if it has none.
+  int SnapshotPathId(std::string_view path) const;
+  // Return the deps set with |id|, decoding its record if needed.
+  DepsSet* LoggedDepsSet(uint32_t id);
+  // Decode the snapshot's build entry for |path|.
+  LogEntry* LoadSnapshotEntry(std::string_view path, int id);
+  // Decode the snapshot's deps for the node with |id|.
+  Deps* LoadSnapshotDeps(int id);
+
+  /// Maps id -> Node, nullptr for ids without a node.
   std::vector<Node*> nodes_;
+  /// Paths of ids that have no node, because the State didn't know them
+  /// when they were loaded, e.g. outputs dropped from the manifest.
+  std::unordered_map<uint32_t, std::string> unknown_paths_;
+  /// Maps path -> id for |unknown_paths_|.
+  ExternalStringHashMap<uint32_t>::Type unknown_path_ids_;
   /// Maps id -> deps of that id.
   std::vector<std::unique_ptr<Deps>> deps_;
+  /// All distinct deps sets.  Sets no longer referenced by |deps_| are only
+  /// dropped by recompaction.
+  std::vector<std::unique_ptr<DepsSet>> deps_sets_;
+  /// Maps DepsSet::hash -> sets with that hash.
+  std::unordered_multimap<uint64_t, DepsSet*> deps_set_index_;
+  /// Maps set id in the log -> set.
+  std::vector<DepsSet*> logged_deps_sets_;
   /// Maps output name -> log entry.
   Entries entries_;
+  /// The State passed to Load(), if any.
+  State* state_;
+
+  /// The contents of a log file after its version record.  Where possible
+  /// the file is mapped into memory, so that only the parts that are used
+  /// get read.
+  struct LogData {
+    LogData() = default;
+    LogData(const LogData&) = delete;
+    LogData& operator=(const LogData&) = delete;
+    ~LogData();
+
+    /// Map or read the rest of |file|, whose size is |file_size|, from
+    /// |offset|.
+    void Read(FILE* file, long offset, long file_size);
+
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    /// Holds the contents if the file couldn't be mapped.
+    std::vector<uint8_t> buffer;
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+  };
+
+  /// The indexed part of a recompacted log that was loaded lazily.  Ids of
+  /// paths and sets in it are reserved in |nodes_| and |logged_deps_sets_|,
+  /// which hold nullptr until they're decoded.
+  struct Snapshot {
+    std::unique_ptr<LogData> data;
+    const log::IndexEntry* index;
+    /// Range of the indexed records in |data|.
+    size_t begin;
+    size_t end;
+  };
+  std::unique_ptr<Snapshot> snapshot_;
+
+  // Append the record for |entry_offset| in |fbb_| to the log.
+  template <class T>
+  bool WriteRecord(const flatbuffers::Offset<T>& entry_offset);
+
   FILE* log_file_;
+  /// If set, records are appended here instead of to |log_file_|.  Used by
+  /// recompaction, which writes the index in front of the records.
+  std::vector<uint8_t>* record_buffer_;
   bool needs_recompaction_;
+  int load_threads_;
+  bool lazy_load_;
   flatbuffers::FlatBufferBuilder fbb_;
 };
 
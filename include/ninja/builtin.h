@@ -0,0 +1,51 @@
+// Copyright 2018 Frank Benkstein. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_BUILTIN_H_
+#define NINJA_BUILTIN_H_
+
+#include <string>
+
+#include "build.h"
+
+namespace ninja {
+
+struct DiskInterface;
+struct Edge;
+
+/// Commands that run inside the build instead of in a subprocess.  A rule
+/// selects one with the |builtin| variable.  Its |command| should do the
+/// same thing, it's still what the build log hashes and tools print.
+///
+/// - touch: update the mtime of each output, creating it if missing.
+/// - stamp: write each output as an empty file.
+/// - copy: copy each explicit input to the explicit output at the same
+///   position, byte for byte and with its permissions (see
+///   DiskInterface::Copy()).
+/// - mkdir: create each output as a directory.
+
+/// Check that |edge| can run the builtin |name|.  Returns false and fills
+/// in |err| if there's no such builtin or it doesn't fit the edge.
+bool VerifyBuiltinCommand(const std::string& name, const Edge* edge,
+                          std::string* err);
+
+/// Run the builtin |name| for |edge| and fill in |result| just like a
+/// finished subprocess would.
+void RunBuiltinCommand(const std::string& name, Edge* edge,
+                       DiskInterface* disk_interface,
+                       CommandRunner::Result* result);
+
+}  // namespace ninja
+
+#endif  // NINJA_BUILTIN_H_
@@ -26,11 +26,19 @@ extern bool g_keep_rsp;
 
 extern bool g_experimental_statcache;
 
+extern bool g_tracing;
+
 template <class... Args>
 void EXPLAIN(const absl::FormatSpec<Args...>& format, const Args&... args) {
   if (g_explaining)
     Message(MessageType::kExplain, absl::StrFormat(format, args...));
 }
+
+template <class... Args>
+void TRACE(const absl::FormatSpec<Args...>& format, const Args&... args) {
+  if (g_tracing)
+    Message(MessageType::kTrace, absl::StrFormat(format, args...));
+}
 }  // namespace ninja
 
 #endif  // NINJA_EXPLAIN_H_
@@ -0,0 +1,74 @@
+// Copyright 2018 Frank Benkstein. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_DIRECTORY_TABLE_H_
+#define NINJA_DIRECTORY_TABLE_H_
+
+#include <deque>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "hash_map.h"
+
+namespace ninja {
+
+/// An interned directory.  |path| includes the trailing separator, so that
+/// the path of a file is just |path| followed by its basename.
+struct Directory {
+  Directory(std::string path, int id, Directory* parent)
+      : path(std::move(path)), id(id), parent(parent), exists(false) {}
+
+  std::string path;
+  /// Dense id of the directory, 0 for the empty directory.
+  int id;
+  /// The directory containing this one, nullptr for the empty directory.
+  Directory* parent;
+  /// True once the directory is known to exist on disk.
+  bool exists;
+};
+
+/// The set of all directories containing nodes, so that each one is stored
+/// only once.  The empty directory (for paths without any separator) always
+/// has id 0.
+struct DirectoryTable {
+  DirectoryTable();
+
+  /// Return the directory for |path|, which must be empty or end with a
+  /// separator.  Interns it and all its parents if necessary.
+  Directory* Intern(std::string_view path);
+
+  /// Return the directory for |path| or nullptr if it hasn't been interned.
+  Directory* Lookup(std::string_view path) const;
+
+  Directory* root() { return &dirs_.front(); }
+  size_t size() const { return dirs_.size(); }
+
+  /// Forget which directories are known to exist, e.g. because a command
+  /// may have removed one.
+  void ForgetExisting();
+
+  /// Return the length of the directory part of |path|, including the
+  /// trailing separator.
+  static size_t DirLength(std::string_view path);
+
+ private:
+  /// Stable storage, |ids_| points into the paths.
+  std::deque<Directory> dirs_;
+  ExternalStringHashMap<Directory*>::Type ids_;
+};
+
+}  // namespace ninja
+
+#endif  // NINJA_DIRECTORY_TABLE_H_
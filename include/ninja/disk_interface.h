@@ -17,11 +17,14 @@
 
 #include <map>
 #include <string>
+#include <vector>
 
 #include "timestamp.h"
 
 namespace ninja {
 
+struct Directory;
+
 /// Interface for reading files from disk.  See DiskInterface for details.
 /// This base offers the minimum interface needed just to read files.
 struct FileReader {
@@ -40,6 +43,13 @@ struct FileReader {
 ///
 /// Abstract so it can be mocked out for tests.  The real implementation
 /// is RealDiskInterface.
+///
+/// Unless noted otherwise, methods are called from the thread running the
+/// build.  With BuildConfig::completion_threads, the Builder also calls
+/// Stat(), ReadFile() and RemoveFile() from its completion threads, at the
+/// same time as each other and as any method on the build thread.  An
+/// implementation passed to such a Builder must allow that.
+/// RealDiskInterface keeps no state of its own, so it does.
 struct DiskInterface : public FileReader {
   /// stat() a file, returning the mtime, or 0 if missing and -1 on
   /// other errors.
@@ -60,9 +70,33 @@ struct DiskInterface : public FileReader {
   ///          -1 if an error occurs.
   virtual int RemoveFile(const std::string& path) = 0;
 
+  /// Update the mtime of a file to now, creating it empty if it doesn't
+  /// exist; like 'touch path'.  Returns false on failure.  The default
+  /// implementation rewrites the file.
+  virtual bool Touch(const std::string& path);
+
+  /// Copy the file |from| to |to|, replacing |to| if it exists; like
+  /// 'cp from to'.  The copy is byte for byte and has the permissions of
+  /// |from|.  Returns false and fills in |err| with the reason on failure.
+  /// The default implementation goes through ReadFile() and WriteFile(), so
+  /// it only copies the contents.
+  virtual bool Copy(const std::string& from, const std::string& to,
+                    std::string* err);
+
   /// Create all the parent directories for path; like mkdir -p
   /// `basename path`.
   bool MakeDirs(const std::string& path);
+
+  /// Create the interned directory |dir| and its parents.  Directories
+  /// already known to exist are skipped without touching the disk; see
+  /// DirectoryTable::ForgetExisting() for dropping that knowledge.
+  bool MakeDirs(Directory* dir);
+
+  /// Create the interned directories |dirs| and their parents ahead of
+  /// MakeDirs(), using up to |threads| threads.  Failures are left for
+  /// MakeDirs() to report.  By default, nothing is done ahead.
+  virtual void MakeDirsInParallel(const std::vector<Directory*>& dirs,
+                                  int threads) {}
 };
 
 /// Implementation of DiskInterface that actually hits the disk.
@@ -74,6 +108,11 @@ struct RealDiskInterface : public DiskInterface {
   virtual Status ReadFile(const std::string& path, std::string* contents,
                           std::string* err);
   virtual int RemoveFile(const std::string& path);
+  virtual bool Touch(const std::string& path);
+  virtual bool Copy(const std::string& from, const std::string& to,
+                    std::string* err);
+  virtual void MakeDirsInParallel(const std::vector<Directory*>& dirs,
+                                  int threads);
 };
 
 }  // namespace ninja
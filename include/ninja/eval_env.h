@@ -25,16 +25,40 @@ namespace ninja {
 
 struct Rule;
 
+/// Receives an evaluated string piece by piece, so that callers which only
+/// look at it once, e.g. to hash it, don't have to concatenate it.
+struct EvalSink {
+  virtual ~EvalSink() {}
+  virtual void Append(std::string_view piece) = 0;
+};
+
+/// An EvalSink that appends to a string.
+struct StringEvalSink : public EvalSink {
+  explicit StringEvalSink(std::string* out) : out_(out) {}
+  void Append(std::string_view piece) override {
+    out_->append(piece.data(), piece.size());
+  }
+
+ private:
+  std::string* out_;
+};
+
 /// An interface for a scope for variable (e.g. "$foo") lookups.
 struct Env {
   virtual ~Env() {}
   virtual std::string LookupVariable(const std::string& var) = 0;
+  /// Pass the value of |var| to |sink|.  Scopes that can produce values in
+  /// pieces override this; by default the value is looked up as a whole.
+  virtual void EvaluateVariable(const std::string& var, EvalSink* sink);
 };
 
 /// A tokenized string that contains variable references.
 /// Can be evaluated relative to an Env.
 struct EvalString {
   std::string Evaluate(Env* env) const;
+  /// Like Evaluate(), but passes text and variable values to |sink| as they
+  /// come.
+  void Evaluate(Env* env, EvalSink* sink) const;
 
   void Clear() { parsed_.clear(); }
   bool empty() const { return parsed_.empty(); }
@@ -81,6 +105,7 @@ struct BindingEnv : public Env {
 
   virtual ~BindingEnv() {}
   virtual std::string LookupVariable(const std::string& var);
+  virtual void EvaluateVariable(const std::string& var, EvalSink* sink);
 
   void AddRule(std::unique_ptr<const Rule> rule);
   const Rule* LookupRule(const std::string& rule_name);
@@ -96,6 +121,8 @@ struct BindingEnv : public Env {
   /// This function takes as parameters the necessary info to do (2).
   std::string LookupWithFallback(const std::string& var, const EvalString* eval,
                                  Env* env);
+  void LookupWithFallback(const std::string& var, const EvalString* eval,
+                          Env* env, EvalSink* sink);
 
  private:
   std::map<std::string, std::string> bindings_;
@@ -15,9 +15,12 @@
 #ifndef NINJA_GRAPH_H_
 #define NINJA_GRAPH_H_
 
+#include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "directory_table.h"
 #include "eval_env.h"
 #include "timestamp.h"
 #include "util.h"
@@ -27,6 +30,7 @@ namespace ninja {
 struct BuildLog;
 struct DiskInterface;
 struct DepsLog;
+struct DepsSet;
 struct Edge;
 struct Node;
 struct Pool;
@@ -35,9 +39,11 @@ struct State;
 /// Information about a node in the dependency graph: the file, whether
 /// it's dirty, mtime, etc.
 struct Node {
-  Node(const std::string& path, uint64_t slash_bits)
-      : path_(path), slash_bits_(slash_bits), mtime_(-1), dirty_(false),
-        in_edge_(nullptr), id_(-1) {}
+  /// |basename| must outlive the node, State keeps it in its name storage.
+  Node(Directory* dir, std::string_view basename, uint64_t slash_bits,
+       int index)
+      : mtime_(-1), in_edge_(nullptr), dirty_(false), id_(-1), index_(index),
+        dir_(dir), basename_(basename), slash_bits_(slash_bits) {}
 
   /// Return false on error.
   bool Stat(DiskInterface* disk_interface, std::string* err);
@@ -62,15 +68,23 @@ struct Node {
 
   bool status_known() const { return mtime_ != -1; }
 
-  const std::string& path() const { return path_; }
+  /// The full path, materialized on first use.
+  const std::string& path() const {
+    if (!path_)
+      path_ = std::make_unique<std::string>(FullPath());
+    return *path_;
+  }
   /// Get |path()| but use slash_bits to convert back to original slash styles.
   std::string PathDecanonicalized() const {
-    return PathDecanonicalized(path_, slash_bits_);
+    return PathDecanonicalized(path(), slash_bits_);
   }
   static std::string PathDecanonicalized(const std::string& path,
                                          uint64_t slash_bits);
   uint64_t slash_bits() const { return slash_bits_; }
 
+  Directory* dir() const { return dir_; }
+  std::string_view basename() const { return basename_; }
+
   TimeStamp mtime() const { return mtime_; }
 
   bool dirty() const { return dirty_; }
@@ -83,17 +97,19 @@ struct Node {
   int id() const { return id_; }
   void set_id(int id) { id_ = id; }
 
+  /// Dense index of the node in creation order, see State::GetNode.
+  int index() const { return index_; }
+
   const std::vector<Edge*>& out_edges() const { return out_edges_; }
   void AddOutEdge(Edge* edge) { out_edges_.push_back(edge); }
 
   void Dump(const char* prefix = "") const;
 
  private:
-  std::string path_;
+  std::string FullPath() const;
 
-  /// Set bits starting from lowest for backslashes that were normalized to
-  /// forward slashes by CanonicalizePath. See |PathDecanonicalized|.
-  uint64_t slash_bits_;
+  // The fields looked at for every node during a scan come first, so that
+  // they share a cache line.
 
   /// Possible values of mtime_:
   ///   -1: file hasn't been examined
@@ -101,20 +117,33 @@ struct Node {
   ///   >0: actual file's mtime
   TimeStamp mtime_;
 
+  /// The Edge that produces this Node, or nullptr when there is no
+  /// known edge to produce it.
+  Edge* in_edge_;
+
   /// Dirty is true when the underlying file is out-of-date.
   /// But note that Edge::outputs_ready_ is also used in judging which
   /// edges to build.
   bool dirty_;
 
-  /// The Edge that produces this Node, or nullptr when there is no
-  /// known edge to produce it.
-  Edge* in_edge_;
+  /// A dense integer id for the node, assigned and used by DepsLog.
+  int id_;
+
+  /// Dense index of the node in State, never changes.
+  int index_;
+
+  /// The path is stored as its interned directory and basename.  The full
+  /// string in |path_| is only built once something asks for it.
+  Directory* dir_;
+  std::string_view basename_;
+  mutable std::unique_ptr<std::string> path_;
+
+  /// Set bits starting from lowest for backslashes that were normalized to
+  /// forward slashes by CanonicalizePath. See |PathDecanonicalized|.
+  uint64_t slash_bits_;
 
   /// All Edges that use this Node as an input.
   std::vector<Edge*> out_edges_;
-
-  /// A dense integer id for the node, assigned and used by DepsLog.
-  int id_;
 };
 
 /// An edge in the dependency graph; links between Nodes using Rules.
@@ -123,8 +152,9 @@ struct Edge {
 
   Edge()
       : rule_(nullptr), pool_(nullptr), env_(nullptr), mark_(VisitNone),
-        outputs_ready_(false), deps_missing_(false), implicit_deps_(0),
-        order_only_deps_(0), implicit_outs_(0) {}
+        outputs_ready_(false), deps_missing_(false), id_(-1),
+        deps_set_(nullptr), implicit_deps_(0), order_only_deps_(0),
+        implicit_outs_(0) {}
 
   /// Return true if all inputs' in-edges are ready.
   bool AllInputsReady() const;
@@ -134,6 +164,22 @@ struct Edge {
   /// full contents of a response file (if applicable)
   std::string EvaluateCommand(bool incl_rsp_file = false);
 
+  /// Expand the command like EvaluateCommand(), but with $rspfile standing
+  /// for |rspfile|, where the command finds its response file instead.
+  std::string EvaluateCommandWithRspfile(const std::string& rspfile);
+
+  /// Return BuildLog::HashCommand(EvaluateCommand(true)), without building
+  /// the command string.
+  uint64_t HashCommand();
+
+  /// Expand the command of |batch|, edges sharing the rule and scope of
+  /// the first one, with $in and $out listing the paths of all of them.
+  static std::string EvaluateBatchCommand(const std::vector<Edge*>& batch);
+
+  /// Return the most edges that may run together as one command, from the
+  /// "batch" binding.  1 if the rule isn't batchable.
+  int GetBatchSize();
+
   /// Returns the shell-escaped value of |key|.
   std::string GetBinding(const std::string& key);
   bool GetBindingBool(const std::string& key);
@@ -153,8 +199,14 @@ struct Edge {
   VisitMark mark_;
   bool outputs_ready_;
   bool deps_missing_;
+  /// Dense index of the edge in State::edges_.
+  int id_;
+  /// The shared deps set loaded from the build log, if any.  Its nodes are
+  /// the last implicit inputs, right before the order-only ones.
+  const DepsSet* deps_set_;
 
   const Rule& rule() const { return *rule_; }
+  int id() const { return id_; }
   Pool* pool() const { return pool_; }
   int weight() const { return 1; }
   bool outputs_ready() const { return outputs_ready_; }
@@ -229,13 +281,26 @@ struct ImplicitDepLoader {
   BuildLog* build_log_;
 };
 
+/// Gets notified by DependencyScan whenever the dirty state of an edge
+/// has been computed.  This allows acting on the results of a scan while
+/// it still continues over the rest of the graph.
+struct DependencyScanObserver {
+  virtual ~DependencyScanObserver() {}
+
+  /// Called once the edge and all its inputs have been visited.
+  /// Return false to abort the scan; \a err is then passed on to the
+  /// caller of RecomputeDirty().
+  virtual bool EdgeScanned(Edge* edge, std::string* err) = 0;
+};
+
 /// DependencyScan manages the process of scanning the files in a graph
 /// and updating the dirty/outputs_ready state of all the nodes and edges.
 struct DependencyScan {
   DependencyScan(State* state, BuildLog* build_log,
                  DiskInterface* disk_interface)
       : build_log_(build_log), disk_interface_(disk_interface),
-        dep_loader_(state, build_log, disk_interface) {}
+        dep_loader_(state, build_log, disk_interface), observer_(nullptr),
+        scan_id_(0) {}
 
   /// Update the |dirty_| state of the given node by inspecting its input edge.
   /// Examine inputs, outputs, and command lines to judge whether an edge
@@ -252,18 +317,35 @@ struct DependencyScan {
   BuildLog* build_log() const { return build_log_; }
   void set_build_log(BuildLog* log) { build_log_ = log; }
 
+  /// Set an observer to notify about scanned edges, nullptr for none.
+  void set_observer(DependencyScanObserver* observer) { observer_ = observer; }
+
+  /// Forget the results cached in deps sets.  Must be called when the state
+  /// of nodes changes while a scan is running, e.g. because a command
+  /// finished.
+  void InvalidateDepsCache();
+
  private:
   bool RecomputeDirty(Node* node, std::vector<Node*>* stack, std::string* err);
   bool VerifyDAG(Node* node, std::vector<Node*>* stack, std::string* err);
 
+  /// Visit the nodes of |set| and fill in its ScanResult, unless that already
+  /// happened during this scan.
+  bool VisitDepsSet(const DepsSet* set, std::vector<Node*>* stack,
+                    std::string* err);
+
   /// Recompute whether a given single output should be marked dirty.
   /// Returns true if so.
   bool RecomputeOutputDirty(Edge* edge, Node* most_recent_input,
-                            const std::string& command, Node* output);
+                            uint64_t command_hash, Node* output);
 
   BuildLog* build_log_;
   DiskInterface* disk_interface_;
   ImplicitDepLoader dep_loader_;
+  DependencyScanObserver* observer_;
+  /// Identifies the results cached in DepsSet::scan that are valid for the
+  /// current scan.
+  uint64_t scan_id_;
 };
 
 }  // namespace ninja
@@ -15,10 +15,12 @@
 #ifndef NINJA_MAP_H_
 #define NINJA_MAP_H_
 
+#include <stdint.h>
 #include <string.h>
 #include <algorithm>
 #include <string_view>
-#include <unordered_map>
+
+#include <absl/container/flat_hash_map.h>
 
 namespace ninja {
 
@@ -55,19 +57,208 @@ inline unsigned int MurmurHash2(const void* key, size_t len) {
   return h;
 }
 
+// 64bit MurmurHash2, by Austin Appleby
+#if defined(_MSC_VER)
+#define BIG_CONSTANT(x) (x)
+#else  // defined(_MSC_VER)
+#define BIG_CONSTANT(x) (x##LLU)
+#endif  // !defined(_MSC_VER)
+inline uint64_t MurmurHash64A(const void* key, size_t len) {
+  static const uint64_t seed = 0xDECAFBADDECAFBADull;
+  const uint64_t m = BIG_CONSTANT(0xc6a4a7935bd1e995);
+  const int r = 47;
+  uint64_t h = seed ^ (len * m);
+  const unsigned char* data = (const unsigned char*)key;
+  while (len >= 8) {
+    uint64_t k;
+    memcpy(&k, data, sizeof k);
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+    data += 8;
+    len -= 8;
+  }
+  switch (len & 7) {
+  case 7:
+    h ^= uint64_t(data[6]) << 48;
+  case 6:
+    h ^= uint64_t(data[5]) << 40;
+  case 5:
+    h ^= uint64_t(data[4]) << 32;
+  case 4:
+    h ^= uint64_t(data[3]) << 24;
+  case 3:
+    h ^= uint64_t(data[2]) << 16;
+  case 2:
+    h ^= uint64_t(data[1]) << 8;
+  case 1:
+    h ^= uint64_t(data[0]);
+    h *= m;
+  };
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+#undef BIG_CONSTANT
+
+/// XXH64 with seed 0, fed incrementally.  Input that arrives in pieces,
+/// like an evaluated command line, can be hashed without concatenating it
+/// first.  Full 32 byte stripes go through four independent lanes, which
+/// keeps the inner loop free of dependencies between lanes.
+class StreamingHash64 {
+ public:
+  StreamingHash64()
+      : lanes_{ kPrime1 + kPrime2, kPrime2, 0, 0 - kPrime1 }, total_(0),
+        buffered_(0) {}
+
+  void Update(const void* data, size_t len) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    total_ += len;
+    if (buffered_ + len < kStripeSize) {
+      if (len)
+        memcpy(buffer_ + buffered_, p, len);
+      buffered_ += len;
+      return;
+    }
+    if (buffered_) {
+      size_t fill = kStripeSize - buffered_;
+      memcpy(buffer_ + buffered_, p, fill);
+      Consume(buffer_);
+      p += fill;
+      len -= fill;
+      buffered_ = 0;
+    }
+    for (; len >= kStripeSize; p += kStripeSize, len -= kStripeSize)
+      Consume(p);
+    if (len)
+      memcpy(buffer_, p, len);
+    buffered_ = len;
+  }
+  void Update(std::string_view data) { Update(data.data(), data.size()); }
+
+  uint64_t Digest() const {
+    uint64_t h;
+    if (total_ >= kStripeSize) {
+      h = Rotl(lanes_[0], 1) + Rotl(lanes_[1], 7) + Rotl(lanes_[2], 12) +
+          Rotl(lanes_[3], 18);
+      for (uint64_t lane : lanes_)
+        h = (h ^ Round(0, lane)) * kPrime1 + kPrime4;
+    } else {
+      h = kPrime5;
+    }
+    h += total_;
+
+    const unsigned char* p = buffer_;
+    size_t len = buffered_;
+    for (; len >= 8; p += 8, len -= 8)
+      h = Rotl(h ^ Round(0, Read64(p)), 27) * kPrime1 + kPrime4;
+    if (len >= 4) {
+      uint32_t k;
+      memcpy(&k, p, sizeof k);
+      h = Rotl(h ^ (k * kPrime1), 23) * kPrime2 + kPrime3;
+      p += 4;
+      len -= 4;
+    }
+    for (; len > 0; ++p, --len)
+      h = Rotl(h ^ (*p * kPrime5), 11) * kPrime1;
+
+    h ^= h >> 33;
+    h *= kPrime2;
+    h ^= h >> 29;
+    h *= kPrime3;
+    h ^= h >> 32;
+    return h;
+  }
+
+  static uint64_t Hash(std::string_view data) {
+    StreamingHash64 hash;
+    hash.Update(data);
+    return hash.Digest();
+  }
+
+ private:
+  static constexpr uint64_t kPrime1 = 0x9E3779B185EBCA87ull;
+  static constexpr uint64_t kPrime2 = 0xC2B2AE3D27D4EB4Full;
+  static constexpr uint64_t kPrime3 = 0x165667B19E3779F9ull;
+  static constexpr uint64_t kPrime4 = 0x85EBCA77C2B2AE63ull;
+  static constexpr uint64_t kPrime5 = 0x27D4EB2F165667C5ull;
+  static constexpr size_t kStripeSize = 32;
+
+  static uint64_t Rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+  static uint64_t Read64(const unsigned char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+  }
+  static uint64_t Round(uint64_t acc, uint64_t input) {
+    return Rotl(acc + input * kPrime2, 31) * kPrime1;
+  }
+  void Consume(const unsigned char* stripe) {
+    for (int i = 0; i < 4; ++i)
+      lanes_[i] = Round(lanes_[i], Read64(stripe + 8 * i));
+  }
+
+  uint64_t lanes_[4];
+  uint64_t total_;
+  unsigned char buffer_[kStripeSize];
+  size_t buffered_;
+};
+
 struct MurmurHash2Hash {
   unsigned int operator()(std::string_view data) const {
     return MurmurHash2(data.data(), data.size());
   }
 };
 
+/// A std::string_view key that carries its 64 bit hash along, so that
+/// growing a table never has to hash the string again and probes can
+/// reject most mismatches without comparing strings.
+struct HashedStringView : public std::string_view {
+  HashedStringView(std::string_view str)
+      : std::string_view(str), hash(MurmurHash64A(str.data(), str.size())) {}
+  /// For a |hash| computed earlier, e.g. on another thread.
+  HashedStringView(std::string_view str, uint64_t hash)
+      : std::string_view(str), hash(hash) {}
+
+  uint64_t hash;
+};
+
+/// Hash and equality for HashedStringView keys.  Both are transparent so
+/// that tables can be searched with a plain std::string_view.
+struct HashedStringHash {
+  using is_transparent = void;
+  size_t operator()(const HashedStringView& key) const { return key.hash; }
+  size_t operator()(std::string_view key) const {
+    return MurmurHash64A(key.data(), key.size());
+  }
+};
+
+struct HashedStringEq {
+  using is_transparent = void;
+  bool operator()(const HashedStringView& a, const HashedStringView& b) const {
+    return a.hash == b.hash && a == b;
+  }
+  bool operator()(std::string_view a, std::string_view b) const {
+    return a == b;
+  }
+};
+
 /// A template for hash_maps keyed by a std::string_view whose string is
 /// owned externally (typically by the values).  Use like:
 /// ExternalStringHash<Foo*>::Type foos; to make foos into a hash
 /// mapping std::string_view => Foo*.
+///
+/// This is an open addressing table probing groups of slots at once, so
+/// unlike std::unordered_map, references to its elements are invalidated
+/// when it grows.
 template <typename V>
 struct ExternalStringHashMap {
-  typedef std::unordered_map<std::string_view, V, MurmurHash2Hash> Type;
+  typedef absl::flat_hash_map<HashedStringView, V, HashedStringHash,
+                              HashedStringEq>
+      Type;
 };
 
 }  // namespace ninja
@@ -31,7 +31,7 @@ struct LinePrinter {
   enum LineType { FULL, ELIDE };
   /// Overprints the current line. If type is ELIDE, elides to_print to fit on
   /// one line.
-  void Print(std::string to_print, LineType type);
+  void Print(const std::string& to_print, LineType type);
 
   /// Prints a string on a new line, not overprinting previous output.
   void PrintOnNewLine(const std::string& to_print);
@@ -40,6 +40,13 @@ struct LinePrinter {
   /// console is locked will not be printed until it is unlocked.
   void SetConsoleLocked(bool locked);
 
+#ifndef _WIN32
+  /// Overprint the current line with |to_print|, elided to |width| like
+  /// ElideMiddle() does, in a single write.  Widths below 3 leave the line
+  /// as it is.  Only Print() should call this; it's public for tests.
+  void WriteElided(const std::string& to_print, size_t width);
+#endif
+
  private:
   /// Whether we can do fancy terminal control codes.
   bool smart_terminal_;
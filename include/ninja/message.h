@@ -26,6 +26,7 @@ enum class MessageType {
   kError,
   kWarning,
   kExplain,
+  kTrace,
 };
 
 /// Log a message with the given type. With kFatal this function doesn't return.
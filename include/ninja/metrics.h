@@ -16,6 +16,7 @@
 #define NINJA_METRICS_H_
 
 #include <chrono>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -26,13 +27,48 @@ namespace ninja {
 /// The Metrics module is used for the debug mode that dumps timing stats of
 /// various actions.  To use, see METRIC_RECORD below.
 
-/// A single metrics we're tracking, like "depfile load time".
+/// Counts of recorded values in buckets whose width grows with the value,
+/// like an HDR histogram: any value is known to within about 3%.
+struct Histogram {
+  Histogram() : count_(0), sum_(0), max_(0) {}
+
+  void Record(uint64_t value);
+  void Merge(const Histogram& other);
+
+  uint64_t count() const { return count_; }
+  uint64_t sum() const { return sum_; }
+  uint64_t max() const { return max_; }
+
+  /// The smallest value that |fraction| of the recorded values don't
+  /// exceed, rounded up to the end of its bucket.  0 if nothing was
+  /// recorded.
+  uint64_t Percentile(double fraction) const;
+
+  /// Values below 2^kSubBucketBits get a bucket each; above, every power
+  /// of two is split into 2^(kSubBucketBits - 1) buckets.
+  static const int kSubBucketBits = 6;
+  static size_t BucketIndex(uint64_t value);
+  /// The largest value that falls into the bucket |index|.
+  static uint64_t BucketMax(size_t index);
+
+ private:
+  /// Only as many buckets as the largest value needs.
+  std::vector<uint64_t> buckets_;
+  uint64_t count_;
+  uint64_t sum_;
+  uint64_t max_;
+};
+
+/// A single metrics we're tracking, like "depfile load time".  Each thread
+/// records to histograms of its own, which are merged when the thread exits
+/// and when the metrics are reported.
 struct Metric {
   std::string name;
-  /// Number of times we've hit the code path.
-  int count;
-  /// Total time (in micros) we've spent on the code path.
-  int64_t sum;
+  /// Index of the metric among the histograms of each thread.
+  size_t id;
+  /// Times (in nanoseconds) recorded by threads that have exited.  Guarded
+  /// by the lock of the thread registry in metrics.cc.
+  Histogram exited;
 };
 
 /// A scoped object for recording a metric across the body of a function.
@@ -44,18 +80,35 @@ struct ScopedMetric {
  private:
   Metric* metric_;
   /// Timestamp when the measurement started.
-  /// Value is platform-dependent.
-  std::chrono::time_point<std::chrono::high_resolution_clock> start_;
+  std::chrono::steady_clock::time_point start_;
 };
 
 /// The singleton that stores metrics and prints the report.
+///
+/// Reporting merges the histograms of all threads, so it should only
+/// happen once other threads are done recording, e.g. after the build.
 struct Metrics {
   Metric* NewMetric(const std::string& name);
 
   /// Print a summary report to stdout.
   void Report();
 
+  /// Return the times recorded for |metric| by all threads.
+  Histogram Collect(Metric* metric);
+
+  /// Format the metrics as JSON, times in microseconds.
+  std::string ToJSON();
+  /// Format the metrics in the text format of Prometheus, as a summary
+  /// with quantiles, times in seconds.
+  std::string ToPrometheus();
+
+  /// Write ToJSON() or ToPrometheus() to |path|.  The file is replaced at
+  /// once, so that a collector never reads half of it.
+  bool WriteJSON(const std::string& path, std::string* err);
+  bool WritePrometheus(const std::string& path, std::string* err);
+
  private:
+  std::mutex mutex_;
   std::vector<Metric*> metrics_;
 };
 
@@ -46,6 +46,16 @@ struct Options {
 
   /// Whether phony cycles should warn or print an error.
   bool phony_cycle_should_err;
+
+  /// Whether the parallelism was set explicitly with -j.
+  bool parallelism_given;
+
+  /// Whether to start commands through a SpawnServer.
+  bool spawn_server;
+
+  /// Files to write the metrics to after the build, or nullptr.
+  const char* metrics_json;
+  const char* metrics_prom;
 };
 
 /// The Ninja main() loads up a series of data structures; various tools need
@@ -122,6 +132,9 @@ struct NinjaMain : public BuildLogUser {
   /// Dump the output requested by '-d stats'.
   void DumpMetrics();
 
+  /// Write the metrics to |json_path| and |prom_path|, unless nullptr.
+  bool ExportMetrics(const char* json_path, const char* prom_path);
+
   bool IsPathDead(std::string_view s) const override;
 };
 
@@ -150,8 +163,34 @@ struct Tool {
   NinjaMain::ToolFunc func;
 };
 
-/// Choose a default value for the -j (parallelism) flag.
-int GuessParallelism();
+/// The facts a default value for the -j (parallelism) flag is derived
+/// from.  Zero means unknown or unlimited.
+struct ParallelismGuess {
+  /// Number of online processors.
+  int processors = 0;
+  /// Number of processors in our affinity mask.
+  int affinity = 0;
+  /// Number of CPUs granted by the cgroup CPU quota.
+  double cpu_quota = 0.0;
+  /// Cgroup memory limit in bytes.
+  int64_t memory_limit = 0;
+  /// Typical peak RSS of a command in bytes, taken from the build log.
+  uint64_t edge_rss = 0;
+
+  /// Fill in the fields from the running system and, if given,
+  /// |build_log|.
+  void Probe(const BuildLog* build_log);
+
+  /// @return the parallelism to use.
+  int Compute() const;
+
+  /// @return a human readable explanation of Compute().
+  std::string Describe() const;
+};
+
+/// Choose a default value for the -j (parallelism) flag.  Historical
+/// memory usage of commands is taken into account if |build_log| is given.
+int GuessParallelism(const BuildLog* build_log = nullptr);
 
 /// Find the function to execute for \a tool_name and return it via \a func.
 /// Returns a Tool, or nullptr if Ninja should exit.
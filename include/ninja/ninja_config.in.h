@@ -17,6 +17,7 @@
 // clang-format off
 #cmakedefine NINJA_HAVE_GETOPT
 #cmakedefine NINJA_USE_PPOLL
+#cmakedefine NINJA_HAVE_MEMFD
 #cmakedefine NINJA_HAVE_BROWSE
 #cmakedefine NINJA_PYTHON "@NINJA_PYTHON@"
 #cmakedefine NINJA_FILESYSTEM_INCLUDE @NINJA_FILESYSTEM_INCLUDE@
@@ -0,0 +1,124 @@
+// Copyright 2018 Frank Benkstein. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_PRESSURE_H_
+#define NINJA_PRESSURE_H_
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace ninja {
+
+/// Cumulative counters of one line ("some" or "full") of a Linux pressure
+/// stall information (PSI) file.
+struct PressureLine {
+  /// Stall percentage averaged over the last 10 seconds.
+  double avg10 = 0.0;
+  /// Total stall time in microseconds.
+  uint64_t total = 0;
+};
+
+/// Parse the line starting with |kind| ("some" or "full") out of the
+/// contents of a PSI file like /proc/pressure/cpu.
+/// @return false if there is no such line or it is malformed.
+bool ParsePressureLine(std::string_view contents, std::string_view kind,
+                       PressureLine* line);
+
+/// Stall percentages of the three PSI resources over the last sampling
+/// interval.  Only the "some" lines are used: they report the share of time
+/// in which at least one task was waiting on the resource.
+struct PressureSample {
+  double cpu = 0.0;
+  double memory = 0.0;
+  double io = 0.0;
+
+  /// The highest of the three percentages.
+  double Max() const;
+};
+
+/// Interface for sampling system pressure.  This allows tests to feed the
+/// ParallelismController with synthetic values.
+struct PressureSource {
+  virtual ~PressureSource() {}
+
+  /// Fill in |sample| with the pressure since the previous call.
+  /// @return false if pressure information is not available.
+  virtual bool Sample(PressureSample* sample) = 0;
+};
+
+/// Implementation of PressureSource reading the PSI files of the cgroup v2
+/// hierarchy ninja runs in, falling back to the system-wide files in
+/// /proc/pressure.  Only available on Linux.
+struct RealPressureSource : public PressureSource {
+  RealPressureSource();
+  virtual ~RealPressureSource() {}
+  virtual bool Sample(PressureSample* sample);
+
+  /// Directory holding cpu.pressure etc., or "/proc/pressure/" for the
+  /// system-wide files.  Empty if PSI is not supported.
+  const std::string& directory() const { return directory_; }
+
+ private:
+  std::string directory_;
+  /// File names inside |directory_| for cpu, memory and io.
+  const char* const* names_;
+  uint64_t last_totals_[3];
+  int64_t last_time_micros_;
+};
+
+/// Adapts the number of concurrently running commands to the system
+/// pressure: the limit is cut by a quarter whenever pressure exceeds the
+/// threshold and grows by one when pressure is well below it and all slots
+/// are in use.  The limit always stays within [floor, ceiling].
+struct ParallelismController {
+  /// |max_pressure| is the stall percentage above which the limit shrinks.
+  /// |source| must outlive the controller.
+  ParallelismController(int floor, int ceiling, double max_pressure,
+                        PressureSource* source);
+
+  /// Minimum time between two samples of |source|.
+  static const int64_t kSampleIntervalMillis = 500;
+
+  /// Return the current limit, resampling pressure if the last sample is
+  /// older than kSampleIntervalMillis.  |running| is the number of
+  /// commands currently running.
+  int Limit(int running, int64_t now_millis);
+
+  int limit() const { return limit_; }
+
+  /// The pressure seen at the last sample.
+  const PressureSample& last_sample() const { return last_sample_; }
+
+  /// Return false if |source| failed to deliver pressure information.
+  bool available() const { return available_; }
+
+ private:
+  void Update(int running);
+
+  const int floor_;
+  const int ceiling_;
+  const double max_pressure_;
+  PressureSource* source_;
+  int limit_;
+  bool available_;
+  /// Whether |source_| was sampled yet, and when it last was.
+  bool sampled_;
+  int64_t last_sample_millis_;
+  PressureSample last_sample_;
+};
+
+}  // namespace ninja
+
+#endif  // NINJA_PRESSURE_H_
@@ -0,0 +1,92 @@
+// Copyright 2018 Frank Benkstein. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_SPAWN_SERVER_H_
+#define NINJA_SPAWN_SERVER_H_
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <unordered_map>
+
+namespace ninja {
+
+/// A small helper process that starts commands on behalf of ninja.
+///
+/// Where posix_spawn() has to fork, starting a command costs time
+/// proportional to the size of the parent, because its page tables are
+/// copied.  The server is forked while ninja is still small, so that
+/// starting commands through it stays cheap however much memory the build
+/// graph takes.  The commands are children of the server, which reports
+/// their exit back to ninja.  Persistent workers (see Worker) are still
+/// started by ninja itself; they are few and long-lived.
+struct SpawnServer {
+  SpawnServer() : fd_(-1), pid_(-1) {}
+  ~SpawnServer();
+
+  /// Fork the server.  Call this early, before the process grows.
+  /// Commands run in the working directory and environment of that time.
+  bool Start();
+
+  /// Start |path| with |argv|, like posix_spawn().  Unless |use_console|,
+  /// the command gets its own process group, stdin from /dev/null and
+  /// |output_fd| as stdout and stderr; otherwise it just inherits
+  /// |output_fd|.  Returns the pid of the command or -1 with errno set.
+  pid_t Spawn(const char* path, char* const argv[], int output_fd,
+              bool use_console);
+
+  /// Wait for the command |pid| to exit, like wait4().  Stores its status
+  /// and peak RSS in bytes.
+  bool Wait(pid_t pid, int* status, int64_t* max_rss);
+
+  /// The server started by StartGlobal(), or nullptr.
+  static SpawnServer* global() { return global_; }
+  /// Start the server that SubprocessSets use by default.
+  static bool StartGlobal();
+
+ private:
+  /// What the server sends back: the pid of a command it started, or -1
+  /// and the errno; or the pid, wait status and peak RSS of a command that
+  /// exited.
+  struct Message {
+    enum Kind : int32_t { kSpawned, kExited };
+    Kind kind;
+    int32_t pid;
+    int32_t value;
+    int64_t max_rss;
+  };
+
+  struct Exit {
+    int status;
+    int64_t max_rss;
+  };
+
+  /// Read the next message from the server, recording it in |exits_| if
+  /// it reports an exit.
+  bool Receive(Message* message);
+
+  friend void ServeSpawns(int fd);
+
+  /// Socket connected to the server.
+  int fd_;
+  pid_t pid_;
+  /// Exits reported by the server but not yet waited for.
+  std::unordered_map<pid_t, Exit> exits_;
+
+  static SpawnServer* global_;
+};
+
+}  // namespace ninja
+
+#endif  // NINJA_SPAWN_SERVER_H_
@@ -16,10 +16,13 @@
 #define NINJA_STATE_H_
 
 #include <map>
+#include <memory>
 #include <set>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "directory_table.h"
 #include "eval_env.h"
 #include "hash_map.h"
 #include "util.h"
@@ -63,8 +66,8 @@ struct Pool {
   /// adds the given edge to this Pool to be delayed.
   void DelayEdge(Edge* edge);
 
-  /// Pool will add zero or more edges to the ready_queue
-  void RetrieveReadyEdges(std::set<Edge*>* ready_queue);
+  /// Pool will append zero or more edges to the ready_queue
+  void RetrieveReadyEdges(std::vector<Edge*>* ready_queue);
 
   /// Dump the Pool and its edges (useful for debugging).
   void Dump() const;
@@ -112,10 +115,50 @@ struct State {
   std::vector<Node*> RootNodes(std::string* error) const;
   std::vector<Node*> DefaultNodes(std::string* error) const;
 
+  /// Number of nodes created so far; Node::index() is below this.
+  int node_count() const { return node_count_; }
+
+  /// Key of |paths_|: a node path split into its directory and basename,
+  /// with the hash computed once up front.
+  struct PathKey {
+    PathKey(const Directory* dir, std::string_view basename)
+        : dir(dir), basename(basename),
+          hash(MurmurHash64A(basename.data(), basename.size()) ^
+               (dir->id * 0x9E3779B97F4A7C15ull)) {}
+
+    bool operator==(const PathKey& other) const {
+      return hash == other.hash && dir == other.dir &&
+             basename == other.basename;
+    }
+
+    const Directory* dir;
+    std::string_view basename;
+    uint64_t hash;
+  };
+  struct PathKeyHash {
+    size_t operator()(const PathKey& key) const { return key.hash; }
+  };
+
   /// Mapping of path -> Node.
-  typedef ExternalStringHashMap<std::unique_ptr<Node>>::Type Paths;
+  typedef absl::flat_hash_map<PathKey, Node*, PathKeyHash> Paths;
   Paths paths_;
 
+  /// All directories containing nodes.
+  DirectoryTable directories_;
+
+  /// Copy |name| into storage owned by the State and return the copy.
+  std::string_view StoreName(std::string_view name);
+  static constexpr size_t kNameChunkSize = 64 * 1024;
+  std::vector<std::unique_ptr<char[]>> names_;
+  char* names_next_ = nullptr;
+  size_t names_left_ = 0;
+
+  /// Storage of all nodes in index order.  Nodes are allocated in chunks of
+  /// kNodeChunkSize so that they are packed densely and never move.
+  static constexpr int kNodeChunkSize = 4096;
+  std::vector<std::vector<Node>> nodes_;
+  int node_count_ = 0;
+
   /// All the pools used in the graph.
   std::map<std::string, std::unique_ptr<Pool>> pools_;
   Pool* default_pool_;
@@ -15,9 +15,12 @@
 #ifndef NINJA_SUBPROCESS_H_
 #define NINJA_SUBPROCESS_H_
 
+#include <cstdint>
 #include <memory>
 #include <queue>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #ifdef _WIN32
@@ -38,6 +41,62 @@
 
 namespace ninja {
 
+struct SpawnServer;
+
+#ifndef _WIN32
+/// A persistent worker: a process started from a rule's "worker" command
+/// that then runs many of the rule's commands, one at a time, so that tools
+/// with an expensive startup only pay for it once.
+///
+/// The worker has a socket as stdin and stdout.  A request is a line with
+/// the size of the payload in bytes, followed by the payload: the
+/// arguments of the command, each terminated by a nul byte.  The worker
+/// answers with a line "<exit code> <size>", followed by that many bytes
+/// of output.  Its stderr is discarded.
+struct Worker {
+  Worker(const std::string& command, pid_t pid, int fd)
+      : command(command), pid(pid), fd(fd), requests(0), busy(true) {}
+
+  std::string command;
+  pid_t pid;
+  int fd;
+  /// Number of requests answered so far.
+  int requests;
+  bool busy;
+};
+
+/// The workers of a SubprocessSet.  Idle workers are reused for later
+/// requests with the same command.
+struct WorkerPool {
+  ~WorkerPool();
+
+  /// Return an idle worker for |command|, starting a new one with the
+  /// signal mask |mask| if there's none.  Returns nullptr if workers for
+  /// |command| turned out to be broken.
+  Worker* Acquire(const std::string& command, const sigset_t* mask);
+
+  enum Outcome {
+    /// The worker answered and may take another request.
+    kAnswered,
+    /// The request was abandoned or the worker did something unexpected
+    /// after answering.  It is stopped.
+    kRetire,
+    /// The worker crashed or broke the protocol.  It is stopped, and if it
+    /// never answered at all, no more workers are started for its command.
+    kBroken,
+  };
+  /// Hand back |worker| after a request.
+  void Release(Worker* worker, Outcome outcome);
+
+  /// Workers are recycled after this many requests, to bound leaks.
+  static const int kMaxRequests = 1000;
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  /// Commands that don't start working workers.
+  std::unordered_set<std::string> broken_;
+};
+#endif  // !_WIN32
+
 /// Subprocess wraps a single async subprocess.  It is entirely
 /// passive: it expects the caller to notify it when its fds are ready
 /// for reading, as well as call Finish() to reap the child once done()
@@ -53,10 +112,32 @@ struct Subprocess {
 
   const std::string& GetOutput() const;
 
+  /// Peak resident set size of the finished process in bytes, or 0 if
+  /// unknown.  Only valid after Finish().
+  int64_t max_rss() const { return max_rss_; }
+
+  /// True if the command was sent to a worker that crashed or broke the
+  /// protocol before answering.  It should be run on its own instead.
+  bool worker_lost() const { return worker_lost_; }
+
  private:
   Subprocess(bool use_console);
-  bool Start(struct SubprocessSet* set, const std::string& command);
+  bool Start(struct SubprocessSet* set, const std::string& command,
+             bool force_shell);
   void OnPipeReady();
+#ifndef _WIN32
+  /// Send |args| to |worker|, taken from |workers|.  What doesn't fit into
+  /// the socket is sent by OnWorkerReady() later.  If the worker is gone,
+  /// the request is done at once and worker_lost() is set.
+  void StartRequest(WorkerPool* workers, Worker* worker,
+                    const std::vector<std::string>& args);
+  /// Send what fits of |request_|.  Returns false if the worker is gone.
+  bool SendRequest();
+  /// Send the rest of the request or read the response of the worker.
+  void OnWorkerReady();
+  /// Stop waiting for the worker and hand it back to the pool.
+  void ReleaseWorker(WorkerPool::Outcome outcome);
+#endif
 
   std::string buf_;
 
@@ -73,8 +154,19 @@ struct Subprocess {
 #else
   int fd_;
   pid_t pid_;
+  /// The server that started the process, if any.
+  SpawnServer* spawn_server_;
+  /// For requests to a worker: the pool, the worker while the request is
+  /// in flight, and its answer.
+  WorkerPool* workers_;
+  Worker* worker_;
+  /// The part of the request that wasn't sent to the worker yet.
+  std::string request_;
+  int worker_exit_;
 #endif
   bool use_console_;
+  int64_t max_rss_;
+  bool worker_lost_;
 
   friend struct SubprocessSet;
 };
@@ -86,8 +178,20 @@ struct SubprocessSet {
   SubprocessSet();
   ~SubprocessSet();
 
-  Subprocess* Add(const std::string& command, bool use_console = false);
-  bool DoWork();
+  /// Start |command|.  On Unix, commands that don't need a shell are split
+  /// into arguments and run directly, unless |force_shell| is set.
+  Subprocess* Add(const std::string& command, bool use_console = false,
+                  bool force_shell = false);
+
+  /// Send |command| to a persistent worker started with |worker_command|,
+  /// see Worker.  Returns nullptr if that's not possible, e.g. because the
+  /// command needs a shell, so that the caller can Add() it instead.
+  Subprocess* AddWorkerRequest(const std::string& worker_command,
+                               const std::string& command);
+
+  /// Wait up to |timeout_millis| (forever if negative) for any state change.
+  /// @return true if interrupted.
+  bool DoWork(int timeout_millis = -1);
   std::unique_ptr<Subprocess> NextFinished();
   void Clear();
 
@@ -106,6 +210,18 @@ struct SubprocessSet {
 
   static bool IsInterrupted() { return interrupted_ != 0; }
 
+  /// Return the program that running |name| would execute, looking it up
+  /// in PATH unless it contains a slash.  Returns nullptr if there's none.
+  /// Lookups are cached, a stale result just makes Start() use the shell.
+  const std::string* FindProgram(const std::string& name);
+  std::unordered_map<std::string, std::string> programs_;
+
+  WorkerPool workers_;
+
+  /// If set, processes are started through this server instead of
+  /// directly.  Defaults to SpawnServer::global().
+  SpawnServer* spawn_server_;
+
   struct sigaction old_int_act_;
   struct sigaction old_term_act_;
   struct sigaction old_hup_act_;
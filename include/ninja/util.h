@@ -17,7 +17,9 @@
 
 #include <cstdint>
 #include <cstdio>
+#include <functional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "message.h"
@@ -33,6 +35,12 @@ bool CanonicalizePath(char* path, size_t* len, uint64_t* slash_bits,
 bool CanonicalizePath(std::string_view* path, std::string* data,
                       uint64_t* slash_bits, std::string* err);
 
+/// Same as the char* CanonicalizePath(), but one character at a time and
+/// without the shortcut for paths that are canonical already.  Only for
+/// comparison in tests and benchmarks.
+bool CanonicalizePathScalar(char* path, size_t* len, uint64_t* slash_bits,
+                            std::string* err);
+
 /// Appends |input| to |*result|, escaping according to the whims of either
 /// Bash, or Win32's CommandLineToArgvW().
 /// Appends the string directly to |result| without modification if we can
@@ -40,6 +48,16 @@ bool CanonicalizePath(std::string_view* path, std::string* data,
 void GetShellEscapedString(const std::string& input, std::string* result);
 void GetWin32EscapedString(const std::string& input, std::string* result);
 
+/// Appends |input| to |*result| as a quoted JSON string.
+void AppendJSONString(std::string_view input, std::string* result);
+
+/// Split |command| into arguments the way /bin/sh would, if it is made of
+/// nothing but plain words, blanks and quotes.  Returns false if running it
+/// needs the shell after all, e.g. because it expands variables or globs,
+/// redirects, chains commands or starts with an assignment or a builtin.
+bool SplitShellCommand(std::string_view command,
+                       std::vector<std::string>* args);
+
 /// Read a file to a string (in text mode: with CRLF conversion
 /// on Windows).
 /// Returns -errno and fills in \a err on error.
@@ -58,6 +76,37 @@ std::string StripAnsiEscapeCodes(const std::string& in);
 /// guess for how many jobs to run in parallel.  @return 0 on error.
 int GetProcessorCount();
 
+/// @return the number of processors this process may run on according to
+/// its CPU affinity mask.  @return 0 if unknown.
+int GetAffinityProcessorCount();
+
+/// @return the cgroup v2 directory of this process (e.g.
+/// "/sys/fs/cgroup/user.slice/"), including a trailing slash.  @return an
+/// empty string if not running in a cgroup v2 hierarchy.
+std::string GetCgroupDirectory();
+
+/// Parse the contents of a cgroup v2 cpu.max file ("$MAX $PERIOD").
+/// @return the number of CPUs the quota allows, or 0 if there is no quota.
+double ParseCgroupCpuMax(std::string_view contents);
+
+/// @return the number of CPUs granted to this process by the cgroup CPU
+/// bandwidth controller (cpu.max or cpu.cfs_quota_us, including the limits
+/// of parent cgroups).  @return 0 if there is no quota.
+double GetCgroupCpuQuota();
+
+/// @return the cgroup memory limit of this process in bytes (memory.max or
+/// memory.limit_in_bytes, including the limits of parent cgroups).
+/// @return 0 if there is no limit.
+int64_t GetCgroupMemoryLimit();
+
+/// @return how many of |processors| this process can keep busy, given the
+/// number of processors in its affinity mask and its cgroup CPU quota.
+/// Zero arguments are unknown or unlimited.  @return 0 if all are unknown.
+int UsableProcessorCount(int processors, int affinity, double cpu_quota);
+
+/// @return UsableProcessorCount() for this process.
+int GetUsableProcessorCount();
+
 /// @return the load average of the machine. A negative value is returned
 /// on error.
 double GetLoadAverage();
@@ -69,6 +118,14 @@ std::string ElideMiddle(const std::string& str, size_t width);
 /// Truncates a file to the given size.
 bool Truncate(const std::string& path, size_t size, std::string* err);
 
+/// Split [0, |count|) into at most |threads| contiguous ranges and call
+/// |fn|(begin, end) for each of them, in parallel, on up to |threads|
+/// threads including the calling one.  Ranges are never smaller than
+/// |min_range| (except for the last one), so small inputs stay on the
+/// calling thread.  Returns once all calls are finished.
+void ParallelFor(size_t count, int threads, size_t min_range,
+                 const std::function<void(size_t begin, size_t end)>& fn);
+
 #ifdef _WIN32
 /// Convert the value returned by GetLastError() into a string.
 std::string GetLastErrorString();
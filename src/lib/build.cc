@@ -12,17 +12,24 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <ninja/ninja_config.h>
+
 #include <ninja/build.h>
 
 #include "depfile_parser.h"
 #include "clparser.h"
 
+#include <ninja/build_events.h>
 #include <ninja/build_log.h>
+#include <ninja/builtin.h>
 #include <ninja/debug_flags.h>
+#include <ninja/directory_table.h>
 #include <ninja/disk_interface.h>
 #include <ninja/graph.h>
+#include <ninja/pressure.h>
 #include <ninja/state.h>
 #include <ninja/subprocess.h>
+#include <ninja/thread_pool.h>
 #include <ninja/util.h>
 
 #include <assert.h>
@@ -30,6 +37,7 @@
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <algorithm>
 #include <functional>
 
 #ifdef _WIN32
@@ -41,6 +49,13 @@
 #include <sys/termios.h>
 #endif
 
+#ifdef NINJA_HAVE_MEMFD
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 namespace ninja {
 
 namespace {
@@ -81,8 +96,11 @@ bool DryRunCommandRunner::WaitForCommand(Result* result) {
 
 BuildStatus::BuildStatus(const BuildConfig& config)
     : config_(config), start_time_millis_(GetTimeMillis()), started_edges_(0),
-      finished_edges_(0), total_edges_(0), progress_status_format_(nullptr),
-      overall_rate_(), current_rate_(config.parallelism) {
+      finished_edges_(0), total_edges_(0),
+      parallelism_limit_(config.parallelism), progress_status_format_(nullptr),
+      refresh_millis_(50), last_refresh_millis_(0), pending_edge_(nullptr),
+      pending_status_(kEdgeStarted), overall_rate_(),
+      current_rate_(config.parallelism) {
   // Don't do anything fancy in verbose mode.
   if (config_.verbosity != BuildConfig::NORMAL)
     printer_.set_smart_terminal(false);
@@ -90,10 +108,25 @@ BuildStatus::BuildStatus(const BuildConfig& config)
   progress_status_format_ = getenv("NINJA_STATUS");
   if (!progress_status_format_)
     progress_status_format_ = "[%f/%t] ";
+
+  if (const char* refresh = getenv("NINJA_STATUS_REFRESH_MILLIS")) {
+    char* end;
+    long millis = strtol(refresh, &end, 10);
+    if (*end != '\0' || millis < 0)
+      Fatal("invalid $NINJA_STATUS_REFRESH_MILLIS '%s'", refresh);
+    refresh_millis_ = millis;
+  }
+
+  if (config_.event_fd >= 0)
+    events_.reset(new BuildEventStream(config_.event_fd));
 }
 
+BuildStatus::~BuildStatus() {}
+
 void BuildStatus::PlanHasTotalEdges(int total) {
   total_edges_ = total;
+  if (events_)
+    events_->PlanHasTotalEdges(total);
 }
 
 void BuildStatus::BuildEdgeStarted(Edge* edge) {
@@ -101,16 +134,23 @@ void BuildStatus::BuildEdgeStarted(Edge* edge) {
   running_edges_.insert(std::make_pair(edge, start_time));
   ++started_edges_;
 
+  if (events_)
+    events_->EdgeStarted(edge, start_time);
+
+  // The status must be on screen before a console command takes it over.
   if (edge->use_console() || printer_.is_smart_terminal())
-    PrintStatus(edge, kEdgeStarted);
+    PrintStatus(edge, kEdgeStarted, edge->use_console());
 
   if (edge->use_console())
     printer_.SetConsoleLocked(true);
 }
 
-void BuildStatus::BuildEdgeFinished(Edge* edge, bool success,
-                                    const std::string& output, int* start_time,
+void BuildStatus::BuildEdgeFinished(const CommandRunner::Result& result,
+                                    bool restat_cleaned, int* start_time,
                                     int* end_time) {
+  Edge* edge = result.edge;
+  bool success = result.success();
+  const std::string& output = result.output;
   int64_t now = GetTimeMillis();
 
   ++finished_edges_;
@@ -120,26 +160,35 @@ void BuildStatus::BuildEdgeFinished(Edge* edge, bool success,
   *end_time = (int)(now - start_time_millis_);
   running_edges_.erase(i);
 
+  if (events_)
+    events_->EdgeFinished(result, restat_cleaned, *start_time, *end_time);
+
   if (edge->use_console())
     printer_.SetConsoleLocked(false);
 
   if (config_.verbosity == BuildConfig::QUIET)
     return;
 
-  if (!edge->use_console())
-    PrintStatus(edge, kEdgeFinished);
+  // On a smart terminal, the oldest running edge overprints the finished
+  // one, so only that is shown.  Any output has to come after the status
+  // is up to date.
+  bool force = !success || !output.empty();
+  Edge* oldest = nullptr;
   if (printer_.is_smart_terminal()) {
     int oldest_start = INT_MAX;
-    Edge* oldest = nullptr;
     for (i = running_edges_.begin(); i != running_edges_.end(); i++) {
       if (i->second < oldest_start) {
         oldest_start = i->second;
         oldest = i->first;
       }
     }
-    if (oldest)
-      PrintStatus(oldest, kEdgeRunning);
   }
+  if (oldest)
+    PrintStatus(oldest, kEdgeRunning, force);
+  else if (!edge->use_console())
+    PrintStatus(edge, kEdgeFinished, force);
+  else if (force)
+    PrintPendingStatus();
 
   // Print the command that is spewing before printing its output.
   if (!success) {
@@ -189,14 +238,28 @@ void BuildStatus::BuildStarted() {
   current_rate_.Restart();
 }
 
-void BuildStatus::BuildFinished() {
+void BuildStatus::BuildFinished(bool success) {
+  if (events_)
+    events_->BuildFinished(success, GetTimeMillis() - start_time_millis_);
+  PrintPendingStatus();
   printer_.SetConsoleLocked(false);
   printer_.PrintOnNewLine("");
 }
 
+void BuildStatus::ParallelismChanged(int limit) {
+  parallelism_limit_ = limit;
+}
+
 std::string BuildStatus::FormatProgressStatus(
     const char* progress_status_format, EdgeStatus status) const {
   std::string out;
+  FormatProgressStatus(progress_status_format, status, &out);
+  return out;
+}
+
+void BuildStatus::FormatProgressStatus(const char* progress_status_format,
+                                       EdgeStatus status,
+                                       std::string* out) const {
   char buf[32];
   int percent;
   for (const char* s = progress_status_format; *s != '\0'; ++s) {
@@ -204,19 +267,19 @@ std::string BuildStatus::FormatProgressStatus(
       ++s;
       switch (*s) {
       case '%':
-        out.push_back('%');
+        out->push_back('%');
         break;
 
         // Started edges.
       case 's':
         std::snprintf(buf, sizeof(buf), "%d", started_edges_);
-        out += buf;
+        out->append(buf);
         break;
 
         // Total edges.
       case 't':
         std::snprintf(buf, sizeof(buf), "%d", total_edges_);
-        out += buf;
+        out->append(buf);
         break;
 
         // Running edges.
@@ -226,85 +289,134 @@ std::string BuildStatus::FormatProgressStatus(
         if (status == kEdgeFinished)
           running_edges++;
         std::snprintf(buf, sizeof(buf), "%d", running_edges);
-        out += buf;
+        out->append(buf);
         break;
       }
 
         // Unstarted edges.
       case 'u':
         std::snprintf(buf, sizeof(buf), "%d", total_edges_ - started_edges_);
-        out += buf;
+        out->append(buf);
         break;
 
         // Finished edges.
       case 'f':
         std::snprintf(buf, sizeof(buf), "%d", finished_edges_);
-        out += buf;
+        out->append(buf);
         break;
 
         // Overall finished edges per second.
       case 'o':
         overall_rate_.UpdateRate(finished_edges_);
         SnprintfRate(overall_rate_.rate(), buf, "%.1f");
-        out += buf;
+        out->append(buf);
         break;
 
         // Current rate, average over the last '-j' jobs.
       case 'c':
         current_rate_.UpdateRate(finished_edges_);
         SnprintfRate(current_rate_.rate(), buf, "%.1f");
-        out += buf;
+        out->append(buf);
         break;
 
         // Percentage
       case 'p':
         percent = (100 * finished_edges_) / total_edges_;
         std::snprintf(buf, sizeof(buf), "%3i%%", percent);
-        out += buf;
+        out->append(buf);
         break;
 
       case 'e': {
         double elapsed = overall_rate_.Elapsed();
         std::snprintf(buf, sizeof(buf), "%.3f", elapsed);
-        out += buf;
+        out->append(buf);
         break;
       }
 
+        // Current parallelism limit.
+      case 'j':
+        std::snprintf(buf, sizeof(buf), "%d", parallelism_limit_);
+        out->append(buf);
+        break;
+
       default:
         Fatal("unknown placeholder '%%%c' in $NINJA_STATUS", *s);
-        return "";
+        return;
       }
     } else {
-      out.push_back(*s);
+      out->push_back(*s);
     }
   }
-
-  return out;
 }
 
-void BuildStatus::PrintStatus(Edge* edge, EdgeStatus status) {
+void BuildStatus::PrintStatus(Edge* edge, EdgeStatus status, bool force) {
   if (config_.verbosity == BuildConfig::QUIET)
     return;
 
-  bool force_full_command = config_.verbosity == BuildConfig::VERBOSE;
-
-  std::string to_print = edge->GetBinding("description");
-  if (to_print.empty() || force_full_command)
-    to_print = edge->GetBinding("command");
+  // Only an overprinted line may be skipped; otherwise every line counts.
+  if (printer_.is_smart_terminal() && refresh_millis_ > 0) {
+    int64_t now = GetTimeMillis();
+    if (!force && now - last_refresh_millis_ < refresh_millis_) {
+      pending_edge_ = edge;
+      pending_status_ = status;
+      return;
+    }
+    last_refresh_millis_ = now;
+  }
+  pending_edge_ = nullptr;
 
-  to_print = FormatProgressStatus(progress_status_format_, status) + to_print;
+  bool force_full_command = config_.verbosity == BuildConfig::VERBOSE;
 
-  printer_.Print(to_print,
+  status_line_.clear();
+  FormatProgressStatus(progress_status_format_, status, &status_line_);
+  std::string description;
+  if (!force_full_command)
+    description = edge->GetBinding("description");
+  if (description.empty())
+    status_line_ += edge->GetBinding("command");
+  else
+    status_line_ += description;
+
+  printer_.Print(status_line_,
                  force_full_command ? LinePrinter::FULL : LinePrinter::ELIDE);
 }
 
+void BuildStatus::PrintPendingStatus() {
+  if (pending_edge_)
+    PrintStatus(pending_edge_, pending_status_, true);
+}
+
 Plan::Plan() : command_edges_(0), wanted_edges_(0) {}
 
+namespace {
+
+/// Order for the |ready_| heap: the edge with the lowest id is on top.
+bool ReadyEdgeCmp(const Edge* a, const Edge* b) {
+  return a->id() > b->id();
+}
+
+}  // namespace
+
 void Plan::Reset() {
   command_edges_ = 0;
   wanted_edges_ = 0;
   ready_.clear();
-  want_.clear();
+  for (Edge* edge : planned_)
+    edges_[edge->id()] = EdgeState();
+  planned_.clear();
+}
+
+Plan::EdgeState& Plan::GetEdgeState(const Edge* edge) {
+  size_t id = static_cast<size_t>(edge->id());
+  assert(edge->id() >= 0);
+  if (id >= edges_.size())
+    edges_.resize(std::max(id + 1, 2 * edges_.size()));
+  return edges_[id];
+}
+
+bool Plan::IsPlanned(const Edge* edge) const {
+  size_t id = static_cast<size_t>(edge->id());
+  return id < edges_.size() && edges_[id].planned;
 }
 
 bool Plan::AddTarget(Node* node, std::string* err) {
@@ -328,25 +440,34 @@ bool Plan::AddSubTarget(Node* node, Node* dependent, std::string* err) {
   if (edge->outputs_ready())
     return false;  // Don't need to do anything.
 
-  // If an entry in want_ does not already exist for edge, create an entry which
-  // maps to kWantNothing, indicating that we do not want to build this entry
-  // itself.
-  std::pair<std::map<Edge*, Want>::iterator, bool> want_ins =
-      want_.insert(std::make_pair(edge, kWantNothing));
-  Want& want = want_ins.first->second;
+  // If the edge is not planned yet, add it with kWantNothing, indicating that
+  // we do not want to build this entry itself.
+  EdgeState& state = GetEdgeState(edge);
+  bool newly_planned = !state.planned;
+  if (newly_planned) {
+    state.planned = true;
+    state.want = kWantNothing;
+    state.pending_inputs = 0;
+    state.dirty_inputs = -1;
+    for (Node* input : edge->inputs_) {
+      if (input->in_edge() && !input->in_edge()->outputs_ready())
+        ++state.pending_inputs;
+    }
+    planned_.push_back(edge);
+  }
 
   // If we do need to build edge and we haven't already marked it as wanted,
   // mark it now.
-  if (node->dirty() && want == kWantNothing) {
-    want = kWantToStart;
+  if (node->dirty() && state.want == kWantNothing) {
+    state.want = kWantToStart;
     ++wanted_edges_;
-    if (edge->AllInputsReady())
-      ScheduleWork(want_ins.first);
+    if (state.pending_inputs == 0)
+      ScheduleWork(edge, &state);
     if (!edge->is_phony())
       ++command_edges_;
   }
 
-  if (!want_ins.second)
+  if (!newly_planned)
     return true;  // We've already processed the inputs.
 
   for (std::vector<Node*>::iterator i = edge->inputs_.begin();
@@ -361,14 +482,49 @@ bool Plan::AddSubTarget(Node* node, Node* dependent, std::string* err) {
 Edge* Plan::FindWork() {
   if (ready_.empty())
     return nullptr;
-  std::set<Edge*>::iterator e = ready_.begin();
-  Edge* edge = *e;
-  ready_.erase(e);
+  std::pop_heap(ready_.begin(), ready_.end(), ReadyEdgeCmp);
+  Edge* edge = ready_.back();
+  ready_.pop_back();
   return edge;
 }
 
-void Plan::ScheduleWork(std::map<Edge*, Want>::iterator want_e) {
-  if (want_e->second == kWantToFinish) {
+void Plan::FindBatch(Edge* edge, int max_size, std::vector<Edge*>* batch) {
+  batch->clear();
+  batch->push_back(edge);
+  for (Edge* other : ready_) {
+    if (other->rule_ == edge->rule_ && other->env_ == edge->env_)
+      batch->push_back(other);
+  }
+  if (batch->size() == 1)
+    return;
+
+  // Take the edges FindWork() would have handed out first.
+  auto by_id = [](const Edge* a, const Edge* b) { return a->id() < b->id(); };
+  std::sort(batch->begin() + 1, batch->end(), by_id);
+  if (batch->size() > (size_t)max_size)
+    batch->resize(max_size);
+
+  ready_.erase(std::remove_if(ready_.begin(), ready_.end(),
+                              [&](Edge* other) {
+                                return std::binary_search(batch->begin() + 1,
+                                                          batch->end(), other,
+                                                          by_id);
+                              }),
+               ready_.end());
+  std::make_heap(ready_.begin(), ready_.end(), ReadyEdgeCmp);
+}
+
+void Plan::RetrieveReadyEdges(Pool* pool) {
+  released_.clear();
+  pool->RetrieveReadyEdges(&released_);
+  for (Edge* edge : released_) {
+    ready_.push_back(edge);
+    std::push_heap(ready_.begin(), ready_.end(), ReadyEdgeCmp);
+  }
+}
+
+void Plan::ScheduleWork(Edge* edge, EdgeState* state) {
+  if (state->want == kWantToFinish) {
     // This edge has already been scheduled.  We can get here again if an edge
     // and one of its dependencies share an order-only input, or if a node
     // duplicates an out edge (see
@@ -376,29 +532,29 @@ void Plan::ScheduleWork(std::map<Edge*, Want>::iterator want_e) {
     // again.
     return;
   }
-  assert(want_e->second == kWantToStart);
-  want_e->second = kWantToFinish;
+  assert(state->want == kWantToStart);
+  state->want = kWantToFinish;
 
-  Edge* edge = want_e->first;
   Pool* pool = edge->pool();
   if (pool->ShouldDelayEdge()) {
     pool->DelayEdge(edge);
-    pool->RetrieveReadyEdges(&ready_);
+    RetrieveReadyEdges(pool);
   } else {
     pool->EdgeScheduled(*edge);
-    ready_.insert(edge);
+    ready_.push_back(edge);
+    std::push_heap(ready_.begin(), ready_.end(), ReadyEdgeCmp);
   }
 }
 
 void Plan::EdgeFinished(Edge* edge, EdgeResult result) {
-  std::map<Edge*, Want>::iterator e = want_.find(edge);
-  assert(e != want_.end());
-  bool directly_wanted = e->second != kWantNothing;
+  assert(IsPlanned(edge));
+  EdgeState& state = edges_[edge->id()];
+  bool directly_wanted = state.want != kWantNothing;
 
   // See if this job frees up any delayed jobs.
   if (directly_wanted)
     edge->pool()->EdgeFinished(*edge);
-  edge->pool()->RetrieveReadyEdges(&ready_);
+  RetrieveReadyEdges(edge->pool());
 
   // The rest of this function only applies to successful commands.
   if (result != kEdgeSucceeded)
@@ -406,7 +562,7 @@ void Plan::EdgeFinished(Edge* edge, EdgeResult result) {
 
   if (directly_wanted)
     --wanted_edges_;
-  want_.erase(e);
+  state.planned = false;
   edge->outputs_ready_ = true;
 
   // Check off any nodes we were waiting for with this edge.
@@ -417,17 +573,20 @@ void Plan::EdgeFinished(Edge* edge, EdgeResult result) {
 }
 
 void Plan::NodeFinished(Node* node) {
-  // See if we we want any edges from this node.
+  // See if we we want any edges from this node.  A node is listed once in
+  // out_edges() for every input slot it occupies, matching the way
+  // pending_inputs was counted.
   for (std::vector<Edge*>::const_iterator oe = node->out_edges().begin();
        oe != node->out_edges().end(); ++oe) {
-    std::map<Edge*, Want>::iterator want_e = want_.find(*oe);
-    if (want_e == want_.end())
+    if (!IsPlanned(*oe))
       continue;
 
     // See if the edge is now ready.
-    if ((*oe)->AllInputsReady()) {
-      if (want_e->second != kWantNothing) {
-        ScheduleWork(want_e);
+    EdgeState& state = edges_[(*oe)->id()];
+    assert(state.pending_inputs > 0);
+    if (--state.pending_inputs == 0) {
+      if (state.want != kWantNothing) {
+        ScheduleWork(*oe, &state);
       } else {
         // We do not need to build this edge, but we might need to build one of
         // its dependents.
@@ -438,25 +597,44 @@ void Plan::NodeFinished(Node* node) {
 }
 
 bool Plan::CleanNode(DependencyScan* scan, Node* node, std::string* err) {
+  bool was_dirty = node->dirty();
   node->set_dirty(false);
 
   for (std::vector<Edge*>::const_iterator oe = node->out_edges().begin();
        oe != node->out_edges().end(); ++oe) {
     // Don't process edges that we don't actually want.
-    std::map<Edge*, Want>::iterator want_e = want_.find(*oe);
-    if (want_e == want_.end() || want_e->second == kWantNothing)
+    if (!IsPlanned(*oe))
+      continue;
+    EdgeState& state = edges_[(*oe)->id()];
+    if (state.want == kWantNothing)
       continue;
 
+    // Count the dirty inputs the first time we get here, treating |node| as
+    // still dirty, then check off one occurrence of |node| per visit.  The
+    // count includes order-only inputs since out_edges() does not tell which
+    // slot |node| occupies.
+    std::vector<Node*>::iterator begin = (*oe)->inputs_.begin(),
+                                 end = (*oe)->inputs_.end() -
+                                       (*oe)->order_only_deps_;
+    if (state.dirty_inputs < 0) {
+      state.dirty_inputs = 0;
+      for (std::vector<Node*>::iterator i = begin; i != (*oe)->inputs_.end();
+           ++i) {
+        if ((*i)->dirty() || (was_dirty && *i == node))
+          ++state.dirty_inputs;
+      }
+    }
+    if (was_dirty)
+      --state.dirty_inputs;
+
     // Don't attempt to clean an edge if it failed to load deps.
     if ((*oe)->deps_missing_)
       continue;
 
     // If all non-order-only inputs for this edge are now clean,
     // we might have changed the dirty state of the outputs.
-    std::vector<Node*>::iterator begin = (*oe)->inputs_.begin(),
-                                 end = (*oe)->inputs_.end() -
-                                       (*oe)->order_only_deps_;
-    if (find_if(begin, end, std::mem_fn(&Node::dirty)) == end) {
+    if (state.dirty_inputs == count_if(end, (*oe)->inputs_.end(),
+                                       std::mem_fn(&Node::dirty))) {
       // Recompute most_recent_input.
       Node* most_recent_input = nullptr;
       for (std::vector<Node*>::iterator i = begin; i != end; ++i) {
@@ -479,7 +657,7 @@ bool Plan::CleanNode(DependencyScan* scan, Node* node, std::string* err) {
             return false;
         }
 
-        want_e->second = kWantNothing;
+        state.want = kWantNothing;
         --wanted_edges_;
         if (!(*oe)->is_phony())
           --command_edges_;
@@ -489,84 +667,370 @@ bool Plan::CleanNode(DependencyScan* scan, Node* node, std::string* err) {
   return true;
 }
 
+void Plan::GetOutputDirs(std::vector<Directory*>* dirs) const {
+  dirs->clear();
+  for (Edge* edge : planned_) {
+    if (!IsPlanned(edge) || edges_[edge->id()].want == kWantNothing ||
+        edge->is_phony())
+      continue;
+    for (Node* output : edge->outputs_) {
+      if (!output->dir()->exists)
+        dirs->push_back(output->dir());
+    }
+  }
+  std::sort(dirs->begin(), dirs->end(),
+            [](const Directory* a, const Directory* b) {
+              return a->id < b->id;
+            });
+  dirs->erase(std::unique(dirs->begin(), dirs->end()), dirs->end());
+}
+
 void Plan::Dump() {
-  printf("pending: %d\n", (int)want_.size());
-  for (std::map<Edge*, Want>::iterator e = want_.begin(); e != want_.end();
-       ++e) {
-    if (e->second != kWantNothing)
+  // An edge is listed in |planned_| again if it's planned after a
+  // State::Reset().
+  std::vector<Edge*> pending;
+  std::vector<bool> seen(edges_.size());
+  for (Edge* edge : planned_) {
+    if (edges_[edge->id()].planned && !seen[edge->id()]) {
+      seen[edge->id()] = true;
+      pending.push_back(edge);
+    }
+  }
+  printf("pending: %d\n", (int)pending.size());
+  for (Edge* edge : pending) {
+    if (edges_[edge->id()].want != kWantNothing)
       printf("want ");
-    e->first->Dump();
+    edge->Dump();
   }
   printf("ready: %d\n", (int)ready_.size());
 }
 
 struct RealCommandRunner : public CommandRunner {
-  explicit RealCommandRunner(const BuildConfig& config) : config_(config) {}
+  RealCommandRunner(const BuildConfig& config, BuildStatus* status,
+                    DiskInterface* disk_interface);
   virtual ~RealCommandRunner() {}
   virtual bool CanRunMore();
   virtual bool StartCommand(Edge* edge);
+  virtual bool StartBatch(const std::vector<Edge*>& batch);
+  virtual bool PassesRspfile(Edge* edge);
   virtual bool WaitForCommand(Result* result);
+  virtual bool HasFinishedCommand();
   virtual std::vector<Edge*> GetActiveEdges();
   virtual void Abort();
 
+  /// Start |edge| with its response file in a memfd, falling back to
+  /// writing it to disk if there are no memfds.
+  bool StartWithRspfileMemfd(Edge* edge, const std::string& rspfile);
+
+  /// Start |command| for |edges|, on a persistent worker if their rule has
+  /// one.
+  bool StartSubprocess(const std::string& command, std::vector<Edge*> edges);
+
+  /// Return the load average, read again at most once per
+  /// ParallelismController::kSampleIntervalMillis like pressure is.
+  double LoadAverage(int64_t now_millis);
+
   const BuildConfig& config_;
+  BuildStatus* status_;
+  DiskInterface* disk_interface_;
   SubprocessSet subprocs_;
-  std::map<Subprocess*, Edge*> subproc_to_edge_;
+  /// Results available without waiting: builtin commands that already ran,
+  /// in the order they were started, and the other edges of a finished
+  /// batch.  They occupy a job slot until they're reaped.
+  std::queue<Result> queued_results_;
+  /// Set when an interruption was seen by HasFinishedCommand(), so that the
+  /// next WaitForCommand() reports it.
+  bool interrupted_;
+  /// The edges of each subprocess, more than one for a batch.
+  std::map<Subprocess*, std::vector<Edge*>> subproc_to_edges_;
+  RealPressureSource pressure_source_;
+  std::unique_ptr<ParallelismController> controller_;
+  /// The last load average read for -l, and when it was read.
+  bool load_average_sampled_;
+  int64_t load_average_millis_;
+  double load_average_;
 };
 
+RealCommandRunner::RealCommandRunner(const BuildConfig& config,
+                                     BuildStatus* status,
+                                     DiskInterface* disk_interface)
+    : config_(config), status_(status), disk_interface_(disk_interface),
+      interrupted_(false), load_average_sampled_(false),
+      load_average_millis_(0), load_average_(0.0) {
+  if (config_.max_pressure >= 0.0) {
+    controller_ = std::make_unique<ParallelismController>(
+        config_.min_parallelism, config_.parallelism, config_.max_pressure,
+        &pressure_source_);
+  }
+}
+
 std::vector<Edge*> RealCommandRunner::GetActiveEdges() {
   std::vector<Edge*> edges;
-  for (std::map<Subprocess*, Edge*>::iterator e = subproc_to_edge_.begin();
-       e != subproc_to_edge_.end(); ++e)
-    edges.push_back(e->second);
+  for (const auto& subproc : subproc_to_edges_)
+    edges.insert(edges.end(), subproc.second.begin(), subproc.second.end());
   return edges;
 }
 
 void RealCommandRunner::Abort() {
   subprocs_.Clear();
+  queued_results_ = std::queue<Result>();
 }
 
 bool RealCommandRunner::CanRunMore() {
-  size_t subproc_number =
-      subprocs_.running_.size() + subprocs_.finished_.size();
-  return (int)subproc_number < config_.parallelism &&
-         ((subprocs_.running_.empty() || config_.max_load_average <= 0.0f) ||
-          GetLoadAverage() < config_.max_load_average);
+  size_t subproc_number = subprocs_.running_.size() +
+                          subprocs_.finished_.size() + queued_results_.size();
+  int parallelism = config_.parallelism;
+  bool limit_load =
+      !subprocs_.running_.empty() && config_.max_load_average > 0.0f;
+  int64_t now = controller_ || limit_load ? GetTimeMillis() : 0;
+  if (controller_) {
+    int old_limit = controller_->limit();
+    parallelism = controller_->Limit((int)subproc_number, now);
+    if (parallelism != old_limit)
+      status_->ParallelismChanged(parallelism);
+  }
+  return (int)subproc_number < parallelism &&
+         (!limit_load || LoadAverage(now) < config_.max_load_average);
+}
+
+double RealCommandRunner::LoadAverage(int64_t now_millis) {
+  // The kernel updates the load average every few seconds, so reading it
+  // on every pass of the build loop only costs time.
+  if (!load_average_sampled_ ||
+      now_millis - load_average_millis_ >=
+          ParallelismController::kSampleIntervalMillis) {
+    load_average_sampled_ = true;
+    load_average_millis_ = now_millis;
+    load_average_ = GetLoadAverage();
+  }
+  return load_average_;
 }
 
 bool RealCommandRunner::StartCommand(Edge* edge) {
-  std::string command = edge->EvaluateCommand();
-  Subprocess* subproc = subprocs_.Add(command, edge->use_console());
+  std::string builtin = edge->GetBinding("builtin");
+  if (!builtin.empty()) {
+    queued_results_.emplace();
+    RunBuiltinCommand(builtin, edge, disk_interface_,
+                      &queued_results_.back());
+    return true;
+  }
+
+  if (PassesRspfile(edge)) {
+    std::string rspfile = edge->GetUnescapedRspfile();
+    if (!rspfile.empty())
+      return StartWithRspfileMemfd(edge, rspfile);
+  }
+
+  return StartSubprocess(edge->EvaluateCommand(), { edge });
+}
+
+bool RealCommandRunner::PassesRspfile(Edge* edge) {
+#ifdef NINJA_HAVE_MEMFD
+  // Only commands that ninja starts itself inherit the memfd.
+  return config_.rspfile_memfd && !g_keep_rsp && !subprocs_.spawn_server_ &&
+         edge->GetBinding("worker").empty();
+#else
+  return false;
+#endif
+}
+
+bool RealCommandRunner::StartWithRspfileMemfd(Edge* edge,
+                                              const std::string& rspfile) {
+  std::string content = edge->GetBinding("rspfile_content");
+#ifdef NINJA_HAVE_MEMFD
+  // Without MFD_CLOEXEC, so that the command inherits it.  It is closed
+  // again right after the start, so no other command gets it.  The name
+  // only shows in /proc and is limited in length.
+  int fd = memfd_create("ninja-rspfile", MFD_ALLOW_SEALING);
+  if (fd >= 0) {
+    bool ok = true;
+    for (size_t written = 0; ok && written < content.size();) {
+      ssize_t len = write(fd, content.data() + written,
+                          content.size() - written);
+      if (len > 0)
+        written += len;
+      else if (len < 0 && errno != EINTR)
+        ok = false;
+    }
+    // Nothing can change the file once the command may read it.
+    ok = ok && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+                                          F_SEAL_WRITE | F_SEAL_SEAL) == 0;
+    if (ok) {
+      bool started = StartSubprocess(
+          edge->EvaluateCommandWithRspfile("/proc/self/fd/" +
+                                           std::to_string(fd)),
+          { edge });
+      close(fd);
+      return started;
+    }
+    close(fd);
+  }
+#endif
+  // The kernel is too old or the memory file couldn't be set up.  The
+  // file on disk does the same job.
+  if (!disk_interface_->WriteFile(rspfile, content))
+    return false;
+  return StartSubprocess(edge->EvaluateCommand(), { edge });
+}
+
+bool RealCommandRunner::StartBatch(const std::vector<Edge*>& batch) {
+  return StartSubprocess(Edge::EvaluateBatchCommand(batch), batch);
+}
+
+bool RealCommandRunner::StartSubprocess(const std::string& command,
+                                        std::vector<Edge*> edges) {
+  Edge* edge = edges.front();
+  Subprocess* subproc = nullptr;
+  std::string worker = edge->GetBinding("worker");
+  if (!worker.empty() && !edge->use_console())
+    subproc = subprocs_.AddWorkerRequest(worker, command);
+  if (!subproc) {
+    subproc = subprocs_.Add(command, edge->use_console(),
+                            edge->GetBindingBool("force_shell"));
+  }
   if (!subproc)
     return false;
-  subproc_to_edge_.insert(std::make_pair(subproc, edge));
+  subproc_to_edges_.emplace(subproc, std::move(edges));
 
   return true;
 }
 
+bool RealCommandRunner::HasFinishedCommand() {
+  if (interrupted_ || !subprocs_.finished_.empty() ||
+      !queued_results_.empty())
+    return true;
+  // Poll without blocking.
+  if (subprocs_.DoWork(0))
+    interrupted_ = true;
+  return interrupted_ || !subprocs_.finished_.empty();
+}
+
 bool RealCommandRunner::WaitForCommand(Result* result) {
+  if (interrupted_)
+    return false;
+
+  if (!queued_results_.empty()) {
+    // Builtins never wait for the subprocess set, which is where
+    // interruptions are noticed.  Poll for them so that a long run of
+    // builtins can still be stopped.
+    if (subprocs_.DoWork(0))
+      return false;
+    *result = std::move(queued_results_.front());
+    queued_results_.pop();
+    return true;
+  }
+
   std::unique_ptr<Subprocess> subproc;
-  while ((subproc = subprocs_.NextFinished()) == nullptr) {
-    bool interrupted = subprocs_.DoWork();
-    if (interrupted)
+  std::vector<Edge*> edges;
+  for (;;) {
+    while ((subproc = subprocs_.NextFinished()) == nullptr) {
+      bool interrupted = subprocs_.DoWork();
+      if (interrupted)
+        return false;
+    }
+
+    auto e = subproc_to_edges_.find(subproc.get());
+    edges = std::move(e->second);
+    subproc_to_edges_.erase(e);
+    if (!subproc->worker_lost())
+      break;
+
+    // The worker crashed before answering; run the command on its own.
+    Edge* edge = edges.front();
+    std::string command = edges.size() > 1 ? Edge::EvaluateBatchCommand(edges)
+                                           : edge->EvaluateCommand();
+    Subprocess* retry = subprocs_.Add(command, edge->use_console(),
+                                      edge->GetBindingBool("force_shell"));
+    if (!retry)
       return false;
+    subproc_to_edges_.emplace(retry, std::move(edges));
   }
 
   result->status = subproc->Finish();
   result->output = subproc->GetOutput();
-
-  std::map<Subprocess*, Edge*>::iterator e =
-      subproc_to_edge_.find(subproc.get());
-  result->edge = e->second;
-  subproc_to_edge_.erase(e);
+  result->max_rss = subproc->max_rss();
+  result->edge = edges.front();
+
+  // The other edges of a batch share the status; the output is reported
+  // with the first one only.
+  for (size_t i = 1; i < edges.size(); ++i) {
+    queued_results_.emplace();
+    Result& batched = queued_results_.back();
+    batched.edge = edges[i];
+    batched.status = result->status;
+    batched.max_rss = result->max_rss;
+  }
 
   return true;
 }
 
+/// A finished command on its way through FinishCommand().
+struct Completion {
+  Completion() : restat(false), restat_mtime(0), restat_cleaned(false),
+                 stat_ok(false), failure_counted(false), processed(false) {}
+
+  CommandRunner::Result result;
+
+  // Set by Builder::PrepareCompletion().
+  std::string deps_type;
+  std::string deps_prefix;
+  std::string depfile;
+  std::string rspfile;
+  bool restat;
+  /// Paths and mtimes of the outputs, unless it's a dry run.
+  std::vector<const std::string*> outputs;
+  std::vector<TimeStamp> old_mtimes;
+  /// Paths of the non-order-only inputs, for restat.
+  std::vector<const std::string*> inputs;
+
+  // Set by Builder::ProcessCompletion().
+  /// Storage for |deps|.
+  std::string depfile_content;
+  std::set<std::string> includes;
+  /// Canonical paths and slash bits of the dependencies read.
+  std::vector<std::pair<std::string_view, uint64_t>> deps;
+  std::vector<TimeStamp> mtimes;
+  TimeStamp restat_mtime;
+  /// Whether restat found outputs the command left unchanged.
+  bool restat_cleaned;
+  /// Whether all stat() calls succeeded, |err| says why not.
+  bool stat_ok;
+  std::string err;
+
+  /// Whether the failure of the command was already counted against
+  /// BuildConfig::failures_allowed when it was reaped.
+  bool failure_counted;
+
+  /// Set once ProcessCompletion() is done, guarded by CompletionQueue::mutex.
+  bool processed;
+};
+
+/// Finished commands handed to the completion threads, oldest first.
+struct CompletionQueue {
+  explicit CompletionQueue(int threads) : pool(threads) {}
+
+  bool IsProcessed(Completion* completion) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return completion->processed;
+  }
+
+  void WaitUntilProcessed(Completion* completion) {
+    std::unique_lock<std::mutex> lock(mutex);
+    processed.wait(lock, [completion] { return completion->processed; });
+  }
+
+  std::mutex mutex;
+  std::condition_variable processed;
+  std::deque<std::unique_ptr<Completion>> queue;
+  /// Last, so that the threads are joined before the queue goes away.
+  ThreadPool pool;
+};
+
 Builder::Builder(State* state, const BuildConfig& config, BuildLog* build_log,
                  DiskInterface* disk_interface)
     : state_(state), config_(config), disk_interface_(disk_interface),
-      scan_(state, build_log, disk_interface) {
+      scan_(state, build_log, disk_interface), build_started_(false),
+      pending_commands_(0), failures_allowed_(config.failures_allowed) {
   status_ = std::make_unique<BuildStatus>(config);
 }
 
@@ -575,6 +1039,13 @@ Builder::~Builder() {
 }
 
 void Builder::Cleanup() {
+  // Commands that already finished keep their outputs, but aren't recorded.
+  if (completions_) {
+    for (const std::unique_ptr<Completion>& completion : completions_->queue)
+      completions_->WaitUntilProcessed(completion.get());
+    completions_->queue.clear();
+  }
+
   if (command_runner_.get()) {
     std::vector<Edge*> active_edges = command_runner_->GetActiveEdges();
     command_runner_->Abort();
@@ -616,8 +1087,15 @@ Node* Builder::AddTarget(const std::string& name, std::string* err) {
 }
 
 bool Builder::AddTarget(Node* node, std::string* err) {
-  if (!scan_.RecomputeDirty(node, err))
+  if (config_.pipelined_scan)
+    scan_.set_observer(this);
+  bool scanned = scan_.RecomputeDirty(node, err);
+  scan_.set_observer(nullptr);
+  if (!scanned) {
+    if (build_started_)
+      AbortBuild();
     return false;
+  }
 
   if (Edge* in_edge = node->in_edge()) {
     if (in_edge->outputs_ready())
@@ -631,26 +1109,194 @@ bool Builder::AddTarget(Node* node, std::string* err) {
 }
 
 bool Builder::AlreadyUpToDate() const {
-  return !plan_.more_to_do();
+  // With a pipelined scan commands may have run (and even finished all the
+  // work) already; Build() still has to wait for them and report.
+  return !plan_.more_to_do() && !build_started_;
 }
 
-bool Builder::Build(std::string* err) {
-  assert(!AlreadyUpToDate());
-
-  status_->PlanHasTotalEdges(plan_.command_edge_count());
-  int pending_commands = 0;
-  int failures_allowed = config_.failures_allowed;
+void Builder::StartBuild() {
+  if (build_started_)
+    return;
+  build_started_ = true;
+  pending_commands_ = 0;
+  failures_allowed_ = config_.failures_allowed;
 
   // Set up the command runner if we haven't done so already.
   if (!command_runner_.get()) {
     if (config_.dry_run)
       command_runner_.reset(new DryRunCommandRunner);
     else
-      command_runner_.reset(new RealCommandRunner(config_));
+      command_runner_.reset(
+          new RealCommandRunner(config_, status_.get(), disk_interface_));
   }
+  if (config_.completion_threads > 0 && !completions_)
+    completions_.reset(new CompletionQueue(config_.completion_threads));
 
   // We are about to start the build process.
   status_->BuildStarted();
+}
+
+void Builder::AbortBuild() {
+  Cleanup();
+  status_->BuildFinished(false);
+  build_started_ = false;
+}
+
+bool Builder::StartWork(Edge* edge, std::string* err) {
+  if (!edge->is_phony()) {
+    int batch_size = edge->GetBatchSize();
+    if (batch_size > 1) {
+      plan_.FindBatch(edge, batch_size, &batch_);
+      if (batch_.size() > 1)
+        return StartBatch(err);
+    }
+  }
+
+  if (!StartEdge(edge, err))
+    return false;
+
+  if (edge->is_phony()) {
+    plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
+  } else {
+    ++pending_commands_;
+  }
+  return true;
+}
+
+bool Builder::ReapCommand(std::string* err) {
+  if (completions_ && !completions_->queue.empty()) {
+    // Committing may make new edges ready, so it comes first.  Rather than
+    // wait for the completion threads, reap another command if one is done.
+    int running = pending_commands_ - (int)completions_->queue.size();
+    bool wait = running == 0 || !command_runner_->HasFinishedCommand();
+    bool committed;
+    if (!CommitQueuedCompletion(wait, &committed, err))
+      return false;
+    if (committed)
+      return true;
+  }
+
+  // Don't leave a held back status line on screen while waiting.
+  if (status_->has_pending_status() && !command_runner_->HasFinishedCommand())
+    status_->PrintPendingStatus();
+
+  CommandRunner::Result result;
+  if (!command_runner_->WaitForCommand(&result) ||
+      result.status == ExitInterrupted) {
+    *err = "interrupted by user";
+    return false;
+  }
+
+  if (completions_) {
+    QueueCompletion(&result);
+    return true;
+  }
+  --pending_commands_;
+  return FinishCommand(&result, err);
+}
+
+void Builder::QueueCompletion(CommandRunner::Result* result) {
+  completions_->queue.emplace_back(new Completion);
+  Completion* completion = completions_->queue.back().get();
+  completion->result = std::move(*result);
+  // Count the failure right away, so that no more commands start while the
+  // completion is queued, however long the threads take.
+  if (!completion->result.success() && failures_allowed_) {
+    failures_allowed_--;
+    completion->failure_counted = true;
+  }
+  PrepareCompletion(completion);
+  CompletionQueue* completions = completions_.get();
+  completions->pool.Add([this, completions, completion] {
+    ProcessCompletion(completion);
+    {
+      std::lock_guard<std::mutex> lock(completions->mutex);
+      completion->processed = true;
+    }
+    completions->processed.notify_all();
+  });
+}
+
+bool Builder::CommitQueuedCompletion(bool wait, bool* committed,
+                                     std::string* err) {
+  *committed = false;
+  Completion* completion = completions_->queue.front().get();
+  if (!completions_->IsProcessed(completion)) {
+    if (!wait)
+      return true;
+    completions_->WaitUntilProcessed(completion);
+  }
+
+  std::unique_ptr<Completion> owned = std::move(completions_->queue.front());
+  completions_->queue.pop_front();
+  *committed = true;
+  --pending_commands_;
+  return CommitCompletion(completion, err);
+}
+
+bool Builder::HasFinishedWork() {
+  int running = pending_commands_;
+  if (completions_ && !completions_->queue.empty()) {
+    if (completions_->IsProcessed(completions_->queue.front().get()))
+      return true;
+    running -= (int)completions_->queue.size();
+  }
+  return running > 0 && command_runner_->HasFinishedCommand();
+}
+
+bool Builder::PumpCommands(std::string* err) {
+  for (;;) {
+    if (failures_allowed_ && command_runner_->CanRunMore()) {
+      if (Edge* edge = plan_.FindWork()) {
+        if (!StartWork(edge, err))
+          return false;
+        continue;
+      }
+    }
+
+    if (pending_commands_ && HasFinishedWork()) {
+      if (!ReapCommand(err))
+        return false;
+      continue;
+    }
+
+    return true;
+  }
+}
+
+bool Builder::EdgeScanned(Edge* edge, std::string* err) {
+  // Only act on edges that the full Plan::AddTarget() would schedule right
+  // away: dirty edges whose inputs are all ready.  Everything else is left
+  // for the plan built after the scan, so that the same edges run in the
+  // end.  Phony edges have nothing to run early.
+  if (edge->is_phony() || edge->outputs_ready() ||
+      !edge->outputs_[0]->dirty() || !edge->AllInputsReady())
+    return true;
+
+  if (!plan_.AddTarget(edge->outputs_[0], err) && !err->empty())
+    return false;
+  status_->PlanHasTotalEdges(plan_.command_edge_count());
+
+  StartBuild();
+  return PumpCommands(err);
+}
+
+bool Builder::Build(std::string* err) {
+  assert(!AlreadyUpToDate());
+
+  status_->PlanHasTotalEdges(plan_.command_edge_count());
+
+  // Create the output directories up front, so that starting a command
+  // doesn't wait for the disk.  Directories known to exist from an earlier
+  // build may have been removed since.
+  if (!config_.dry_run) {
+    state_->directories_.ForgetExisting();
+    std::vector<Directory*> dirs;
+    plan_.GetOutputDirs(&dirs);
+    disk_interface_->MakeDirsInParallel(dirs, config_.parallelism);
+  }
+
+  StartBuild();
 
   // This main loop runs the entire build process.
   // It is structured like this:
@@ -659,60 +1305,38 @@ bool Builder::Build(std::string* err) {
   // Second, we attempt to wait for / reap the next finished command.
   while (plan_.more_to_do()) {
     // See if we can start any more commands.
-    if (failures_allowed && command_runner_->CanRunMore()) {
+    if (failures_allowed_ && command_runner_->CanRunMore()) {
       if (Edge* edge = plan_.FindWork()) {
-        if (!StartEdge(edge, err)) {
-          Cleanup();
-          status_->BuildFinished();
+        if (!StartWork(edge, err)) {
+          AbortBuild();
           return false;
         }
 
-        if (edge->is_phony()) {
-          plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
-        } else {
-          ++pending_commands;
-        }
-
         // We made some progress; go back to the main loop.
         continue;
       }
     }
 
     // See if we can reap any finished commands.
-    if (pending_commands) {
-      CommandRunner::Result result;
-      if (!command_runner_->WaitForCommand(&result) ||
-          result.status == ExitInterrupted) {
-        Cleanup();
-        status_->BuildFinished();
-        *err = "interrupted by user";
+    if (pending_commands_) {
+      if (!ReapCommand(err)) {
+        AbortBuild();
         return false;
       }
 
-      --pending_commands;
-      if (!FinishCommand(&result, err)) {
-        Cleanup();
-        status_->BuildFinished();
-        return false;
-      }
-
-      if (!result.success()) {
-        if (failures_allowed)
-          failures_allowed--;
-      }
-
       // We made some progress; start the main loop over.
       continue;
     }
 
     // If we get here, we cannot make any more progress.
-    status_->BuildFinished();
-    if (failures_allowed == 0) {
+    status_->BuildFinished(false);
+    build_started_ = false;
+    if (failures_allowed_ == 0) {
       if (config_.failures_allowed > 1)
         *err = "subcommands failed";
       else
         *err = "subcommand failed";
-    } else if (failures_allowed < config_.failures_allowed)
+    } else if (failures_allowed_ < config_.failures_allowed)
       *err = "cannot make progress due to previous errors";
     else
       *err = "stuck [this is a bug]";
@@ -720,7 +1344,8 @@ bool Builder::Build(std::string* err) {
     return false;
   }
 
-  status_->BuildFinished();
+  status_->BuildFinished(true);
+  build_started_ = false;
   return true;
 }
 
@@ -731,18 +1356,20 @@ bool Builder::StartEdge(Edge* edge, std::string* err) {
 
   status_->BuildEdgeStarted(edge);
 
-  // Create directories necessary for outputs.
-  // XXX: this will block; do we care?
+  // Create directories necessary for outputs.  Usually Build() made them
+  // already.
   for (std::vector<Node*>::iterator o = edge->outputs_.begin();
        o != edge->outputs_.end(); ++o) {
-    if (!disk_interface_->MakeDirs((*o)->path()))
+    if (!disk_interface_->MakeDirs((*o)->dir())) {
+      err->assign("cannot create directory for '" + (*o)->path() + "'");
       return false;
+    }
   }
 
   // Create response file, if needed
   // XXX: this may also block; do we care?
   std::string rspfile = edge->GetUnescapedRspfile();
-  if (!rspfile.empty()) {
+  if (!rspfile.empty() && !command_runner_->PassesRspfile(edge)) {
     std::string content = edge->GetBinding("rspfile_content");
     if (!disk_interface_->WriteFile(rspfile, content))
       return false;
@@ -757,24 +1384,73 @@ bool Builder::StartEdge(Edge* edge, std::string* err) {
   return true;
 }
 
+bool Builder::StartBatch(std::string* err) {
+  METRIC_RECORD("StartEdge");
+  for (Edge* edge : batch_) {
+    status_->BuildEdgeStarted(edge);
+    for (Node* output : edge->outputs_) {
+      if (!disk_interface_->MakeDirs(output->dir())) {
+        err->assign("cannot create directory for '" + output->path() + "'");
+        return false;
+      }
+    }
+  }
+
+  if (!command_runner_->StartBatch(batch_)) {
+    err->assign("command '" + Edge::EvaluateBatchCommand(batch_) +
+                "' failed.");
+    return false;
+  }
+  pending_commands_ += batch_.size();
+  return true;
+}
+
 bool Builder::FinishCommand(CommandRunner::Result* result, std::string* err) {
-  METRIC_RECORD("FinishCommand");
+  Completion completion;
+  completion.result = std::move(*result);
+  PrepareCompletion(&completion);
+  ProcessCompletion(&completion);
+  bool committed = CommitCompletion(&completion, err);
+  *result = std::move(completion.result);
+  return committed;
+}
 
-  Edge* edge = result->edge;
+void Builder::PrepareCompletion(Completion* completion) {
+  Edge* edge = completion->result.edge;
+  completion->deps_type = edge->GetBinding("deps");
+  if (!completion->deps_type.empty())
+    completion->deps_prefix = edge->GetBinding("msvc_deps_prefix");
+  completion->restat = edge->GetBindingBool("restat");
+  if (completion->deps_type == "gcc" || completion->restat)
+    completion->depfile = edge->GetUnescapedDepfile();
+  completion->rspfile = edge->GetUnescapedRspfile();
+  if (config_.dry_run)
+    return;
+
+  // Paths are materialized here, the completion threads may only read them.
+  for (Node* output : edge->outputs_) {
+    completion->outputs.push_back(&output->path());
+    completion->old_mtimes.push_back(output->mtime());
+  }
+  if (completion->restat) {
+    for (std::vector<Node*>::iterator i = edge->inputs_.begin();
+         i != edge->inputs_.end() - edge->order_only_deps_; ++i) {
+      completion->inputs.push_back(&(*i)->path());
+    }
+  }
+}
+
+void Builder::ProcessCompletion(Completion* completion) {
+  CommandRunner::Result* result = &completion->result;
 
   // First try to extract dependencies from the result, if any.
   // This must happen first as it filters the command output (we want
   // to filter /showIncludes output, even on compile failure) and
   // extraction itself can fail, which makes the command fail from a
   // build perspective.
-  std::vector<Node*> deps_nodes;
-  std::string deps_type = edge->GetBinding("deps");
-  const std::string deps_prefix = edge->GetBinding("msvc_deps_prefix");
-  if (!deps_type.empty()) {
+  if (!completion->deps_type.empty()) {
     std::string extract_err;
-    if (!ExtractDeps(result, deps_type, deps_prefix, &deps_nodes,
-                     &extract_err) &&
-        result->success()) {
+    if (!ExtractDeps(completion, &extract_err) && result->success()) {
       if (!result->output.empty())
         result->output.append("\n");
       result->output.append(extract_err);
@@ -782,91 +1458,142 @@ bool Builder::FinishCommand(CommandRunner::Result* result, std::string* err) {
     }
   }
 
+  // The rest of this function only applies to successful commands.
+  if (!result->success())
+    return;
+
+  // Restat the edge outputs
+  bool unchanged = false;
+  for (size_t i = 0; i < completion->outputs.size(); ++i) {
+    TimeStamp new_mtime =
+        disk_interface_->Stat(*completion->outputs[i], &completion->err);
+    if (new_mtime == -1)
+      return;
+    completion->mtimes.push_back(new_mtime);
+    if (completion->old_mtimes[i] == new_mtime)
+      unchanged = true;
+  }
+
+  if (completion->restat && unchanged) {
+    // CommitCompletion() will clean the unchanged outputs.  Find the most
+    // recent mtime of any (existing) non-order-only input or the depfile.
+    completion->restat_cleaned = true;
+    TimeStamp restat_mtime = 0;
+    for (const std::string* input : completion->inputs) {
+      TimeStamp input_mtime = disk_interface_->Stat(*input, &completion->err);
+      if (input_mtime == -1)
+        return;
+      if (input_mtime > restat_mtime)
+        restat_mtime = input_mtime;
+    }
+
+    if (restat_mtime != 0 && completion->deps_type.empty() &&
+        !completion->depfile.empty()) {
+      TimeStamp depfile_mtime =
+          disk_interface_->Stat(completion->depfile, &completion->err);
+      if (depfile_mtime == -1)
+        return;
+      if (depfile_mtime > restat_mtime)
+        restat_mtime = depfile_mtime;
+    }
+    completion->restat_mtime = restat_mtime;
+  }
+
+  // Delete any left over response file.
+  if (!completion->rspfile.empty() && !g_keep_rsp)
+    disk_interface_->RemoveFile(completion->rspfile);
+  completion->stat_ok = true;
+}
+
+bool Builder::CommitCompletion(Completion* completion, std::string* err) {
+  METRIC_RECORD("FinishCommand");
+
+  CommandRunner::Result* result = &completion->result;
+  Edge* edge = result->edge;
+
+  // With a pipelined scan, the dirty state cached in deps sets goes stale
+  // once outputs change.
+  scan_.InvalidateDepsCache();
+
+  std::vector<Node*> deps_nodes;
+  deps_nodes.reserve(completion->deps.size());
+  for (const auto& dep : completion->deps)
+    deps_nodes.push_back(state_->GetNode(dep.first, dep.second));
+
   int start_time, end_time;
-  status_->BuildEdgeFinished(edge, result->success(), result->output,
-                             &start_time, &end_time);
+  status_->BuildEdgeFinished(*result, completion->restat_cleaned, &start_time,
+                             &end_time);
 
   // The rest of this function only applies to successful commands.
   if (!result->success()) {
+    // The command may have failed because a directory cached as existing
+    // was removed during the build.  Let MakeDirs() check the disk again.
+    if (!config_.dry_run) {
+      for (Node* output : edge->outputs_) {
+        Directory* dir = output->dir();
+        std::string stat_err;
+        if (dir->exists && !dir->path.empty() &&
+            disk_interface_->Stat(dir->path + ".", &stat_err) == 0) {
+          state_->directories_.ForgetExisting();
+          break;
+        }
+      }
+    }
+    // Failures of queued commands were counted when they were reaped,
+    // except for failures to extract their deps.
+    if (failures_allowed_ && !completion->failure_counted)
+      failures_allowed_--;
     plan_.EdgeFinished(edge, Plan::kEdgeFailed);
     return true;
   }
 
-  // Restat the edge outputs
   TimeStamp output_mtime = 0;
-  bool restat = edge->GetBindingBool("restat");
   if (!config_.dry_run) {
-    bool node_cleaned = false;
+    if (!completion->stat_ok) {
+      *err = completion->err;
+      return false;
+    }
 
-    for (std::vector<Node*>::iterator o = edge->outputs_.begin();
-         o != edge->outputs_.end(); ++o) {
-      TimeStamp new_mtime = disk_interface_->Stat((*o)->path(), err);
-      if (new_mtime == -1)
-        return false;
+    bool node_cleaned = false;
+    for (size_t i = 0; i < edge->outputs_.size(); ++i) {
+      TimeStamp new_mtime = completion->mtimes[i];
       if (new_mtime > output_mtime)
         output_mtime = new_mtime;
-      if ((*o)->mtime() == new_mtime && restat) {
+      if (completion->old_mtimes[i] == new_mtime && completion->restat) {
         // The rule command did not change the output.  Propagate the clean
         // state through the build graph.
         // Note that this also applies to nonexistent outputs (mtime == 0).
-        if (!plan_.CleanNode(&scan_, *o, err))
+        if (!plan_.CleanNode(&scan_, edge->outputs_[i], err))
           return false;
         node_cleaned = true;
       }
     }
 
     if (node_cleaned) {
-      TimeStamp restat_mtime = 0;
-      // If any output was cleaned, find the most recent mtime of any
-      // (existing) non-order-only input or the depfile.
-      for (std::vector<Node*>::iterator i = edge->inputs_.begin();
-           i != edge->inputs_.end() - edge->order_only_deps_; ++i) {
-        TimeStamp input_mtime = disk_interface_->Stat((*i)->path(), err);
-        if (input_mtime == -1)
-          return false;
-        if (input_mtime > restat_mtime)
-          restat_mtime = input_mtime;
-      }
-
-      std::string depfile = edge->GetUnescapedDepfile();
-      if (restat_mtime != 0 && deps_type.empty() && !depfile.empty()) {
-        TimeStamp depfile_mtime = disk_interface_->Stat(depfile, err);
-        if (depfile_mtime == -1)
-          return false;
-        if (depfile_mtime > restat_mtime)
-          restat_mtime = depfile_mtime;
-      }
-
       // The total number of edges in the plan may have changed as a result
       // of a restat.
       status_->PlanHasTotalEdges(plan_.command_edge_count());
 
-      output_mtime = restat_mtime;
+      output_mtime = completion->restat_mtime;
     }
   }
 
   plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
 
-  // Delete any left over response file.
-  std::string rspfile = edge->GetUnescapedRspfile();
-  if (!rspfile.empty() && !g_keep_rsp)
-    disk_interface_->RemoveFile(rspfile);
-
   if (scan_.build_log()) {
     if (!scan_.build_log()->RecordCommand(edge, start_time, end_time,
-                                          output_mtime)) {
+                                          output_mtime, result->max_rss)) {
       *err = std::string("Error writing to build log: ") + strerror(errno);
       return false;
     }
   }
 
-  if (!deps_type.empty() && !config_.dry_run) {
+  if (!completion->deps_type.empty() && !config_.dry_run) {
     assert(edge->outputs_.size() == 1 && "should have been rejected by parser");
+    // The output was stat()ed just after the command finished.
     Node* out = edge->outputs_[0];
-    TimeStamp deps_mtime = disk_interface_->Stat(out->path(), err);
-    if (deps_mtime == -1)
-      return false;
-    if (!scan_.build_log()->RecordDeps(out, deps_mtime, deps_nodes)) {
+    if (!scan_.build_log()->RecordDeps(out, completion->mtimes[0],
+                                       deps_nodes)) {
       *err = std::string("Error writing to deps log: ") + strerror(errno);
       return false;
     }
@@ -874,33 +1601,32 @@ bool Builder::FinishCommand(CommandRunner::Result* result, std::string* err) {
   return true;
 }
 
-bool Builder::ExtractDeps(CommandRunner::Result* result,
-                          const std::string& deps_type,
-                          const std::string& deps_prefix,
-                          std::vector<Node*>* deps_nodes, std::string* err) {
+bool Builder::ExtractDeps(Completion* completion, std::string* err) {
+  CommandRunner::Result* result = &completion->result;
+  const std::string& deps_type = completion->deps_type;
   if (deps_type == "msvc") {
     CLParser parser;
     std::string output;
-    if (!parser.Parse(result->output, deps_prefix, &output, err))
+    if (!parser.Parse(result->output, completion->deps_prefix, &output, err))
       return false;
     result->output = output;
-    for (std::set<std::string>::iterator i = parser.includes_.begin();
-         i != parser.includes_.end(); ++i) {
+    completion->includes = std::move(parser.includes_);
+    for (const std::string& include : completion->includes) {
       // ~0 is assuming that with MSVC-parsed headers, it's ok to always make
       // all backslashes (as some of the slashes will certainly be backslashes
       // anyway). This could be fixed if necessary with some additional
       // complexity in IncludesNormalize::Relativize.
-      deps_nodes->push_back(state_->GetNode(*i, ~0u));
+      completion->deps.emplace_back(include, ~0u);
     }
   } else if (deps_type == "gcc") {
-    std::string depfile = result->edge->GetUnescapedDepfile();
+    const std::string& depfile = completion->depfile;
     if (depfile.empty()) {
       *err = std::string("edge with deps=gcc but no depfile makes no sense");
       return false;
     }
 
     // Read depfile content.  Treat a missing depfile as empty.
-    std::string content;
+    std::string& content = completion->depfile_content;
     switch (disk_interface_->ReadFile(depfile, &content, err)) {
     case DiskInterface::Okay:
       break;
@@ -918,13 +1644,13 @@ bool Builder::ExtractDeps(CommandRunner::Result* result,
       return false;
 
     // XXX check depfile matches expected output.
-    deps_nodes->reserve(deps.ins_.size());
+    completion->deps.reserve(deps.ins_.size());
     for (std::vector<std::string_view>::iterator i = deps.ins_.begin();
          i != deps.ins_.end(); ++i) {
       uint64_t slash_bits;
       if (!CanonicalizePath(&*i, &content, &slash_bits, err))
         return false;
-      deps_nodes->push_back(state_->GetNode(*i, slash_bits));
+      completion->deps.emplace_back(*i, slash_bits);
     }
 
     if (!g_keep_depfile) {
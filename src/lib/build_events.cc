@@ -0,0 +1,185 @@
+// Copyright 2018 Frank Benkstein. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <ninja/ninja_config.h>
+
+#include <ninja/build_events.h>
+
+#include <ninja/graph.h>
+#include <ninja/util.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+namespace ninja {
+
+namespace {
+
+const char* ExitStatusName(ExitStatus status) {
+  switch (status) {
+  case ExitSuccess:
+    return "success";
+  case ExitFailure:
+    return "failure";
+  case ExitInterrupted:
+    return "interrupted";
+  }
+  return "unknown";
+}
+
+bool WriteAll(int fd, const char* data, size_t size) {
+  while (size > 0) {
+#ifdef _WIN32
+    int len = _write(fd, data, static_cast<unsigned>(size));
+#else
+    ssize_t len = write(fd, data, size);
+#endif
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += len;
+    size -= len;
+  }
+  return true;
+}
+
+}  // namespace
+
+BuildEventStream::BuildEventStream(int fd)
+    : fd_(fd), total_edges_(-1), dropped_(0), done_(false),
+      writer_(&BuildEventStream::Run, this) {}
+
+BuildEventStream::~BuildEventStream() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    done_ = true;
+  }
+  wake_.notify_one();
+  writer_.join();
+}
+
+void BuildEventStream::PlanHasTotalEdges(int total) {
+  if (total == total_edges_)
+    return;
+  total_edges_ = total;
+  char buf[64];
+  snprintf(buf, sizeof(buf), "{\"event\":\"plan\",\"total\":%d}\n", total);
+  line_ = buf;
+  Emit(false);
+}
+
+void BuildEventStream::EdgeStarted(const Edge* edge, int64_t start_millis) {
+  char buf[96];
+  snprintf(buf, sizeof(buf),
+           "{\"event\":\"edge_started\",\"id\":%d,\"time_ms\":%" PRId64
+           ",\"rule\":",
+           edge->id(), start_millis);
+  line_ = buf;
+  AppendJSONString(edge->rule().name(), &line_);
+  line_ += ",\"outputs\":[";
+  for (size_t i = 0; i < edge->outputs_.size(); ++i) {
+    if (i > 0)
+      line_.push_back(',');
+    AppendJSONString(edge->outputs_[i]->path(), &line_);
+  }
+  line_ += "]}\n";
+  Emit(false);
+}
+
+void BuildEventStream::EdgeFinished(const CommandRunner::Result& result,
+                                    bool restat_cleaned, int64_t start_millis,
+                                    int64_t end_millis) {
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+           "{\"event\":\"edge_finished\",\"id\":%d,\"start_ms\":%" PRId64
+           ",\"end_ms\":%" PRId64
+           ",\"status\":\"%s\",\"output_bytes\":%zu,\"max_rss\":%" PRId64
+           ",\"restat_cleaned\":%s}\n",
+           result.edge->id(), start_millis, end_millis,
+           ExitStatusName(result.status), result.output.size(),
+           result.max_rss, restat_cleaned ? "true" : "false");
+  line_ = buf;
+  Emit(false);
+}
+
+void BuildEventStream::BuildFinished(bool success, int64_t time_millis) {
+  uint64_t dropped;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    dropped = dropped_;
+  }
+  char buf[128];
+  snprintf(buf, sizeof(buf),
+           "{\"event\":\"build_finished\",\"time_ms\":%" PRId64
+           ",\"success\":%s,\"dropped\":%" PRIu64 "}\n",
+           time_millis, success ? "true" : "false", dropped);
+  line_ = buf;
+  // Readers rely on this one to know that the build is over.
+  Emit(true);
+}
+
+void BuildEventStream::Emit(bool force) {
+  bool wake;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!force && pending_.size() + line_.size() > kMaxPending) {
+      ++dropped_;
+      return;
+    }
+    // The writer only sleeps while there is nothing to write.
+    wake = pending_.empty();
+    pending_ += line_;
+  }
+  if (wake)
+    wake_.notify_one();
+}
+
+void BuildEventStream::Run() {
+#ifndef _WIN32
+  // A reader that goes away must not kill the build; write() fails with
+  // EPIPE instead.
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, nullptr);
+#endif
+
+  bool failed = false;
+  std::string buffer;
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    wake_.wait(lock, [this] { return done_ || !pending_.empty(); });
+    if (pending_.empty())
+      return;
+    buffer.swap(pending_);
+    lock.unlock();
+    // After an error, the rest is discarded.
+    if (!failed)
+      failed = !WriteAll(fd_, buffer.data(), buffer.size());
+    buffer.clear();
+    lock.lock();
+  }
+}
+
+}  // namespace ninja
@@ -25,11 +25,16 @@
 #include <ninja/state.h>
 #include <ninja/util.h>
 
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
 #include <optional>
+#include <tuple>
 
 #include <errno.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 namespace ninja {
 
@@ -81,99 +86,217 @@ namespace ninja {
 // repacking step can run occasionally to remove dead records.
 //
 // The above is almost accurate, except that we write log entries though
-// flatbuffers and not manually anymore.
+// flatbuffers and not manually anymore.  Also, since version 2 dependency
+// lists are stored once in deps set records, numbered in file order like
+// path records, and dependency records reference them by id.  Objects that
+// include the same headers thus share a single list.  Since version 3
+// commands are stored in edge records, one per edge, which reference their
+// outputs by path id just like dependency records do.  Since version 4
+// deps sets store their ids as varint encoded differences, see
+// EncodeDepsIds().  Since version 5 recompaction writes an index record
+// after the version record, which locates the records of the compacted log
+// by path so that they can be decoded on demand.  Since version 6 command
+// hashes are XXH64 instead of MurmurHash64A, see Edge::HashCommand().
+// Since version 7 every record is padded to kRecordAlignment, so records
+// start aligned and can be decoded where they are.
 
 namespace {
 
-// 64bit MurmurHash2, by Austin Appleby
-#if defined(_MSC_VER)
-#define BIG_CONSTANT(x) (x)
-#else  // defined(_MSC_VER)
-#define BIG_CONSTANT(x) (x##LLU)
-#endif  // !defined(_MSC_VER)
-inline uint64_t MurmurHash64A(const void* key, size_t len) {
-  static const uint64_t seed = 0xDECAFBADDECAFBADull;
-  const uint64_t m = BIG_CONSTANT(0xc6a4a7935bd1e995);
-  const int r = 47;
-  uint64_t h = seed ^ (len * m);
-  const unsigned char* data = (const unsigned char*)key;
-  while (len >= 8) {
-    uint64_t k;
-    memcpy(&k, data, sizeof k);
-    k *= m;
-    k ^= k >> r;
-    k *= m;
-    h ^= k;
-    h *= m;
-    data += 8;
-    len -= 8;
-  }
-  switch (len & 7) {
-  case 7:
-    h ^= uint64_t(data[6]) << 48;
-  case 6:
-    h ^= uint64_t(data[5]) << 40;
-  case 5:
-    h ^= uint64_t(data[4]) << 32;
-  case 4:
-    h ^= uint64_t(data[3]) << 24;
-  case 3:
-    h ^= uint64_t(data[2]) << 16;
-  case 2:
-    h ^= uint64_t(data[1]) << 8;
-  case 1:
-    h ^= uint64_t(data[0]);
-    h *= m;
-  };
-  h ^= h >> r;
-  h *= m;
-  h ^= h >> r;
-  return h;
-}
-#undef BIG_CONSTANT
-
 // Record size is currently limited to less than the full 32 bit, to
 // be able to control flushing manually.
 const unsigned kMaxRecordSize = (1 << 20) - 1;
 
+/// The largest alignment of a scalar in a record.
+const size_t kRecordAlignment = alignof(uint64_t);
+
 bool VersionIsValid(uint32_t version) {
   return version >= BuildLog::kOldestSupportedVersion &&
          version <= BuildLog::kCurrentVersion;
 }
 
+/// Finish the record for |entry_offset| in |fbb|.
 template <class T>
-bool FlushEntry(FILE* file, flatbuffers::FlatBufferBuilder& fbb,
-                const flatbuffers::Offset<T>& entry_offset) {
+void FinishEntry(flatbuffers::FlatBufferBuilder& fbb,
+                 const flatbuffers::Offset<T>& entry_offset) {
   log::EntryHolderBuilder entry_holder_builder(fbb);
   entry_holder_builder.add_entry_type(log::EntryTraits<T>::enum_value);
   entry_holder_builder.add_entry(entry_offset.Union());
   auto entry_holder_offset = entry_holder_builder.Finish();
+  fbb.TrackMinAlign(kRecordAlignment);
   fbb.FinishSizePrefixed(entry_holder_offset);
 
   assert(fbb.GetSize() < kMaxRecordSize);
+}
 
+template <class T>
+bool FlushEntry(FILE* file, flatbuffers::FlatBufferBuilder& fbb,
+                const flatbuffers::Offset<T>& entry_offset) {
+  FinishEntry(fbb, entry_offset);
   return fwrite(fbb.GetBufferPointer(), 1, fbb.GetSize(), file) ==
              fbb.GetSize() &&
          fflush(file) == 0;
 }
+
+/// Append the ids of |nodes| to |out| in list order.  Each id is stored as
+/// its difference to the previous one, zigzag encoded so that steps back
+/// stay small too, in a LEB128 varint.  Ids are assigned in the order in
+/// which deps lists first mention nodes, so most differences are small and
+/// take a single byte instead of four.
+void EncodeDepsIds(const std::vector<Node*>& nodes, std::vector<uint8_t>* out) {
+  uint32_t previous = 0;
+  for (Node* node : nodes) {
+    uint32_t id = static_cast<uint32_t>(node->id());
+    int32_t delta = static_cast<int32_t>(id - previous);
+    uint32_t value = (static_cast<uint32_t>(delta) << 1) ^
+                     static_cast<uint32_t>(delta >> 31);
+    while (value >= 0x80) {
+      out->push_back(static_cast<uint8_t>(value | 0x80));
+      value >>= 7;
+    }
+    out->push_back(static_cast<uint8_t>(value));
+    previous = id;
+  }
+}
+
+/// Inverse of EncodeDepsIds().  Returns false if |data| is malformed.
+bool DecodeDepsIds(const uint8_t* data, size_t size,
+                   std::vector<uint32_t>* ids) {
+  ids->clear();
+  uint32_t previous = 0;
+  for (size_t i = 0; i < size;) {
+    uint32_t value = data[i++];
+    if (value >= 0x80) {
+      value &= 0x7f;
+      for (int shift = 7;; shift += 7) {
+        if (i == size || shift > 28)
+          return false;
+        uint8_t byte = data[i++];
+        // Only the low four bits of the fifth byte fit into 32 bits.
+        if (shift == 28 && (byte & 0x70))
+          return false;
+        value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+        if (byte < 0x80)
+          break;
+      }
+    }
+    previous += (value >> 1) ^ (0u - (value & 1));
+    ids->push_back(previous);
+  }
+  return true;
+}
+
+/// Write the recompacted log consisting of |records| to |path|, with an
+/// IndexEntry for them between the version record and the records.
+bool WriteCompactedLog(const std::string& path,
+                       const std::vector<uint8_t>& records,
+                       uint64_t typical_max_rss, std::string* err) {
+  static constexpr size_t size_prefix_size = sizeof(flatbuffers::uoffset_t);
+  const uint8_t* data = records.data();
+
+  // The records were just written, so there's no need to verify them.
+  std::vector<uint64_t> path_offsets, path_hashes, edge_offsets, deps_offsets,
+      set_offsets;
+  uint32_t entry_count = 0;
+  uint32_t deps_count = 0;
+  for (size_t offset = 0; offset < records.size();
+       offset += size_prefix_size + flatbuffers::GetPrefixedSize(data + offset)) {
+    auto* entry_holder =
+        flatbuffers::GetSizePrefixedRoot<log::EntryHolder>(data + offset);
+    if (auto path_entry = entry_holder->entry_as_PathEntry()) {
+      path_offsets.push_back(offset);
+      path_hashes.push_back(MurmurHash64A(path_entry->path()->c_str(),
+                                          path_entry->path()->size()));
+      edge_offsets.push_back(0);
+      deps_offsets.push_back(0);
+    } else if (auto edge_entry = entry_holder->entry_as_EdgeEntry()) {
+      for (uint32_t id : *edge_entry->outputs()) {
+        edge_offsets[id] = offset;
+        ++entry_count;
+      }
+    } else if (auto deps_entry = entry_holder->entry_as_DepsEntry()) {
+      deps_offsets[deps_entry->output()] = offset;
+      ++deps_count;
+    } else if (entry_holder->entry_as_DepsSetEntry()) {
+      set_offsets.push_back(offset);
+    }
+  }
+
+  size_t table_size = 1;
+  while (table_size < 2 * path_hashes.size())
+    table_size *= 2;
+  std::vector<uint32_t> path_table(table_size);
+  for (size_t id = 0; id < path_hashes.size(); ++id) {
+    size_t slot = path_hashes[id] & (table_size - 1);
+    while (path_table[slot])
+      slot = (slot + 1) & (table_size - 1);
+    path_table[slot] = id + 1;
+  }
+
+  flatbuffers::FlatBufferBuilder version_fbb;
+  FinishEntry(version_fbb,
+              log::CreateVersionEntry(version_fbb, BuildLog::kCurrentVersion));
+  flatbuffers::FlatBufferBuilder fbb;
+  FinishEntry(fbb, log::CreateIndexEntry(
+                       fbb, records.size(), fbb.CreateVector(path_offsets),
+                       fbb.CreateVector(path_table),
+                       fbb.CreateVector(edge_offsets),
+                       fbb.CreateVector(deps_offsets),
+                       fbb.CreateVector(set_offsets), entry_count, deps_count,
+                       typical_max_rss));
+
+  FILE* file = fopen(path.c_str(), "wb");
+  if (!file ||
+      fwrite(version_fbb.GetBufferPointer(), 1, version_fbb.GetSize(),
+             file) != version_fbb.GetSize() ||
+      fwrite(fbb.GetBufferPointer(), 1, fbb.GetSize(), file) !=
+          fbb.GetSize() ||
+      (!records.empty() &&
+       fwrite(data, 1, records.size(), file) != records.size())) {
+    *err = strerror(errno);
+    if (file)
+      fclose(file);
+    return false;
+  }
+  if (fclose(file) != 0) {
+    *err = strerror(errno);
+    return false;
+  }
+  return true;
+}
 }  // namespace
 
 // static
-const uint32_t BuildLog::kCurrentVersion = 1;
+const uint32_t BuildLog::kCurrentVersion = 7;
 const uint32_t BuildLog::kOldestSupportedVersion = 1;
 const char* const BuildLog::kFilename = ".majak_log";
 const char* const BuildLog::kSchema = kBuildLogSchema;
 
 uint64_t BuildLog::HashCommand(std::string_view command) {
-  return MurmurHash64A(command.data(), command.size());
+  return StreamingHash64::Hash(command);
+}
+
+uint64_t BuildLog::HashDeps(int node_count, Node* const* nodes) {
+  return MurmurHash64A(nodes, node_count * sizeof(Node*));
 }
 
-BuildLog::BuildLog() : log_file_(nullptr), needs_recompaction_(false) {}
+BuildLog::BuildLog()
+    : state_(nullptr), log_file_(nullptr), record_buffer_(nullptr),
+      needs_recompaction_(false), load_threads_(0), lazy_load_(false) {}
 
 BuildLog::~BuildLog() {
   Close();
 }
 
+template <class T>
+bool BuildLog::WriteRecord(const flatbuffers::Offset<T>& entry_offset) {
+  if (!record_buffer_)
+    return FlushEntry(log_file_, fbb_, entry_offset);
+  FinishEntry(fbb_, entry_offset);
+  record_buffer_->insert(record_buffer_->end(), fbb_.GetBufferPointer(),
+                         fbb_.GetBufferPointer() + fbb_.GetSize());
+  return true;
+}
+
 bool BuildLog::OpenForWrite(const std::string& path, const BuildLogUser& user,
                             std::string* err) {
   if (needs_recompaction_) {
@@ -208,42 +331,86 @@ bool BuildLog::OpenForWrite(const std::string& path, const BuildLogUser& user,
 }
 
 bool BuildLog::RecordCommand(Edge* edge, int start_time, int end_time,
-                             TimeStamp mtime) {
-  std::string command = edge->EvaluateCommand(true);
-  uint64_t command_hash = HashCommand(command);
-  for (std::vector<Node*>::iterator out = edge->outputs_.begin();
-       out != edge->outputs_.end(); ++out) {
-    if (!RecordCommand((*out)->path(), command_hash, start_time, end_time,
-                       mtime))
+                             TimeStamp mtime, uint64_t max_rss) {
+  return RecordCommand(edge->outputs_, {}, edge->HashCommand(), start_time,
+                       end_time, mtime, max_rss);
+}
+
+bool BuildLog::RecordCommand(
+    const std::vector<Node*>& outputs,
+    const std::vector<std::string_view>& unknown_outputs,
+    uint64_t command_hash, int start_time, int end_time, TimeStamp mtime,
+    uint64_t max_rss) {
+  auto update_entry = [&](std::string_view output) {
+    bool added;
+    LogEntry* log_entry = FindOrAddEntry(HashedStringView(output), &added);
+    log_entry->command_hash = command_hash;
+    log_entry->start_time = start_time;
+    log_entry->end_time = end_time;
+    log_entry->mtime = mtime;
+    log_entry->max_rss = max_rss;
+  };
+  for (Node* output : outputs)
+    update_entry(output->path());
+  for (std::string_view output : unknown_outputs)
+    update_entry(output);
+
+  if (!log_file_ && !record_buffer_)
+    return true;
+
+  // Assign ids to all outputs that are missing one.
+  bool recorded = false;
+  std::vector<uint32_t> ids;
+  ids.reserve(outputs.size() + unknown_outputs.size());
+  for (Node* output : outputs) {
+    if (!AssignId(output, &recorded))
+      return false;
+    ids.push_back(output->id());
+  }
+  for (std::string_view output : unknown_outputs) {
+    uint32_t id;
+    if (!AssignId(output, &id, &recorded))
       return false;
+    ids.push_back(id);
   }
 
-  return true;
+  return WriteEdgeEntry(ids, command_hash, start_time, end_time, mtime,
+                        max_rss);
 }
 
-bool BuildLog::RecordCommand(const std::string& path, uint64_t command_hash,
-                             int start_time, int end_time, TimeStamp mtime) {
-  Entries::iterator i = entries_.find(path);
-  LogEntry* log_entry;
-  if (i != entries_.end()) {
-    log_entry = i->second.get();
-  } else {
-    auto owned_log_entry = std::make_unique<LogEntry>();
-    log_entry = owned_log_entry.get();
-    log_entry->output = path;
-    entries_.insert(
-        Entries::value_type(log_entry->output, std::move(owned_log_entry)));
-  }
-  log_entry->command_hash = command_hash;
-  log_entry->start_time = start_time;
-  log_entry->end_time = end_time;
-  log_entry->mtime = mtime;
-
-  if (log_file_) {
-    if (!WriteEntry(log_file_, *log_entry))
-      return false;
-  }
-  return true;
+bool BuildLog::WriteEdgeEntry(const std::vector<uint32_t>& ids,
+                              uint64_t command_hash, int start_time,
+                              int end_time, TimeStamp mtime,
+                              uint64_t max_rss) {
+  fbb_.Clear();
+
+  auto outputs_offset = fbb_.CreateVector(ids);
+  log::EdgeEntryBuilder edge_entry_builder(fbb_);
+  edge_entry_builder.add_outputs(outputs_offset);
+  edge_entry_builder.add_command_hash(command_hash);
+  edge_entry_builder.add_start_time(start_time);
+  edge_entry_builder.add_end_time(end_time);
+  edge_entry_builder.add_mtime(mtime);
+  edge_entry_builder.add_max_rss(max_rss);
+  auto edge_entry_offset = edge_entry_builder.Finish();
+
+  return WriteRecord(edge_entry_offset);
+}
+
+BuildLog::LogEntry* BuildLog::FindOrAddEntry(HashedStringView output,
+                                             bool* added) {
+  Entries::iterator i = entries_.find(output);
+  *added = i == entries_.end();
+  if (!*added)
+    return i->second.get();
+
+  auto owned_log_entry = std::make_unique<LogEntry>();
+  LogEntry* log_entry = owned_log_entry.get();
+  log_entry->output = output;
+  entries_.insert(
+      Entries::value_type(HashedStringView(log_entry->output, output.hash),
+                          std::move(owned_log_entry)));
+  return log_entry;
 }
 
 bool BuildLog::RecordDeps(Node* node, TimeStamp mtime,
@@ -258,76 +425,111 @@ bool BuildLog::RecordDeps(Node* node, TimeStamp mtime, int node_count,
   bool made_change = false;
 
   // Assign ids to all nodes that are missing one.
-  if (node->id() < 0) {
-    if (!RecordId(node))
-      return false;
-    made_change = true;
-  }
+  if (!AssignId(node, &made_change))
+    return false;
   for (int i = 0; i < node_count; ++i) {
-    if (nodes[i]->id() < 0) {
-      if (!RecordId(nodes[i]))
-        return false;
-      made_change = true;
-    }
+    if (!AssignId(nodes[i], &made_change))
+      return false;
   }
 
-  // See if the new data is different than the existing data, if any.
+  // Identical lists share one set, so comparing the sets is enough to see
+  // if the new data is different than the existing data, if any.
+  DepsSet* set = InternDeps(node_count, nodes);
   if (!made_change) {
     Deps* deps = GetDeps(node);
-    if (!deps || deps->mtime != mtime || deps->node_count != node_count) {
+    if (!deps || deps->mtime != mtime || deps->set != set)
       made_change = true;
-    } else {
-      for (int i = 0; i < node_count; ++i) {
-        if (deps->nodes[i] != nodes[i]) {
-          made_change = true;
-          break;
-        }
-      }
-    }
   }
 
   // Don't write anything if there's no new info.
   if (!made_change)
     return true;
 
+  if (set->id < 0) {
+    if (!RecordDepsSet(set))
+      return false;
+  }
+
   fbb_.Clear();
 
   {
-    fbb_.StartVector(node_count, sizeof(uint32_t));
-
-    for (size_t i = node_count; i > 0;) {
-      fbb_.PushElement(static_cast<uint32_t>(nodes[--i]->id()));
-    }
-
-    auto deps_offset = fbb_.EndVector(node_count);
+    // The list itself is in the deps set record.
+    fbb_.StartVector(0, sizeof(uint32_t));
+    auto deps_offset = fbb_.EndVector(0);
 
     log::DepsEntryBuilder deps_entry_builder(fbb_);
     deps_entry_builder.add_output(node->id());
     deps_entry_builder.add_deps(deps_offset);
+    deps_entry_builder.add_deps_set(set->id);
     deps_entry_builder.add_mtime(mtime);
     auto deps_entry_offset = deps_entry_builder.Finish();
 
-    if (!FlushEntry(log_file_, fbb_, deps_entry_offset))
+    if (!WriteRecord(deps_entry_offset))
       return false;
   }
 
   // Update in-memory representation.
-  auto deps = std::make_unique<Deps>(mtime, node_count);
-  for (int i = 0; i < node_count; ++i)
-    deps->nodes[i] = nodes[i];
-  UpdateDeps(node->id(), std::move(deps));
+  UpdateDeps(node->id(), std::make_unique<Deps>(mtime, set));
 
   return true;
 }
 
+DepsSet* BuildLog::InternDeps(int node_count, Node* const* nodes) {
+  uint64_t hash = HashDeps(node_count, nodes);
+  auto range = deps_set_index_.equal_range(hash);
+  for (auto i = range.first; i != range.second; ++i) {
+    const std::vector<Node*>& set_nodes = i->second->nodes;
+    if (set_nodes.size() == static_cast<size_t>(node_count) &&
+        std::equal(set_nodes.begin(), set_nodes.end(), nodes))
+      return i->second;
+  }
+
+  auto set =
+      std::make_unique<DepsSet>(std::vector<Node*>(nodes, nodes + node_count));
+  set->hash = hash;
+  DepsSet* result = set.get();
+  deps_set_index_.emplace(hash, result);
+  deps_sets_.push_back(std::move(set));
+  return result;
+}
+
 void BuildLog::Close() {
   if (log_file_)
     fclose(log_file_);
   log_file_ = nullptr;
 }
 
+BuildLog::LogData::~LogData() {
+#ifndef _WIN32
+  if (mapping)
+    munmap(mapping, mapping_size);
+#endif
+}
+
+void BuildLog::LogData::Read(FILE* file, long offset, long file_size) {
+#ifndef _WIN32
+  // The mapping is of the whole file, as offsets into it must be aligned to
+  // pages.  Appending to the file later doesn't affect it.
+  void* map = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fileno(file),
+                   0);
+  if (map != MAP_FAILED) {
+    mapping = map;
+    mapping_size = file_size;
+    data = static_cast<const uint8_t*>(map) + offset;
+    size = file_size - offset;
+    return;
+  }
+#endif
+  buffer.resize(file_size - offset);
+  fseek(file, offset, SEEK_SET);
+  buffer.resize(fread(buffer.data(), 1, buffer.size(), file));
+  data = buffer.data();
+  size = buffer.size();
+}
+
 bool BuildLog::Load(const std::string& path, State* state, std::string* err) {
   METRIC_RECORD(".ninja_log load");
+  state_ = state;
   FILE* file = fopen(path.c_str(), "rb");
   if (!file) {
     if (errno == ENOENT)
@@ -337,6 +539,8 @@ bool BuildLog::Load(const std::string& path, State* state, std::string* err) {
   }
 
   static constexpr size_t size_prefix_size = sizeof(flatbuffers::uoffset_t);
+  // Starting threads isn't worth it for small logs.
+  static constexpr size_t kMinLoadRecordsPerThread = 4096;
   std::vector<uint8_t> entry_buffer;
 
   enum class ReadStatus {
@@ -411,96 +615,273 @@ bool BuildLog::Load(const std::string& path, State* state, std::string* err) {
     return true;
   }
 
-  long offset;
-  ReadStatus read_status;
-  int unique_entry_count = 0;
-  int total_entry_count = 0;
-  int unique_dep_record_count = 0;
-  int total_dep_record_count = 0;
+  // Read the rest of the log at once.  Records are size prefixed, so their
+  // boundaries can be found without looking at their contents.  Verifying
+  // and decoding them is what takes time, so that's done on several threads
+  // before the records are merged into memory in log order.
+  long data_offset = ftell(file);
+  auto data = std::make_unique<LogData>();
+  if (fseek(file, 0, SEEK_END) == 0) {
+    long file_size = ftell(file);
+    if (file_size > data_offset)
+      data->Read(file, data_offset, file_size);
+  }
 
-  for (;;) {
-    offset = ftell(file);
+  // A recompacted log starts with an index.  When loading lazily, the
+  // records it covers are kept as they are and only the ones appended later
+  // are loaded, so only the index and those records are read from disk.
+  // Otherwise the index is just skipped.
+  size_t data_begin = 0;
+  if (data->size >= size_prefix_size) {
+    size_t index_size =
+        size_prefix_size + flatbuffers::GetPrefixedSize(data->data);
+    flatbuffers::Verifier verifier(data->data,
+                                   std::min(index_size, data->size));
+    const log::IndexEntry* index = nullptr;
+    if (verifier.VerifySizePrefixedBuffer<log::EntryHolder>(nullptr)) {
+      index = flatbuffers::GetSizePrefixedRoot<log::EntryHolder>(data->data)
+                  ->entry_as_IndexEntry();
+    }
+    if (index && index->snapshot_size() <= data->size - index_size &&
+        index->edge_offsets()->size() == index->path_offsets()->size() &&
+        index->deps_offsets()->size() == index->path_offsets()->size()) {
+      data_begin = index_size;
+      // Older snapshots are loaded in full, they're about to be upgraded.
+      if (lazy_load_ && *log_version == kCurrentVersion) {
+        data_begin += index->snapshot_size();
+        nodes_.resize(index->path_offsets()->size());
+        logged_deps_sets_.resize(index->set_offsets()->size());
+        snapshot_ = std::make_unique<Snapshot>(
+            Snapshot{ std::move(data), index, index_size, data_begin });
+      }
+    }
+  }
+  const LogData& log_data = snapshot_ ? *snapshot_->data : *data;
 
-    if ((read_status = read_entry_data()) != ReadStatus::kSuccess)
+  std::vector<size_t> record_offsets;
+  size_t data_end = data_begin;
+  while (log_data.size - data_end >= size_prefix_size) {
+    size_t entry_size = flatbuffers::GetPrefixedSize(log_data.data + data_end);
+    if (entry_size > log_data.size - data_end - size_prefix_size)
       break;
+    record_offsets.push_back(data_end);
+    data_end += size_prefix_size + entry_size;
+  }
+  auto record_size = [&record_offsets, data_end](size_t i) {
+    return (i + 1 < record_offsets.size() ? record_offsets[i + 1] : data_end) -
+           record_offsets[i];
+  };
 
-    flatbuffers::Verifier verifier(entry_buffer.data(), entry_buffer.size());
-
-    if (!verifier.VerifySizePrefixedBuffer<log::EntryHolder>(nullptr)) {
-      read_status = ReadStatus::kFailed;
-      break;
+  // Records are decoded in place, which needs them aligned in memory.
+  // Logs older than version 7 don't pad them, so copy the misaligned ones.
+  std::vector<const uint8_t*> record_data(record_offsets.size());
+  size_t copy_size = 0;
+  for (size_t i = 0; i < record_offsets.size(); ++i) {
+    record_data[i] = log_data.data + record_offsets[i];
+    if (reinterpret_cast<uintptr_t>(record_data[i]) % kRecordAlignment)
+      copy_size += (record_size(i) + kRecordAlignment - 1) / kRecordAlignment;
+  }
+  std::vector<uint64_t> aligned_records(copy_size);
+  for (size_t i = 0, copied = 0; copy_size && i < record_offsets.size(); ++i) {
+    if (reinterpret_cast<uintptr_t>(record_data[i]) % kRecordAlignment) {
+      memcpy(&aligned_records[copied], record_data[i], record_size(i));
+      record_data[i] =
+          reinterpret_cast<const uint8_t*>(&aligned_records[copied]);
+      copied += (record_size(i) + kRecordAlignment - 1) / kRecordAlignment;
     }
+  }
 
-    auto* entry_holder =
-        flatbuffers::GetSizePrefixedRoot<log::EntryHolder>(entry_buffer.data());
+  /// A verified record.  |holder| is nullptr if the record is corrupt.
+  struct Record {
+    const log::EntryHolder* holder;
+    /// Hash of a BuildEntry's output.
+    uint64_t output_hash;
+  };
+  std::vector<Record> records(record_offsets.size());
+  int threads = load_threads_;
+  if (threads <= 0 && records.size() >= 2 * kMinLoadRecordsPerThread)
+    threads = GetUsableProcessorCount();
+  ParallelFor(records.size(), threads, kMinLoadRecordsPerThread,
+              [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i) {
+                  const uint8_t* record = record_data[i];
+                  flatbuffers::Verifier verifier(record, record_size(i));
+                  records[i] = Record{ nullptr, 0 };
+                  if (!verifier.VerifySizePrefixedBuffer<log::EntryHolder>(
+                          nullptr))
+                    continue;
+                  records[i].holder =
+                      flatbuffers::GetSizePrefixedRoot<log::EntryHolder>(
+                          record);
+                  if (auto build_entry =
+                          records[i].holder->entry_as_BuildEntry()) {
+                    records[i].output_hash =
+                        MurmurHash64A(build_entry->output()->c_str(),
+                                      build_entry->output()->size());
+                  }
+                }
+              });
+
+  // The offset of the first record that couldn't be loaded.
+  long offset = data_offset + data_end;
+  bool failed = data_end != log_data.size || ferror(file);
+  std::vector<Node*> node_buffer;
+  std::vector<uint32_t> id_buffer;
+  int unique_entry_count = 0;
+  int total_entry_count = 0;
+  int unique_dep_record_count = 0;
+  int total_dep_record_count = 0;
+  if (snapshot_) {
+    // Entries of the snapshot are unique.  Later entries for the same
+    // outputs also count as unique here, which only delays recompaction.
+    unique_entry_count = total_entry_count = snapshot_->index->entry_count();
+    unique_dep_record_count = total_dep_record_count =
+        snapshot_->index->deps_count();
+  }
+
+  for (size_t record = 0; record < records.size(); ++record) {
+    auto* entry_holder = records[record].holder;
 
     if (!entry_holder) {
-      read_status = ReadStatus::kFailed;
+      offset = data_offset + record_offsets[record];
+      failed = true;
       break;
     }
 
-    if (auto build_entry = entry_holder->entry_as_BuildEntry()) {
-      std::string_view output(build_entry->output()->c_str(),
-                              build_entry->output()->Length());
-
-      Entries::iterator i = entries_.find(output);
-      LogEntry* log_entry;
+    if (auto edge_entry = entry_holder->entry_as_EdgeEntry()) {
+      const auto& outputs = *edge_entry->outputs();
+      if (std::any_of(outputs.begin(), outputs.end(),
+                      [this](uint32_t id) { return !HasPath(id); })) {
+        offset = data_offset + record_offsets[record];
+        failed = true;
+        break;
+      }
 
-      if (i != entries_.end()) {
-        log_entry = i->second.get();
-      } else {
-        auto owned_log_entry = std::make_unique<LogEntry>();
-        log_entry = owned_log_entry.get();
-        log_entry->output = output;
-        entries_.insert(
-            Entries::value_type(log_entry->output, std::move(owned_log_entry)));
-        ++unique_entry_count;
+      for (uint32_t id : outputs) {
+        bool added;
+        LogEntry* log_entry =
+            FindOrAddEntry(HashedStringView(IdPath(id)), &added);
+        unique_entry_count += added;
+        ++total_entry_count;
+
+        log_entry->start_time = edge_entry->start_time();
+        log_entry->end_time = edge_entry->end_time();
+        log_entry->mtime = edge_entry->mtime();
+        log_entry->command_hash = edge_entry->command_hash();
+        log_entry->max_rss = edge_entry->max_rss();
       }
+    } else if (auto build_entry = entry_holder->entry_as_BuildEntry()) {
+      // Version 2 and older records store one output per record.
+      bool added;
+      LogEntry* log_entry = FindOrAddEntry(
+          HashedStringView(std::string_view(build_entry->output()->c_str(),
+                                            build_entry->output()->size()),
+                           records[record].output_hash),
+          &added);
+      unique_entry_count += added;
       ++total_entry_count;
 
       log_entry->start_time = build_entry->start_time();
       log_entry->end_time = build_entry->end_time();
       log_entry->mtime = build_entry->mtime();
       log_entry->command_hash = build_entry->command_hash();
+      log_entry->max_rss = build_entry->max_rss();
     } else if (auto path_entry = entry_holder->entry_as_PathEntry()) {
-      const flatbuffers::String* deps_path = path_entry->path();
-
-      // It is not necessary to pass in a correct slash_bits here. It will
-      // either be a Node that's in the manifest (in which case it will
-      // already have a correct slash_bits that GetNode will look up), or it
-      // is an implicit dependency from a .d which does not affect the build
-      // command (and so need not have its slashes maintained).
-      Node* node = state->GetNode(
-          std::string_view(deps_path->c_str(), deps_path->size()), 0);
       int expected_id = ~path_entry->checksum();
       int id = nodes_.size();
-      if (id != expected_id) {
-        read_status = ReadStatus::kFailed;
+      if (id == expected_id) {
+        nodes_.push_back(nullptr);
+        if (!AddPath(id, std::string_view(path_entry->path()->c_str(),
+                                          path_entry->path()->size())))
+          nodes_.pop_back();
+      }
+      if (static_cast<int>(nodes_.size()) != id + 1) {
+        offset = data_offset + record_offsets[record];
+        failed = true;
         break;
       }
-
-      assert(node->id() < 0);
-      node->set_id(id);
-      nodes_.push_back(node);
     } else if (auto deps_entry = entry_holder->entry_as_DepsEntry()) {
-      const auto& deps_data = *deps_entry->deps();
-      int deps_count = deps_data.size();
+      DepsSet* set;
+      int set_id = deps_entry->deps_set();
+      if (set_id >= 0) {
+        if (set_id >= static_cast<int>(logged_deps_sets_.size()) ||
+            !(set = LoggedDepsSet(set_id))) {
+          offset = data_offset + record_offsets[record];
+          failed = true;
+          break;
+        }
+      } else {
+        // Version 1 records store the list inline.
+        const auto& deps_data = *deps_entry->deps();
+        node_buffer.resize(deps_data.size());
+        bool valid = true;
+        for (size_t i = 0; i < deps_data.size() && valid; ++i)
+          valid = (node_buffer[i] = PathNode(deps_data[i])) != nullptr;
+        if (!valid) {
+          offset = data_offset + record_offsets[record];
+          failed = true;
+          break;
+        }
+        set = InternDeps(node_buffer.size(), node_buffer.data());
+      }
       int out_id = deps_entry->output();
-      auto deps = std::make_unique<Deps>(deps_entry->mtime(), deps_count);
-
-      for (int i = 0; i < deps_count; ++i) {
-        assert(deps_data[i] < nodes_.size());
-        assert(nodes_[deps_data[i]]);
-        deps->nodes[i] = nodes_[deps_data[i]];
+      if (snapshot_ && !HasPath(out_id)) {
+        offset = data_offset + record_offsets[record];
+        failed = true;
+        break;
       }
+      auto deps = std::make_unique<Deps>(deps_entry->mtime(), set);
 
       total_dep_record_count++;
       if (!UpdateDeps(out_id, std::move(deps)))
         ++unique_dep_record_count;
+    } else if (auto set_entry = entry_holder->entry_as_DepsSetEntry()) {
+      int expected_id = ~set_entry->checksum();
+      int id = logged_deps_sets_.size();
+      if (id != expected_id) {
+        offset = data_offset + record_offsets[record];
+        failed = true;
+        break;
+      }
+
+      if (auto packed_deps = set_entry->packed_deps()) {
+        if (!DecodeDepsIds(packed_deps->data(), packed_deps->size(),
+                           &id_buffer)) {
+          offset = data_offset + record_offsets[record];
+          failed = true;
+          break;
+        }
+      } else if (auto deps = set_entry->deps()) {
+        id_buffer.assign(deps->begin(), deps->end());
+      } else {
+        id_buffer.clear();
+      }
+      node_buffer.resize(id_buffer.size());
+      bool valid = true;
+      for (size_t i = 0; i < id_buffer.size() && valid; ++i)
+        valid = (node_buffer[i] = PathNode(id_buffer[i])) != nullptr;
+      if (!valid) {
+        offset = data_offset + record_offsets[record];
+        failed = true;
+        break;
+      }
+      // A set may be logged twice, e.g. by concurrent writers; both ids map
+      // to the same set in memory.
+      DepsSet* set = InternDeps(node_buffer.size(), node_buffer.data());
+      if (set->id < 0)
+        set->id = id;
+      logged_deps_sets_.push_back(set);
     }
   }
 
-  if (read_status != ReadStatus::kFinished) {
+  // Only the snapshot refers to the log's contents after this, so the rest
+  // is unmapped before the log may be truncated.
+  data.reset();
+
+  if (*log_version < 6)
+    MigrateCommandHashes();
+
+  if (failed) {
     // An error occurred while loading; try to recover by truncating the
     // file to the last fully-read record.
     if (ferror(file)) {
@@ -541,21 +922,304 @@ bool BuildLog::Load(const std::string& path, State* state, std::string* err) {
   return true;
 }
 
+void BuildLog::MigrateCommandHashes() {
+  // Rehash the commands that are still the same, anything else would look
+  // changed anyway.
+  for (auto& entry : entries_) {
+    LogEntry* log_entry = entry.second.get();
+    Node* node = state_ ? state_->LookupNode(log_entry->output) : nullptr;
+    Edge* edge = node ? node->in_edge() : nullptr;
+    if (!edge)
+      continue;
+    std::string command = edge->EvaluateCommand(true);
+    if (MurmurHash64A(command.data(), command.size()) ==
+        log_entry->command_hash)
+      log_entry->command_hash = edge->HashCommand();
+  }
+}
+
 BuildLog::LogEntry* BuildLog::LookupByOutput(const std::string& path) {
   Entries::iterator i = entries_.find(path);
   if (i != entries_.end())
     return i->second.get();
+  if (snapshot_)
+    return LoadSnapshotEntry(path, SnapshotPathId(path));
   return nullptr;
 }
 
 BuildLog::Deps* BuildLog::GetDeps(Node* node) {
+  if (node->id() < 0)
+    FindId(node);
+
   // Abort if the node has no id (never referenced in the deps) or if
   // there's no deps recorded for the node.
-  if (node->id() < 0 || node->id() >= (int)deps_.size())
+  if (node->id() < 0)
     return nullptr;
+  if (node->id() >= (int)deps_.size() || !deps_[node->id()])
+    return snapshot_ ? LoadSnapshotDeps(node->id()) : nullptr;
   return deps_[node->id()].get();
 }
 
+void BuildLog::MaterializeAll() {
+  if (!snapshot_)
+    return;
+
+  const log::IndexEntry* index = snapshot_->index;
+  for (uint32_t id = 0; id < index->path_offsets()->size(); ++id) {
+    if (!HasPath(id))
+      continue;
+    if (index->edge_offsets()->Get(id) &&
+        entries_.find(HashedStringView(IdPath(id))) == entries_.end())
+      LoadSnapshotEntry(IdPath(id), id);
+    if (id >= deps_.size() || !deps_[id])
+      LoadSnapshotDeps(id);
+  }
+  for (uint32_t id = 0; id < index->set_offsets()->size(); ++id)
+    LoggedDepsSet(id);
+
+  snapshot_.reset();
+}
+
+uint64_t BuildLog::TypicalMaxRss() const {
+  if (snapshot_)
+    return snapshot_->index->typical_max_rss();
+
+  // Use the 90th percentile so that a few outliers like the final link
+  // don't dominate.
+  std::vector<uint64_t> rss;
+  for (const auto& entry : entries_) {
+    if (entry.second->max_rss > 0)
+      rss.push_back(entry.second->max_rss);
+  }
+  if (rss.empty())
+    return 0;
+  auto nth = rss.begin() + rss.size() * 9 / 10;
+  std::nth_element(rss.begin(), nth, rss.end());
+  return *nth;
+}
+
+bool BuildLog::AssignId(Node* node, bool* recorded) {
+  if (node->id() >= 0)
+    return true;
+
+  FindId(node);
+  if (node->id() >= 0)
+    return true;
+
+  *recorded = true;
+  return RecordId(node);
+}
+
+bool BuildLog::AssignId(std::string_view path, uint32_t* id, bool* recorded) {
+  auto i = unknown_path_ids_.find(path);
+  if (i != unknown_path_ids_.end()) {
+    *id = i->second;
+    return true;
+  }
+
+  *recorded = true;
+  *id = nodes_.size();
+  if (!WritePathEntry(path, *id))
+    return false;
+  nodes_.push_back(nullptr);
+  return AddPath(*id, path);
+}
+
+void BuildLog::FindId(Node* node) {
+  int id = -1;
+  if (!unknown_path_ids_.empty()) {
+    auto i = unknown_path_ids_.find(node->path());
+    if (i != unknown_path_ids_.end()) {
+      id = i->second;
+      unknown_path_ids_.erase(i);
+      unknown_paths_.erase(id);
+    }
+  }
+  if (id < 0 && snapshot_) {
+    id = SnapshotPathId(node->path());
+    if (id >= 0 && nodes_[id])
+      id = -1;
+  }
+  if (id >= 0) {
+    node->set_id(id);
+    nodes_[id] = node;
+  }
+}
+
+bool BuildLog::AddPath(uint32_t id, std::string_view path) {
+  if (Node* node = state_ ? state_->LookupNode(path) : nullptr) {
+    if (node->id() >= 0)
+      return false;
+    node->set_id(id);
+    nodes_[id] = node;
+    return true;
+  }
+
+  auto added = unknown_paths_.emplace(id, path);
+  if (!added.second)
+    return false;
+  if (!unknown_path_ids_.emplace(HashedStringView(added.first->second), id)
+           .second) {
+    unknown_paths_.erase(added.first);
+    return false;
+  }
+  return true;
+}
+
+bool BuildLog::HasPath(uint32_t id) {
+  if (id >= nodes_.size())
+    return false;
+  if (nodes_[id] || unknown_paths_.count(id))
+    return true;
+  if (!snapshot_ || id >= snapshot_->index->path_offsets()->size())
+    return false;
+
+  const log::EntryHolder* entry_holder =
+      SnapshotRecord(snapshot_->index->path_offsets()->Get(id));
+  const log::PathEntry* path_entry =
+      entry_holder ? entry_holder->entry_as_PathEntry() : nullptr;
+  if (!path_entry || ~path_entry->checksum() != id)
+    return false;
+  return AddPath(id, std::string_view(path_entry->path()->c_str(),
+                                      path_entry->path()->size()));
+}
+
+std::string_view BuildLog::IdPath(uint32_t id) const {
+  if (nodes_[id])
+    return nodes_[id]->path();
+  return unknown_paths_.find(id)->second;
+}
+
+Node* BuildLog::PathNode(uint32_t id) {
+  if (!HasPath(id))
+    return nullptr;
+  if (nodes_[id])
+    return nodes_[id];
+
+  // It is not necessary to pass in a correct slash_bits here.  A Node
+  // that's in the manifest would have been found when the path was
+  // loaded, so this is an implicit dependency from a .d which does not
+  // affect the build command (and so need not have its slashes
+  // maintained).
+  auto i = unknown_paths_.find(id);
+  Node* node = state_->GetNode(i->second, 0);
+  unknown_path_ids_.erase(std::string_view(i->second));
+  unknown_paths_.erase(i);
+  assert(node->id() < 0);
+  node->set_id(id);
+  nodes_[id] = node;
+  return node;
+}
+
+const log::EntryHolder* BuildLog::SnapshotRecord(uint64_t offset) const {
+  static constexpr size_t size_prefix_size = sizeof(flatbuffers::uoffset_t);
+  size_t size = snapshot_->end - snapshot_->begin;
+  if (offset >= size || size - offset < size_prefix_size)
+    return nullptr;
+  const uint8_t* record = snapshot_->data->data + snapshot_->begin + offset;
+  if (reinterpret_cast<uintptr_t>(record) % kRecordAlignment)
+    return nullptr;
+  flatbuffers::Verifier verifier(
+      record, std::min<size_t>(size - offset,
+                               size_prefix_size +
+                                   flatbuffers::GetPrefixedSize(record)));
+  if (!verifier.VerifySizePrefixedBuffer<log::EntryHolder>(nullptr))
+    return nullptr;
+  return flatbuffers::GetSizePrefixedRoot<log::EntryHolder>(record);
+}
+
+int BuildLog::SnapshotPathId(std::string_view path) const {
+  const auto& table = *snapshot_->index->path_table();
+  const auto& path_offsets = *snapshot_->index->path_offsets();
+  if (table.size() == 0)
+    return -1;
+
+  size_t mask = table.size() - 1;
+  size_t slot = MurmurHash64A(path.data(), path.size()) & mask;
+  for (size_t probes = 0; probes < table.size();
+       ++probes, slot = (slot + 1) & mask) {
+    uint32_t id = table[slot];
+    if (id-- == 0 || id >= path_offsets.size())
+      return -1;
+    const log::EntryHolder* entry_holder = SnapshotRecord(path_offsets[id]);
+    const log::PathEntry* path_entry =
+        entry_holder ? entry_holder->entry_as_PathEntry() : nullptr;
+    if (path_entry && std::string_view(path_entry->path()->c_str(),
+                                      path_entry->path()->size()) == path)
+      return id;
+  }
+  return -1;
+}
+
+DepsSet* BuildLog::LoggedDepsSet(uint32_t id) {
+  if (logged_deps_sets_[id] || !snapshot_ ||
+      id >= snapshot_->index->set_offsets()->size())
+    return logged_deps_sets_[id];
+
+  const log::EntryHolder* entry_holder =
+      SnapshotRecord(snapshot_->index->set_offsets()->Get(id));
+  const log::DepsSetEntry* set_entry =
+      entry_holder ? entry_holder->entry_as_DepsSetEntry() : nullptr;
+  std::vector<uint32_t> ids;
+  if (!set_entry || ~set_entry->checksum() != id || !set_entry->packed_deps() ||
+      !DecodeDepsIds(set_entry->packed_deps()->data(),
+                     set_entry->packed_deps()->size(), &ids))
+    return nullptr;
+
+  std::vector<Node*> nodes(ids.size());
+  for (size_t i = 0; i < ids.size(); ++i) {
+    if (!(nodes[i] = PathNode(ids[i])))
+      return nullptr;
+  }
+  DepsSet* set = InternDeps(nodes.size(), nodes.data());
+  if (set->id < 0)
+    set->id = id;
+  logged_deps_sets_[id] = set;
+  return set;
+}
+
+BuildLog::LogEntry* BuildLog::LoadSnapshotEntry(std::string_view path,
+                                                int id) {
+  if (id < 0)
+    return nullptr;
+  uint64_t offset = snapshot_->index->edge_offsets()->Get(id);
+  const log::EntryHolder* entry_holder =
+      offset ? SnapshotRecord(offset) : nullptr;
+  const log::EdgeEntry* edge_entry =
+      entry_holder ? entry_holder->entry_as_EdgeEntry() : nullptr;
+  if (!edge_entry)
+    return nullptr;
+
+  bool added;
+  LogEntry* log_entry = FindOrAddEntry(HashedStringView(path), &added);
+  log_entry->start_time = edge_entry->start_time();
+  log_entry->end_time = edge_entry->end_time();
+  log_entry->mtime = edge_entry->mtime();
+  log_entry->command_hash = edge_entry->command_hash();
+  log_entry->max_rss = edge_entry->max_rss();
+  return log_entry;
+}
+
+BuildLog::Deps* BuildLog::LoadSnapshotDeps(int id) {
+  if (id >= static_cast<int>(snapshot_->index->deps_offsets()->size()))
+    return nullptr;
+  uint64_t offset = snapshot_->index->deps_offsets()->Get(id);
+  const log::EntryHolder* entry_holder =
+      offset ? SnapshotRecord(offset) : nullptr;
+  const log::DepsEntry* deps_entry =
+      entry_holder ? entry_holder->entry_as_DepsEntry() : nullptr;
+  if (!deps_entry || deps_entry->output() != static_cast<uint32_t>(id) ||
+      deps_entry->deps_set() < 0 ||
+      deps_entry->deps_set() >= static_cast<int>(logged_deps_sets_.size()))
+    return nullptr;
+
+  DepsSet* set = LoggedDepsSet(deps_entry->deps_set());
+  if (!set)
+    return nullptr;
+  UpdateDeps(id, std::make_unique<Deps>(deps_entry->mtime(), set));
+  return deps_[id].get();
+}
+
 bool BuildLog::WriteEntry(FILE* f, const LogEntry& entry) {
   fbb_.Clear();
   auto build_entry_offset = log::CreateBuildEntry(fbb_, &entry);
@@ -566,6 +1230,7 @@ bool BuildLog::Recompact(const std::string& path, const BuildLogUser& user,
                          std::string* err) {
   METRIC_RECORD(".ninja_log recompact");
 
+  MaterializeAll();
   Close();
   std::string temp_path = path + ".recompact";
 
@@ -575,33 +1240,56 @@ bool BuildLog::Recompact(const std::string& path, const BuildLogUser& user,
     return ec;
   };
 
-  // OpenForWrite() opens for append.  Make sure it's not appending to a
-  // left-over file from a previous recompaction attempt that crashed somehow.
-  remove_temp_path();
-
+  // The records are collected in memory, so that the index can be written
+  // in front of them and the file is written only once.
+  std::vector<uint8_t> records;
   BuildLog new_log;
+  new_log.record_buffer_ = &records;
 
-  if (!new_log.OpenForWrite(temp_path, user, err))
-    return false;
+  // Clear all known ids so that new ones can be reassigned.  The new indices
+  // will refer to the ordering in new_log, not in the current log.
+  for (auto& node : nodes_) {
+    if (node)
+      node->set_id(-1);
+  }
 
-  // Write out all entries but skip dead paths.
+  // Write out all entries but skip dead paths.  Outputs of the same edge
+  // share all values, so sorting puts them next to each other again and
+  // they can be written as a single record.
+  std::vector<const LogEntry*> live_entries;
   for (const auto & [ output, entry ] : entries_) {
-    if (user.IsPathDead(output))
-      continue;
-
-    if (!new_log.RecordCommand(entry->output, entry->command_hash,
-                               entry->start_time, entry->end_time,
-                               entry->mtime)) {
-      *err = strerror(errno);
-      remove_temp_path();
-      return false;
-    }
+    if (!user.IsPathDead(output))
+      live_entries.push_back(entry.get());
   }
+  auto entry_values = [](const LogEntry* entry) {
+    return std::make_tuple(entry->command_hash, entry->start_time,
+                           entry->end_time, entry->mtime, entry->max_rss);
+  };
+  std::sort(live_entries.begin(), live_entries.end(),
+            [&entry_values](const LogEntry* e1, const LogEntry* e2) {
+              return entry_values(e1) < entry_values(e2);
+            });
+
+  std::vector<Node*> outputs;
+  std::vector<std::string_view> unknown_outputs;
+  for (size_t begin = 0, end; begin < live_entries.size(); begin = end) {
+    const LogEntry* entry = live_entries[begin];
+    outputs.clear();
+    unknown_outputs.clear();
+    for (end = begin; end < live_entries.size() &&
+                      entry_values(live_entries[end]) == entry_values(entry);
+         ++end) {
+      const std::string& output = live_entries[end]->output;
+      if (Node* node = state_ ? state_->LookupNode(output) : nullptr)
+        outputs.push_back(node);
+      else
+        unknown_outputs.push_back(output);
+    }
 
-  // Clear all known ids so that new ones can be reassigned.  The new indices
-  // will refer to the ordering in new_log, not in the current log.
-  for (auto& node : nodes_)
-    node->set_id(-1);
+    new_log.RecordCommand(outputs, unknown_outputs, entry->command_hash,
+                          entry->start_time, entry->end_time, entry->mtime,
+                          entry->max_rss);
+  }
 
   // Write out all deps again.
   for (int old_id = 0; old_id < (int)deps_.size(); ++old_id) {
@@ -609,24 +1297,35 @@ bool BuildLog::Recompact(const std::string& path, const BuildLogUser& user,
     if (!deps)
       continue;  // If nodes_[old_id] is a leaf, it has no deps.
 
-    if (!IsDepsEntryLiveFor(nodes_[old_id]))
+    if (!nodes_[old_id] || !IsDepsEntryLiveFor(nodes_[old_id]))
       continue;
 
-    if (!new_log.RecordDeps(nodes_[old_id], deps->mtime, deps->node_count,
-                            deps->nodes)) {
-      *err = strerror(errno);
-      remove_temp_path();
-      return false;
-    }
+    new_log.RecordDeps(nodes_[old_id], deps->mtime, deps->node_count,
+                       deps->nodes);
   }
 
-  new_log.Close();
+  if (!WriteCompactedLog(temp_path, records, new_log.TypicalMaxRss(), err)) {
+    remove_temp_path();
+    return false;
+  }
 
   // Steal the new log's data.
   nodes_ = std::move(new_log.nodes_);
+  unknown_paths_ = std::move(new_log.unknown_paths_);
+  unknown_path_ids_ = std::move(new_log.unknown_path_ids_);
   deps_ = std::move(new_log.deps_);
+  deps_sets_ = std::move(new_log.deps_sets_);
+  deps_set_index_ = std::move(new_log.deps_set_index_);
+  logged_deps_sets_ = std::move(new_log.logged_deps_sets_);
   entries_ = std::move(new_log.entries_);
 
+  // Edges may still point at sets that were just freed; the next scan
+  // loads their deps again.
+  if (state_) {
+    for (const auto& edge : state_->edges_)
+      edge->deps_set_ = nullptr;
+  }
+
   {
     fs::error_code ec;
     fs::rename(temp_path, path);
@@ -650,24 +1349,49 @@ bool BuildLog::UpdateDeps(int out_id, std::unique_ptr<Deps> deps) {
 }
 
 bool BuildLog::RecordId(Node* node) {
-  std::string_view path = node->path();
   int id = nodes_.size();
+  if (!WritePathEntry(node->path(), id))
+    return false;
+
+  node->set_id(id);
+  nodes_.push_back(node);
+
+  return true;
+}
+
+bool BuildLog::WritePathEntry(std::string_view path, uint32_t id) {
+  fbb_.Clear();
+
+  auto path_offset = fbb_.CreateString(path.data(), path.size());
+  log::PathEntryBuilder path_entry_builder(fbb_);
+  path_entry_builder.add_path(path_offset);
+  path_entry_builder.add_checksum(~id);
+  auto path_entry_offset = path_entry_builder.Finish();
+
+  return WriteRecord(path_entry_offset);
+}
+
+bool BuildLog::RecordDepsSet(DepsSet* set) {
+  int id = logged_deps_sets_.size();
 
   fbb_.Clear();
 
   {
-    auto path_offset = fbb_.CreateString(path.data(), path.size());
-    log::PathEntryBuilder path_entry_builder(fbb_);
-    path_entry_builder.add_path(path_offset);
-    path_entry_builder.add_checksum(~static_cast<uint32_t>(id));
-    auto path_entry_offset = path_entry_builder.Finish();
+    std::vector<uint8_t> packed_deps;
+    EncodeDepsIds(set->nodes, &packed_deps);
+    auto packed_deps_offset = fbb_.CreateVector(packed_deps);
+
+    log::DepsSetEntryBuilder set_entry_builder(fbb_);
+    set_entry_builder.add_checksum(~static_cast<uint32_t>(id));
+    set_entry_builder.add_packed_deps(packed_deps_offset);
+    auto set_entry_offset = set_entry_builder.Finish();
 
-    if (!FlushEntry(log_file_, fbb_, path_entry_offset))
+    if (!WriteRecord(set_entry_offset))
       return false;
   }
 
-  node->set_id(id);
-  nodes_.push_back(node);
+  set->id = id;
+  logged_deps_sets_.push_back(set);
 
   return true;
 }
@@ -685,7 +1409,7 @@ bool BuildLog::IsDepsEntryLiveFor(Node* node) {
 bool operator==(const log::BuildEntryT& e1, const log::BuildEntryT& e2) {
   auto to_tuple = [](const auto& e) {
     return std::tie(e.output, e.command_hash, e.start_time, e.end_time,
-                    e.mtime);
+                    e.mtime, e.max_rss);
   };
   return to_tuple(e1) == to_tuple(e2);
 }
@@ -0,0 +1,93 @@
+// Copyright 2018 Frank Benkstein. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <ninja/builtin.h>
+
+#include <ninja/disk_interface.h>
+#include <ninja/graph.h>
+
+namespace ninja {
+
+namespace {
+
+int ExplicitInputCount(const Edge* edge) {
+  return static_cast<int>(edge->inputs_.size()) - edge->implicit_deps_ -
+         edge->order_only_deps_;
+}
+
+int ExplicitOutputCount(const Edge* edge) {
+  return static_cast<int>(edge->outputs_.size()) - edge->implicit_outs_;
+}
+
+/// Run |builtin| and return an error message, empty on success.
+std::string RunBuiltin(const std::string& builtin, Edge* edge,
+                       DiskInterface* disk_interface) {
+  if (builtin == "copy") {
+    std::string err;
+    for (int i = 0; i < ExplicitOutputCount(edge); ++i) {
+      const std::string& input = edge->inputs_[i]->path();
+      const std::string& output = edge->outputs_[i]->path();
+      if (!disk_interface->Copy(input, output, &err))
+        return "cannot copy '" + input + "' to '" + output + "': " + err;
+    }
+    return std::string();
+  }
+
+  for (Node* output : edge->outputs_) {
+    if (builtin == "touch") {
+      if (!disk_interface->Touch(output->path()))
+        return "cannot touch '" + output->path() + "'";
+    } else if (builtin == "stamp") {
+      if (!disk_interface->WriteFile(output->path(), std::string()))
+        return "cannot write '" + output->path() + "'";
+    } else if (builtin == "mkdir") {
+      if (!disk_interface->MakeDir(output->path()))
+        return "cannot create directory '" + output->path() + "'";
+    }
+  }
+  return std::string();
+}
+
+}  // namespace
+
+bool VerifyBuiltinCommand(const std::string& name, const Edge* edge,
+                          std::string* err) {
+  if (name != "touch" && name != "stamp" && name != "copy" &&
+      name != "mkdir") {
+    *err = "unknown builtin '" + name + "'";
+    return false;
+  }
+  if (name == "copy" && ExplicitInputCount(edge) != ExplicitOutputCount(edge)) {
+    *err = "builtin copy needs as many explicit inputs as explicit outputs";
+    return false;
+  }
+  return true;
+}
+
+void RunBuiltinCommand(const std::string& name, Edge* edge,
+                       DiskInterface* disk_interface,
+                       CommandRunner::Result* result) {
+  result->edge = edge;
+  result->max_rss = 0;
+  std::string err = RunBuiltin(name, edge, disk_interface);
+  if (err.empty()) {
+    result->status = ExitSuccess;
+    result->output.clear();
+  } else {
+    result->status = ExitFailure;
+    result->output = "builtin " + name + ": " + err + "\n";
+  }
+}
+
+}  // namespace ninja
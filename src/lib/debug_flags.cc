@@ -22,4 +22,6 @@ bool g_keep_rsp = false;
 
 bool g_experimental_statcache = true;
 
+bool g_tracing = false;
+
 }  // namespace ninja
@@ -0,0 +1,74 @@
+// Copyright 2018 Frank Benkstein. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <ninja/directory_table.h>
+
+#include <assert.h>
+
+namespace ninja {
+
+namespace {
+
+bool IsSeparator(char c) {
+#ifdef _WIN32
+  return c == '/' || c == '\\';
+#else
+  return c == '/';
+#endif
+}
+
+}  // namespace
+
+DirectoryTable::DirectoryTable() {
+  dirs_.emplace_back(std::string(), 0, nullptr);
+  ids_[dirs_.front().path] = &dirs_.front();
+}
+
+Directory* DirectoryTable::Intern(std::string_view path) {
+  if (Directory* dir = Lookup(path))
+    return dir;
+
+  assert(!path.empty() && IsSeparator(path.back()));
+  // The parent is whatever precedes the last component, e.g. "a/" for
+  // "a/b/".  Runs of separators belong to the directory they end.
+  size_t end = path.size();
+  while (end > 0 && IsSeparator(path[end - 1]))
+    --end;
+  Directory* parent = Intern(path.substr(0, DirLength(path.substr(0, end))));
+
+  Directory* dir =
+      &dirs_.emplace_back(std::string(path), (int)dirs_.size(), parent);
+  ids_[dir->path] = dir;
+  return dir;
+}
+
+Directory* DirectoryTable::Lookup(std::string_view path) const {
+  auto i = ids_.find(path);
+  return i == ids_.end() ? nullptr : i->second;
+}
+
+void DirectoryTable::ForgetExisting() {
+  for (Directory& dir : dirs_)
+    dir.exists = false;
+}
+
+// static
+size_t DirectoryTable::DirLength(std::string_view path) {
+  size_t len = path.size();
+  while (len > 0 && !IsSeparator(path[len - 1]))
+    --len;
+  return len;
+}
+
+}  // namespace ninja
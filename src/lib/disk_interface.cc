@@ -24,10 +24,16 @@
 
 #ifdef _WIN32
 #include <direct.h>  // _mkdir
+#include <sys/utime.h>
 #include <windows.h>
 #include <sstream>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
 #endif
 
+#include <ninja/directory_table.h>
 #include <ninja/metrics.h>
 #include <ninja/util.h>
 
@@ -59,6 +65,24 @@ int MakeDir(const std::string& path) {
 #endif
 }
 
+/// Like MakeDirs(Directory*), but without reporting errors or updating
+/// Directory::exists, so that it can run on any thread.
+bool MakeDirsQuietly(const Directory* dir) {
+  if (dir->exists)
+    return true;
+  std::string path = DirName(dir->path + ".");
+  if (path.empty())
+    return true;
+  if (MakeDir(path) == 0 || errno == EEXIST)
+    return true;
+  if (errno != ENOENT || !MakeDirsQuietly(dir->parent))
+    return false;
+  return MakeDir(path) == 0 || errno == EEXIST;
+}
+
+/// Output directories for a thread to create, at least.
+const size_t kMinDirsPerThread = 16;
+
 #ifdef _WIN32
 TimeStamp TimeStampFromFileTime(const FILETIME& filetime) {
   // FILETIME is in 100-nanosecond increments since the Windows epoch.
@@ -107,6 +131,49 @@ bool DiskInterface::MakeDirs(const std::string& path) {
   return MakeDir(dir);
 }
 
+bool DiskInterface::Touch(const std::string& path) {
+  std::string contents, err;
+  if (ReadFile(path, &contents, &err) == OtherError) {
+    Error("%s", err.c_str());
+    return false;
+  }
+  return WriteFile(path, contents);
+}
+
+bool DiskInterface::Copy(const std::string& from, const std::string& to,
+                         std::string* err) {
+  std::string contents;
+  if (ReadFile(from, &contents, err) != Okay)
+    return false;
+  if (!WriteFile(to, contents)) {
+    *err = "write failed";
+    return false;
+  }
+  return true;
+}
+
+bool DiskInterface::MakeDirs(Directory* dir) {
+  if (dir->exists)
+    return true;
+  std::string path = DirName(dir->path + ".");
+  if (path.empty()) {
+    dir->exists = true;  // Reached root; assume it's there.
+    return true;
+  }
+  std::string err;
+  TimeStamp mtime = Stat(path, &err);
+  if (mtime < 0) {
+    Error("%s", err.c_str());
+    return false;
+  }
+  if (mtime == 0) {
+    if (!MakeDirs(dir->parent) || !MakeDir(path))
+      return false;
+  }
+  dir->exists = true;
+  return true;
+}
+
 // RealDiskInterface -----------------------------------------------------------
 
 TimeStamp RealDiskInterface::Stat(const std::string& path,
@@ -193,6 +260,23 @@ bool RealDiskInterface::MakeDir(const std::string& path) {
   return true;
 }
 
+void RealDiskInterface::MakeDirsInParallel(const std::vector<Directory*>& dirs,
+                                           int threads) {
+  METRIC_RECORD("make dirs");
+  std::vector<char> made(dirs.size());
+  ParallelFor(dirs.size(), threads, kMinDirsPerThread,
+              [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i)
+                  made[i] = MakeDirsQuietly(dirs[i]);
+              });
+  for (size_t i = 0; i < dirs.size(); ++i) {
+    if (!made[i])
+      continue;
+    for (Directory* dir = dirs[i]; dir && !dir->exists; dir = dir->parent)
+      dir->exists = true;
+  }
+}
+
 FileReader::Status RealDiskInterface::ReadFile(const std::string& path,
                                                std::string* contents,
                                                std::string* err) {
@@ -220,4 +304,74 @@ int RealDiskInterface::RemoveFile(const std::string& path) {
   }
 }
 
+bool RealDiskInterface::Touch(const std::string& path) {
+#ifdef _WIN32
+  if (_utime(path.c_str(), nullptr) == 0)
+    return true;
+#else
+  if (utime(path.c_str(), nullptr) == 0)
+    return true;
+#endif
+  if (errno == ENOENT)
+    return WriteFile(path, std::string());
+  Error("utime(%s): %s", path.c_str(), strerror(errno));
+  return false;
+}
+
+bool RealDiskInterface::Copy(const std::string& from, const std::string& to,
+                             std::string* err) {
+#ifdef _WIN32
+  // CopyFileA() copies the attributes along with the contents.
+  if (!CopyFileA(from.c_str(), to.c_str(), FALSE)) {
+    *err = GetLastErrorString();
+    return false;
+  }
+  return true;
+#else
+  int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (in < 0 || fstat(in, &st) < 0) {
+    *err = strerror(errno);
+    if (in >= 0)
+      close(in);
+    return false;
+  }
+  mode_t mode = st.st_mode & 07777;
+  int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+  if (out < 0) {
+    *err = strerror(errno);
+    close(in);
+    return false;
+  }
+
+  // An existing |to| keeps its permissions on open(), so set them too.
+  bool ok = fchmod(out, mode) == 0;
+  char buf[64 << 10];
+  while (ok) {
+    ssize_t len = read(in, buf, sizeof(buf));
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0) {
+      ok = len == 0;
+      break;
+    }
+    for (ssize_t written = 0; ok && written < len;) {
+      ssize_t n = write(out, buf + written, len - written);
+      if (n < 0 && errno != EINTR)
+        ok = false;
+      else if (n > 0)
+        written += n;
+    }
+  }
+  if (!ok)
+    *err = strerror(errno);
+  close(in);
+  if (close(out) < 0 && ok) {
+    *err = strerror(errno);
+    ok = false;
+  }
+  return ok;
+#endif
+}
+
 }  // namespace ninja
@@ -18,6 +18,10 @@
 
 namespace ninja {
 
+void Env::EvaluateVariable(const std::string& var, EvalSink* sink) {
+  sink->Append(LookupVariable(var));
+}
+
 std::string BindingEnv::LookupVariable(const std::string& var) {
   std::map<std::string, std::string>::iterator i = bindings_.find(var);
   if (i != bindings_.end())
@@ -27,6 +31,14 @@ std::string BindingEnv::LookupVariable(const std::string& var) {
   return "";
 }
 
+void BindingEnv::EvaluateVariable(const std::string& var, EvalSink* sink) {
+  std::map<std::string, std::string>::iterator i = bindings_.find(var);
+  if (i != bindings_.end())
+    sink->Append(i->second);
+  else if (parent_)
+    parent_->EvaluateVariable(var, sink);
+}
+
 void BindingEnv::AddBinding(const std::string& key, const std::string& val) {
   bindings_[key] = val;
 }
@@ -68,7 +80,8 @@ bool Rule::IsReservedBinding(const std::string& var) {
   return var == "command" || var == "depfile" || var == "description" ||
          var == "deps" || var == "generator" || var == "pool" ||
          var == "restat" || var == "rspfile" || var == "rspfile_content" ||
-         var == "msvc_deps_prefix";
+         var == "msvc_deps_prefix" || var == "force_shell" ||
+         var == "builtin" || var == "batch" || var == "worker";
 }
 
 const std::map<std::string, std::unique_ptr<const Rule>>& BindingEnv::GetRules()
@@ -91,6 +104,18 @@ std::string BindingEnv::LookupWithFallback(const std::string& var,
   return "";
 }
 
+void BindingEnv::LookupWithFallback(const std::string& var,
+                                    const EvalString* eval, Env* env,
+                                    EvalSink* sink) {
+  std::map<std::string, std::string>::iterator i = bindings_.find(var);
+  if (i != bindings_.end())
+    sink->Append(i->second);
+  else if (eval)
+    eval->Evaluate(env, sink);
+  else if (parent_)
+    parent_->EvaluateVariable(var, sink);
+}
+
 std::string EvalString::Evaluate(Env* env) const {
   std::string result;
   for (TokenList::const_iterator i = parsed_.begin(); i != parsed_.end(); ++i) {
@@ -102,6 +127,15 @@ std::string EvalString::Evaluate(Env* env) const {
   return result;
 }
 
+void EvalString::Evaluate(Env* env, EvalSink* sink) const {
+  for (TokenList::const_iterator i = parsed_.begin(); i != parsed_.end(); ++i) {
+    if (i->second == RAW)
+      sink->Append(i->first);
+    else
+      env->EvaluateVariable(i->first, sink);
+  }
+}
+
 void EvalString::AddText(std::string_view text) {
   // Add it to the end of an existing RAW token if possible.
   if (!parsed_.empty() && parsed_.back().second == RAW) {
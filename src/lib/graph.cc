@@ -19,6 +19,7 @@
 #include <ninja/build_log.h>
 #include <ninja/debug_flags.h>
 #include <ninja/disk_interface.h>
+#include <ninja/hash_map.h>
 #include <ninja/manifest_parser.h>
 #include <ninja/metrics.h>
 #include <ninja/state.h>
@@ -26,18 +27,77 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 namespace ninja {
 
 bool Node::Stat(DiskInterface* disk_interface, std::string* err) {
-  return (mtime_ = disk_interface->Stat(path_, err)) != -1;
+  if (path_)
+    return (mtime_ = disk_interface->Stat(*path_, err)) != -1;
+  // Most nodes are only ever stat()ed, don't materialize their path for it.
+  thread_local std::string path;
+  path.assign(dir_->path).append(basename_);
+  return (mtime_ = disk_interface->Stat(path, err)) != -1;
 }
 
+std::string Node::FullPath() const {
+  std::string path;
+  path.reserve(dir_->path.size() + basename_.size());
+  path.append(dir_->path).append(basename_);
+  return path;
+}
+
+namespace {
+
+/// Source of DependencyScan::scan_id_.  Ids are unique across all scans as
+/// deps sets may be shared between them.
+uint64_t g_last_scan_id = 0;
+
+}  // namespace
+
 bool DependencyScan::RecomputeDirty(Node* node, std::string* err) {
+  // Node states might have been reset since the last call.
+  InvalidateDepsCache();
   std::vector<Node*> stack;
   return RecomputeDirty(node, &stack, err);
 }
 
+void DependencyScan::InvalidateDepsCache() {
+  scan_id_ = ++g_last_scan_id;
+}
+
+bool DependencyScan::VisitDepsSet(const DepsSet* set, std::vector<Node*>* stack,
+                                  std::string* err) {
+  if (set->scan.scan_id == scan_id_)
+    return true;
+
+  DepsSet::ScanResult result;
+  result.ready = true;
+  for (Node* node : set->nodes) {
+    if (!RecomputeDirty(node, stack, err))
+      return false;
+
+    if (Edge* in_edge = node->in_edge()) {
+      if (!in_edge->outputs_ready_)
+        result.ready = false;
+    }
+
+    if (node->dirty()) {
+      if (!result.dirty_input)
+        result.dirty_input = node;
+    } else if (!result.most_recent_input ||
+               node->mtime() > result.most_recent_input->mtime()) {
+      result.most_recent_input = node;
+    }
+  }
+
+  // Only mark the result valid once complete: visiting the nodes may reach
+  // another edge using the same set.
+  result.scan_id = scan_id_;
+  set->scan = result;
+  return true;
+}
+
 bool DependencyScan::RecomputeDirty(Node* node, std::vector<Node*>* stack,
                                     std::string* err) {
   Edge* edge = node->in_edge();
@@ -85,10 +145,39 @@ bool DependencyScan::RecomputeDirty(Node* node, std::vector<Node*>* stack,
     dirty = edge->deps_missing_ = true;
   }
 
+  // Inputs from a deps set are visited as a whole, so that edges sharing
+  // the set reuse the result.
+  std::vector<Node*>::iterator set_begin = edge->inputs_.end();
+  std::vector<Node*>::iterator set_end = set_begin;
+  if (edge->deps_set_ && !edge->deps_set_->nodes.empty()) {
+    set_end = edge->inputs_.end() - edge->order_only_deps_;
+    set_begin = set_end - edge->deps_set_->nodes.size();
+  }
+
   // Visit all inputs; we're dirty if any of the inputs are dirty.
   Node* most_recent_input = nullptr;
   for (std::vector<Node*>::iterator i = edge->inputs_.begin();
        i != edge->inputs_.end(); ++i) {
+    if (i == set_begin) {
+      if (!VisitDepsSet(edge->deps_set_, stack, err))
+        return false;
+
+      const DepsSet::ScanResult& result = edge->deps_set_->scan;
+      if (!result.ready)
+        edge->outputs_ready_ = false;
+      if (result.dirty_input) {
+        EXPLAIN("%s is dirty", result.dirty_input->path().c_str());
+        dirty = true;
+      }
+      if (result.most_recent_input &&
+          (!most_recent_input ||
+           result.most_recent_input->mtime() > most_recent_input->mtime())) {
+        most_recent_input = result.most_recent_input;
+      }
+      i = set_end - 1;
+      continue;
+    }
+
     // Visit this input.
     if (!RecomputeDirty(*i, stack, err))
       return false;
@@ -140,6 +229,9 @@ bool DependencyScan::RecomputeDirty(Node* node, std::vector<Node*>* stack,
   assert(stack->back() == node);
   stack->pop_back();
 
+  if (observer_ && !observer_->EdgeScanned(edge, err))
+    return false;
+
   return true;
 }
 
@@ -186,10 +278,11 @@ bool DependencyScan::VerifyDAG(Node* node, std::vector<Node*>* stack,
 bool DependencyScan::RecomputeOutputsDirty(Edge* edge, Node* most_recent_input,
                                            bool* outputs_dirty,
                                            std::string* err) {
-  std::string command = edge->EvaluateCommand(/*incl_rsp_file=*/true);
+  // The hash is only compared against the build log.
+  uint64_t command_hash = build_log() ? edge->HashCommand() : 0;
   for (std::vector<Node*>::iterator o = edge->outputs_.begin();
        o != edge->outputs_.end(); ++o) {
-    if (RecomputeOutputDirty(edge, most_recent_input, command, *o)) {
+    if (RecomputeOutputDirty(edge, most_recent_input, command_hash, *o)) {
       *outputs_dirty = true;
       return true;
     }
@@ -198,7 +291,7 @@ bool DependencyScan::RecomputeOutputsDirty(Edge* edge, Node* most_recent_input,
 }
 
 bool DependencyScan::RecomputeOutputDirty(Edge* edge, Node* most_recent_input,
-                                          const std::string& command,
+                                          uint64_t command_hash,
                                           Node* output) {
   if (edge->is_phony()) {
     // Phony edges don't write any output.  Outputs are only dirty if
@@ -248,7 +341,7 @@ bool DependencyScan::RecomputeOutputDirty(Edge* edge, Node* most_recent_input,
   if (build_log()) {
     bool generator = edge->GetBindingBool("generator");
     if (entry || (entry = build_log()->LookupByOutput(output->path()))) {
-      if (!generator && BuildLog::HashCommand(command) != entry->command_hash) {
+      if (!generator && command_hash != entry->command_hash) {
         // May also be dirty due to the command changing since the last build.
         // But if this is a generator rule, the command changing does not make
         // us dirty.
@@ -290,32 +383,73 @@ struct EdgeEnv : public Env {
   enum EscapeKind { kShellEscape, kDoNotEscape };
 
   EdgeEnv(Edge* edge, EscapeKind escape)
-      : edge_(edge), escape_in_out_(escape), recursive_(false) {}
+      : edge_(edge), batch_begin_(&edge_), batch_end_(&edge_ + 1),
+        escape_in_out_(escape), rspfile_(nullptr), recursive_(false) {}
+  /// Evaluate in the scope of the first edge of |batch|, with $in and $out
+  /// covering all of them.
+  EdgeEnv(const std::vector<Edge*>& batch, EscapeKind escape)
+      : edge_(batch.front()), batch_begin_(batch.data()),
+        batch_end_(batch.data() + batch.size()), escape_in_out_(escape),
+        rspfile_(nullptr), recursive_(false) {}
   virtual std::string LookupVariable(const std::string& var);
+  virtual void EvaluateVariable(const std::string& var, EvalSink* sink);
 
-  /// Given a span of Nodes, construct a list of paths suitable for a command
-  /// line.
-  std::string MakePathList(std::vector<Node*>::iterator begin,
-                           std::vector<Node*>::iterator end, char sep);
+  /// Make $rspfile expand to |rspfile|, verbatim.
+  void OverrideRspfile(const std::string* rspfile) { rspfile_ = rspfile; }
+
+  /// Given a span of Nodes, pass a list of paths suitable for a command
+  /// line to |sink|.
+  void MakePathList(std::vector<Node*>::iterator begin,
+                    std::vector<Node*>::iterator end, char sep,
+                    EvalSink* sink);
 
  private:
   std::vector<std::string> lookups_;
   Edge* edge_;
+  Edge* const* batch_begin_;
+  Edge* const* batch_end_;
   EscapeKind escape_in_out_;
+  const std::string* rspfile_;
   bool recursive_;
+  /// Scratch space for a single path.
+  std::string decanonicalized_;
+  std::string escaped_;
 };
 
 std::string EdgeEnv::LookupVariable(const std::string& var) {
-  if (var == "in" || var == "in_newline") {
-    int explicit_deps_count =
-        edge_->inputs_.size() - edge_->implicit_deps_ - edge_->order_only_deps_;
-    return MakePathList(edge_->inputs_.begin(),
-                        edge_->inputs_.begin() + explicit_deps_count,
-                        var == "in" ? ' ' : '\n');
-  } else if (var == "out") {
-    int explicit_outs_count = edge_->outputs_.size() - edge_->implicit_outs_;
-    return MakePathList(edge_->outputs_.begin(),
-                        edge_->outputs_.begin() + explicit_outs_count, ' ');
+  std::string result;
+  StringEvalSink sink(&result);
+  EvaluateVariable(var, &sink);
+  return result;
+}
+
+void EdgeEnv::EvaluateVariable(const std::string& var, EvalSink* sink) {
+  if (var == "in" || var == "in_newline" || var == "out") {
+    char sep = var == "in_newline" ? '\n' : ' ';
+    bool empty = true;
+    for (Edge* const* e = batch_begin_; e != batch_end_; ++e) {
+      Edge* edge = *e;
+      std::vector<Node*>::iterator begin, end;
+      if (var == "out") {
+        begin = edge->outputs_.begin();
+        end = edge->outputs_.end() - edge->implicit_outs_;
+      } else {
+        begin = edge->inputs_.begin();
+        end = edge->inputs_.end() - edge->implicit_deps_ -
+              edge->order_only_deps_;
+      }
+      if (begin == end)
+        continue;
+      if (!empty)
+        sink->Append(std::string_view(&sep, 1));
+      MakePathList(begin, end, sep, sink);
+      empty = false;
+    }
+    return;
+  }
+  if (var == "rspfile" && rspfile_) {
+    sink->Append(*rspfile_);
+    return;
   }
 
   if (recursive_) {
@@ -337,29 +471,57 @@ std::string EdgeEnv::LookupVariable(const std::string& var) {
   // In practice, variables defined on rules never use another rule variable.
   // For performance, only start checking for cycles after the first lookup.
   recursive_ = true;
-  return edge_->env_->LookupWithFallback(var, eval, this);
+  edge_->env_->LookupWithFallback(var, eval, this, sink);
 }
 
-std::string EdgeEnv::MakePathList(std::vector<Node*>::iterator begin,
-                                  std::vector<Node*>::iterator end, char sep) {
-  std::string result;
+void EdgeEnv::MakePathList(std::vector<Node*>::iterator begin,
+                           std::vector<Node*>::iterator end, char sep,
+                           EvalSink* sink) {
   for (std::vector<Node*>::iterator i = begin; i != end; ++i) {
-    if (!result.empty())
-      result.push_back(sep);
-    const std::string& path = (*i)->PathDecanonicalized();
+    if (i != begin)
+      sink->Append(std::string_view(&sep, 1));
+    // Only paths with backslashes need a decanonicalized copy.
+    const std::string& path = (*i)->slash_bits()
+                                  ? (decanonicalized_ = (*i)->PathDecanonicalized())
+                                  : (*i)->path();
     if (escape_in_out_ == kShellEscape) {
+      escaped_.clear();
 #if _WIN32
-      GetWin32EscapedString(path, &result);
+      GetWin32EscapedString(path, &escaped_);
 #else
-      GetShellEscapedString(path, &result);
+      GetShellEscapedString(path, &escaped_);
 #endif
+      sink->Append(escaped_);
     } else {
-      result.append(path);
+      sink->Append(path);
     }
   }
-  return result;
 }
 
+namespace {
+
+/// Feeds evaluated pieces to a hash.  Non-empty input is preceded by
+/// |prefix|, which mirrors how EvaluateCommand() appends the rspfile.
+struct HashEvalSink : public EvalSink {
+  HashEvalSink(StreamingHash64* hash, std::string_view prefix)
+      : hash_(hash), prefix_(prefix) {}
+  void Append(std::string_view piece) override {
+    if (piece.empty())
+      return;
+    if (!prefix_.empty()) {
+      hash_->Update(prefix_);
+      prefix_ = std::string_view();
+    }
+    hash_->Update(piece);
+  }
+
+ private:
+  StreamingHash64* hash_;
+  std::string_view prefix_;
+};
+
+}  // namespace
+
 std::string Edge::EvaluateCommand(bool incl_rsp_file) {
   std::string command = GetBinding("command");
   if (incl_rsp_file) {
@@ -370,6 +532,34 @@ std::string Edge::EvaluateCommand(bool incl_rsp_file) {
   return command;
 }
 
+std::string Edge::EvaluateCommandWithRspfile(const std::string& rspfile) {
+  EdgeEnv env(this, EdgeEnv::kShellEscape);
+  env.OverrideRspfile(&rspfile);
+  return env.LookupVariable("command");
+}
+
+uint64_t Edge::HashCommand() {
+  // Each binding gets its own EdgeEnv, just like in EvaluateCommand(), so
+  // that the cycle check sees the same lookups.
+  StreamingHash64 hash;
+  HashEvalSink command(&hash, std::string_view());
+  EdgeEnv(this, EdgeEnv::kShellEscape).EvaluateVariable("command", &command);
+  HashEvalSink rspfile_content(&hash, ";rspfile=");
+  EdgeEnv(this, EdgeEnv::kShellEscape)
+      .EvaluateVariable("rspfile_content", &rspfile_content);
+  return hash.Digest();
+}
+
+std::string Edge::EvaluateBatchCommand(const std::vector<Edge*>& batch) {
+  EdgeEnv env(batch, EdgeEnv::kShellEscape);
+  return env.LookupVariable("command");
+}
+
+int Edge::GetBatchSize() {
+  int size = atoi(GetBinding("batch").c_str());
+  return size > 1 ? size : 1;
+}
+
 std::string Edge::GetBinding(const std::string& key) {
   EdgeEnv env(this, EdgeEnv::kShellEscape);
   return env.LookupVariable(key);
@@ -459,6 +649,8 @@ void Node::Dump(const char* prefix) const {
 }
 
 bool ImplicitDepLoader::LoadDeps(Edge* edge, std::string* err) {
+  edge->deps_set_ = nullptr;
+
   std::string deps_type = edge->GetBinding("deps");
   if (!deps_type.empty())
     return LoadDepsFromLog(edge, err);
@@ -538,7 +730,7 @@ bool ImplicitDepLoader::LoadDepFile(Edge* edge, const std::string& path,
 bool ImplicitDepLoader::LoadDepsFromLog(Edge* edge, std::string* err) {
   // NOTE: deps are only supported for single-target edges.
   Node* output = edge->outputs_[0];
-  BuildLog::Deps* deps = build_log_->GetDeps(output);
+  BuildLog::Deps* deps = build_log_ ? build_log_->GetDeps(output) : nullptr;
   if (!deps) {
     EXPLAIN("deps for '%s' are missing", output->path().c_str());
     return false;
@@ -560,6 +752,7 @@ bool ImplicitDepLoader::LoadDepsFromLog(Edge* edge, std::string* err) {
     node->AddOutEdge(edge);
     CreatePhonyInEdge(node);
   }
+  edge->deps_set_ = deps->set;
   return true;
 }
 
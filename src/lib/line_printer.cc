@@ -16,11 +16,16 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+
+#include <algorithm>
+
 #ifdef _WIN32
 #include <windows.h>
 #else
+#include <errno.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <unistd.h>
 #endif
@@ -45,25 +50,24 @@ LinePrinter::LinePrinter() : have_blank_line_(true), console_locked_(false) {
 #endif
 }
 
-void LinePrinter::Print(std::string to_print, LineType type) {
+void LinePrinter::Print(const std::string& to_print, LineType type) {
   if (console_locked_) {
     line_buffer_ = to_print;
     line_type_ = type;
     return;
   }
 
-  if (smart_terminal_) {
+  if (smart_terminal_ && type == ELIDE) {
+#ifdef _WIN32
     printf("\r");  // Print over previous line, if any.
     // On Windows, calling a C library function writing to stdout also handles
     // pausing the executable when the "Pause" key or Ctrl-S is pressed.
-  }
 
-  if (smart_terminal_ && type == ELIDE) {
-#ifdef _WIN32
     CONSOLE_SCREEN_BUFFER_INFO csbi;
     GetConsoleScreenBufferInfo(console_, &csbi);
 
-    to_print = ElideMiddle(to_print, static_cast<size_t>(csbi.dwSize.X));
+    std::string elided =
+        ElideMiddle(to_print, static_cast<size_t>(csbi.dwSize.X));
     // We don't want to have the cursor spamming back and forth, so instead of
     // printf use WriteConsoleOutput which updates the contents of the buffer,
     // but doesn't move the cursor position.
@@ -75,7 +79,7 @@ void LinePrinter::Print(std::string to_print, LineType type) {
                           csbi.dwCursorPosition.Y };
     std::vector<CHAR_INFO> char_data(csbi.dwSize.X);
     for (size_t i = 0; i < static_cast<size_t>(csbi.dwSize.X); ++i) {
-      char_data[i].Char.AsciiChar = i < to_print.size() ? to_print[i] : ' ';
+      char_data[i].Char.AsciiChar = i < elided.size() ? elided[i] : ' ';
       char_data[i].Attributes = csbi.wAttributes;
     }
     WriteConsoleOutput(console_, &char_data[0], buf_size, zero_zero, &target);
@@ -83,20 +87,67 @@ void LinePrinter::Print(std::string to_print, LineType type) {
     // Limit output to width of the terminal if provided so we don't cause
     // line-wrapping.
     winsize size;
-    if ((ioctl(0, TIOCGWINSZ, &size) == 0) && size.ws_col) {
-      to_print = ElideMiddle(to_print, size.ws_col);
-    }
-    printf("%s", to_print.c_str());
-    printf("\x1B[K");  // Clear to end of line.
-    fflush(stdout);
+    if (ioctl(0, TIOCGWINSZ, &size) != 0)
+      size.ws_col = 0;
+    WriteElided(to_print, size.ws_col);
 #endif
 
     have_blank_line_ = false;
   } else {
+    if (smart_terminal_)
+      printf("\r");  // Print over previous line, if any.
     printf("%s\n", to_print.c_str());
   }
 }
 
+#ifndef _WIN32
+void LinePrinter::WriteElided(const std::string& to_print, size_t width) {
+  static const char kReturn[] = "\r";  // Print over previous line, if any.
+  static const char kEllipsis[] = "...";
+  static const char kClear[] = "\x1B[K";  // Clear to end of line.
+
+  // The elided line is pieced together from parts of |to_print| instead of
+  // being copied, like ElideMiddle() would.
+  iovec iov[5];
+  int count = 0;
+  auto add = [&iov, &count](const char* data, size_t size) {
+    iov[count].iov_base = const_cast<char*>(data);
+    iov[count].iov_len = size;
+    ++count;
+  };
+  add(kReturn, sizeof(kReturn) - 1);
+  const size_t kMargin = sizeof(kEllipsis) - 1;
+  if (width >= kMargin && to_print.size() + kMargin > width) {
+    size_t elide_size = (width - kMargin) / 2;
+    add(to_print.data(), elide_size);
+    add(kEllipsis, kMargin);
+    add(to_print.data() + to_print.size() - elide_size, elide_size);
+  } else {
+    add(to_print.data(), to_print.size());
+  }
+  add(kClear, sizeof(kClear) - 1);
+
+  // Anything printed through stdio has to come first.
+  fflush(stdout);
+  ssize_t len;
+  do {
+    len = writev(1, iov, count);
+  } while (len < 0 && errno == EINTR);
+
+  // Hand whatever the terminal didn't take to stdio.
+  size_t written = len < 0 ? 0 : static_cast<size_t>(len);
+  for (int i = 0; i < count; ++i) {
+    size_t done = std::min(written, iov[i].iov_len);
+    written -= done;
+    if (done < iov[i].iov_len) {
+      fwrite(static_cast<char*>(iov[i].iov_base) + done, 1,
+             iov[i].iov_len - done, stdout);
+    }
+  }
+  fflush(stdout);
+}
+#endif
+
 void LinePrinter::PrintOrBuffer(const char* data, size_t size) {
   if (console_locked_) {
     output_buffer_.append(data, size);
@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include <vector>
 
+#include <ninja/builtin.h>
 #include <ninja/disk_interface.h>
 #include <ninja/graph.h>
 #include <ninja/metrics.h>
@@ -409,6 +410,26 @@ bool ManifestParser::ParseEdge(std::string* err) {
     }
   }
 
+  std::string builtin = edge->GetBinding("builtin");
+  std::string builtin_err;
+  if (!builtin.empty() &&
+      !VerifyBuiltinCommand(builtin, edge, &builtin_err)) {
+    return lexer_.Error(builtin_err, err);
+  }
+
+  std::string batch = edge->GetBinding("batch");
+  if (!batch.empty()) {
+    if (atoi(batch.c_str()) < 1)
+      return lexer_.Error("batch must be a positive number", err);
+    // All of these are tied to a single edge's command.
+    if (!builtin.empty() || edge->GetBindingBool("deps") ||
+        edge->GetBindingBool("depfile") || edge->GetBindingBool("rspfile")) {
+      return lexer_.Error(
+          "batch can't be combined with builtin, deps, depfile or rspfile",
+          err);
+    }
+  }
+
   // Multiple outputs aren't (yet?) supported with depslog.
   std::string deps_type = edge->GetBinding("deps");
   if (!deps_type.empty() && edge->outputs_.size() > 1) {
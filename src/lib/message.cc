@@ -32,6 +32,9 @@ void Message(MessageType type, std::string_view message) {
   case MessageType::kExplain:
     std::fputs("ninja explain: ", stderr);
     break;
+  case MessageType::kTrace:
+    std::fputs("ninja trace: ", stderr);
+    break;
   }
 
   std::fwrite(message.data(), 1, message.size(), stderr);
@@ -14,59 +14,311 @@
 
 #include <ninja/metrics.h>
 
+#include <ninja/filesystem.h>
+
+#include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <algorithm>
+#include <cmath>
 #include <vector>
 
 namespace ninja {
 
 Metrics* g_metrics = nullptr;
 
+namespace {
+
+struct ThreadHistograms;
+
+/// All metrics and the threads recording to them.
+struct Registry {
+  std::mutex mutex;
+  /// The metrics by id.
+  std::vector<Metric*> metrics;
+  /// The running threads that recorded anything.
+  std::vector<ThreadHistograms*> threads;
+};
+
+/// Never destroyed, since threads may still exit after main() returned.
+Registry& GetRegistry() {
+  static Registry* registry = new Registry;
+  return *registry;
+}
+
+/// The histograms a thread records to, by Metric::id.  Recording needs no
+/// synchronization; the lock is only taken when the thread starts and
+/// exits.
+struct ThreadHistograms {
+  ThreadHistograms() {
+    Registry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.threads.push_back(this);
+  }
+
+  ~ThreadHistograms() {
+    Registry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (size_t id = 0; id < histograms.size(); ++id)
+      registry.metrics[id]->exited.Merge(histograms[id]);
+    registry.threads.erase(
+        std::find(registry.threads.begin(), registry.threads.end(), this));
+  }
+
+  void Record(size_t id, uint64_t value) {
+    if (id >= histograms.size())
+      histograms.resize(id + 1);
+    histograms[id].Record(value);
+  }
+
+  std::vector<Histogram> histograms;
+};
+
+thread_local ThreadHistograms t_histograms;
+
+int Log2(uint64_t value) {
+#ifdef __GNUC__
+  return 63 - __builtin_clzll(value);
+#else
+  int log2 = 0;
+  while (value >>= 1)
+    ++log2;
+  return log2;
+#endif
+}
+
+/// Append |value| to |out| as the value of a Prometheus label.
+void AppendLabelValue(const std::string& value, std::string* out) {
+  out->push_back('"');
+  for (char c : value) {
+    if (c == '\n') {
+      out->append("\\n");
+      continue;
+    }
+    if (c == '"' || c == '\\')
+      out->push_back('\\');
+    out->push_back(c);
+  }
+  out->push_back('"');
+}
+
+bool WriteFileAtomically(const std::string& path, const std::string& contents,
+                         std::string* err) {
+  std::string temp_path = path + ".tmp";
+  FILE* file = fopen(temp_path.c_str(), "wb");
+  if (!file) {
+    *err = strerror(errno);
+    return false;
+  }
+  bool ok = fwrite(contents.data(), 1, contents.size(), file) ==
+            contents.size();
+  ok = fclose(file) == 0 && ok;
+  if (!ok) {
+    *err = strerror(errno);
+    remove(temp_path.c_str());
+    return false;
+  }
+
+  fs::error_code ec;
+  fs::rename(temp_path, path, ec);
+  if (ec) {
+    *err = ec.message();
+    remove(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+void Histogram::Record(uint64_t value) {
+  size_t index = BucketIndex(value);
+  if (index >= buckets_.size())
+    buckets_.resize(index + 1);
+  ++buckets_[index];
+  ++count_;
+  sum_ += value;
+  max_ = std::max(max_, value);
+}
+
+void Histogram::Merge(const Histogram& other) {
+  if (other.buckets_.size() > buckets_.size())
+    buckets_.resize(other.buckets_.size());
+  for (size_t i = 0; i < other.buckets_.size(); ++i)
+    buckets_[i] += other.buckets_[i];
+  count_ += other.count_;
+  sum_ += other.sum_;
+  max_ = std::max(max_, other.max_);
+}
+
+uint64_t Histogram::Percentile(double fraction) const {
+  if (count_ == 0)
+    return 0;
+  uint64_t rank = static_cast<uint64_t>(std::ceil(fraction * count_));
+  rank = std::min(std::max<uint64_t>(rank, 1), count_);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < buckets_.size(); ++i) {
+    seen += buckets_[i];
+    if (seen >= rank)
+      return std::min(BucketMax(i), max_);
+  }
+  return max_;
+}
+
+size_t Histogram::BucketIndex(uint64_t value) {
+  const int kHalfBits = kSubBucketBits - 1;
+  if (value < (uint64_t(1) << kSubBucketBits))
+    return static_cast<size_t>(value);
+  // Keep the kSubBucketBits most significant bits; the top one is implied
+  // by the shift.
+  int shift = Log2(value) - kHalfBits;
+  return (static_cast<size_t>(shift) << kHalfBits) +
+         static_cast<size_t>(value >> shift);
+}
+
+uint64_t Histogram::BucketMax(size_t index) {
+  const int kHalfBits = kSubBucketBits - 1;
+  const size_t kHalf = size_t(1) << kHalfBits;
+  if (index < 2 * kHalf)
+    return index;
+  int shift = static_cast<int>(index >> kHalfBits) - 1;
+  uint64_t mantissa = (index & (kHalf - 1)) + kHalf;
+  // Wraps around to the largest value for the topmost bucket.
+  return ((mantissa + 1) << shift) - 1;
+}
+
 ScopedMetric::ScopedMetric(Metric* metric) {
   metric_ = metric;
   if (!metric_)
     return;
-  start_ = std::chrono::high_resolution_clock::now();
+  start_ = std::chrono::steady_clock::now();
 }
 ScopedMetric::~ScopedMetric() {
   if (!metric_)
     return;
-  metric_->count++;
-  int64_t dt = std::chrono::duration_cast<std::chrono::microseconds>(
-                   std::chrono::high_resolution_clock::now() - start_)
+  int64_t dt = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now() - start_)
                    .count();
-  metric_->sum += dt;
+  t_histograms.Record(metric_->id, dt);
 }
 
 Metric* Metrics::NewMetric(const std::string& name) {
   Metric* metric = new Metric;
   metric->name = name;
-  metric->count = 0;
-  metric->sum = 0;
+  {
+    Registry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    metric->id = registry.metrics.size();
+    registry.metrics.push_back(metric);
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
   metrics_.push_back(metric);
   return metric;
 }
 
+Histogram Metrics::Collect(Metric* metric) {
+  Registry& registry = GetRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  Histogram histogram = metric->exited;
+  for (ThreadHistograms* thread : registry.threads) {
+    if (metric->id < thread->histograms.size())
+      histogram.Merge(thread->histograms[metric->id]);
+  }
+  return histogram;
+}
+
 void Metrics::Report() {
+  std::lock_guard<std::mutex> lock(mutex_);
   int width = 0;
-  for (std::vector<Metric*>::iterator i = metrics_.begin(); i != metrics_.end();
-       ++i) {
-    width = std::max((int)(*i)->name.size(), width);
-  }
+  for (Metric* metric : metrics_)
+    width = std::max((int)metric->name.size(), width);
 
-  printf("%-*s\t%-6s\t%-9s\t%s\n", width, "metric", "count", "avg (us)",
+  printf("%-*s\t%-6s\t%-9s\t%-9s\t%-9s\t%-9s\t%-9s\t%s\n", width, "metric",
+         "count", "avg (us)", "p50 (us)", "p90 (us)", "p99 (us)", "max (us)",
          "total (ms)");
-  for (std::vector<Metric*>::iterator i = metrics_.begin(); i != metrics_.end();
-       ++i) {
-    Metric* metric = *i;
-    double total = metric->sum / (double)1000;
-    double avg = metric->sum / (double)metric->count;
-    printf("%-*s\t%-6d\t%-8.1f\t%.1f\n", width, metric->name.c_str(),
-           metric->count, avg, total);
+  for (Metric* metric : metrics_) {
+    Histogram histogram = Collect(metric);
+    double count = static_cast<double>(histogram.count());
+    double total = histogram.sum() / 1e6;
+    double avg = count ? histogram.sum() / 1e3 / count : 0;
+    printf("%-*s\t%-6" PRIu64 "\t%-8.1f\t%-8.1f\t%-8.1f\t%-8.1f\t%-8.1f\t%.1f\n",
+           width, metric->name.c_str(), histogram.count(), avg,
+           histogram.Percentile(0.5) / 1e3, histogram.Percentile(0.9) / 1e3,
+           histogram.Percentile(0.99) / 1e3, histogram.max() / 1e3, total);
   }
 }
 
+std::string Metrics::ToJSON() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::string out = "{\"metrics\":[";
+  for (size_t i = 0; i < metrics_.size(); ++i) {
+    Histogram histogram = Collect(metrics_[i]);
+    if (i > 0)
+      out.push_back(',');
+    out += "{\"name\":";
+    AppendJSONString(metrics_[i]->name, &out);
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             ",\"count\":%" PRIu64
+             ",\"total_us\":%.3f,\"p50_us\":%.3f,\"p90_us\":%.3f,"
+             "\"p99_us\":%.3f,\"max_us\":%.3f}",
+             histogram.count(), histogram.sum() / 1e3,
+             histogram.Percentile(0.5) / 1e3, histogram.Percentile(0.9) / 1e3,
+             histogram.Percentile(0.99) / 1e3, histogram.max() / 1e3);
+    out += buf;
+  }
+  out += "]}\n";
+  return out;
+}
+
+std::string Metrics::ToPrometheus() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<Histogram> histograms;
+  for (Metric* metric : metrics_)
+    histograms.push_back(Collect(metric));
+
+  char buf[64];
+  std::string out =
+      "# HELP ninja_metric_duration_seconds Time spent in a code path.\n"
+      "# TYPE ninja_metric_duration_seconds summary\n";
+  for (size_t i = 0; i < metrics_.size(); ++i) {
+    const Histogram& histogram = histograms[i];
+    std::string label = "{metric=";
+    AppendLabelValue(metrics_[i]->name, &label);
+    for (double quantile : { 0.5, 0.9, 0.99 }) {
+      snprintf(buf, sizeof(buf), ",quantile=\"%g\"} %.9g\n", quantile,
+               histogram.Percentile(quantile) / 1e9);
+      out += "ninja_metric_duration_seconds" + label + buf;
+    }
+    snprintf(buf, sizeof(buf), "} %.9g\n", histogram.sum() / 1e9);
+    out += "ninja_metric_duration_seconds_sum" + label + buf;
+    snprintf(buf, sizeof(buf), "} %" PRIu64 "\n", histogram.count());
+    out += "ninja_metric_duration_seconds_count" + label + buf;
+  }
+
+  out +=
+      "# HELP ninja_metric_duration_max_seconds Longest time spent in a code "
+      "path.\n"
+      "# TYPE ninja_metric_duration_max_seconds gauge\n";
+  for (size_t i = 0; i < metrics_.size(); ++i) {
+    out += "ninja_metric_duration_max_seconds{metric=";
+    AppendLabelValue(metrics_[i]->name, &out);
+    snprintf(buf, sizeof(buf), "} %.9g\n", histograms[i].max() / 1e9);
+    out += buf;
+  }
+  return out;
+}
+
+bool Metrics::WriteJSON(const std::string& path, std::string* err) {
+  return WriteFileAtomically(path, ToJSON(), err);
+}
+
+bool Metrics::WritePrometheus(const std::string& path, std::string* err) {
+  return WriteFileAtomically(path, ToPrometheus(), err);
+}
+
 int64_t GetTimeMillis() {
   return std::chrono::duration_cast<std::chrono::milliseconds>(
              std::chrono::high_resolution_clock::now().time_since_epoch())
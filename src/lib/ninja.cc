@@ -29,6 +29,8 @@
 #include <ninja/util.h>
 #include <ninja/version.h>
 
+#include <algorithm>
+
 #include <errno.h>
 #include <limits.h>
 #include <stdio.h>
@@ -65,16 +67,64 @@ bool NinjaMain::IsPathDead(std::string_view s) const {
   return mtime == 0;
 }
 
-int GuessParallelism() {
-  switch (int processors = GetProcessorCount()) {
+void ParallelismGuess::Probe(const BuildLog* build_log) {
+  processors = GetProcessorCount();
+  affinity = GetAffinityProcessorCount();
+  cpu_quota = GetCgroupCpuQuota();
+  memory_limit = GetCgroupMemoryLimit();
+  edge_rss = 0;
+
+  if (build_log && memory_limit > 0)
+    edge_rss = build_log->TypicalMaxRss();
+}
+
+int ParallelismGuess::Compute() const {
+  int cpus = UsableProcessorCount(processors, affinity, cpu_quota);
+  int parallelism;
+  switch (cpus) {
   case 0:
   case 1:
-    return 2;
+    parallelism = 2;
+    break;
   case 2:
-    return 3;
+    parallelism = 3;
+    break;
   default:
-    return processors + 2;
+    parallelism = cpus + 2;
+    break;
+  }
+
+  if (memory_limit > 0 && edge_rss > 0) {
+    int64_t fit = memory_limit / (int64_t)edge_rss;
+    if (fit < parallelism)
+      parallelism = std::max<int64_t>(1, fit);
+  }
+  return parallelism;
+}
+
+std::string ParallelismGuess::Describe() const {
+  const int64_t kMiB = 1024 * 1024;
+  std::string description =
+      absl::StrFormat("%d processors, %d in affinity mask", processors,
+                      affinity);
+  if (cpu_quota > 0.0)
+    absl::StrAppendFormat(&description, ", cgroup cpu quota %.2f", cpu_quota);
+  if (memory_limit > 0) {
+    absl::StrAppendFormat(&description, ", cgroup memory limit %d MiB",
+                          memory_limit / kMiB);
+  }
+  if (edge_rss > 0) {
+    absl::StrAppendFormat(&description, ", typical command rss %d MiB",
+                          edge_rss / kMiB);
   }
+  absl::StrAppendFormat(&description, " -> -j %d", Compute());
+  return description;
+}
+
+int GuessParallelism(const BuildLog* build_log) {
+  ParallelismGuess guess;
+  guess.Probe(build_log);
+  return guess.Compute();
 }
 
 /// Rebuild the build manifest, if necessary.
@@ -315,9 +365,10 @@ int ToolTargetsList(State* state) {
 int NinjaMain::ToolDeps(const Options* options, int argc, char** argv) {
   std::vector<Node*> nodes;
   if (argc == 0) {
+    build_log_.MaterializeAll();
     for (std::vector<Node*>::const_iterator ni = build_log_.nodes().begin();
          ni != build_log_.nodes().end(); ++ni) {
-      if (build_log_.IsDepsEntryLiveFor(*ni))
+      if (*ni && build_log_.IsDepsEntryLiveFor(*ni))
         nodes.push_back(*ni);
     }
   } else {
@@ -688,6 +739,7 @@ bool DebugEnable(const std::string& name) {
         "  explain      explain what caused a command to execute\n"
         "  keepdepfile  don't delete depfiles after they're read by ninja\n"
         "  keeprsp      don't delete @response files on success\n"
+        "  trace        trace scheduling decisions, e.g. of -P\n"
 #ifdef _WIN32
         "  nostatcache  don't batch stat() calls per directory and cache them\n"
 #endif
@@ -705,6 +757,9 @@ bool DebugEnable(const std::string& name) {
   } else if (name == "keeprsp") {
     g_keep_rsp = true;
     return true;
+  } else if (name == "trace") {
+    g_tracing = true;
+    return true;
   } else {
     Error("unknown debug setting '%s'", name.c_str());
     return false;
@@ -742,6 +797,8 @@ bool NinjaMain::OpenBuildLog(bool recompact_only) {
     log_path = build_dir_ + "/" + log_path;
 
   std::string err;
+  // Only recompaction needs all of the log.
+  build_log_.set_lazy_load(!recompact_only);
   if (!build_log_.Load(log_path, &state_, &err)) {
     Error("loading build log %s: %s", log_path.c_str(), err.c_str());
     return false;
@@ -777,6 +834,21 @@ void NinjaMain::DumpMetrics() {
   int buckets = (int)state_.paths_.bucket_count();
   printf("path->node hash load %.2f (%d entries / %d buckets)\n",
          count / (double)buckets, count, buckets);
+  printf("%d nodes in %d directories\n", state_.node_count(),
+         (int)state_.directories_.size());
+}
+
+bool NinjaMain::ExportMetrics(const char* json_path, const char* prom_path) {
+  std::string err;
+  if (json_path && !g_metrics->WriteJSON(json_path, &err)) {
+    Error("writing metrics to %s: %s", json_path, err.c_str());
+    return false;
+  }
+  if (prom_path && !g_metrics->WritePrometheus(prom_path, &err)) {
+    Error("writing metrics to %s: %s", prom_path, err.c_str());
+    return false;
+  }
+  return true;
 }
 
 bool NinjaMain::EnsureBuildDirExists() {
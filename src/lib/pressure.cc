@@ -0,0 +1,178 @@
+// Copyright 2018 Frank Benkstein. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <ninja/pressure.h>
+
+#include <ninja/debug_flags.h>
+#include <ninja/util.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+
+namespace ninja {
+
+namespace {
+
+const char* const kCgroupNames[] = { "cpu.pressure", "memory.pressure",
+                                     "io.pressure" };
+const char* const kProcNames[] = { "cpu", "memory", "io" };
+
+int64_t NowMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+/// Parse the value of |key| (e.g. "avg10=") in the space separated |line|.
+bool FindField(std::string_view line, std::string_view key,
+               std::string_view* value) {
+  size_t pos = 0;
+  while (pos < line.size()) {
+    size_t end = line.find(' ', pos);
+    if (end == std::string_view::npos)
+      end = line.size();
+    std::string_view field = line.substr(pos, end - pos);
+    if (field.substr(0, key.size()) == key) {
+      *value = field.substr(key.size());
+      return !value->empty();
+    }
+    pos = end + 1;
+  }
+  return false;
+}
+
+}  // namespace
+
+bool ParsePressureLine(std::string_view contents, std::string_view kind,
+                       PressureLine* line) {
+  while (!contents.empty()) {
+    size_t eol = contents.find('\n');
+    std::string_view current = contents.substr(0, eol);
+    contents = eol == std::string_view::npos ? std::string_view()
+                                             : contents.substr(eol + 1);
+    if (current.size() <= kind.size() ||
+        current.substr(0, kind.size()) != kind || current[kind.size()] != ' ')
+      continue;
+
+    std::string_view avg10, total;
+    if (!FindField(current, "avg10=", &avg10) ||
+        !FindField(current, "total=", &total))
+      return false;
+
+    // strtod() and strtoull() need NUL terminated input.
+    std::string avg10_str(avg10), total_str(total);
+    char* end;
+    line->avg10 = strtod(avg10_str.c_str(), &end);
+    if (*end != '\0')
+      return false;
+    line->total = strtoull(total_str.c_str(), &end, 10);
+    if (*end != '\0')
+      return false;
+    return true;
+  }
+  return false;
+}
+
+double PressureSample::Max() const {
+  return std::max(cpu, std::max(memory, io));
+}
+
+RealPressureSource::RealPressureSource()
+    : names_(kProcNames), last_totals_(), last_time_micros_(-1) {
+#ifdef __linux__
+  std::string probe, err;
+  std::string cgroup = GetCgroupDirectory();
+  if (!cgroup.empty() &&
+      ReadFile(cgroup + kCgroupNames[0], &probe, &err) >= 0) {
+    directory_ = cgroup;
+    names_ = kCgroupNames;
+  } else if (ReadFile("/proc/pressure/cpu", &probe, &err) >= 0) {
+    directory_ = "/proc/pressure/";
+  }
+#endif
+}
+
+bool RealPressureSource::Sample(PressureSample* sample) {
+  if (directory_.empty())
+    return false;
+
+  int64_t now = NowMicros();
+  double* values[] = { &sample->cpu, &sample->memory, &sample->io };
+  uint64_t totals[3];
+  for (int i = 0; i < 3; ++i) {
+    std::string contents, err;
+    PressureLine line;
+    if (ReadFile(directory_ + names_[i], &contents, &err) < 0 ||
+        !ParsePressureLine(contents, "some", &line))
+      return false;
+    totals[i] = line.total;
+    // The first sample has nothing to compare to, so use the kernel's own
+    // average.  Afterwards the delta of the totals gives the pressure over
+    // exactly the interval since the previous sample.
+    if (last_time_micros_ < 0 || now <= last_time_micros_ ||
+        totals[i] < last_totals_[i])
+      *values[i] = line.avg10;
+    else
+      *values[i] =
+          100.0 * (totals[i] - last_totals_[i]) / (now - last_time_micros_);
+  }
+  std::copy(std::begin(totals), std::end(totals), last_totals_);
+  last_time_micros_ = now;
+  return true;
+}
+
+ParallelismController::ParallelismController(int floor, int ceiling,
+                                             double max_pressure,
+                                             PressureSource* source)
+    : floor_(std::max(1, std::min(floor, ceiling))), ceiling_(ceiling),
+      max_pressure_(max_pressure), source_(source), limit_(ceiling),
+      available_(true), sampled_(false), last_sample_millis_(0),
+      last_sample_() {}
+
+int ParallelismController::Limit(int running, int64_t now_millis) {
+  if (!available_)
+    return limit_;
+  if (sampled_ && now_millis - last_sample_millis_ < kSampleIntervalMillis)
+    return limit_;
+  sampled_ = true;
+  last_sample_millis_ = now_millis;
+  Update(running);
+  return limit_;
+}
+
+void ParallelismController::Update(int running) {
+  if (!source_->Sample(&last_sample_)) {
+    available_ = false;
+    limit_ = ceiling_;
+    Warning("pressure information not available; using -j %d", ceiling_);
+    return;
+  }
+
+  int old_limit = limit_;
+  double pressure = last_sample_.Max();
+  if (pressure > max_pressure_) {
+    limit_ = std::max(floor_, limit_ - std::max(1, limit_ / 4));
+  } else if (pressure < max_pressure_ / 2 && running >= limit_) {
+    limit_ = std::min(ceiling_, limit_ + 1);
+  }
+
+  if (limit_ != old_limit) {
+    TRACE("parallelism %d -> %d (pressure cpu %.1f%% memory %.1f%% io %.1f%%)",
+          old_limit, limit_, last_sample_.cpu, last_sample_.memory,
+          last_sample_.io);
+  }
+}
+
+}  // namespace ninja
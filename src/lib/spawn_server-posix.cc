@@ -0,0 +1,340 @@
+// Copyright 2018 Frank Benkstein. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <ninja/ninja_config.h>
+
+#include <ninja/spawn_server.h>
+
+#include <ninja/util.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+extern char** environ;
+
+namespace ninja {
+
+namespace {
+
+/// The header of a request, followed by |size| bytes: the path and the
+/// arguments, each terminated by a nul byte.  The output fd is attached.
+struct Request {
+  uint32_t size;
+  int32_t use_console;
+};
+
+#ifdef MSG_NOSIGNAL
+const int kSendFlags = MSG_NOSIGNAL;
+#else
+const int kSendFlags = 0;
+#endif
+
+bool SendAll(int fd, const void* data, size_t size) {
+  const char* p = static_cast<const char*>(data);
+  while (size > 0) {
+    ssize_t len = send(fd, p, size, kSendFlags);
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    p += len;
+    size -= len;
+  }
+  return true;
+}
+
+bool ReadAll(int fd, void* data, size_t size) {
+  char* p = static_cast<char*>(data);
+  while (size > 0) {
+    ssize_t len = read(fd, p, size);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      return false;
+    p += len;
+    size -= len;
+  }
+  return true;
+}
+
+/// Read a request header from |fd| along with the fd attached to it.
+bool ReceiveRequest(int fd, Request* request, int* output_fd) {
+  char control[CMSG_SPACE(sizeof(int))];
+  iovec iov = { request, sizeof(*request) };
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t len;
+  do {
+    len = recvmsg(fd, &msg, 0);
+  } while (len < 0 && errno == EINTR);
+  if (len <= 0)
+    return false;
+
+  *output_fd = -1;
+  for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy(output_fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+  return *output_fd >= 0 &&
+         ReadAll(fd, reinterpret_cast<char*>(request) + len,
+                 sizeof(*request) - len);
+}
+
+/// Only there to interrupt the wait for requests.
+void OnChildExited(int) {}
+
+}  // namespace
+
+/// The main loop of the server, reading requests from |fd| until ninja
+/// goes away.  Doesn't return.
+void ServeSpawns(int fd) {
+  // The terminal signals the whole process group on ctrl-c, but the
+  // server has to outlive ninja's cleanup.  Commands get the default
+  // dispositions back.
+  sigset_t default_signals;
+  sigemptyset(&default_signals);
+  for (int signum : { SIGINT, SIGTERM, SIGHUP, SIGPIPE, SIGCHLD }) {
+    sigaddset(&default_signals, signum);
+    if (signum != SIGCHLD)
+      signal(signum, SIG_IGN);
+  }
+
+  // Only notice exits while waiting for requests.
+  struct sigaction act;
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = OnChildExited;
+  sigaction(SIGCHLD, &act, nullptr);
+  sigset_t child_mask, command_mask;
+  sigemptyset(&child_mask);
+  sigaddset(&child_mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &child_mask, &command_mask);
+  sigset_t wait_mask = command_mask;
+  sigdelset(&wait_mask, SIGCHLD);
+  // A SubprocessSet may have blocked these before the server was forked.
+  for (int signum : { SIGINT, SIGTERM, SIGHUP, SIGPIPE, SIGCHLD })
+    sigdelset(&command_mask, signum);
+
+  std::string payload;
+  std::vector<char*> argv;
+  for (;;) {
+    pollfd pfd = { fd, POLLIN, 0 };
+#ifdef NINJA_USE_PPOLL
+    int ret = ppoll(&pfd, 1, nullptr, &wait_mask);
+#else
+    fd_set set;
+    FD_ZERO(&set);
+    FD_SET(fd, &set);
+    int ret = pselect(fd + 1, &set, nullptr, nullptr, nullptr, &wait_mask);
+    if (ret > 0)
+      pfd.revents = POLLIN;
+#endif
+
+    int status;
+    rusage usage;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+      SpawnServer::Message message = {};
+      message.kind = SpawnServer::Message::kExited;
+      message.pid = pid;
+      message.value = status;
+#ifdef __APPLE__
+      message.max_rss = usage.ru_maxrss;
+#else
+      message.max_rss = int64_t(usage.ru_maxrss) * 1024;
+#endif
+      if (!SendAll(fd, &message, sizeof(message)))
+        _exit(0);
+    }
+    if (ret <= 0 || !pfd.revents)
+      continue;
+
+    Request request;
+    int output_fd;
+    if (!ReceiveRequest(fd, &request, &output_fd))
+      _exit(0);
+    payload.resize(request.size);
+    if (!ReadAll(fd, &payload[0], payload.size()))
+      _exit(0);
+    argv.clear();
+    for (size_t begin = 0; begin < payload.size();) {
+      argv.push_back(&payload[begin]);
+      begin = payload.find('\0', begin) + 1;
+    }
+    const char* path = argv.front();
+    argv.erase(argv.begin());
+    argv.push_back(nullptr);
+
+    posix_spawn_file_actions_t action;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&action);
+    posix_spawnattr_init(&attr);
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    posix_spawnattr_setsigmask(&attr, &command_mask);
+    posix_spawnattr_setsigdefault(&attr, &default_signals);
+    if (!request.use_console) {
+      flags |= POSIX_SPAWN_SETPGROUP;
+      posix_spawn_file_actions_addopen(&action, 0, "/dev/null", O_RDONLY, 0);
+      posix_spawn_file_actions_adddup2(&action, output_fd, 1);
+      posix_spawn_file_actions_adddup2(&action, output_fd, 2);
+      posix_spawn_file_actions_addclose(&action, output_fd);
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    SpawnServer::Message message = {};
+    message.kind = SpawnServer::Message::kSpawned;
+    int err = posix_spawn(&pid, path, &action, &attr, argv.data(), environ);
+    message.pid = err == 0 ? pid : -1;
+    message.value = err;
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&action);
+    close(output_fd);
+    if (!SendAll(fd, &message, sizeof(message)))
+      _exit(0);
+  }
+}
+
+SpawnServer* SpawnServer::global_;
+
+SpawnServer::~SpawnServer() {
+  if (fd_ < 0)
+    return;
+  // The server exits when it sees the socket closed.
+  close(fd_);
+  waitpid(pid_, nullptr, 0);
+}
+
+bool SpawnServer::Start() {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    return false;
+  // Neither end may leak into commands.
+  SetCloseOnExec(fds[0]);
+  SetCloseOnExec(fds[1]);
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    ServeSpawns(fds[1]);
+  }
+  close(fds[1]);
+  fd_ = fds[0];
+  pid_ = pid;
+  return true;
+}
+
+bool SpawnServer::StartGlobal() {
+  if (global_)
+    return true;
+  SpawnServer* server = new SpawnServer;
+  if (!server->Start()) {
+    delete server;
+    return false;
+  }
+  global_ = server;
+  return true;
+}
+
+pid_t SpawnServer::Spawn(const char* path, char* const argv[], int output_fd,
+                         bool use_console) {
+  std::string payload(path);
+  payload += '\0';
+  for (char* const* arg = argv; *arg; ++arg) {
+    payload += *arg;
+    payload += '\0';
+  }
+
+  Request request = { static_cast<uint32_t>(payload.size()),
+                      use_console ? 1 : 0 };
+  char control[CMSG_SPACE(sizeof(int))] = {};
+  iovec iov = { &request, sizeof(request) };
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &output_fd, sizeof(int));
+
+  ssize_t len;
+  do {
+    len = sendmsg(fd_, &msg, kSendFlags);
+  } while (len < 0 && errno == EINTR);
+  if (len < 0 ||
+      !SendAll(fd_, reinterpret_cast<char*>(&request) + len,
+               sizeof(request) - len) ||
+      !SendAll(fd_, payload.data(), payload.size())) {
+    return -1;
+  }
+
+  Message message;
+  do {
+    if (!Receive(&message)) {
+      errno = EPIPE;
+      return -1;
+    }
+  } while (message.kind != Message::kSpawned);
+  if (message.pid < 0)
+    errno = message.value;
+  return message.pid;
+}
+
+bool SpawnServer::Wait(pid_t pid, int* status, int64_t* max_rss) {
+  for (;;) {
+    auto exit = exits_.find(pid);
+    if (exit != exits_.end()) {
+      *status = exit->second.status;
+      *max_rss = exit->second.max_rss;
+      exits_.erase(exit);
+      return true;
+    }
+    Message message;
+    if (!Receive(&message))
+      return false;
+  }
+}
+
+bool SpawnServer::Receive(Message* message) {
+  if (!ReadAll(fd_, message, sizeof(*message)))
+    return false;
+  if (message->kind == Message::kExited)
+    exits_[message->pid] = Exit{ message->value, message->max_rss };
+  return true;
+}
+
+}  // namespace ninja
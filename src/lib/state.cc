@@ -16,6 +16,9 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
 
 #include <ninja/graph.h>
 #include <ninja/metrics.h>
@@ -38,13 +41,13 @@ void Pool::DelayEdge(Edge* edge) {
   delayed_.insert(edge);
 }
 
-void Pool::RetrieveReadyEdges(std::set<Edge*>* ready_queue) {
+void Pool::RetrieveReadyEdges(std::vector<Edge*>* ready_queue) {
   DelayedEdges::iterator it = delayed_.begin();
   while (it != delayed_.end()) {
     Edge* edge = *it;
     if (current_use_ + edge->weight() > depth_)
       break;
-    ready_queue->insert(edge);
+    ready_queue->push_back(edge);
     EdgeScheduled(*edge);
     ++it;
   }
@@ -101,28 +104,60 @@ Edge* State::AddEdge(const Rule* rule) {
   edge->rule_ = rule;
   edge->pool_ = default_pool_;
   edge->env_ = bindings_;
+  edge->id_ = static_cast<int>(edges_.size());
   edges_.push_back(std::move(owned_edge));
   return edge;
 }
 
 Node* State::GetNode(std::string_view path, uint64_t slash_bits) {
-  if (Node* node = LookupNode(path))
-    return node;
+  size_t dir_len = DirectoryTable::DirLength(path);
+  Directory* dir = directories_.Intern(path.substr(0, dir_len));
+  std::string_view basename = path.substr(dir_len);
+  PathKey key(dir, basename);
+  Paths::const_iterator i = paths_.find(key);
+  if (i != paths_.end())
+    return i->second;
 
-  auto owned_node = std::make_unique<Node>(std::string(path), slash_bits);
-  Node* node = owned_node.get();
-  paths_[node->path()] = std::move(owned_node);
+  if (node_count_ % kNodeChunkSize == 0) {
+    nodes_.emplace_back();
+    nodes_.back().reserve(kNodeChunkSize);
+  }
+  // The chunk has been reserved up front, so this never reallocates and
+  // pointers to existing nodes stay valid.
+  Node* node = &nodes_.back().emplace_back(dir, StoreName(basename),
+                                           slash_bits, node_count_++);
+  // Same hash, but the key has to point to the node's own copy.
+  key.basename = node->basename();
+  paths_.emplace(key, node);
   return node;
 }
 
 Node* State::LookupNode(std::string_view path) const {
   METRIC_RECORD("lookup node");
-  Paths::const_iterator i = paths_.find(path);
+  size_t dir_len = DirectoryTable::DirLength(path);
+  const Directory* dir = directories_.Lookup(path.substr(0, dir_len));
+  if (!dir)
+    return nullptr;
+  Paths::const_iterator i = paths_.find(PathKey(dir, path.substr(dir_len)));
   if (i != paths_.end())
-    return i->second.get();
+    return i->second;
   return nullptr;
 }
 
+std::string_view State::StoreName(std::string_view name) {
+  if (name.size() > names_left_) {
+    size_t size = std::max(kNameChunkSize, name.size());
+    names_.push_back(std::make_unique<char[]>(size));
+    names_next_ = names_.back().get();
+    names_left_ = size;
+  }
+  char* copy = names_next_;
+  memcpy(copy, name.data(), name.size());
+  names_next_ += name.size();
+  names_left_ -= name.size();
+  return std::string_view(copy, name.size());
+}
+
 void State::AddIn(Edge* edge, std::string_view path, uint64_t slash_bits) {
   Node* node = GetNode(path, slash_bits);
   edge->inputs_.push_back(node);
@@ -169,8 +204,10 @@ std::vector<Node*> State::DefaultNodes(std::string* err) const {
 }
 
 void State::Reset() {
-  for (Paths::iterator i = paths_.begin(); i != paths_.end(); ++i)
-    i->second->ResetState();
+  for (auto& chunk : nodes_) {
+    for (Node& node : chunk)
+      node.ResetState();
+  }
   for (const auto& e : edges_) {
     e->outputs_ready_ = false;
     e->mark_ = Edge::VisitNone;
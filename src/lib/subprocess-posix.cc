@@ -16,6 +16,7 @@
 
 #include <ninja/subprocess.h>
 
+#include <ninja/spawn_server.h>
 #include <ninja/util.h>
 
 #include <assert.h>
@@ -25,17 +26,28 @@
 #include <spawn.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <string_view>
+
 extern char** environ;
 
 namespace ninja {
 
 Subprocess::Subprocess(bool use_console)
-    : fd_(-1), pid_(-1), use_console_(use_console) {}
+    : fd_(-1), pid_(-1), spawn_server_(nullptr), workers_(nullptr),
+      worker_(nullptr), worker_exit_(0), use_console_(use_console),
+      max_rss_(0), worker_lost_(false) {}
 
 Subprocess::~Subprocess() {
+  // An abandoned request leaves the worker in an unknown state.
+  if (worker_)
+    ReleaseWorker(WorkerPool::kRetire);
   if (fd_ >= 0)
     close(fd_);
   // Reap child if forgotten.
@@ -43,7 +55,8 @@ Subprocess::~Subprocess() {
     Finish();
 }
 
-bool Subprocess::Start(SubprocessSet* set, const std::string& command) {
+bool Subprocess::Start(SubprocessSet* set, const std::string& command,
+                       bool force_shell) {
   int output_pipe[2];
   if (pipe(output_pipe) < 0)
     Fatal("pipe: %s", strerror(errno));
@@ -103,10 +116,36 @@ bool Subprocess::Start(SubprocessSet* set, const std::string& command) {
   if (posix_spawnattr_setflags(&attr, flags) != 0)
     Fatal("posix_spawnattr_setflags: %s", strerror(errno));
 
-  const char* spawned_args[] = { "/bin/sh", "-c", command.c_str(), nullptr };
-  if (posix_spawn(&pid_, "/bin/sh", &action, &attr,
-                  const_cast<char**>(spawned_args), environ) != 0)
-    Fatal("posix_spawn: %s", strerror(errno));
+  // Most commands are a single program with plain arguments.  Those are
+  // run directly, which saves starting a shell for each one.  If that
+  // fails, e.g. because the program is a script without #!, the shell
+  // gets to try and report errors as usual.
+  spawn_server_ = set->spawn_server_;
+  auto spawn = [&](const char* path, char* const argv[]) {
+    if (spawn_server_) {
+      pid_ = spawn_server_->Spawn(path, argv, output_pipe[1], use_console_);
+      return pid_ != -1;
+    }
+    return posix_spawn(&pid_, path, &action, &attr, argv, environ) == 0;
+  };
+
+  bool spawned = false;
+  std::vector<std::string> args;
+  const std::string* program;
+  if (!force_shell && SplitShellCommand(command, &args) &&
+      (program = set->FindProgram(args[0])) != nullptr) {
+    std::vector<char*> argv;
+    argv.reserve(args.size() + 1);
+    for (std::string& arg : args)
+      argv.push_back(&arg[0]);
+    argv.push_back(nullptr);
+    spawned = spawn(program->c_str(), argv.data());
+  }
+  if (!spawned) {
+    const char* spawned_args[] = { "/bin/sh", "-c", command.c_str(), nullptr };
+    if (!spawn("/bin/sh", const_cast<char**>(spawned_args)))
+      Fatal("posix_spawn: %s", strerror(errno));
+  }
 
   if (posix_spawnattr_destroy(&attr) != 0)
     Fatal("posix_spawnattr_destroy: %s", strerror(errno));
@@ -117,7 +156,105 @@ bool Subprocess::Start(SubprocessSet* set, const std::string& command) {
   return true;
 }
 
+void Subprocess::StartRequest(WorkerPool* workers, Worker* worker,
+                              const std::vector<std::string>& args) {
+  workers_ = workers;
+  worker_ = worker;
+  fd_ = worker->fd;
+
+  std::string payload;
+  for (const std::string& arg : args) {
+    payload += arg;
+    payload += '\0';
+  }
+  request_ = std::to_string(payload.size()) + "\n" + payload;
+  if (!SendRequest()) {
+    worker_lost_ = true;
+    ReleaseWorker(WorkerPool::kBroken);
+  }
+}
+
+bool Subprocess::SendRequest() {
+#ifdef MSG_NOSIGNAL
+  const int flags = MSG_NOSIGNAL;
+#else
+  const int flags = 0;  // SO_NOSIGPIPE is set on the socket instead.
+#endif
+  // The socket doesn't block, so a worker that is slow to read can't hold
+  // up the build loop.
+  size_t sent = 0;
+  while (sent < request_.size()) {
+    ssize_t len =
+        send(fd_, request_.data() + sent, request_.size() - sent, flags);
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      return false;
+    }
+    sent += len;
+  }
+  request_.erase(0, sent);
+  return true;
+}
+
+void Subprocess::OnWorkerReady() {
+  if (!request_.empty() && !SendRequest()) {
+    worker_lost_ = true;
+    ReleaseWorker(WorkerPool::kBroken);
+    return;
+  }
+
+  char buf[4 << 10];
+  ssize_t len = read(fd_, buf, sizeof(buf));
+  if (len < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+  if (len <= 0) {
+    worker_lost_ = true;
+    buf_.clear();
+    ReleaseWorker(WorkerPool::kBroken);
+    return;
+  }
+  buf_.append(buf, len);
+
+  size_t header = buf_.find('\n');
+  if (header == std::string::npos)
+    return;
+  int exit_code;
+  unsigned long size;
+  char end;
+  if (sscanf(buf_.c_str(), "%d %lu%c", &exit_code, &size, &end) != 3 ||
+      end != '\n') {
+    worker_lost_ = true;
+    buf_.clear();
+    ReleaseWorker(WorkerPool::kBroken);
+    return;
+  }
+  size_t available = buf_.size() - header - 1;
+  if (available < size)
+    return;
+
+  worker_exit_ = exit_code;
+  buf_.erase(0, header + 1);
+  buf_.resize(size);
+  // Anything beyond the response wasn't asked for.
+  ReleaseWorker(available == size ? WorkerPool::kAnswered
+                                  : WorkerPool::kRetire);
+}
+
+void Subprocess::ReleaseWorker(WorkerPool::Outcome outcome) {
+  // The worker owns the socket.
+  fd_ = -1;
+  Worker* worker = worker_;
+  worker_ = nullptr;
+  workers_->Release(worker, outcome);
+}
+
 void Subprocess::OnPipeReady() {
+  if (workers_)
+    return OnWorkerReady();
+
   char buf[4 << 10];
   ssize_t len = read(fd_, buf, sizeof(buf));
   if (len > 0) {
@@ -131,10 +268,25 @@ void Subprocess::OnPipeReady() {
 }
 
 ExitStatus Subprocess::Finish() {
+  if (workers_)
+    return worker_exit_ == 0 && !worker_lost_ ? ExitSuccess : ExitFailure;
+
   assert(pid_ != -1);
   int status;
-  if (waitpid(pid_, &status, 0) < 0)
-    Fatal("waitpid(%d): %s", pid_, strerror(errno));
+  if (spawn_server_) {
+    if (!spawn_server_->Wait(pid_, &status, &max_rss_))
+      Fatal("spawn server: lost track of %d", pid_);
+  } else {
+    struct rusage usage;
+    if (wait4(pid_, &status, 0, &usage) < 0)
+      Fatal("wait4(%d): %s", pid_, strerror(errno));
+#ifdef __APPLE__
+    max_rss_ = usage.ru_maxrss;
+#else
+    // Everybody else reports kilobytes.
+    max_rss_ = int64_t(usage.ru_maxrss) * 1024;
+#endif
+  }
   pid_ = -1;
 
   if (WIFEXITED(status)) {
@@ -178,7 +330,7 @@ void SubprocessSet::HandlePendingInterruption() {
     interrupted_ = SIGHUP;
 }
 
-SubprocessSet::SubprocessSet() {
+SubprocessSet::SubprocessSet() : spawn_server_(SpawnServer::global()) {
   sigset_t set;
   sigemptyset(&set);
   sigaddset(&set, SIGINT);
@@ -211,17 +363,72 @@ SubprocessSet::~SubprocessSet() {
     Fatal("sigprocmask: %s", strerror(errno));
 }
 
-Subprocess* SubprocessSet::Add(const std::string& command, bool use_console) {
+Subprocess* SubprocessSet::Add(const std::string& command, bool use_console,
+                               bool force_shell) {
   auto subprocess = std::unique_ptr<Subprocess>(new Subprocess(use_console));
-  if (!subprocess->Start(this, command)) {
+  if (!subprocess->Start(this, command, force_shell)) {
     return 0;
   }
   running_.push_back(std::move(subprocess));
   return running_.back().get();
 }
 
+Subprocess* SubprocessSet::AddWorkerRequest(const std::string& worker_command,
+                                            const std::string& command) {
+  std::vector<std::string> args;
+  if (!SplitShellCommand(command, &args))
+    return nullptr;
+  Worker* worker = workers_.Acquire(worker_command, &old_mask_);
+  if (!worker)
+    return nullptr;
+
+  auto subprocess = std::unique_ptr<Subprocess>(new Subprocess(false));
+  subprocess->StartRequest(&workers_, worker, args);
+  Subprocess* added = subprocess.get();
+  if (subprocess->Done())
+    finished_.push(std::move(subprocess));
+  else
+    running_.push_back(std::move(subprocess));
+  return added;
+}
+
+const std::string* SubprocessSet::FindProgram(const std::string& name) {
+  auto found = programs_.find(name);
+  if (found != programs_.end())
+    return found->second.empty() ? nullptr : &found->second;
+
+  auto is_program = [](const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+           access(path.c_str(), X_OK) == 0;
+  };
+
+  std::string& program = programs_[name];
+  if (name.find('/') != std::string::npos) {
+    if (is_program(name))
+      program = name;
+  } else {
+    const char* path = getenv("PATH");
+    std::string_view dirs = path ? path : "/usr/bin:/bin";
+    for (size_t begin = 0; begin <= dirs.size();) {
+      size_t end = std::min(dirs.find(':', begin), dirs.size());
+      // An empty entry means the current directory.
+      std::string candidate(end > begin ? dirs.substr(begin, end - begin)
+                                        : std::string_view("."));
+      candidate += '/';
+      candidate += name;
+      if (is_program(candidate)) {
+        program = std::move(candidate);
+        break;
+      }
+      begin = end + 1;
+    }
+  }
+  return program.empty() ? nullptr : &program;
+}
+
 #ifdef NINJA_USE_PPOLL
-bool SubprocessSet::DoWork() {
+bool SubprocessSet::DoWork(int timeout_millis) {
   std::vector<pollfd> fds;
   nfds_t nfds = 0;
 
@@ -229,13 +436,19 @@ bool SubprocessSet::DoWork() {
     int fd = p->fd_;
     if (fd < 0)
       continue;
-    pollfd pfd = { fd, POLLIN | POLLPRI, 0 };
+    short events = POLLIN | POLLPRI;
+    if (!p->request_.empty())
+      events |= POLLOUT;
+    pollfd pfd = { fd, events, 0 };
     fds.push_back(pfd);
     ++nfds;
   }
 
+  timespec timeout = { timeout_millis / 1000,
+                       (timeout_millis % 1000) * 1000000 };
   interrupted_ = 0;
-  int ret = ppoll(&fds.front(), nfds, nullptr, &old_mask_);
+  int ret = ppoll(fds.data(), nfds, timeout_millis < 0 ? nullptr : &timeout,
+                  &old_mask_);
   if (ret == -1) {
     if (errno != EINTR) {
       perror("ninja: ppoll");
@@ -269,23 +482,30 @@ bool SubprocessSet::DoWork() {
 }
 
 #else   // !defined(NINJA_USE_PPOLL)
-bool SubprocessSet::DoWork() {
+bool SubprocessSet::DoWork(int timeout_millis) {
   fd_set set;
+  fd_set write_set;
   int nfds = 0;
   FD_ZERO(&set);
+  FD_ZERO(&write_set);
 
   for (std::vector<Subprocess*>::iterator i = running_.begin();
        i != running_.end(); ++i) {
     int fd = (*i)->fd_;
     if (fd >= 0) {
       FD_SET(fd, &set);
+      if (!(*i)->request_.empty())
+        FD_SET(fd, &write_set);
       if (nfds < fd + 1)
         nfds = fd + 1;
     }
   }
 
+  timespec timeout = { timeout_millis / 1000,
+                       (timeout_millis % 1000) * 1000000 };
   interrupted_ = 0;
-  int ret = pselect(nfds, &set, 0, 0, 0, &old_mask_);
+  int ret = pselect(nfds, &set, &write_set, 0,
+                    timeout_millis < 0 ? nullptr : &timeout, &old_mask_);
   if (ret == -1) {
     if (errno != EINTR) {
       perror("ninja: pselect");
@@ -301,7 +521,7 @@ bool SubprocessSet::DoWork() {
   for (std::vector<Subprocess*>::iterator i = running_.begin();
        i != running_.end();) {
     int fd = (*i)->fd_;
-    if (fd >= 0 && FD_ISSET(fd, &set)) {
+    if (fd >= 0 && (FD_ISSET(fd, &set) || FD_ISSET(fd, &write_set))) {
       (*i)->OnPipeReady();
       if ((*i)->Done()) {
         finished_.push(*i);
@@ -328,9 +548,105 @@ void SubprocessSet::Clear() {
   for (auto i = running_.begin(); i != running_.end(); ++i)
     // Since the foreground process is in our process group, it will receive
     // the interruption signal (i.e. SIGINT or SIGTERM) at the same time as us.
-    if (!(*i)->use_console_)
+    // Workers have no process of their own, they're stopped when their
+    // request is destroyed.
+    if (!(*i)->use_console_ && !(*i)->workers_)
       kill(-(*i)->pid_, interrupted_);
   running_.clear();
 }
 
+namespace {
+
+/// Stop |worker| along with anything it started.  It has its own process
+/// group, in case the shell didn't exec the worker command.
+void StopWorker(const Worker& worker) {
+  close(worker.fd);
+  kill(-worker.pid, SIGKILL);
+  waitpid(worker.pid, nullptr, 0);
+}
+
+}  // namespace
+
+WorkerPool::~WorkerPool() {
+  for (const auto& worker : workers_)
+    StopWorker(*worker);
+}
+
+Worker* WorkerPool::Acquire(const std::string& command, const sigset_t* mask) {
+  for (const auto& worker : workers_) {
+    if (!worker->busy && worker->command == command) {
+      worker->busy = true;
+      return worker.get();
+    }
+  }
+  if (broken_.count(command))
+    return nullptr;
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    Fatal("socketpair: %s", strerror(errno));
+#if !defined(NINJA_USE_PPOLL)
+  if (fds[0] >= static_cast<int>(FD_SETSIZE))
+    Fatal("socketpair: %s", strerror(EMFILE));
+#endif  // !NINJA_USE_PPOLL
+  SetCloseOnExec(fds[0]);
+  if (fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK) < 0)
+    Fatal("fcntl: %s", strerror(errno));
+#ifdef SO_NOSIGPIPE
+  int one = 1;
+  setsockopt(fds[0], SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+  posix_spawn_file_actions_t action;
+  if (posix_spawn_file_actions_init(&action) != 0)
+    Fatal("posix_spawn_file_actions_init: %s", strerror(errno));
+  if (posix_spawn_file_actions_addclose(&action, fds[0]) != 0 ||
+      posix_spawn_file_actions_adddup2(&action, fds[1], 0) != 0 ||
+      posix_spawn_file_actions_adddup2(&action, fds[1], 1) != 0 ||
+      posix_spawn_file_actions_addopen(&action, 2, "/dev/null", O_WRONLY,
+                                       0) != 0 ||
+      posix_spawn_file_actions_addclose(&action, fds[1]) != 0) {
+    Fatal("posix_spawn_file_actions: %s", strerror(errno));
+  }
+
+  posix_spawnattr_t attr;
+  if (posix_spawnattr_init(&attr) != 0)
+    Fatal("posix_spawnattr_init: %s", strerror(errno));
+  // Like other commands, workers get their own process group so that
+  // ctrl-c doesn't reach them.
+  if (posix_spawnattr_setsigmask(&attr, mask) != 0 ||
+      posix_spawnattr_setflags(&attr,
+                               POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP) !=
+          0) {
+    Fatal("posix_spawnattr: %s", strerror(errno));
+  }
+
+  pid_t pid;
+  const char* spawned_args[] = { "/bin/sh", "-c", command.c_str(), nullptr };
+  if (posix_spawn(&pid, "/bin/sh", &action, &attr,
+                  const_cast<char**>(spawned_args), environ) != 0)
+    Fatal("posix_spawn: %s", strerror(errno));
+
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&action);
+  close(fds[1]);
+
+  workers_.push_back(std::make_unique<Worker>(command, pid, fds[0]));
+  return workers_.back().get();
+}
+
+void WorkerPool::Release(Worker* worker, Outcome outcome) {
+  worker->busy = false;
+  if (outcome == kAnswered && ++worker->requests < kMaxRequests)
+    return;
+  if (outcome == kBroken && worker->requests == 0)
+    broken_.insert(worker->command);
+
+  auto i = std::find_if(
+      workers_.begin(), workers_.end(),
+      [worker](const std::unique_ptr<Worker>& w) { return w.get() == worker; });
+  StopWorker(*worker);
+  workers_.erase(i);
+}
+
 }  // namespace ninja
@@ -25,7 +25,7 @@ namespace ninja {
 
 Subprocess::Subprocess(bool use_console)
     : child_(nullptr), overlapped_(), is_reading_(false),
-      use_console_(use_console) {}
+      use_console_(use_console), max_rss_(0), worker_lost_(false) {}
 
 Subprocess::~Subprocess() {
   if (pipe_) {
@@ -71,7 +71,9 @@ HANDLE Subprocess::SetupPipe(HANDLE ioport) {
   return output_write_child;
 }
 
-bool Subprocess::Start(SubprocessSet* set, const std::string& command) {
+bool Subprocess::Start(SubprocessSet* set, const std::string& command,
+                       bool force_shell) {
+  // Commands never go through a shell here, so |force_shell| is moot.
   HANDLE child_pipe = SetupPipe(set->ioport_);
 
   SECURITY_ATTRIBUTES security_attributes;
@@ -223,9 +225,10 @@ BOOL WINAPI SubprocessSet::NotifyInterrupted(DWORD dwCtrlType) {
   return FALSE;
 }
 
-Subprocess* SubprocessSet::Add(const std::string& command, bool use_console) {
+Subprocess* SubprocessSet::Add(const std::string& command, bool use_console,
+                               bool force_shell) {
   auto subprocess = std::unique_ptr<Subprocess>(new Subprocess(use_console));
-  if (!subprocess->Start(this, command)) {
+  if (!subprocess->Start(this, command, force_shell)) {
     return 0;
   }
   if (subprocess->child_) {
@@ -237,13 +240,23 @@ Subprocess* SubprocessSet::Add(const std::string& command, bool use_console) {
   }
 }
 
-bool SubprocessSet::DoWork() {
+Subprocess* SubprocessSet::AddWorkerRequest(const std::string& worker_command,
+                                            const std::string& command) {
+  // Persistent workers aren't supported on Windows.
+  return nullptr;
+}
+
+bool SubprocessSet::DoWork(int timeout_millis) {
   DWORD bytes_read;
   Subprocess* subproc;
   OVERLAPPED* overlapped;
 
   if (!GetQueuedCompletionStatus(ioport_, &bytes_read, (PULONG_PTR)&subproc,
-                                 &overlapped, INFINITE)) {
+                                 &overlapped,
+                                 timeout_millis < 0 ? INFINITE
+                                                    : timeout_millis)) {
+    if (!overlapped && GetLastError() == WAIT_TIMEOUT)
+      return false;
     if (GetLastError() != ERROR_BROKEN_PIPE)
       Win32Fatal("GetQueuedCompletionStatus");
   }
@@ -42,8 +42,16 @@
 #include <unistd.h>
 #endif
 
+#include <algorithm>
+#include <bitset>
+#include <cmath>
+#include <thread>
 #include <vector>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #if defined(__APPLE__) || defined(__FreeBSD__)
 #include <sys/sysctl.h>
 #elif defined(__SVR4) && defined(__sun)
@@ -55,6 +63,10 @@
 #include <sys/sysinfo.h>
 #endif
 
+#ifdef __linux__
+#include <sched.h>
+#endif
+
 namespace ninja {
 bool CanonicalizePath(std::string* path, uint64_t* slash_bits,
                       std::string* err) {
@@ -102,17 +114,104 @@ bool IsPathSeparator(char c) {
 #endif
 }
 
-bool CanonicalizePath(char* path, size_t* len, uint64_t* slash_bits,
-                      std::string* err) {
-  // WARNING: this function is performance-critical; please benchmark
-  // any changes you make to it.
-  METRIC_RECORD("canonicalize path");
+namespace {
+
+const int kMaxPathComponents = 60;
+
+#ifdef __SSE2__
+/// Bit i is set for every byte i of the 16 at |p| that equals |c|.
+unsigned ByteMask(const char* p, char c) {
+  __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(c)));
+}
+
+unsigned SeparatorMask(const char* p) {
+#ifdef _WIN32
+  return ByteMask(p, '/') | ByteMask(p, '\\');
+#else
+  return ByteMask(p, '/');
+#endif
+}
+#endif
+
+/// Return the first separator in [begin, end), or |end|.
+const char* FindPathSeparator(const char* begin, const char* end) {
+#ifdef __SSE2__
+  for (; end - begin >= 16; begin += 16) {
+    if (unsigned mask = SeparatorMask(begin))
+      return begin + __builtin_ctz(mask);
+  }
+#endif
+  while (begin != end && !IsPathSeparator(*begin))
+    ++begin;
+  return begin;
+}
+
+/// Return true if CanonicalizePath() would leave |path| unchanged with zero
+/// |slash_bits|: there are no "." components, no ".." components except
+/// leading ones, no repeated or trailing separators and no backslashes.
+/// False negatives are fine, they just take the slow path.
+bool IsCanonicalPath(const char* path, size_t len) {
+  const char* p = path;
+  const char* end = path + len;
+
+  // Skip what the slow path copies as is.
+  if (p != end && *p == '/')
+    ++p;
+  while (end - p > 3 && p[0] == '.' && p[1] == '.' && p[2] == '/')
+    p += 3;
+  if (p == end || end[-1] == '/')
+    return false;
+
+  // Byte i of the path may neither be a separator nor start with a dot if
+  // byte i - 1 is a separator.  The path start counts as one.
+  unsigned prev_separator = 1;
+  size_t separators = 0;
+#ifdef __SSE2__
+  for (; end - p >= 16; p += 16) {
+    unsigned separator = ByteMask(p, '/');
+#ifdef _WIN32
+    if (ByteMask(p, '\\'))
+      return false;
+#endif
+    unsigned after_separator = (separator << 1) | prev_separator;
+    if ((separator | ByteMask(p, '.')) & after_separator)
+      return false;
+    prev_separator = separator >> 15;
+    separators += std::bitset<16>(separator).count();
+  }
+#endif
+  for (; p != end; ++p) {
+#ifdef _WIN32
+    if (*p == '\\')
+      return false;
+#endif
+    bool separator = *p == '/';
+    if ((separator || *p == '.') && prev_separator)
+      return false;
+    prev_separator = separator;
+    separators += separator;
+  }
+
+  // Let the slow path complain about too many components.
+  return separators < kMaxPathComponents;
+}
+
+template <bool kVectorized>
+bool CanonicalizePathImpl(char* path, size_t* len, uint64_t* slash_bits,
+                          std::string* err) {
   if (*len == 0) {
     *err = "empty path";
     return false;
   }
 
-  const int kMaxPathComponents = 60;
+  if constexpr (kVectorized) {
+    if (IsCanonicalPath(path, *len)) {
+      *slash_bits = 0;
+      return true;
+    }
+  }
+
   char* components[kMaxPathComponents];
   int component_count = 0;
 
@@ -169,8 +268,17 @@ bool CanonicalizePath(char* path, size_t* len, uint64_t* slash_bits,
     components[component_count] = dst;
     ++component_count;
 
-    while (src != end && !IsPathSeparator(*src))
-      *dst++ = *src++;
+    if constexpr (kVectorized) {
+      // Until the first component is dropped, everything is in place.
+      const char* sep = FindPathSeparator(src, end);
+      if (dst != src)
+        memmove(dst, src, sep - src);
+      dst += sep - src;
+      src = sep;
+    } else {
+      while (src != end && !IsPathSeparator(*src))
+        *dst++ = *src++;
+    }
     *dst++ = *src++;  // Copy '/' or final \0 character as well.
   }
 
@@ -202,24 +310,46 @@ bool CanonicalizePath(char* path, size_t* len, uint64_t* slash_bits,
   return true;
 }
 
-static inline bool IsKnownShellSafeCharacter(char ch) {
-  if ('A' <= ch && ch <= 'Z')
-    return true;
-  if ('a' <= ch && ch <= 'z')
-    return true;
-  if ('0' <= ch && ch <= '9')
-    return true;
+}  // namespace
 
-  switch (ch) {
-  case '_':
-  case '+':
-  case '-':
-  case '.':
-  case '/':
-    return true;
-  default:
-    return false;
+bool CanonicalizePath(char* path, size_t* len, uint64_t* slash_bits,
+                      std::string* err) {
+  // WARNING: this function is performance-critical; please benchmark
+  // any changes you make to it.
+  METRIC_RECORD("canonicalize path");
+  return CanonicalizePathImpl<true>(path, len, slash_bits, err);
+}
+
+bool CanonicalizePathScalar(char* path, size_t* len, uint64_t* slash_bits,
+                            std::string* err) {
+  return CanonicalizePathImpl<false>(path, len, slash_bits, err);
+}
+
+namespace {
+
+/// Characters that never need quoting in a shell command, indexed by
+/// unsigned char.  Command lines are made of long runs of these, so a
+/// table lookup beats a chain of range checks.
+struct ShellSafeCharacters {
+  constexpr ShellSafeCharacters() : safe() {
+    for (int ch = 'A'; ch <= 'Z'; ++ch)
+      safe[ch] = true;
+    for (int ch = 'a'; ch <= 'z'; ++ch)
+      safe[ch] = true;
+    for (int ch = '0'; ch <= '9'; ++ch)
+      safe[ch] = true;
+    for (char ch : { '_', '+', '-', '.', '/' })
+      safe[static_cast<unsigned char>(ch)] = true;
   }
+  bool safe[256];
+};
+
+constexpr ShellSafeCharacters kShellSafeCharacters;
+
+}  // namespace
+
+static inline bool IsKnownShellSafeCharacter(char ch) {
+  return kShellSafeCharacters.safe[static_cast<unsigned char>(ch)];
 }
 
 static inline bool IsKnownWin32SafeCharacter(char ch) {
@@ -274,6 +404,65 @@ void GetShellEscapedString(const std::string& input, std::string* result) {
   result->push_back(kQuote);
 }
 
+bool SplitShellCommand(std::string_view command,
+                       std::vector<std::string>* args) {
+  // Reserved words and builtins that sh runs itself, or that behave
+  // differently from the programs of the same name.
+  static const char* const kShellWords[] = {
+    "!", "{", "}", "[[", "]]", ".", ":", "alias", "bg", "break", "case", "cd",
+    "command", "continue", "do", "done", "echo", "elif", "else", "esac", "eval",
+    "exec", "exit", "export", "fc", "fg", "fi", "for", "function", "getopts",
+    "hash", "if", "in", "jobs", "local", "printf", "read", "readonly", "return",
+    "select", "set", "shift", "source", "then", "time", "times", "trap", "type",
+    "ulimit", "umask", "unalias", "unset", "until", "wait", "while",
+  };
+
+  args->clear();
+  std::string arg;
+  bool in_arg = false;
+  for (size_t i = 0; i < command.size(); ++i) {
+    char ch = command[i];
+    if (ch == ' ' || ch == '\t') {
+      if (in_arg)
+        args->push_back(std::move(arg));
+      arg.clear();
+      in_arg = false;
+    } else if (ch == '\'') {
+      size_t end = command.find('\'', i + 1);
+      if (end == std::string_view::npos)
+        return false;
+      arg.append(command.substr(i + 1, end - i - 1));
+      in_arg = true;
+      i = end;
+    } else if (ch == '"') {
+      // Double quotes are only literal without expansions or escapes.
+      size_t end = command.find_first_of("\"$`\\", i + 1);
+      if (end == std::string_view::npos || command[end] != '"')
+        return false;
+      arg.append(command.substr(i + 1, end - i - 1));
+      in_arg = true;
+      i = end;
+    } else if (IsKnownShellSafeCharacter(ch) || ch == ',' || ch == ':' ||
+               ch == '=' || ch == '%' || ch == '@' ||
+               static_cast<unsigned char>(ch) >= 0x80) {
+      arg.push_back(ch);
+      in_arg = true;
+    } else {
+      return false;
+    }
+  }
+  if (in_arg)
+    args->push_back(std::move(arg));
+
+  if (args->empty() || args->front().find('=') != std::string::npos)
+    return false;
+  for (const char* word : kShellWords) {
+    if (args->front() == word)
+      return false;
+  }
+  return true;
+}
+
 void GetWin32EscapedString(const std::string& input, std::string* result) {
   assert(result);
   if (!StringNeedsWin32Escaping(input)) {
@@ -309,6 +498,23 @@ void GetWin32EscapedString(const std::string& input, std::string* result) {
   result->push_back(kQuote);
 }
 
+void AppendJSONString(std::string_view input, std::string* result) {
+  result->push_back('"');
+  for (char c : input) {
+    if (c == '"' || c == '\\') {
+      result->push_back('\\');
+      result->push_back(c);
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      result->append(buf);
+    } else {
+      result->push_back(c);
+    }
+  }
+  result->push_back('"');
+}
+
 int ReadFile(const std::string& path, std::string* contents, std::string* err) {
 #ifdef _WIN32
   // This makes a ninja run on a set of 1500 manifest files about 4% faster
@@ -442,6 +648,216 @@ int GetProcessorCount() {
 #endif
 }
 
+int GetAffinityProcessorCount() {
+#ifdef __linux__
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    return CPU_COUNT(&set);
+#endif
+  return 0;
+}
+
+#ifdef __linux__
+namespace {
+
+const char kCgroupRoot[] = "/sys/fs/cgroup/";
+
+/// Limits above this are the kernel's way of saying "no limit" in
+/// cgroup v1.
+const int64_t kCgroupV1Unlimited = int64_t(1) << 60;
+
+bool ReadSmallFile(const std::string& path, std::string* contents) {
+  std::string err;
+  return ReadFile(path, contents, &err) >= 0;
+}
+
+/// Call |f| for |dir| and all its parents up to the cgroup root.
+template <class F>
+void ForEachCgroupAncestor(std::string dir, F f) {
+  for (;;) {
+    f(dir);
+    if (dir.size() <= sizeof(kCgroupRoot) - 1)
+      break;
+    dir.pop_back();
+    dir.resize(dir.rfind('/') + 1);
+  }
+}
+
+/// Return the candidate cgroup v1 directories of this process for
+/// |controller|.  Depending on the setup the hierarchy is mounted at e.g.
+/// cpu,cpuacct/ or cpu/, and inside a container the path from
+/// /proc/self/cgroup may or may not be visible.
+std::vector<std::string> CgroupV1Directories(std::string_view controller) {
+  std::vector<std::string> dirs;
+  std::string contents;
+  if (!ReadSmallFile("/proc/self/cgroup", &contents))
+    return dirs;
+
+  // Lines look like "4:cpu,cpuacct:/user.slice".
+  std::string_view rest = contents;
+  while (!rest.empty()) {
+    size_t eol = rest.find('\n');
+    std::string_view line = rest.substr(0, eol);
+    rest = eol == std::string_view::npos ? std::string_view()
+                                         : rest.substr(eol + 1);
+    size_t first = line.find(':');
+    size_t second = line.find(':', first + 1);
+    if (first == std::string_view::npos || second == std::string_view::npos)
+      continue;
+    std::string_view controllers = line.substr(first + 1, second - first - 1);
+    std::string_view path = line.substr(second + 1);
+    bool found = false;
+    for (size_t pos = 0; pos <= controllers.size();) {
+      size_t end = controllers.find(',', pos);
+      if (end == std::string_view::npos)
+        end = controllers.size();
+      found |= controllers.substr(pos, end - pos) == controller;
+      pos = end + 1;
+    }
+    if (!found)
+      continue;
+    for (std::string_view mount : { controllers, controller }) {
+      std::string dir = std::string(kCgroupRoot).append(mount);
+      if (path != "/")
+        dirs.push_back(std::string(dir).append(path).append("/"));
+      dirs.push_back(dir + "/");
+    }
+  }
+  return dirs;
+}
+
+}  // namespace
+#endif
+
+std::string GetCgroupDirectory() {
+#ifdef __linux__
+  std::string contents;
+  if (!ReadSmallFile("/proc/self/cgroup", &contents))
+    return std::string();
+
+  // The unified hierarchy has the line "0::<path>".
+  std::string_view rest = contents;
+  while (!rest.empty()) {
+    size_t eol = rest.find('\n');
+    std::string_view line = rest.substr(0, eol);
+    rest = eol == std::string_view::npos ? std::string_view()
+                                         : rest.substr(eol + 1);
+    if (line.substr(0, 3) != "0::")
+      continue;
+    std::string_view path = line.substr(3);
+    if (!path.empty() && path[0] == '/')
+      path.remove_prefix(1);
+    std::string dir = kCgroupRoot;
+    dir.append(path);
+    if (dir.back() != '/')
+      dir.push_back('/');
+    std::string probe;
+    if (ReadSmallFile(dir + "cgroup.controllers", &probe))
+      return dir;
+  }
+#endif
+  return std::string();
+}
+
+double ParseCgroupCpuMax(std::string_view contents) {
+  size_t space = contents.find(' ');
+  if (space == std::string_view::npos)
+    return 0.0;
+  std::string max(contents.substr(0, space));
+  std::string period(contents.substr(space + 1));
+  char* end;
+  double quota = strtod(max.c_str(), &end);
+  if (end == max.c_str() || quota <= 0.0)
+    return 0.0;  // "max" means no quota.
+  double length = strtod(period.c_str(), &end);
+  if (end == period.c_str() || length <= 0.0)
+    return 0.0;
+  return quota / length;
+}
+
+double GetCgroupCpuQuota() {
+  double cpus = 0.0;
+#ifdef __linux__
+  auto apply = [&cpus](double quota) {
+    if (quota > 0.0 && (cpus == 0.0 || quota < cpus))
+      cpus = quota;
+  };
+
+  std::string dir = GetCgroupDirectory();
+  if (!dir.empty()) {
+    ForEachCgroupAncestor(dir, [&apply](const std::string& d) {
+      std::string contents;
+      if (ReadSmallFile(d + "cpu.max", &contents))
+        apply(ParseCgroupCpuMax(contents));
+    });
+    return cpus;
+  }
+
+  for (const std::string& d : CgroupV1Directories("cpu")) {
+    std::string quota, period;
+    if (ReadSmallFile(d + "cpu.cfs_quota_us", &quota) &&
+        ReadSmallFile(d + "cpu.cfs_period_us", &period)) {
+      // A quota of -1 means unlimited.
+      double q = strtod(quota.c_str(), nullptr);
+      double p = strtod(period.c_str(), nullptr);
+      if (q > 0.0 && p > 0.0)
+        apply(q / p);
+      break;
+    }
+  }
+#endif
+  return cpus;
+}
+
+int64_t GetCgroupMemoryLimit() {
+  int64_t limit = 0;
+#ifdef __linux__
+  auto apply = [&limit](int64_t value) {
+    if (value > 0 && (limit == 0 || value < limit))
+      limit = value;
+  };
+
+  std::string dir = GetCgroupDirectory();
+  if (!dir.empty()) {
+    ForEachCgroupAncestor(dir, [&apply](const std::string& d) {
+      // "max" parses as 0 and is ignored.
+      std::string contents;
+      if (ReadSmallFile(d + "memory.max", &contents))
+        apply(strtoll(contents.c_str(), nullptr, 10));
+    });
+    return limit;
+  }
+
+  for (const std::string& d : CgroupV1Directories("memory")) {
+    std::string contents;
+    if (ReadSmallFile(d + "memory.limit_in_bytes", &contents)) {
+      int64_t value = strtoll(contents.c_str(), nullptr, 10);
+      if (value < kCgroupV1Unlimited)
+        apply(value);
+      break;
+    }
+  }
+#endif
+  return limit;
+}
+
+int UsableProcessorCount(int processors, int affinity, double cpu_quota) {
+  int cpus = processors;
+  if (affinity > 0 && (cpus <= 0 || affinity < cpus))
+    cpus = affinity;
+  if (cpu_quota > 0.0) {
+    int quota = std::max(1, (int)std::ceil(cpu_quota));
+    if (cpus <= 0 || quota < cpus)
+      cpus = quota;
+  }
+  return cpus;
+}
+
+int GetUsableProcessorCount() {
+  return UsableProcessorCount(GetProcessorCount(), GetAffinityProcessorCount(),
+                              GetCgroupCpuQuota());
+}
+
 #if defined(_WIN32) || defined(__CYGWIN__)
 static double CalculateProcessorLoad(uint64_t idle_ticks,
                                      uint64_t total_ticks) {
@@ -536,6 +952,20 @@ double GetLoadAverage() {
 }
 #endif  // _WIN32
 
+void ParallelFor(size_t count, int threads, size_t min_range,
+                 const std::function<void(size_t begin, size_t end)>& fn) {
+  size_t ranges = std::max<size_t>(1, std::min<size_t>(
+      threads > 0 ? threads : 1, count / std::max<size_t>(min_range, 1)));
+  size_t range_size = (count + ranges - 1) / std::max<size_t>(ranges, 1);
+
+  std::vector<std::thread> workers;
+  for (size_t begin = range_size; begin < count; begin += range_size)
+    workers.emplace_back(fn, begin, std::min(count, begin + range_size));
+  fn(0, std::min(count, range_size));
+  for (std::thread& worker : workers)
+    worker.join();
+}
+
 std::string ElideMiddle(const std::string& str, size_t width) {
   const int kMargin = 3;  // Space for "...".
   std::string result = str;
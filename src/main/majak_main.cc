@@ -25,6 +25,7 @@
 #include <windows.h>
 #else
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #endif
 
@@ -32,12 +33,17 @@
 
 #include <flatbuffers/minireflect.h>
 
+#include <ninja/debug_flags.h>
 #include <ninja/manifest_parser.h>
 #include <ninja/ninja.h>
 #include <ninja/util.h>
 #include <ninja/version.h>
 #include <ninja/filesystem.h>
 
+#ifndef _WIN32
+#include <ninja/spawn_server.h>
+#endif
+
 using namespace ninja;
 
 namespace {
@@ -59,10 +65,20 @@ constexpr const char BUILD_USAGE[] =
     R"(usage: majak build [options] [targets...]
 
 options:
-  -j N     run N jobs in parallel [default derived from CPUs available]
+  -j N     run N jobs in parallel [default derived from CPUs and memory]
   -k N     keep going until N jobs fail (0 means infinity) [default=1]
   -n       dry run (don't run commands but act like they succeeded)
-  -v       show all command lines while building
+  -p       start commands while still scanning for dirty files
+  -P N     adapt jobs to keep CPU, memory and IO pressure below N%
+  --min-jobs=N    run at least N jobs in parallel under -P [default=1]
+  -v       show all command lines and scheduling decisions while building
+  --spawn-server  start commands from a helper process forked at startup
+  --rspfile-memfd pass response files in memory instead of on disk (Linux)
+  --completion-threads=N  finish commands on N threads besides the main loop
+  --event-fd=FD   write build events as JSON lines to file descriptor FD
+  --metrics-json=FILE  write timing percentiles to FILE as JSON
+  --metrics-prom=FILE  write timing percentiles to FILE for the Prometheus
+                       node exporter's textfile collector
 )";
 
 constexpr const char DEBUG_USAGE[] =
@@ -97,14 +113,41 @@ Command ChooseCommand(const CommandEntry (&commands)[N],
 
 int CommandBuild(const char* working_dir, int argc, char** argv) {
   BuildConfig config;
-  config.parallelism = GuessParallelism();
+  bool parallelism_given = false;
+  bool spawn_server = false;
+  const char* metrics_json = nullptr;
+  const char* metrics_prom = nullptr;
   optind = 1;
   int opt;
 
+  enum {
+    OPT_SPAWN_SERVER = 1,
+    OPT_RSPFILE_MEMFD,
+    OPT_COMPLETION_THREADS,
+    OPT_MIN_JOBS,
+    OPT_EVENT_FD,
+    OPT_METRICS_JSON,
+    OPT_METRICS_PROM
+  };
   constexpr option kLongOptions[] = { { "help", no_argument, nullptr, 'h' },
+                                      { "spawn-server", no_argument, nullptr,
+                                        OPT_SPAWN_SERVER },
+                                      { "rspfile-memfd", no_argument, nullptr,
+                                        OPT_RSPFILE_MEMFD },
+                                      { "completion-threads",
+                                        required_argument, nullptr,
+                                        OPT_COMPLETION_THREADS },
+                                      { "min-jobs", required_argument,
+                                        nullptr, OPT_MIN_JOBS },
+                                      { "event-fd", required_argument,
+                                        nullptr, OPT_EVENT_FD },
+                                      { "metrics-json", required_argument,
+                                        nullptr, OPT_METRICS_JSON },
+                                      { "metrics-prom", required_argument,
+                                        nullptr, OPT_METRICS_PROM },
                                       { nullptr, 0, nullptr, 0 } };
 
-  while ((opt = getopt_long(argc, argv, "j:k:nvh", kLongOptions, nullptr)) !=
+  while ((opt = getopt_long(argc, argv, "j:k:npP:vh", kLongOptions, nullptr)) !=
          -1) {
     switch (opt) {
     case 'j': {
@@ -113,6 +156,7 @@ int CommandBuild(const char* working_dir, int argc, char** argv) {
       if (*end != 0 || value <= 0)
         Fatal("invalid -j parameter");
       config.parallelism = value;
+      parallelism_given = true;
       break;
     }
     case 'k': {
@@ -130,8 +174,62 @@ int CommandBuild(const char* working_dir, int argc, char** argv) {
     case 'n':
       config.dry_run = true;
       break;
+    case 'p':
+      config.pipelined_scan = true;
+      break;
+    case 'P': {
+      char* end;
+      double value = strtod(optarg, &end);
+      if (*end != 0 || value < 0.0)
+        Fatal("invalid -P parameter");
+      config.max_pressure = value;
+      break;
+    }
     case 'v':
       config.verbosity = BuildConfig::VERBOSE;
+      g_tracing = true;
+      break;
+    case OPT_SPAWN_SERVER:
+      spawn_server = true;
+      break;
+    case OPT_RSPFILE_MEMFD:
+      config.rspfile_memfd = true;
+      break;
+    case OPT_COMPLETION_THREADS: {
+      char* end;
+      int value = strtol(optarg, &end, 10);
+      if (*end != 0 || value < 0)
+        Fatal("invalid --completion-threads parameter");
+      config.completion_threads = value;
+      break;
+    }
+    case OPT_MIN_JOBS: {
+      char* end;
+      int value = strtol(optarg, &end, 10);
+      if (*end != 0 || value <= 0)
+        Fatal("invalid --min-jobs parameter");
+      config.min_parallelism = value;
+      break;
+    }
+    case OPT_EVENT_FD: {
+      char* end;
+      int value = strtol(optarg, &end, 10);
+      if (*end != 0 || value < 0)
+        Fatal("invalid --event-fd parameter");
+#ifndef _WIN32
+      if (fcntl(value, F_GETFD) < 0)
+        Fatal("--event-fd %d: %s", value, strerror(errno));
+      // Commands mustn't keep the reader waiting for the end of the stream.
+      SetCloseOnExec(value);
+#endif
+      config.event_fd = value;
+      break;
+    }
+    case OPT_METRICS_JSON:
+      metrics_json = optarg;
+      break;
+    case OPT_METRICS_PROM:
+      metrics_prom = optarg;
       break;
     case 'h':
     default:
@@ -142,6 +240,9 @@ int CommandBuild(const char* working_dir, int argc, char** argv) {
   argv += optind;
   argc -= optind;
 
+  if (metrics_json || metrics_prom)
+    g_metrics = new Metrics;
+
   // If build.ninja is not found in the current working directory, walk up the
   // directory hierarchy until a build.ninja is found.
   std::string fallback_dir;
@@ -205,6 +306,12 @@ int CommandBuild(const char* working_dir, int argc, char** argv) {
     }
   }
 
+#ifndef _WIN32
+  // Fork the server before loading the manifest makes the process big.
+  if (spawn_server && !SpawnServer::StartGlobal())
+    Warning("can't start spawn server: %s", strerror(errno));
+#endif
+
   constexpr int kCycleLimit = 100;
   for (int cycle = 1; cycle <= kCycleLimit; ++cycle) {
     NinjaMain ninja("majak build", config);
@@ -225,6 +332,14 @@ int CommandBuild(const char* working_dir, int argc, char** argv) {
     if (!ninja.OpenBuildLog())
       exit(1);
 
+    // The default parallelism depends on the memory usage of commands in
+    // previous builds, so it can only be chosen once the log is loaded.
+    if (!parallelism_given) {
+      ParallelismGuess guess;
+      guess.Probe(&ninja.build_log_);
+      config.parallelism = guess.Compute();
+      TRACE("default parallelism: %s", guess.Describe());
+    }
     // Attempt to rebuild the manifest before building anything else
     if (ninja.RebuildManifest(kInputFile, &err)) {
       // In dry_run mode the regeneration will succeed without changing the
@@ -239,8 +354,8 @@ int CommandBuild(const char* working_dir, int argc, char** argv) {
     }
 
     int result = ninja.RunBuild(argc, argv, true);
-    if (g_metrics)
-      ninja.DumpMetrics();
+    if (!ninja.ExportMetrics(metrics_json, metrics_prom) && result == 0)
+      result = 1;
     exit(result);
   }
 
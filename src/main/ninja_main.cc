@@ -15,6 +15,7 @@
 #include <ninja/ninja_config.h>
 
 #include <limits.h>
+#include <string.h>
 
 #ifdef _WIN32
 #include <direct.h>
@@ -26,11 +27,18 @@
 
 #include <getopt.h>
 
+#include <algorithm>
+
+#include <ninja/debug_flags.h>
 #include <ninja/filesystem.h>
 #include <ninja/manifest_parser.h>
 #include <ninja/ninja.h>
 #include <ninja/version.h>
 
+#ifndef _WIN32
+#include <ninja/spawn_server.h>
+#endif
+
 using namespace ninja;
 
 namespace {
@@ -52,8 +60,21 @@ void Usage(const BuildConfig& config) {
       "available]\n"
       "  -k N     keep going until N jobs fail (0 means infinity) [default=1]\n"
       "  -l N     do not start new jobs if the load average is greater than N\n"
+      "  -P N     adapt jobs to keep CPU, memory and IO pressure below N%%\n"
+      "  --min-jobs=N  run at least N jobs in parallel under -P "
+      "[default=1]\n"
       "  -n       dry run (don't run commands but act like they succeeded)\n"
+      "  -p       start commands while still scanning for dirty files\n"
       "  -v       show all command lines while building\n"
+      "  --spawn-server  start commands from a helper process forked at "
+      "startup\n"
+      "  --rspfile-memfd pass response files in memory instead of on disk "
+      "(Linux)\n"
+      "  --completion-threads=N  finish commands on N threads besides the "
+      "main loop\n"
+      "  --metrics-json=FILE  write timing percentiles to FILE as JSON\n"
+      "  --metrics-prom=FILE  write timing percentiles to FILE for the\n"
+      "                       Prometheus node exporter's textfile collector\n"
       "\n"
       "  -d MODE  enable debugging (use '-d list' to list modes)\n"
       "  -t TOOL  run a subtool (use '-t list' to list subtools)\n"
@@ -67,15 +88,35 @@ void Usage(const BuildConfig& config) {
 int ReadFlags(int* argc, char*** argv, Options* options, BuildConfig* config) {
   config->parallelism = GuessParallelism();
 
-  enum { OPT_VERSION = 1 };
+  enum {
+    OPT_VERSION = 1,
+    OPT_SPAWN_SERVER,
+    OPT_RSPFILE_MEMFD,
+    OPT_COMPLETION_THREADS,
+    OPT_MIN_JOBS,
+    OPT_METRICS_JSON,
+    OPT_METRICS_PROM
+  };
   const option kLongOptions[] = { { "help", no_argument, nullptr, 'h' },
                                   { "version", no_argument, nullptr,
                                     OPT_VERSION },
+                                  { "spawn-server", no_argument, nullptr,
+                                    OPT_SPAWN_SERVER },
+                                  { "rspfile-memfd", no_argument, nullptr,
+                                    OPT_RSPFILE_MEMFD },
+                                  { "completion-threads", required_argument,
+                                    nullptr, OPT_COMPLETION_THREADS },
+                                  { "min-jobs", required_argument, nullptr,
+                                    OPT_MIN_JOBS },
+                                  { "metrics-json", required_argument,
+                                    nullptr, OPT_METRICS_JSON },
+                                  { "metrics-prom", required_argument,
+                                    nullptr, OPT_METRICS_PROM },
                                   { nullptr, 0, nullptr, 0 } };
 
   int opt;
   while (!options->tool &&
-         (opt = getopt_long(*argc, *argv, "d:f:j:k:l:nt:vw:C:h", kLongOptions,
+         (opt = getopt_long(*argc, *argv, "d:f:j:k:l:npP:t:vw:C:h", kLongOptions,
                             nullptr)) != -1) {
     switch (opt) {
     case 'd':
@@ -91,6 +132,7 @@ int ReadFlags(int* argc, char*** argv, Options* options, BuildConfig* config) {
       if (*end != 0 || value <= 0)
         Fatal("invalid -j parameter");
       config->parallelism = value;
+      options->parallelism_given = true;
       break;
     }
     case 'k': {
@@ -116,6 +158,17 @@ int ReadFlags(int* argc, char*** argv, Options* options, BuildConfig* config) {
     case 'n':
       config->dry_run = true;
       break;
+    case 'p':
+      config->pipelined_scan = true;
+      break;
+    case 'P': {
+      char* end;
+      double value = strtod(optarg, &end);
+      if (*end != 0 || value < 0.0)
+        Fatal("invalid -P parameter");
+      config->max_pressure = value;
+      break;
+    }
     case 't':
       options->tool = ChooseTool(optarg);
       if (!options->tool)
@@ -134,6 +187,34 @@ int ReadFlags(int* argc, char*** argv, Options* options, BuildConfig* config) {
     case OPT_VERSION:
       printf("%s\n", kNinjaVersion);
       return 0;
+    case OPT_SPAWN_SERVER:
+      options->spawn_server = true;
+      break;
+    case OPT_RSPFILE_MEMFD:
+      config->rspfile_memfd = true;
+      break;
+    case OPT_COMPLETION_THREADS: {
+      char* end;
+      int value = strtol(optarg, &end, 10);
+      if (*end != 0 || value < 0)
+        Fatal("invalid --completion-threads parameter");
+      config->completion_threads = value;
+      break;
+    }
+    case OPT_MIN_JOBS: {
+      char* end;
+      int value = strtol(optarg, &end, 10);
+      if (*end != 0 || value <= 0)
+        Fatal("invalid --min-jobs parameter");
+      config->min_parallelism = value;
+      break;
+    }
+    case OPT_METRICS_JSON:
+      options->metrics_json = optarg;
+      break;
+    case OPT_METRICS_PROM:
+      options->metrics_prom = optarg;
+      break;
     case 'h':
     default:
       Usage(*config);
@@ -161,6 +242,11 @@ int ReadFlags(int* argc, char*** argv, Options* options, BuildConfig* config) {
   if (exit_code >= 0)
     exit(exit_code);
 
+  // Only -d stats prints the table; exporting just needs the recording.
+  bool print_metrics = g_metrics != nullptr;
+  if (!g_metrics && (options.metrics_json || options.metrics_prom))
+    g_metrics = new Metrics;
+
   if (options.working_dir) {
     // The formatting of this string, complete with funny quotes, is
     // so Emacs can properly identify that the cwd has changed for
@@ -176,6 +262,12 @@ int ReadFlags(int* argc, char*** argv, Options* options, BuildConfig* config) {
     }
   }
 
+#ifndef _WIN32
+  // Fork the server before loading the manifest makes the process big.
+  if (options.spawn_server && !SpawnServer::StartGlobal())
+    Warning("can't start spawn server: %s", strerror(errno));
+#endif
+
   if (options.tool && options.tool->when == Tool::RUN_AFTER_FLAGS) {
     // None of the RUN_AFTER_FLAGS actually use a NinjaMain, but it's needed
     // by other tools.
@@ -211,6 +303,14 @@ int ReadFlags(int* argc, char*** argv, Options* options, BuildConfig* config) {
     if (!ninja.OpenBuildLog())
       exit(1);
 
+    // Now that the build log is loaded, refine the default parallelism
+    // with the memory usage of previous builds.
+    if (!options.parallelism_given) {
+      ParallelismGuess guess;
+      guess.Probe(&ninja.build_log_);
+      config.parallelism = guess.Compute();
+      TRACE("default parallelism: %s", guess.Describe());
+    }
     if (options.tool && options.tool->when == Tool::RUN_AFTER_LOGS)
       exit((ninja.*options.tool->func)(&options, argc, argv));
 
@@ -228,8 +328,11 @@ int ReadFlags(int* argc, char*** argv, Options* options, BuildConfig* config) {
     }
 
     int result = ninja.RunBuild(argc, argv);
-    if (g_metrics)
+    if (print_metrics)
       ninja.DumpMetrics();
+    if (!ninja.ExportMetrics(options.metrics_json, options.metrics_prom) &&
+        result == 0)
+      result = 1;
     exit(result);
   }
 
@@ -0,0 +1,143 @@
+// Copyright 2018 Frank Benkstein. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <ninja/build_events.h>
+
+#include <stdio.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include <memory>
+#include <thread>
+
+#include "test.h"
+
+using namespace ninja;
+
+namespace {
+
+struct BuildEventStreamTest : public StateTestWithBuiltinRules {
+  void SetUp() override {
+    file_ = tmpfile();
+    ASSERT_TRUE(file_);
+  }
+
+  void TearDown() override { fclose(file_); }
+
+  /// Everything written to |file_|.
+  std::string Contents() {
+    std::string contents;
+    rewind(file_);
+    char buf[4096];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), file_)) > 0)
+      contents.append(buf, len);
+    return contents;
+  }
+
+  FILE* file_;
+};
+
+TEST_F(BuildEventStreamTest, Events) {
+  AssertParse(&state_, "build out: cat in\n");
+  Edge* edge = GetNode("out")->in_edge();
+
+  {
+    BuildEventStream events(fileno(file_));
+    events.PlanHasTotalEdges(1);
+    events.EdgeStarted(edge, 5);
+    CommandRunner::Result result;
+    result.edge = edge;
+    result.status = ExitFailure;
+    result.output = "oops\n";
+    result.max_rss = 1024;
+    events.EdgeFinished(result, true, 5, 12);
+    events.BuildFinished(false, 13);
+  }
+
+  char expected[512];
+  snprintf(expected, sizeof(expected),
+           "{\"event\":\"plan\",\"total\":1}\n"
+           "{\"event\":\"edge_started\",\"id\":%d,\"time_ms\":5,"
+           "\"rule\":\"cat\",\"outputs\":[\"out\"]}\n"
+           "{\"event\":\"edge_finished\",\"id\":%d,\"start_ms\":5,"
+           "\"end_ms\":12,\"status\":\"failure\",\"output_bytes\":5,"
+           "\"max_rss\":1024,\"restat_cleaned\":true}\n"
+           "{\"event\":\"build_finished\",\"time_ms\":13,\"success\":false,"
+           "\"dropped\":0}\n",
+           edge->id(), edge->id());
+  EXPECT_EQ(expected, Contents());
+}
+
+TEST_F(BuildEventStreamTest, RepeatedTotal) {
+  {
+    BuildEventStream events(fileno(file_));
+    events.PlanHasTotalEdges(3);
+    events.PlanHasTotalEdges(3);
+    events.PlanHasTotalEdges(2);
+  }
+  EXPECT_EQ("{\"event\":\"plan\",\"total\":3}\n"
+            "{\"event\":\"plan\",\"total\":2}\n",
+            Contents());
+}
+
+TEST_F(BuildEventStreamTest, EscapesStrings) {
+  AssertParse(&state_, "build a\"b\\c: cat in\n");
+  Edge* edge = state_.LookupNode("a\"b\\c")->in_edge();
+  {
+    BuildEventStream events(fileno(file_));
+    events.EdgeStarted(edge, 0);
+  }
+  EXPECT_NE(std::string::npos,
+            Contents().find("\"outputs\":[\"a\\\"b\\\\c\"]"));
+}
+
+#ifndef _WIN32
+TEST(BuildEventStream, DropsWhenReaderFallsBehind) {
+  State state;
+  AssertParse(&state, "rule cat\n  command = cat $in > $out\n");
+  std::string manifest = "build " + std::string(1000, 'x') + ": cat in\n";
+  AssertParse(&state, manifest.c_str());
+  Edge* edge = state.edges_.back().get();
+
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  std::unique_ptr<BuildEventStream> events(new BuildEventStream(fds[1]));
+  // Nobody reads yet, so the pipe and then the stream fill up.
+  for (int i = 0; i < 4096; ++i)
+    events->EdgeStarted(edge, i);
+  events->BuildFinished(true, 1);
+
+  std::string contents;
+  std::thread reader([&contents, fd = fds[0]] {
+    char buf[4096];
+    ssize_t len;
+    while ((len = read(fd, buf, sizeof(buf))) > 0)
+      contents.append(buf, len);
+  });
+  // Close the write end once everything is written.
+  events.reset();
+  close(fds[1]);
+  reader.join();
+  close(fds[0]);
+
+  size_t last = contents.rfind("{\"event\":\"build_finished\"");
+  ASSERT_NE(std::string::npos, last);
+  EXPECT_EQ(std::string::npos, contents.find("\"dropped\":0}", last));
+  EXPECT_LT(contents.size(), 4096u * 1000u);
+}
+#endif
+
+}  // namespace
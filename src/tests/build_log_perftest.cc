@@ -114,7 +114,6 @@ void BM_BuildLogLoad(benchmark::State& state) {
   std::string err;
   fs::error_code ec;
   fs::remove(kTestFilename, ec);
-  State ninja_state;
 
   if (!WriteTestData(&err)) {
     state.SkipWithError(("Failed to write test data: " + err).c_str());
@@ -123,14 +122,73 @@ void BM_BuildLogLoad(benchmark::State& state) {
 
   {
     // Read once to warm up disk cache.
+    State ninja_state;
+    BuildLog log;
+    if (!log.Load(kTestFilename, &ninja_state, &err)) {
+      state.SkipWithError(("Failed to load test data: " + err).c_str());
+      return;
+    }
+  }
+
+  for (auto _ : state) {
+    // Loading assigns ids to nodes, so every load needs a fresh state.
+    State ninja_state;
+    auto start = now();
     BuildLog log;
+    log.set_load_threads(state.range(0));
     if (!log.Load(kTestFilename, &ninja_state, &err)) {
       state.SkipWithError(("Failed to load test data: " + err).c_str());
       return;
     }
+    state.SetIterationTime(now() - start);
+  }
+
+  fs::remove(kTestFilename, ec);
+}
+/// The argument is the number of threads records are verified on.
+BENCHMARK(BM_BuildLogLoad)
+    ->Unit(benchmark::kMillisecond)
+    ->UseManualTime()
+    ->Arg(1)
+    ->Arg(2)
+    ->Arg(4)
+    ->Arg(8);
+
+/// Header-heavy deps: each of 10000 objects includes 200 of 5000 headers,
+/// mostly in runs like a real include tree.
+void BM_BuildLogLoadDeps(benchmark::State& state) {
+  const int kNumObjects = 10000;
+  const int kNumHeaders = 5000;
+  const int kHeadersPerObject = 200;
+  std::string err;
+  fs::error_code ec;
+  fs::remove(kTestFilename, ec);
+
+  {
+    State ninja_state;
+    BuildLog log;
+    NoDeadPaths no_dead_paths;
+    if (!log.OpenForWrite(kTestFilename, no_dead_paths, &err)) {
+      state.SkipWithError(err.c_str());
+      return;
+    }
+    std::vector<Node*> deps;
+    for (int i = 0; i < kNumObjects; ++i) {
+      deps.clear();
+      for (int h = 0; h < kHeadersPerObject; ++h) {
+        int header = (i * 37 + h + (h / 20) * 211) % kNumHeaders;
+        deps.push_back(ninja_state.GetNode(
+            "include/" + std::to_string(header) + ".h", 0));
+      }
+      log.RecordDeps(
+          ninja_state.GetNode("obj/" + std::to_string(i) + ".o", 0), 1,
+          deps);
+    }
+    log.Close();
   }
 
   for (auto _ : state) {
+    State ninja_state;
     auto start = now();
     BuildLog log;
     if (!log.Load(kTestFilename, &ninja_state, &err)) {
@@ -139,9 +197,147 @@ void BM_BuildLogLoad(benchmark::State& state) {
     }
     state.SetIterationTime(now() - start);
   }
+  state.counters["file_bytes"] = fs::file_size(kTestFilename, ec);
+
+  fs::remove(kTestFilename, ec);
+}
+BENCHMARK(BM_BuildLogLoadDeps)->Unit(benchmark::kMillisecond)->UseManualTime();
+
+/// Load a recompacted deps log of as many objects as the first argument,
+/// each with 200 of 5000 headers, and look up the deps of one object.  The
+/// second argument enables lazy loading.
+void BM_BuildLogLoadRecompacted(benchmark::State& state) {
+  const int kNumObjects = state.range(0);
+  const int kNumHeaders = 5000;
+  const int kHeadersPerObject = 200;
+  std::string err;
+  fs::error_code ec;
+  fs::remove(kTestFilename, ec);
+
+  std::string manifest = "rule cc\n  command = cc $out\n  deps = gcc\n";
+  for (int i = 0; i < kNumObjects; ++i)
+    manifest += "build obj/" + std::to_string(i) + ".o: cc\n";
+  auto parse = [&manifest, &err](State* ninja_state) {
+    ManifestParser parser(ninja_state, nullptr);
+    return parser.ParseTest(manifest, &err);
+  };
+
+  NoDeadPaths no_dead_paths;
+  {
+    State ninja_state;
+    BuildLog log;
+    if (!parse(&ninja_state) ||
+        !log.OpenForWrite(kTestFilename, no_dead_paths, &err)) {
+      state.SkipWithError(err.c_str());
+      return;
+    }
+    std::vector<Node*> deps;
+    for (int i = 0; i < kNumObjects; ++i) {
+      deps.clear();
+      for (int h = 0; h < kHeadersPerObject; ++h) {
+        int header = (i * 37 + h + (h / 20) * 211) % kNumHeaders;
+        deps.push_back(ninja_state.GetNode(
+            "include/" + std::to_string(header) + ".h", 0));
+      }
+      log.RecordDeps(ninja_state.edges_[i]->outputs_[0], 1, deps);
+    }
+    log.Close();
+  }
+  {
+    State ninja_state;
+    BuildLog log;
+    if (!parse(&ninja_state) || !log.Load(kTestFilename, &ninja_state, &err) ||
+        !log.Recompact(kTestFilename, no_dead_paths, &err)) {
+      state.SkipWithError(err.c_str());
+      return;
+    }
+  }
+
+  for (auto _ : state) {
+    State ninja_state;
+    parse(&ninja_state);
+    auto start = now();
+    BuildLog log;
+    log.set_lazy_load(state.range(1));
+    if (!log.Load(kTestFilename, &ninja_state, &err) ||
+        !log.GetDeps(ninja_state.edges_[kNumObjects / 2]->outputs_[0])) {
+      state.SkipWithError(("Failed to load test data: " + err).c_str());
+      return;
+    }
+    state.SetIterationTime(now() - start);
+  }
+  state.counters["file_bytes"] = fs::file_size(kTestFilename, ec);
+
+  fs::remove(kTestFilename, ec);
+}
+BENCHMARK(BM_BuildLogLoadRecompacted)
+    ->Unit(benchmark::kMillisecond)
+    ->UseManualTime()
+    ->Args({ 1000, 0 })
+    ->Args({ 1000, 1 })
+    ->Args({ 10000, 0 })
+    ->Args({ 10000, 1 });
+
+/// Size of the log written for edges with as many outputs as the argument,
+/// as for code generators.
+void BM_BuildLogMultiOutputSize(benchmark::State& state) {
+  const int kNumEdges = 1000;
+  std::string err;
+  fs::error_code ec;
+
+  State ninja_state;
+  ManifestParser parser(&ninja_state, nullptr);
+  std::string manifest = "rule gen\n  command = gen $out\n";
+  for (int i = 0; i < kNumEdges; ++i) {
+    manifest += "build";
+    for (int o = 0; o < state.range(0); ++o)
+      manifest += " gen/" + std::to_string(i) + "/out" + std::to_string(o);
+    manifest += ": gen\n";
+  }
+  if (!parser.ParseTest(manifest, &err)) {
+    state.SkipWithError(err.c_str());
+    return;
+  }
+
+  uintmax_t size = 0;
+  uintmax_t rebuild_size = 0;
+  for (auto _ : state) {
+    // Every log assigns path ids anew.
+    fs::remove(kTestFilename, ec);
+    for (auto& edge : ninja_state.edges_) {
+      for (Node* node : edge->outputs_)
+        node->set_id(-1);
+    }
+    BuildLog log;
+    NoDeadPaths no_dead_paths;
+    if (!log.OpenForWrite(kTestFilename, no_dead_paths, &err)) {
+      state.SkipWithError(err.c_str());
+      return;
+    }
+    for (int i = 0; i < kNumEdges; ++i)
+      log.RecordCommand(ninja_state.edges_[i].get(), 100 * i, 100 * i + 1);
+    log.Close();
+    size = fs::file_size(kTestFilename, ec);
+
+    // Rebuilds only append edge records, the paths already have ids.
+    if (!log.OpenForWrite(kTestFilename, no_dead_paths, &err)) {
+      state.SkipWithError(err.c_str());
+      return;
+    }
+    for (int i = 0; i < kNumEdges; ++i)
+      log.RecordCommand(ninja_state.edges_[i].get(), 100 * i, 100 * i + 2);
+    log.Close();
+    rebuild_size = fs::file_size(kTestFilename, ec) - size;
+  }
+  state.counters["bytes_per_edge"] = size / kNumEdges;
+  state.counters["rebuild_bytes_per_edge"] = rebuild_size / kNumEdges;
 
   fs::remove(kTestFilename, ec);
 }
-BENCHMARK(BM_BuildLogLoad)->Unit(benchmark::kMillisecond)->UseManualTime();
+BENCHMARK(BM_BuildLogMultiOutputSize)
+    ->Unit(benchmark::kMillisecond)
+    ->Arg(1)
+    ->Arg(10)
+    ->Arg(50);
 
 BENCHMARK_MAIN();
@@ -17,6 +17,7 @@
 #include "test.h"
 
 #include <ninja/filesystem.h>
+#include <ninja/graph.h>
 #include <ninja/util.h>
 
 #include <flatbuffers/flatbuffers.h>
@@ -59,11 +60,12 @@ TEST_F(BuildLogTest, WriteRead) {
   EXPECT_TRUE(log1.OpenForWrite(kTestFilename, *this, &err));
   ASSERT_EQ("", err);
   log1.RecordCommand(state_.edges_[0].get(), 15, 18);
-  log1.RecordCommand(state_.edges_[1].get(), 20, 25);
+  log1.RecordCommand(state_.edges_[1].get(), 20, 25, 0, 1 << 20);
   log1.Close();
 
+  State state2;
   BuildLog log2;
-  EXPECT_TRUE(log2.Load(kTestFilename, &state_, &err));
+  EXPECT_TRUE(log2.Load(kTestFilename, &state2, &err));
   ASSERT_EQ("", err);
 
   ASSERT_EQ(2u, log1.entries().size());
@@ -75,6 +77,8 @@ TEST_F(BuildLogTest, WriteRead) {
   ASSERT_TRUE(*e1 == *e2);
   ASSERT_EQ(15, e1->start_time);
   ASSERT_EQ("out", e1->output);
+  ASSERT_EQ(0u, e2->max_rss);
+  ASSERT_EQ(1u << 20, log2.LookupByOutput("mid")->max_rss);
 }
 
 TEST_F(BuildLogTest, FirstWriteAddsSignature) {
@@ -210,9 +214,10 @@ TEST_F(BuildLogTest, Truncate) {
 
     ASSERT_TRUE(Truncate(kTestFilename, size, &err));
 
+    State state3;
     BuildLog log3;
     err.clear();
-    ASSERT_TRUE(log3.Load(kTestFilename, &state_, &err) || !err.empty());
+    ASSERT_TRUE(log3.Load(kTestFilename, &state3, &err) || !err.empty());
   }
 }
 
@@ -277,6 +282,260 @@ TEST_F(BuildLogTest, MultiTargetEdge) {
   ASSERT_EQ(22, e2->end_time);
 }
 
+TEST_F(BuildLogTest, MultiTargetEdgeSingleRecord) {
+  AssertParse(&state_, "build out out.d out.h: cat\n");
+
+  std::string err;
+  {
+    BuildLog log;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+    ASSERT_EQ("", err);
+    log.RecordCommand(state_.edges_[0].get(), 21, 22);
+    log.Close();
+  }
+
+  // The version, one path per output and a single edge record.
+  std::string contents;
+  ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(contents.data());
+  std::vector<log::Entry> types;
+  for (size_t offset = 0; offset < contents.size();) {
+    auto* entry_holder =
+        flatbuffers::GetSizePrefixedRoot<log::EntryHolder>(data + offset);
+    types.push_back(entry_holder->entry_type());
+    offset += flatbuffers::GetPrefixedSize(data + offset) +
+              sizeof(flatbuffers::uoffset_t);
+  }
+  ASSERT_EQ(5u, types.size());
+  EXPECT_EQ(log::Entry::PathEntry, types[1]);
+  EXPECT_EQ(log::Entry::EdgeEntry, types[4]);
+
+  State state;
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &state, &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(3u, log.entries().size());
+  BuildLog::LogEntry* e = log.LookupByOutput("out.h");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(21, e->start_time);
+  EXPECT_EQ(22, e->end_time);
+  BuildLog::LogEntry* e2 = log.LookupByOutput("out");
+  ASSERT_TRUE(e2);
+  EXPECT_EQ(e->command_hash, e2->command_hash);
+  EXPECT_EQ(e->start_time, e2->start_time);
+  EXPECT_EQ(e->end_time, e2->end_time);
+  EXPECT_EQ(e->mtime, e2->mtime);
+  EXPECT_EQ(e->max_rss, e2->max_rss);
+  // The State doesn't know the outputs, so loading didn't add them.
+  EXPECT_EQ(0, state.node_count());
+}
+
+TEST_F(BuildLogTest, UpgradeVersion2) {
+  std::string err;
+  {
+    // A version 2 log stores one BuildEntry per output.
+    FILE* f = fopen(kTestFilename, "wb");
+    flatbuffers::FlatBufferBuilder fbb;
+    auto version_offset = log::CreateVersionEntry(fbb, 2);
+    fbb.FinishSizePrefixed(log::CreateEntryHolder(
+        fbb, log::Entry::VersionEntry, version_offset.Union()));
+    fwrite(fbb.GetBufferPointer(), 1, fbb.GetSize(), f);
+    BuildLog log;
+    log.WriteEntry(
+        f, LogEntry("out", BuildLog::HashCommand("command"), 1, 2, 3));
+    log.WriteEntry(
+        f, LogEntry("out.d", BuildLog::HashCommand("command"), 1, 2, 3));
+    fclose(f);
+  }
+
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &state_, &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(2u, log.entries().size());
+
+  // Opening the log upgrades it to the current version.
+  EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  log.Close();
+
+  State state;
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &state, &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(2u, log2.entries().size());
+  BuildLog::LogEntry* e = log2.LookupByOutput("out.d");
+  ASSERT_TRUE(e);
+  ASSERT_NO_FATAL_FAILURE(AssertHash("command", e->command_hash));
+  EXPECT_EQ(3, e->mtime);
+}
+
+TEST_F(BuildLogTest, UpgradeCommandHash) {
+  AssertParse(&state_,
+              "build out: cat in\n"
+              "build changed: cat in\n");
+  std::string err;
+  {
+    // Logs before version 6 hash commands with MurmurHash64A.
+    FILE* f = fopen(kTestFilename, "wb");
+    flatbuffers::FlatBufferBuilder fbb;
+    auto version_offset = log::CreateVersionEntry(fbb, 2);
+    fbb.FinishSizePrefixed(log::CreateEntryHolder(
+        fbb, log::Entry::VersionEntry, version_offset.Union()));
+    fwrite(fbb.GetBufferPointer(), 1, fbb.GetSize(), f);
+    std::string command = GetNode("out")->in_edge()->EvaluateCommand(true);
+    BuildLog log;
+    log.WriteEntry(f, LogEntry("out",
+                               MurmurHash64A(command.data(), command.size()),
+                               1, 2, 3));
+    log.WriteEntry(f, LogEntry("changed", MurmurHash64A("old", 3), 1, 2, 3));
+    fclose(f);
+  }
+
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &state_, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e = log.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(GetNode("out")->in_edge()->HashCommand(), e->command_hash);
+  e = log.LookupByOutput("changed");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(MurmurHash64A("old", 3), e->command_hash);
+}
+
+TEST_F(BuildLogTest, MisalignedRecords) {
+  std::string err;
+  // Offsets of edge records modulo 8 that were seen.  Both are needed for
+  // some of them to be misaligned in memory, wherever the log is read to.
+  bool offsets_seen[2] = { false, false };
+  {
+    // Logs before version 7 don't pad records, so edge records with 64 bit
+    // fields may follow a path record at any 4 byte boundary.
+    FILE* f = fopen(kTestFilename, "wb");
+    flatbuffers::FlatBufferBuilder fbb;
+    auto write = [&fbb, f](log::Entry type, flatbuffers::Offset<void> entry) {
+      fbb.FinishSizePrefixed(log::CreateEntryHolder(fbb, type, entry));
+      fwrite(fbb.GetBufferPointer(), 1, fbb.GetSize(), f);
+      fbb.Clear();
+    };
+    write(log::Entry::VersionEntry, log::CreateVersionEntry(fbb, 6).Union());
+    for (uint32_t id = 0; id < 8; ++id) {
+      std::string path(id + 1, 'a');
+      write(log::Entry::PathEntry,
+            log::CreatePathEntry(fbb, ~id, fbb.CreateString(path)).Union());
+      offsets_seen[ftell(f) % 8 / 4] = true;
+      write(log::Entry::EdgeEntry,
+            log::CreateEdgeEntry(fbb, fbb.CreateVector(&id, 1), id, 1, 2,
+                                 int64_t(1) << 40, uint64_t(1) << 33)
+                .Union());
+    }
+    fclose(f);
+  }
+  ASSERT_TRUE(offsets_seen[0] && offsets_seen[1]);
+
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &state_, &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(8u, log.entries().size());
+  for (uint32_t id = 0; id < 8; ++id) {
+    BuildLog::LogEntry* e = log.LookupByOutput(std::string(id + 1, 'a'));
+    ASSERT_TRUE(e);
+    EXPECT_EQ(id, e->command_hash);
+    EXPECT_EQ(int64_t(1) << 40, e->mtime);
+    EXPECT_EQ(uint64_t(1) << 33, e->max_rss);
+  }
+}
+
+TEST_F(BuildLogTest, LazyLoad) {
+  const char kManifest[] =
+      "rule cc\n"
+      "  command = cc $in\n"
+      "  deps = gcc\n"
+      "build out1.o: cc in1.c\n"
+      "build out2.o: cc in2.c\n";
+  AssertParse(&state_, kManifest);
+
+  std::string err;
+  {
+    BuildLog log;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+    ASSERT_EQ("", err);
+    log.RecordCommand(state_.edges_[0].get(), 1, 2);
+    log.RecordCommand(state_.edges_[1].get(), 3, 4);
+    log.RecordDeps(GetNode("out1.o"), 2,
+                   std::vector<Node*>{ GetNode("a.h"), GetNode("b.h") });
+    log.RecordDeps(GetNode("out2.o"), 4, std::vector<Node*>{ GetNode("b.h") });
+    log.Close();
+  }
+
+  {
+    // Recompaction indexes the log.
+    State state;
+    AssertParse(&state, kManifest);
+    BuildLog log;
+    EXPECT_TRUE(log.Load(kTestFilename, &state, &err));
+    EXPECT_TRUE(log.Recompact(kTestFilename, *this, &err));
+    ASSERT_EQ("", err);
+  }
+
+  State state1;
+  AssertParse(&state1, kManifest);
+  BuildLog log1;
+  log1.set_lazy_load(true);
+  EXPECT_TRUE(log1.Load(kTestFilename, &state1, &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(0u, log1.entries().size());
+
+  BuildLog::LogEntry* e = log1.LookupByOutput("out2.o");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(3, e->start_time);
+  EXPECT_EQ(1u, log1.entries().size());
+  EXPECT_FALSE(log1.LookupByOutput("in1.c"));
+
+  BuildLog::Deps* deps = log1.GetDeps(state1.LookupNode("out1.o"));
+  ASSERT_TRUE(deps);
+  ASSERT_EQ(2, deps->node_count);
+  EXPECT_EQ("b.h", deps->nodes[1]->path());
+
+  // New records reuse the ids of the snapshot.
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  std::vector<Node*> out1_deps(deps->nodes, deps->nodes + deps->node_count);
+  EXPECT_TRUE(log1.RecordDeps(state1.LookupNode("out1.o"), 2, out1_deps));
+  EXPECT_TRUE(log1.RecordDeps(state1.LookupNode("out2.o"), 5,
+                              std::vector<Node*>{ state1.LookupNode("a.h") }));
+  log1.Close();
+
+  State state2;
+  AssertParse(&state2, kManifest);
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &state2, &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(4u, log2.nodes().size());
+  EXPECT_EQ(2u, log2.entries().size());
+  deps = log2.GetDeps(state2.LookupNode("out2.o"));
+  ASSERT_TRUE(deps);
+  EXPECT_EQ(5, deps->mtime);
+  ASSERT_EQ(1, deps->node_count);
+  EXPECT_EQ("a.h", deps->nodes[0]->path());
+  deps = log2.GetDeps(state2.LookupNode("out1.o"));
+  ASSERT_TRUE(deps);
+  EXPECT_EQ(2, deps->node_count);
+
+  // A lazily loaded log can still be loaded completely.
+  State state3;
+  AssertParse(&state3, kManifest);
+  BuildLog log3;
+  log3.set_lazy_load(true);
+  EXPECT_TRUE(log3.Load(kTestFilename, &state3, &err));
+  ASSERT_EQ("", err);
+  log3.MaterializeAll();
+  EXPECT_EQ(4u, log3.nodes().size());
+  EXPECT_EQ(2u, log3.entries().size());
+  deps = log3.GetDeps(state3.LookupNode("out2.o"));
+  ASSERT_TRUE(deps);
+  EXPECT_EQ(5, deps->mtime);
+}
+
 struct BuildLogRecompactTest : public BuildLogTest {
   virtual bool IsPathDead(std::string_view s) const { return s == "out2"; }
 };
@@ -298,8 +557,9 @@ TEST_F(BuildLogRecompactTest, Recompact) {
   log1.Close();
 
   // Load...
+  State state2;
   BuildLog log2;
-  EXPECT_TRUE(log2.Load(kTestFilename, &state_, &err));
+  EXPECT_TRUE(log2.Load(kTestFilename, &state2, &err));
   ASSERT_EQ("", err);
   ASSERT_EQ(2u, log2.entries().size());
   ASSERT_TRUE(log2.LookupByOutput("out"));
@@ -309,12 +569,57 @@ TEST_F(BuildLogRecompactTest, Recompact) {
   log2.Close();
 
   // "out2" is dead, it should've been removed.
+  State state3;
   BuildLog log3;
-  EXPECT_TRUE(log2.Load(kTestFilename, &state_, &err));
+  EXPECT_TRUE(log3.Load(kTestFilename, &state3, &err));
   ASSERT_EQ("", err);
-  ASSERT_EQ(1u, log2.entries().size());
-  ASSERT_TRUE(log2.LookupByOutput("out"));
-  ASSERT_FALSE(log2.LookupByOutput("out2"));
+  ASSERT_EQ(1u, log3.entries().size());
+  ASSERT_TRUE(log3.LookupByOutput("out"));
+  ASSERT_FALSE(log3.LookupByOutput("out2"));
+}
+
+TEST_F(BuildLogRecompactTest, RecompactKeepsStateUnchanged) {
+  const char kManifest[] = "build out: cat in\n";
+  AssertParse(&state_, "build out: cat in\n"
+                       "build gone: cat in\n");
+
+  std::string err;
+  {
+    BuildLog log;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+    ASSERT_EQ("", err);
+    log.RecordCommand(state_.edges_[0].get(), 15, 18);
+    log.RecordCommand(state_.edges_[1].get(), 21, 22);
+    log.Close();
+  }
+
+  // "gone" was dropped from the manifest but its output is still around.
+  for (bool lazy_load : { false, true }) {
+    State state;
+    AddCatRule(&state);
+    AssertParse(&state, kManifest);
+    int node_count = state.node_count();
+    BuildLog log;
+    log.set_lazy_load(lazy_load);
+    EXPECT_TRUE(log.Load(kTestFilename, &state, &err));
+    ASSERT_EQ("", err);
+    EXPECT_TRUE(log.Recompact(kTestFilename, *this, &err));
+    ASSERT_EQ("", err);
+    EXPECT_EQ(node_count, state.node_count());
+    EXPECT_FALSE(state.LookupNode("gone"));
+
+    State state2;
+    AddCatRule(&state2);
+    AssertParse(&state2, kManifest);
+    BuildLog log2;
+    EXPECT_TRUE(log2.Load(kTestFilename, &state2, &err));
+    ASSERT_EQ("", err);
+    BuildLog::LogEntry* e = log2.LookupByOutput("gone");
+    ASSERT_TRUE(e);
+    EXPECT_EQ(21, e->start_time);
+    ASSERT_TRUE(log2.LookupByOutput("out"));
+    EXPECT_EQ(node_count, state2.node_count());
+  }
 }
 
 }  // anonymous namespace
@@ -15,11 +15,19 @@
 #include <ninja/build.h>
 
 #include <ninja/build_log.h>
+#include <ninja/directory_table.h>
 #include <ninja/graph.h>
+#include <ninja/ninja_config.h>
 
 #include "test.h"
 
 #include <assert.h>
+#include <string.h>
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+
+#include <mutex>
 
 using namespace ninja;
 
@@ -84,6 +92,34 @@ TEST_F(PlanTest, Basic) {
   ASSERT_EQ(0, edge);
 }
 
+// Only the directories of outputs of commands to run are created ahead.
+TEST_F(PlanTest, OutputDirs) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "build out/all: phony obj/a obj/b\n"
+                                      "build obj/a: cat gen/a\n"
+                                      "build obj/b: cat gen/b\n"
+                                      "build gen/a: cat in\n"
+                                      "build gen/b: cat in\n"
+                                      "build gen/c: cat in\n"));
+  for (const char* path : { "obj/a", "obj/b", "gen/a", "out/all" })
+    state_.LookupNode(path)->MarkDirty();
+  std::string err;
+  EXPECT_TRUE(plan_.AddTarget(state_.LookupNode("out/all"), &err));
+  ASSERT_EQ("", err);
+
+  std::vector<Directory*> dirs;
+  plan_.GetOutputDirs(&dirs);
+  ASSERT_EQ(2u, dirs.size());
+  EXPECT_EQ(state_.LookupNode("obj/a")->dir(), dirs[0]);
+  EXPECT_EQ(state_.LookupNode("gen/a")->dir(), dirs[1]);
+
+  // Directories known to exist are skipped.
+  dirs[0]->exists = true;
+  plan_.GetOutputDirs(&dirs);
+  ASSERT_EQ(1u, dirs.size());
+  EXPECT_EQ(state_.LookupNode("gen/a")->dir(), dirs[0]);
+}
+
 // Test that two outputs from one rule can be handled as inputs to the next.
 TEST_F(PlanTest, DoubleOutputDirect) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
@@ -680,6 +716,55 @@ TEST_F(BuildTest, TwoStep) {
   EXPECT_EQ("cat cat1 cat2 > cat12", command_runner_.commands_ran_[4]);
 }
 
+TEST_F(BuildTest, PipelinedScan) {
+  config_.pipelined_scan = true;
+
+  // Commands start while AddTarget() is still scanning.
+  std::string err;
+  EXPECT_TRUE(builder_.AddTarget("cat12", &err));
+  ASSERT_EQ("", err);
+  EXPECT_FALSE(command_runner_.commands_ran_.empty());
+  EXPECT_FALSE(builder_.AlreadyUpToDate());
+  EXPECT_TRUE(builder_.Build(&err));
+  EXPECT_EQ("", err);
+
+  // The same commands run as without pipelining.
+  ASSERT_EQ(3u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("cat in1 > cat1", command_runner_.commands_ran_[0]);
+  EXPECT_EQ("cat in1 in2 > cat2", command_runner_.commands_ran_[1]);
+  EXPECT_EQ("cat cat1 cat2 > cat12", command_runner_.commands_ran_[2]);
+
+  fs_.Tick();
+
+  fs_.Create("in2", "");
+  state_.Reset();
+  EXPECT_TRUE(builder_.AddTarget("cat12", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(5u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("cat in1 in2 > cat2", command_runner_.commands_ran_[3]);
+  EXPECT_EQ("cat cat1 cat2 > cat12", command_runner_.commands_ran_[4]);
+}
+
+TEST_F(BuildTest, PipelinedScanFailure) {
+  config_.pipelined_scan = true;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule fail\n"
+                                      "  command = fail\n"
+                                      "build out1: fail\n"
+                                      "build all: cat out1 in1\n"));
+
+  // The failing command runs during the scan, its dependent never does.
+  std::string err;
+  EXPECT_TRUE(builder_.AddTarget("all", &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(1u, command_runner_.commands_ran_.size());
+  EXPECT_FALSE(builder_.Build(&err));
+  EXPECT_EQ("subcommand failed", err);
+  ASSERT_EQ(1u, command_runner_.commands_ran_.size());
+}
+
 TEST_F(BuildTest, TwoOutputs) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
                                       "rule touch\n"
@@ -805,6 +890,22 @@ TEST_F(BuildTest, MakeDirs) {
   EXPECT_EQ("subdir/dir2", fs_.directories_made_[1]);
 }
 
+// A failing command may have removed a directory that was created
+// earlier, so it is no longer assumed to exist.
+TEST_F(BuildTest, MakeDirsAfterFailure) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule fail\n"
+                                      "  command = fail\n"
+                                      "build subdir/out: fail\n"));
+  std::string err;
+  EXPECT_TRUE(builder_.AddTarget("subdir/out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_FALSE(builder_.Build(&err));
+  ASSERT_EQ(1u, fs_.directories_made_.size());
+  EXPECT_EQ("subdir", fs_.directories_made_[0]);
+  EXPECT_FALSE(state_.LookupNode("subdir/out")->dir()->exists);
+}
+
 TEST_F(BuildTest, DepFileMissing) {
   std::string err;
   ASSERT_NO_FATAL_FAILURE(
@@ -1769,6 +1870,107 @@ TEST_F(BuildTest, StatusFormatReplacePlaceholder) {
                                          BuildStatus::kEdgeStarted));
 }
 
+TEST_F(BuildTest, StatusFormatParallelism) {
+  EXPECT_EQ("[j1]", status_.FormatProgressStatus("[j%j]",
+                                                 BuildStatus::kEdgeStarted));
+  status_.ParallelismChanged(7);
+  EXPECT_EQ("[j7]", status_.FormatProgressStatus("[j%j]",
+                                                 BuildStatus::kEdgeStarted));
+}
+
+TEST_F(BuildTest, StatusFormatAppend) {
+  std::string out = "keep ";
+  status_.FormatProgressStatus("[%f/%t] ", BuildStatus::kEdgeStarted, &out);
+  EXPECT_EQ("keep [0/0] ", out);
+}
+
+#ifndef _WIN32
+TEST_F(BuildTest, StatusRefreshBeforeFailure) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "build a: cat in1\n"
+                                      "  description = making a\n"
+                                      "build b: cat in1\n"
+                                      "  description = making b\n"));
+  // All status lines after the first are held back.
+  BuildConfig config;
+  setenv("NINJA_STATUS_REFRESH_MILLIS", "3600000", 1);
+  BuildStatus status(config);
+  unsetenv("NINJA_STATUS_REFRESH_MILLIS");
+  status.set_smart_terminal(true);
+  status.PlanHasTotalEdges(2);
+  status.BuildStarted();
+  Edge* a = GetNode("a")->in_edge();
+  Edge* b = GetNode("b")->in_edge();
+
+  bool held_back, flushed;
+  std::string before, after;
+  {
+    ScopedStdoutCapture capture;
+    status.BuildEdgeStarted(a);
+    status.BuildEdgeStarted(b);
+    CommandRunner::Result result;
+    result.edge = a;
+    result.status = ExitSuccess;
+    int start_time, end_time;
+    status.BuildEdgeFinished(result, false, &start_time, &end_time);
+    held_back = status.has_pending_status();
+    before = capture.Read();
+
+    result.edge = b;
+    result.status = ExitFailure;
+    result.output = "oops\n";
+    status.BuildEdgeFinished(result, false, &start_time, &end_time);
+    flushed = !status.has_pending_status();
+    after = capture.Read();
+  }
+
+  EXPECT_TRUE(held_back);
+  EXPECT_EQ("\r[0/2] making a\x1B[K", before);
+  // The status is brought up to date before the failure is reported.
+  EXPECT_TRUE(flushed);
+  EXPECT_EQ("\r[0/2] making a\x1B[K"
+            "\r[2/2] making b\x1B[K\n"
+            "FAILED: b \n"
+            "cat in1 > b\n"
+            "oops\n",
+            after);
+}
+
+TEST_F(BuildTest, StatusRefreshAtBuildFinished) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "build a: cat in1\n"
+                                      "  description = making a\n"
+                                      "build b: cat in1\n"
+                                      "  description = making b\n"));
+  BuildConfig config;
+  setenv("NINJA_STATUS_REFRESH_MILLIS", "3600000", 1);
+  BuildStatus status(config);
+  unsetenv("NINJA_STATUS_REFRESH_MILLIS");
+  status.set_smart_terminal(true);
+  status.PlanHasTotalEdges(2);
+  status.BuildStarted();
+
+  bool held_back, flushed;
+  std::string before, after;
+  {
+    ScopedStdoutCapture capture;
+    status.BuildEdgeStarted(GetNode("a")->in_edge());
+    status.BuildEdgeStarted(GetNode("b")->in_edge());
+    held_back = status.has_pending_status();
+    before = capture.Read();
+
+    status.BuildFinished(false);
+    flushed = !status.has_pending_status();
+    after = capture.Read();
+  }
+
+  EXPECT_TRUE(held_back);
+  EXPECT_EQ("\r[0/2] making a\x1B[K", before);
+  EXPECT_TRUE(flushed);
+  EXPECT_EQ("\r[0/2] making a\x1B[K\r[0/2] making b\x1B[K\n", after);
+}
+#endif  // _WIN32
+
 TEST_F(BuildTest, FailedDepsParse) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
                                       "build bad_deps.o: cat in1\n"
@@ -1876,6 +2078,92 @@ TEST_F(BuildWithDepsLogTest, Straightforward) {
 /// 1) Run a successful build where everything has time t, record deps.
 /// 2) Move input/output to time t+1 -- despite files in alignment,
 ///    should still need to rebuild due to deps at older time.
+
+/// Outputs with identical deps share them and get dirty together.
+TEST_F(BuildWithDepsLogTest, SharedDepsSet) {
+  std::string err;
+  const char* manifest =
+      "build out1: cat in1\n"
+      "  deps = gcc\n"
+      "  depfile = in1.d\n"
+      "build out2: cat in1\n"
+      "  deps = gcc\n"
+      "  depfile = in2.d\n"
+      "build all: phony out1 out2\n";
+  fs_.Create("in2", "");
+  fs_.Create("in3", "");
+  {
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AddCatRule(&state));
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state, manifest));
+
+    BuildLog build_log;
+    ASSERT_TRUE(build_log.OpenForWrite("ninja_deps", *this, &err));
+    ASSERT_EQ("", err);
+
+    Builder builder(&state, config_, &build_log, &fs_);
+    builder.command_runner_.reset(&command_runner_);
+    EXPECT_TRUE(builder.AddTarget("all", &err));
+    ASSERT_EQ("", err);
+    fs_.Create("in1.d", "out1: in2 in3");
+    fs_.Create("in2.d", "out2: in2 in3");
+    EXPECT_TRUE(builder.Build(&err));
+    EXPECT_EQ("", err);
+
+    BuildLog::Deps* deps1 = build_log.GetDeps(state.LookupNode("out1"));
+    BuildLog::Deps* deps2 = build_log.GetDeps(state.LookupNode("out2"));
+    ASSERT_TRUE(deps1 && deps2);
+    EXPECT_EQ(deps1->set, deps2->set);
+    EXPECT_EQ(1u, build_log.deps_sets().size());
+
+    // Rescanning uses the set's cached result for the second output.
+    state.Reset();
+    DependencyScan scan(&state, &build_log, &fs_);
+    EXPECT_TRUE(scan.RecomputeDirty(state.LookupNode("all"), &err));
+    ASSERT_EQ("", err);
+    EXPECT_FALSE(state.LookupNode("out1")->dirty());
+    EXPECT_FALSE(state.LookupNode("out2")->dirty());
+    EXPECT_EQ(deps1->set, state.LookupNode("out2")->in_edge()->deps_set_);
+
+    fs_.Tick();
+    fs_.Create("in3", "");
+    state.Reset();
+    EXPECT_TRUE(scan.RecomputeDirty(state.LookupNode("all"), &err));
+    ASSERT_EQ("", err);
+    EXPECT_TRUE(state.LookupNode("out1")->dirty());
+    EXPECT_TRUE(state.LookupNode("out2")->dirty());
+
+    build_log.Close();
+    builder.command_runner_.release();
+  }
+
+  {
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AddCatRule(&state));
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state, manifest));
+
+    // Touch a file only mentioned in the shared deps.
+    fs_.Tick();
+    fs_.Create("in3", "");
+
+    BuildLog build_log;
+    ASSERT_TRUE(build_log.Load("ninja_deps", &state, &err));
+    ASSERT_TRUE(build_log.OpenForWrite("ninja_deps", *this, &err));
+
+    Builder builder(&state, config_, &build_log, &fs_);
+    builder.command_runner_.reset(&command_runner_);
+    command_runner_.commands_ran_.clear();
+    EXPECT_TRUE(builder.AddTarget("all", &err));
+    ASSERT_EQ("", err);
+    EXPECT_TRUE(builder.Build(&err));
+    EXPECT_EQ("", err);
+
+    // Both outputs are out of date.
+    EXPECT_EQ(2u, command_runner_.commands_ran_.size());
+
+    builder.command_runner_.release();
+  }
+}
 TEST_F(BuildWithDepsLogTest, ObsoleteDeps) {
   std::string err;
   // Note: in1 was created by the superclass SetUp().
@@ -2312,3 +2600,430 @@ TEST_F(BuildTest, Console) {
   EXPECT_EQ("", err);
   ASSERT_EQ(1u, command_runner_.commands_ran_.size());
 }
+
+/// Runs a batch as a single command, creating the outputs of its edges
+/// unless their rule is "batchfail".
+struct BatchCommandRunner : public CommandRunner {
+  explicit BatchCommandRunner(VirtualFileSystem* fs) : fs_(fs) {}
+
+  bool CanRunMore() override { return active_.empty(); }
+  bool StartCommand(Edge* edge) override { return StartBatch({ edge }); }
+  bool StartBatch(const std::vector<Edge*>& batch) override {
+    commands_ran_.push_back(Edge::EvaluateBatchCommand(batch));
+    for (Edge* edge : batch) {
+      if (edge->rule().name() != "batchfail") {
+        for (Node* out : edge->outputs_)
+          fs_->Create(out->path(), "");
+      }
+      active_.push_back(edge);
+    }
+    return true;
+  }
+  bool WaitForCommand(Result* result) override {
+    if (active_.empty())
+      return false;
+    result->edge = active_.front();
+    active_.pop_front();
+    result->status = result->edge->rule().name() == "batchfail" ? ExitFailure
+                                                                 : ExitSuccess;
+    return true;
+  }
+  std::vector<Edge*> GetActiveEdges() override {
+    return std::vector<Edge*>(active_.begin(), active_.end());
+  }
+  void Abort() override { active_.clear(); }
+
+  std::vector<std::string> commands_ran_;
+  std::deque<Edge*> active_;
+  VirtualFileSystem* fs_;
+};
+
+TEST_F(BuildTest, Batch) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule bcc\n"
+                                      "  command = bcc $in -o $out\n"
+                                      "  batch = 2\n"
+                                      "build a.o: bcc a.c\n"
+                                      "build b.o: bcc b.c | b.h\n"
+                                      "build c.o: bcc c.c\n"
+                                      "build d.o: bcc d.c\n"
+                                      "  flags = -O2\n"
+                                      "build all: cat a.o b.o c.o d.o\n"));
+  for (const char* in : { "a.c", "b.c", "b.h", "c.c", "d.c" })
+    fs_.Create(in, "");
+
+  BatchCommandRunner runner(&fs_);
+  builder_.command_runner_.release();
+  builder_.command_runner_.reset(&runner);
+
+  std::string err;
+  EXPECT_TRUE(builder_.AddTarget("all", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+
+  // d.o has its own scope, so it can't share c.o's command.
+  ASSERT_EQ(4u, runner.commands_ran_.size());
+  EXPECT_EQ("bcc a.c b.c -o a.o b.o", runner.commands_ran_[0]);
+  EXPECT_EQ("bcc c.c -o c.o", runner.commands_ran_[1]);
+  EXPECT_EQ("bcc d.c -o d.o", runner.commands_ran_[2]);
+  EXPECT_EQ("cat a.o b.o c.o d.o > all", runner.commands_ran_[3]);
+}
+
+TEST_F(BuildTest, BatchFailure) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule batchfail\n"
+                                      "  command = fail $in\n"
+                                      "  batch = 4\n"
+                                      "build a.o: batchfail a.c\n"
+                                      "build b.o: batchfail b.c\n"
+                                      "build a: cat a.o\n"
+                                      "build b: cat b.o\n"));
+  fs_.Create("a.c", "");
+  fs_.Create("b.c", "");
+
+  BatchCommandRunner runner(&fs_);
+  builder_.command_runner_.release();
+  builder_.command_runner_.reset(&runner);
+
+  // Both edges fail, even though another failure would be allowed, so
+  // neither dependent runs.
+  config_.failures_allowed = 3;
+
+  std::string err;
+  EXPECT_TRUE(builder_.AddTarget("a", &err));
+  EXPECT_TRUE(builder_.AddTarget("b", &err));
+  ASSERT_EQ("", err);
+  EXPECT_FALSE(builder_.Build(&err));
+  EXPECT_EQ("cannot make progress due to previous errors", err);
+
+  ASSERT_EQ(1u, runner.commands_ran_.size());
+  EXPECT_EQ("fail a.c b.c", runner.commands_ran_[0]);
+}
+
+TEST_F(BuildTest, BatchMakeDirsFailure) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule bcc\n"
+                                      "  command = bcc $in -o $out\n"
+                                      "  batch = 2\n"
+                                      "build sub/a.o: bcc a.c\n"
+                                      "build sub/b.o: bcc b.c\n"));
+  fs_.Create("a.c", "");
+  fs_.Create("b.c", "");
+  fs_.files_["sub"].mtime = -1;
+  fs_.files_["sub"].stat_error = "stat failed";
+
+  BatchCommandRunner runner(&fs_);
+  builder_.command_runner_.release();
+  builder_.command_runner_.reset(&runner);
+
+  std::string err;
+  EXPECT_TRUE(builder_.AddTarget("sub/a.o", &err));
+  EXPECT_TRUE(builder_.AddTarget("sub/b.o", &err));
+  ASSERT_EQ("", err);
+  EXPECT_FALSE(builder_.Build(&err));
+  EXPECT_EQ("cannot create directory for 'sub/a.o'", err);
+  EXPECT_EQ(0u, runner.commands_ran_.size());
+}
+
+#ifndef _WIN32
+/// Builds that run real commands through the RealCommandRunner.
+struct RealCommandRunnerTest : public testing::Test {
+  void SetUp() override {
+    temp_dir_.CreateAndEnter("RealCommandRunnerTest");
+    config_.verbosity = BuildConfig::QUIET;
+  }
+  void TearDown() override { temp_dir_.Cleanup(); }
+
+  ScopedTempDir temp_dir_;
+  State state_;
+  BuildConfig config_;
+  RealDiskInterface disk_interface_;
+};
+
+/// The result of a batch's command is split into one result per edge.
+TEST_F(RealCommandRunnerTest, Batch) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule touch\n"
+                                      "  command = touch $out\n"
+                                      "  batch = 3\n"
+                                      "build a.o: touch\n"
+                                      "build b.o: touch\n"
+                                      "build c.o: touch\n"
+                                      "build all: phony a.o b.o c.o\n"));
+  Builder builder(&state_, config_, nullptr, &disk_interface_);
+  std::string err;
+  EXPECT_TRUE(builder.AddTarget("all", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder.Build(&err));
+  ASSERT_EQ("", err);
+
+  for (const char* out : { "a.o", "b.o", "c.o" })
+    EXPECT_GT(disk_interface_.Stat(out, &err), 0) << out;
+  EXPECT_TRUE(builder.AlreadyUpToDate());
+}
+
+TEST_F(RealCommandRunnerTest, BatchFailure) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule fail\n"
+                                      "  command = false $out\n"
+                                      "  batch = 3\n"
+                                      "build x.o: fail\n"
+                                      "build y.o: fail\n"
+                                      "build z.o: fail\n"
+                                      "build x: phony x.o\n"
+                                      "build y: phony y.o\n"
+                                      "build z: phony z.o\n"));
+  // Each edge of the failed batch gets its own failed result, so the build
+  // stops for lack of progress even though more failures are allowed.
+  config_.failures_allowed = 4;
+  Builder builder(&state_, config_, nullptr, &disk_interface_);
+  std::string err;
+  EXPECT_TRUE(builder.AddTarget("x", &err));
+  EXPECT_TRUE(builder.AddTarget("y", &err));
+  EXPECT_TRUE(builder.AddTarget("z", &err));
+  ASSERT_EQ("", err);
+  EXPECT_FALSE(builder.Build(&err));
+  EXPECT_EQ("cannot make progress due to previous errors", err);
+}
+
+/// A command whose worker is lost is run on its own instead.
+TEST_F(RealCommandRunnerTest, WorkerLost) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule touch\n"
+                                      "  command = touch $out\n"
+                                      "  worker = exit 1\n"
+                                      "build a.o: touch\n"
+                                      "build b.o: touch\n"));
+  Builder builder(&state_, config_, nullptr, &disk_interface_);
+  std::string err;
+  EXPECT_TRUE(builder.AddTarget("a.o", &err));
+  EXPECT_TRUE(builder.AddTarget("b.o", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder.Build(&err));
+  ASSERT_EQ("", err);
+
+  EXPECT_GT(disk_interface_.Stat("a.o", &err), 0);
+  EXPECT_GT(disk_interface_.Stat("b.o", &err), 0);
+}
+
+#ifdef NINJA_HAVE_MEMFD
+/// Return the number of open file descriptors.
+size_t CountOpenFds() {
+  size_t count = 0;
+  DIR* dir = opendir("/proc/self/fd");
+  while (readdir(dir))
+    ++count;
+  closedir(dir);
+  return count;
+}
+
+/// The command reads the response file from an inherited memfd, which
+/// ninja closes again once the command started.
+TEST_F(RealCommandRunnerTest, RspfileMemfd) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule cp\n"
+                                      "  command = cp $rspfile $out\n"
+                                      "  rspfile = $out.rsp\n"
+                                      "  rspfile_content = $in\n"
+                                      "build a.o: cp a.c b.c\n"));
+  ASSERT_TRUE(disk_interface_.WriteFile("a.c", ""));
+  ASSERT_TRUE(disk_interface_.WriteFile("b.c", ""));
+  config_.rspfile_memfd = true;
+  size_t fds = CountOpenFds();
+
+  Builder builder(&state_, config_, nullptr, &disk_interface_);
+  std::string err;
+  EXPECT_TRUE(builder.AddTarget("a.o", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder.Build(&err));
+  ASSERT_EQ("", err);
+
+  std::string contents;
+  EXPECT_EQ(DiskInterface::Okay,
+            disk_interface_.ReadFile("a.o", &contents, &err));
+  EXPECT_EQ("a.c b.c", contents);
+  EXPECT_EQ(fds, CountOpenFds());
+  EXPECT_EQ(0, disk_interface_.Stat("a.o.rsp", &err));
+}
+#endif  // NINJA_HAVE_MEMFD
+#endif  // _WIN32
+
+/// A VirtualFileSystem that the completion threads may use too.
+struct LockedFileSystem : public DiskInterface {
+  explicit LockedFileSystem(VirtualFileSystem* fs) : fs_(fs) {}
+
+  TimeStamp Stat(const std::string& path, std::string* err) const override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return fs_->Stat(path, err);
+  }
+  bool WriteFile(const std::string& path,
+                 const std::string& contents) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return fs_->WriteFile(path, contents);
+  }
+  bool MakeDir(const std::string& path) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return fs_->MakeDir(path);
+  }
+  Status ReadFile(const std::string& path, std::string* contents,
+                  std::string* err) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return fs_->ReadFile(path, contents, err);
+  }
+  int RemoveFile(const std::string& path) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return fs_->RemoveFile(path);
+  }
+
+  mutable std::mutex mutex_;
+  VirtualFileSystem* fs_;
+};
+
+/// Runs up to three commands at a time and finishes them in the order they
+/// were started.  "cat" writes its outputs, "fail" fails and "true" does
+/// nothing.
+struct ParallelCommandRunner : public CommandRunner {
+  explicit ParallelCommandRunner(DiskInterface* disk) : disk_(disk) {}
+
+  bool CanRunMore() override { return active_.size() < 3; }
+  bool StartCommand(Edge* edge) override {
+    commands_ran_.push_back(edge->EvaluateCommand());
+    if (edge->rule().name() == "cat") {
+      for (Node* out : edge->outputs_)
+        disk_->WriteFile(out->path(), "");
+    }
+    active_.push_back(edge);
+    return true;
+  }
+  bool WaitForCommand(Result* result) override {
+    if (active_.empty())
+      return false;
+    result->edge = active_.front();
+    active_.pop_front();
+    result->status = result->edge->rule().name() == "fail" ? ExitFailure
+                                                            : ExitSuccess;
+    return true;
+  }
+  std::vector<Edge*> GetActiveEdges() override {
+    return std::vector<Edge*>(active_.begin(), active_.end());
+  }
+  void Abort() override { active_.clear(); }
+
+  std::vector<std::string> commands_ran_;
+  std::deque<Edge*> active_;
+  DiskInterface* disk_;
+};
+
+struct CompletionThreadsTest : public StateTestWithBuiltinRules {
+  CompletionThreadsTest()
+      : config_(MakeConfig()), disk_(&fs_), runner_(&disk_),
+        builder_(&state_, config_, nullptr, &disk_) {}
+
+  void SetUp() override {
+    StateTestWithBuiltinRules::SetUp();
+    builder_.command_runner_.reset(&runner_);
+  }
+
+  void TearDown() override { builder_.command_runner_.release(); }
+
+  BuildConfig MakeConfig() {
+    BuildConfig config;
+    config.verbosity = BuildConfig::QUIET;
+    config.completion_threads = 2;
+    return config;
+  }
+
+  BuildConfig config_;
+  VirtualFileSystem fs_;
+  LockedFileSystem disk_;
+  ParallelCommandRunner runner_;
+  Builder builder_;
+};
+
+TEST_F(CompletionThreadsTest, Build) {
+  std::string manifest = "build all: cat";
+  for (int i = 0; i < 20; ++i) {
+    std::string obj = "obj" + std::to_string(i);
+    ASSERT_NO_FATAL_FAILURE(
+        AssertParse(&state_, ("build " + obj + ": cat in\n").c_str()));
+    manifest += " " + obj;
+  }
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_, (manifest + "\n").c_str()));
+  fs_.Create("in", "");
+
+  std::string err;
+  EXPECT_TRUE(builder_.AddTarget("all", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+
+  // The final command only starts once all the others were committed.
+  ASSERT_EQ(21u, runner_.commands_ran_.size());
+  EXPECT_EQ(manifest.substr(strlen("build all: ")) + " > all",
+            runner_.commands_ran_.back());
+  EXPECT_GT(fs_.Stat("all", &err), 0);
+}
+
+TEST_F(CompletionThreadsTest, Restat) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule true\n"
+                                      "  command = true\n"
+                                      "  restat = 1\n"
+                                      "build mid: true in\n"
+                                      "build out: cat mid\n"));
+  fs_.Create("mid", "");
+  fs_.Create("out", "");
+  fs_.Tick();
+  fs_.Create("in", "");
+
+  // The unchanged output cleans the edge depending on it.
+  std::string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(1u, runner_.commands_ran_.size());
+  EXPECT_EQ("true", runner_.commands_ran_[0]);
+}
+
+TEST_F(CompletionThreadsTest, Failure) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+                                      "rule fail\n"
+                                      "  command = fail\n"
+                                      "build bad: fail in\n"
+                                      "build out: cat bad\n"));
+  fs_.Create("in", "");
+
+  std::string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_FALSE(builder_.Build(&err));
+  EXPECT_EQ("subcommand failed", err);
+  ASSERT_EQ(1u, runner_.commands_ran_.size());
+}
+
+TEST_F(CompletionThreadsTest, NoStartAfterFailure) {
+  std::string manifest = "rule fail\n"
+                         "  command = fail\n"
+                         "build bad: fail in\n";
+  for (int i = 0; i < 10; ++i)
+    manifest += "build obj" + std::to_string(i) + ": cat in\n";
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_, manifest.c_str()));
+  fs_.Create("in", "");
+
+  std::string err;
+  EXPECT_TRUE(builder_.AddTarget("bad", &err));
+  for (int i = 0; i < 10; ++i)
+    EXPECT_TRUE(builder_.AddTarget("obj" + std::to_string(i), &err));
+  ASSERT_EQ("", err);
+  EXPECT_FALSE(builder_.Build(&err));
+  EXPECT_EQ("subcommand failed", err);
+
+  // With -k 1, the commands that were running when the failure was reaped
+  // are the last ones, however quickly the threads process it.
+  ASSERT_EQ(3u, runner_.commands_ran_.size());
+  EXPECT_EQ("fail", runner_.commands_ran_[0]);
+  EXPECT_EQ("cat in > obj0", runner_.commands_ran_[1]);
+  EXPECT_EQ("cat in > obj1", runner_.commands_ran_[2]);
+}
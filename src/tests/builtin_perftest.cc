@@ -0,0 +1,102 @@
+// Copyright 2018 Frank Benkstein. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <benchmark/benchmark.h>
+
+#include <ninja/build.h>
+#include <ninja/disk_interface.h>
+#include <ninja/filesystem.h>
+#include <ninja/manifest_parser.h>
+#include <ninja/state.h>
+
+#include <string>
+
+using namespace ninja;
+
+namespace {
+
+/// |num_stamps| stamp edges below a phony "all", as generated for the
+/// per-target stamps of a large CMake or GN project.
+std::string StampManifest(int num_stamps, bool builtin) {
+  std::string manifest =
+      "rule stamp\n"
+      "  command = touch $out\n";
+  if (builtin)
+    manifest += "  builtin = stamp\n";
+  std::string all = "build all: phony";
+  for (int i = 0; i < num_stamps; ++i) {
+    std::string stamp = "stamps/" + std::to_string(i) + ".stamp";
+    manifest += "build " + stamp + ": stamp\n";
+    all += " " + stamp;
+  }
+  return manifest + all + "\n";
+}
+
+void BuildStamps(benchmark::State& state, bool builtin) {
+  fs::path dir = fs::temp_directory_path() / "majak_builtin_perftest";
+  fs::error_code ec;
+  fs::remove_all(dir, ec);
+  fs::create_directories(dir, ec);
+  fs::path old_dir = fs::current_path();
+  fs::current_path(dir);
+
+  std::string manifest = StampManifest(state.range(0), builtin);
+  BuildConfig config;
+  config.verbosity = BuildConfig::QUIET;
+  config.parallelism = 8;
+  RealDiskInterface disk_interface;
+  std::string err;
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    fs::remove_all("stamps", ec);
+    State ninja_state;
+    ManifestParser parser(&ninja_state, nullptr);
+    if (!parser.ParseTest(manifest, &err)) {
+      state.SkipWithError(err.c_str());
+      break;
+    }
+    Builder builder(&ninja_state, config, nullptr, &disk_interface);
+    state.ResumeTiming();
+
+    if (!builder.AddTarget("all", &err) || !builder.Build(&err)) {
+      state.SkipWithError(err.c_str());
+      break;
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+
+  fs::current_path(old_dir);
+  fs::remove_all(dir, ec);
+}
+
+}  // namespace
+
+static void BM_StampCommand(benchmark::State& state) {
+  BuildStamps(state, false);
+}
+BENCHMARK(BM_StampCommand)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime()
+    ->Arg(1000);
+
+static void BM_StampBuiltin(benchmark::State& state) {
+  BuildStamps(state, true);
+}
+BENCHMARK(BM_StampBuiltin)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime()
+    ->Arg(1000);
+
+BENCHMARK_MAIN();
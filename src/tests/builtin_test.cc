@@ -0,0 +1,98 @@
+// Copyright 2018 Frank Benkstein. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <ninja/builtin.h>
+
+#include "test.h"
+
+using namespace ninja;
+
+namespace {
+
+struct BuiltinTest : public StateTestWithBuiltinRules {
+  /// Run the builtin of the edge building |output|.
+  CommandRunner::Result Run(const char* output) {
+    Edge* edge = state_.LookupNode(output)->in_edge();
+    CommandRunner::Result result;
+    RunBuiltinCommand(edge->GetBinding("builtin"), edge, &fs_, &result);
+    EXPECT_EQ(edge, result.edge);
+    return result;
+  }
+
+  VirtualFileSystem fs_;
+};
+
+TEST_F(BuiltinTest, Stamp) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule stamp\n"
+"  command = touch $out\n"
+"  builtin = stamp\n"
+"build out1 out2: stamp in\n"));
+  fs_.Create("out1", "old");
+
+  CommandRunner::Result result = Run("out1");
+  EXPECT_TRUE(result.success());
+  EXPECT_EQ("", result.output);
+  EXPECT_EQ("", fs_.files_["out1"].contents);
+  EXPECT_EQ(1u, fs_.files_.count("out2"));
+}
+
+TEST_F(BuiltinTest, Touch) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule touch\n"
+"  command = touch $out\n"
+"  builtin = touch\n"
+"build out1 out2: touch\n"));
+  fs_.Create("out1", "contents");
+  fs_.Tick();
+
+  EXPECT_TRUE(Run("out1").success());
+  EXPECT_EQ("contents", fs_.files_["out1"].contents);
+  EXPECT_EQ(fs_.now_, fs_.files_["out1"].mtime);
+  EXPECT_EQ("", fs_.files_["out2"].contents);
+}
+
+TEST_F(BuiltinTest, Copy) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule copy\n"
+"  command = cp $in $out\n"
+"  builtin = copy\n"
+"build out: copy in\n"
+"build missing.out: copy missing\n"));
+  fs_.Create("in", "contents");
+
+  EXPECT_TRUE(Run("out").success());
+  EXPECT_EQ("contents", fs_.files_["out"].contents);
+
+  CommandRunner::Result result = Run("missing.out");
+  EXPECT_FALSE(result.success());
+  EXPECT_EQ("builtin copy: cannot copy 'missing' to 'missing.out': " +
+                std::string(strerror(ENOENT)) + "\n",
+            result.output);
+  EXPECT_EQ(0u, fs_.files_.count("missing.out"));
+}
+
+TEST_F(BuiltinTest, Mkdir) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule mkdir\n"
+"  command = mkdir -p $out\n"
+"  builtin = mkdir\n"
+"build a/b: mkdir\n"));
+
+  EXPECT_TRUE(Run("a/b").success());
+  ASSERT_EQ(1u, fs_.directories_made_.size());
+  EXPECT_EQ("a/b", fs_.directories_made_[0]);
+}
+
+}  // namespace
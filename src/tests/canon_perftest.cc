@@ -32,6 +32,10 @@ constexpr const char* kPaths[] = {
   "../../third_party/WebKit/Source/WebCore/platform/leveldb/"
   "LevelDBWriteBatch.cpp",
   "/usr/lib/gcc/x86_64-linux-gnu/7/../../../x86_64-linux-gnu",
+  "obj/third_party/WebKit/Source/WebCore/platform/leveldb/"
+  "LevelDBWriteBatch.o",
+  "./out/Release/../../third_party/WebKit/Source/WebCore/platform/./leveldb/"
+  "LevelDBWriteBatch.cpp",
 };
 
 double now() {
@@ -81,6 +85,38 @@ static void BM_CanonicalizePath(benchmark::State& state) {
 }
 BENCHMARK(BM_CanonicalizePath)->UseManualTime()->Arg(0)->Arg(1);
 
+/// Canonicalize a fresh copy of the path each time, so that non-canonical
+/// paths stay non-canonical.  |Canonicalize| is CanonicalizePath() or
+/// CanonicalizePathScalar().
+template <bool (*Canonicalize)(char*, size_t*, uint64_t*, std::string*)>
+static void BM_CanonicalizeCopy(benchmark::State& state) {
+  std::string err;
+
+  constexpr int kNumRepetitions = 100000;
+  uint64_t slash_bits;
+  const std::string path(kPaths[state.range(0)]);
+  std::string s = path;
+
+  for (auto _ : state) {
+    auto start = now();
+    for (int i = 0; i < kNumRepetitions; ++i) {
+      s.assign(path);
+      size_t len = s.size();
+      Canonicalize(s.data(), &len, &slash_bits, &err);
+      benchmark::DoNotOptimize(len);
+    }
+    state.SetIterationTime(now() - start);
+  }
+}
+BENCHMARK_TEMPLATE(BM_CanonicalizeCopy, CanonicalizePathScalar)
+    ->Unit(benchmark::kMillisecond)
+    ->UseManualTime()
+    ->DenseRange(0, 3);
+BENCHMARK_TEMPLATE(BM_CanonicalizeCopy, CanonicalizePath)
+    ->Unit(benchmark::kMillisecond)
+    ->UseManualTime()
+    ->DenseRange(0, 3);
+
 static void BM_EmptyPath(benchmark::State& state) {
   for (auto _ : state) {
     auto start = now();
@@ -16,6 +16,8 @@
 
 #include "test.h"
 
+#include <algorithm>
+
 #include <sys/stat.h>
 #ifndef _WIN32
 #include <unistd.h>
@@ -45,6 +47,25 @@ struct DepsLogTest : public testing::Test, public BuildLogUser {
   virtual bool IsPathDead(std::string_view s) const { return false; }
 };
 
+/// Size of the log at |path| without the index that recompaction writes.
+int RecordsSize(const char* path) {
+  std::string contents, err;
+  if (ReadFile(path, &contents, &err) != 0)
+    return -1;
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(contents.data());
+  size_t offset = 0;
+  for (int record = 0; record < 2 && offset < contents.size(); ++record) {
+    size_t size = sizeof(flatbuffers::uoffset_t) +
+                  flatbuffers::GetPrefixedSize(data + offset);
+    auto* entry_holder =
+        flatbuffers::GetSizePrefixedRoot<log::EntryHolder>(data + offset);
+    if (entry_holder->entry_as_IndexEntry())
+      return contents.size() - size;
+    offset += size;
+  }
+  return contents.size();
+}
+
 TEST_F(DepsLogTest, WriteRead) {
   State state1;
   DepsLog log1;
@@ -73,7 +94,10 @@ TEST_F(DepsLogTest, WriteRead) {
 
   log1.Close();
 
+  // The manifest knows the outputs.
   State state2;
+  state2.GetNode("out.o", 0);
+  state2.GetNode("out2.o", 0);
   DepsLog log2;
   EXPECT_TRUE(log2.Load(kTestFilename, &state2, &err));
   ASSERT_EQ("", err);
@@ -128,6 +152,86 @@ TEST_F(DepsLogTest, LotsOfDeps) {
   ASSERT_EQ(kNumDeps, log_deps->node_count);
 }
 
+// Verify that identical deps lists share one set, also after reloading.
+TEST_F(DepsLogTest, SharedDepsSets) {
+  State state1;
+  DepsLog log1;
+  std::string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+
+  std::vector<Node*> deps;
+  deps.push_back(state1.GetNode("foo.h", 0));
+  deps.push_back(state1.GetNode("bar.h", 0));
+  log1.RecordDeps(state1.GetNode("out1.o", 0), 1, deps);
+  log1.RecordDeps(state1.GetNode("out2.o", 0), 2, deps);
+  deps.pop_back();
+  log1.RecordDeps(state1.GetNode("out3.o", 0), 3, deps);
+
+  DepsLog::Deps* deps1 = log1.GetDeps(state1.GetNode("out1.o", 0));
+  DepsLog::Deps* deps2 = log1.GetDeps(state1.GetNode("out2.o", 0));
+  DepsLog::Deps* deps3 = log1.GetDeps(state1.GetNode("out3.o", 0));
+  ASSERT_TRUE(deps1 && deps2 && deps3);
+  EXPECT_EQ(deps1->set, deps2->set);
+  EXPECT_NE(deps1->set, deps3->set);
+  EXPECT_EQ(2u, log1.deps_sets().size());
+  log1.Close();
+
+  State state2;
+  DepsLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &state2, &err));
+  ASSERT_EQ("", err);
+
+  deps1 = log2.GetDeps(state2.GetNode("out1.o", 0));
+  deps2 = log2.GetDeps(state2.GetNode("out2.o", 0));
+  deps3 = log2.GetDeps(state2.GetNode("out3.o", 0));
+  ASSERT_TRUE(deps1 && deps2 && deps3);
+  EXPECT_EQ(deps1->set, deps2->set);
+  EXPECT_EQ(2, deps1->node_count);
+  EXPECT_EQ("bar.h", deps1->nodes[1]->path());
+  EXPECT_EQ(2, deps2->mtime);
+  EXPECT_EQ(1, deps3->node_count);
+  EXPECT_EQ(2u, log2.deps_sets().size());
+}
+
+// Verify that lists keep their order although ids are stored as differences.
+TEST_F(DepsLogTest, DepsOrder) {
+  const int kNumDeps = 1000;
+
+  State state1;
+  DepsLog log1;
+  std::string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+
+  // Ids ascending, then descending and jumping back and forth.
+  std::vector<Node*> deps;
+  for (int i = 0; i < kNumDeps; ++i)
+    deps.push_back(state1.GetNode("file" + std::to_string(i) + ".h", 0));
+  log1.RecordDeps(state1.GetNode("out1.o", 0), 1, deps);
+  std::reverse(deps.begin(), deps.end());
+  log1.RecordDeps(state1.GetNode("out2.o", 0), 1, deps);
+  for (int i = 0; i < kNumDeps; ++i)
+    deps[i] = state1.GetNode(
+        "file" + std::to_string(i % 2 ? i : kNumDeps - 1 - i) + ".h", 0);
+  log1.RecordDeps(state1.GetNode("out3.o", 0), 1, deps);
+  log1.Close();
+
+  State state2;
+  DepsLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &state2, &err));
+  ASSERT_EQ("", err);
+
+  for (const char* out : { "out1.o", "out2.o", "out3.o" }) {
+    DepsLog::Deps* deps1 = log1.GetDeps(state1.GetNode(out, 0));
+    DepsLog::Deps* deps2 = log2.GetDeps(state2.GetNode(out, 0));
+    ASSERT_TRUE(deps1 && deps2);
+    ASSERT_EQ(deps1->node_count, deps2->node_count);
+    for (int i = 0; i < deps1->node_count; ++i)
+      ASSERT_EQ(deps1->nodes[i]->path(), deps2->nodes[i]->path()) << out;
+  }
+}
+
 // Verify that adding the same deps twice doesn't grow the file.
 TEST_F(DepsLogTest, DoubleEntry) {
   // Write some deps to the file and grab its size.
@@ -260,7 +364,11 @@ TEST_F(DepsLogTest, Recompact) {
     ASSERT_EQ("foo.h", deps->nodes[0]->path());
     ASSERT_EQ("baz.h", deps->nodes[1]->path());
 
+    // Scanning points the edge at the set, which recompaction frees.
+    other_out->in_edge()->deps_set_ = deps->set;
+
     ASSERT_TRUE(log.Recompact(kTestFilename, *this, &err));
+    EXPECT_EQ(nullptr, other_out->in_edge()->deps_set_);
 
     // The in-memory deps graph should still be valid after recompaction.
     deps = log.GetDeps(out);
@@ -278,10 +386,9 @@ TEST_F(DepsLogTest, Recompact) {
     ASSERT_EQ("baz.h", deps->nodes[1]->path());
     ASSERT_EQ(other_out, log.nodes()[other_out->id()]);
 
-    // The file should have shrunk a bit for the smaller deps.
-    struct stat st;
-    ASSERT_EQ(0, stat(kTestFilename, &st));
-    file_size_3 = (int)st.st_size;
+    // The records should have shrunk a bit for the smaller deps.  The
+    // index that's added in front of them doesn't count.
+    file_size_3 = RecordsSize(kTestFilename);
     ASSERT_LT(file_size_3, file_size_2);
   }
 
@@ -322,10 +429,8 @@ TEST_F(DepsLogTest, Recompact) {
     ASSERT_EQ(-1, state.LookupNode("foo.h")->id());
     ASSERT_EQ(-1, state.LookupNode("baz.h")->id());
 
-    // The file should have shrunk more.
-    struct stat st;
-    ASSERT_EQ(0, stat(kTestFilename, &st));
-    int file_size_4 = (int)st.st_size;
+    // The records should have shrunk more.
+    int file_size_4 = RecordsSize(kTestFilename);
     ASSERT_LT(file_size_4, file_size_3);
   }
 }
@@ -357,6 +462,44 @@ TEST_F(DepsLogTest, InvalidHeader) {
 }
 
 // Simulate what happens when loading a truncated log file.
+TEST_F(DepsLogTest, OverlongPackedDeps) {
+  {
+    FILE* f = fopen(kTestFilename, "wb");
+    flatbuffers::FlatBufferBuilder fbb;
+    auto write = [&fbb, f](log::Entry type, flatbuffers::Offset<void> entry) {
+      fbb.TrackMinAlign(alignof(uint64_t));
+      fbb.FinishSizePrefixed(log::CreateEntryHolder(fbb, type, entry));
+      fwrite(fbb.GetBufferPointer(), 1, fbb.GetSize(), f);
+      fbb.Clear();
+    };
+    write(log::Entry::VersionEntry,
+          log::CreateVersionEntry(fbb, DepsLog::kCurrentVersion).Union());
+    write(log::Entry::PathEntry,
+          log::CreatePathEntry(fbb, ~0u, fbb.CreateString("foo.h")).Union());
+    write(log::Entry::PathEntry,
+          log::CreatePathEntry(fbb, ~1u, fbb.CreateString("out.o")).Union());
+    // The fifth byte of a varint only has room for the top four bits of a
+    // 32 bit id.  With more bits set the id would wrap around to 0.
+    const uint8_t packed_deps[] = { 0x80, 0x80, 0x80, 0x80, 0x10 };
+    write(log::Entry::DepsSetEntry,
+          log::CreateDepsSetEntry(fbb, ~0u, 0,
+                                  fbb.CreateVector(packed_deps,
+                                                   sizeof(packed_deps)))
+              .Union());
+    write(log::Entry::DepsEntry,
+          log::CreateDepsEntry(fbb, 1, 1, fbb.CreateVector(std::vector<uint32_t>()), 0)
+              .Union());
+    fclose(f);
+  }
+
+  State state;
+  DepsLog log;
+  std::string err;
+  EXPECT_TRUE(log.Load(kTestFilename, &state, &err));
+  EXPECT_NE("", err);
+  EXPECT_FALSE(log.GetDeps(state.GetNode("out.o", 0)));
+}
+
 TEST_F(DepsLogTest, Truncated) {
   // Create a file with some entries.
   {
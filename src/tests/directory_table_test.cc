@@ -0,0 +1,61 @@
+// Copyright 2018 Frank Benkstein. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <ninja/directory_table.h>
+
+#include "test.h"
+
+using namespace ninja;
+
+namespace {
+
+TEST(DirectoryTableTest, Root) {
+  DirectoryTable table;
+  EXPECT_EQ(1u, table.size());
+  EXPECT_EQ(table.root(), table.Intern(""));
+  EXPECT_EQ(0, table.root()->id);
+  EXPECT_EQ("", table.root()->path);
+  EXPECT_EQ(nullptr, table.root()->parent);
+}
+
+TEST(DirectoryTableTest, InternParents) {
+  DirectoryTable table;
+  EXPECT_EQ(nullptr, table.Lookup("a/b/"));
+
+  Directory* b = table.Intern("a/b/");
+  EXPECT_EQ("a/b/", b->path);
+  EXPECT_EQ(3u, table.size());
+  EXPECT_EQ(b, table.Lookup("a/b/"));
+  EXPECT_EQ(b, table.Intern("a/b/"));
+
+  Directory* a = b->parent;
+  ASSERT_NE(nullptr, a);
+  EXPECT_EQ("a/", a->path);
+  EXPECT_EQ(table.root(), a->parent);
+
+  Directory* slash = table.Intern("/");
+  EXPECT_EQ(table.root(), slash->parent);
+  EXPECT_EQ(table.Intern("/usr/"), table.Intern("/usr/include/")->parent);
+  EXPECT_EQ(slash, table.Intern("/usr/")->parent);
+}
+
+TEST(DirectoryTableTest, DirLength) {
+  EXPECT_EQ(0u, DirectoryTable::DirLength(""));
+  EXPECT_EQ(0u, DirectoryTable::DirLength("foo"));
+  EXPECT_EQ(4u, DirectoryTable::DirLength("foo/bar"));
+  EXPECT_EQ(8u, DirectoryTable::DirLength("foo/bar/"));
+  EXPECT_EQ(1u, DirectoryTable::DirLength("/foo"));
+}
+
+}  // namespace
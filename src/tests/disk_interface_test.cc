@@ -14,11 +14,13 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <sys/stat.h>
 #ifdef _WIN32
 #include <io.h>
 #include <windows.h>
 #endif
 
+#include <ninja/directory_table.h>
 #include <ninja/disk_interface.h>
 #include <ninja/graph.h>
 
@@ -124,6 +126,35 @@ TEST_F(DiskInterfaceTest, ReadFile) {
   EXPECT_EQ("", err);
 }
 
+TEST_F(DiskInterfaceTest, Copy) {
+  // Line endings and NUL bytes must survive the copy.
+  const std::string kContent("a\r\nb\0c\n", 7);
+  FILE* f = fopen("in", "wb");
+  ASSERT_TRUE(f);
+  ASSERT_EQ(kContent.size(), fwrite(kContent.data(), 1, kContent.size(), f));
+  ASSERT_EQ(0, fclose(f));
+  ASSERT_TRUE(Touch("out"));
+#ifndef _WIN32
+  ASSERT_EQ(0, chmod("in", 0751));
+  ASSERT_EQ(0, chmod("out", 0600));
+#endif
+
+  std::string err;
+  EXPECT_TRUE(disk_.Copy("in", "out", &err));
+  EXPECT_EQ("", err);
+  std::string content;
+  ASSERT_EQ(DiskInterface::Okay, disk_.ReadFile("out", &content, &err));
+  EXPECT_EQ(kContent, content);
+#ifndef _WIN32
+  struct stat st;
+  ASSERT_EQ(0, stat("out", &st));
+  EXPECT_EQ(0751, st.st_mode & 07777);
+#endif
+
+  EXPECT_FALSE(disk_.Copy("missing", "out2", &err));
+  EXPECT_NE("", err);
+}
+
 TEST_F(DiskInterfaceTest, MakeDirs) {
   std::string path = "path/with/double//slash/";
   EXPECT_TRUE(disk_.MakeDirs(path.c_str()));
@@ -139,6 +170,50 @@ TEST_F(DiskInterfaceTest, MakeDirs) {
 #endif
 }
 
+TEST_F(DiskInterfaceTest, MakeDirsInterned) {
+  DirectoryTable table;
+  Directory* dir = table.Intern("path/with/double//slash/");
+  EXPECT_TRUE(disk_.MakeDirs(dir));
+  EXPECT_TRUE(dir->exists);
+  EXPECT_TRUE(dir->parent->exists);
+  EXPECT_TRUE(table.root()->exists);
+  FILE* f = fopen((dir->path + "a_file").c_str(), "w");
+  EXPECT_TRUE(f);
+  EXPECT_EQ(0, fclose(f));
+
+  // A sibling only needs to create itself.
+  Directory* sibling = table.Intern("path/with/double//other/");
+  EXPECT_TRUE(disk_.MakeDirs(sibling));
+  EXPECT_TRUE(sibling->exists);
+  std::string err;
+  EXPECT_GT(disk_.Stat("path/with/double/other", &err), 0);
+}
+
+TEST_F(DiskInterfaceTest, MakeDirsInParallel) {
+  DirectoryTable table;
+  std::vector<Directory*> dirs;
+  for (int i = 0; i < 50; ++i)
+    dirs.push_back(table.Intern("out/" + std::to_string(i % 5) + "/" +
+                                std::to_string(i) + "/"));
+  // A file where a directory should be.
+  ASSERT_TRUE(Touch("blocked"));
+  Directory* blocked = table.Intern("blocked/dir/");
+  dirs.push_back(blocked);
+
+  disk_.MakeDirsInParallel(dirs, 4);
+  std::string err;
+  for (Directory* dir : dirs) {
+    if (dir == blocked)
+      continue;
+    EXPECT_TRUE(dir->exists) << dir->path;
+    EXPECT_TRUE(dir->parent->exists) << dir->path;
+    EXPECT_GT(disk_.Stat(dir->path + ".", &err), 0) << dir->path;
+  }
+  // The failure is left for MakeDirs() to report.
+  EXPECT_FALSE(blocked->exists);
+  EXPECT_FALSE(blocked->parent->exists);
+}
+
 TEST_F(DiskInterfaceTest, RemoveFile) {
   const char* kFileName = "file-to-remove";
   ASSERT_TRUE(Touch(kFileName));
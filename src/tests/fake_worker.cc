@@ -0,0 +1,84 @@
+// Copyright 2018 Frank Benkstein. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A persistent worker for the tests, speaking the protocol described at
+// ninja::Worker.  It understands these commands:
+//
+//   say WORDS...  answers with WORDS and succeeds
+//   fail          answers with an error message and fails
+//   pid           answers with its process id
+//   crash         exits without answering
+//   garble        answers with a broken header
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+namespace {
+
+/// Read a request from stdin into |args|.  Returns false at the end of
+/// input.
+bool ReadRequest(std::vector<std::string>* args) {
+  size_t size;
+  if (scanf("%zu", &size) != 1 || getchar() != '\n')
+    return false;
+  std::string payload(size, '\0');
+  if (fread(&payload[0], 1, size, stdin) != size)
+    return false;
+
+  args->clear();
+  for (size_t begin = 0; begin < payload.size();) {
+    size_t end = payload.find('\0', begin);
+    args->push_back(payload.substr(begin, end - begin));
+    begin = end + 1;
+  }
+  return true;
+}
+
+void Respond(int exit_code, const std::string& output) {
+  printf("%d %zu\n", exit_code, output.size());
+  fwrite(output.data(), 1, output.size(), stdout);
+  fflush(stdout);
+}
+
+}  // namespace
+
+int main() {
+  std::vector<std::string> args;
+  while (ReadRequest(&args)) {
+    if (args.empty()) {
+      Respond(1, "empty request\n");
+    } else if (args[0] == "say") {
+      std::string output;
+      for (size_t i = 1; i < args.size(); ++i)
+        output += (i > 1 ? " " : "") + args[i];
+      Respond(0, output + "\n");
+    } else if (args[0] == "fail") {
+      Respond(1, "failed\n");
+    } else if (args[0] == "pid") {
+      Respond(0, std::to_string(getpid()) + "\n");
+    } else if (args[0] == "crash") {
+      _exit(1);
+    } else if (args[0] == "garble") {
+      printf("garbage\n");
+      fflush(stdout);
+    } else {
+      Respond(127, "unknown command " + args[0] + "\n");
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,184 @@
+// Copyright 2018 Frank Benkstein. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <benchmark/benchmark.h>
+
+#include <ninja/build_log.h>
+#include <ninja/disk_interface.h>
+#include <ninja/eval_env.h>
+#include <ninja/graph.h>
+#include <ninja/state.h>
+
+#include <chrono>
+#include <string>
+
+using namespace ninja;
+
+namespace {
+
+double now() {
+  return std::chrono::duration_cast<std::chrono::duration<double>>(
+             std::chrono::high_resolution_clock::now().time_since_epoch())
+      .count();
+}
+
+/// Pretends that every file exists, with outputs newer than sources, so
+/// that a scan finds nothing to do without touching the disk.
+struct UpToDateDiskInterface : public DiskInterface {
+  TimeStamp Stat(const std::string& path, std::string* err) const override {
+    return path.compare(0, 3, "obj") == 0 || path.compare(0, 3, "lib") == 0
+               ? 2
+               : 1;
+  }
+  bool MakeDir(const std::string& path) override { return true; }
+  bool WriteFile(const std::string& path,
+                 const std::string& contents) override {
+    return true;
+  }
+  Status ReadFile(const std::string& path, std::string* contents,
+                  std::string* err) override {
+    return NotFound;
+  }
+  int RemoveFile(const std::string& path) override { return 1; }
+};
+
+/// |num_objects| compile steps, each with its own source and a few of
+/// |kNumHeaders| shared headers, linked into libraries of |kLibrarySize|
+/// objects below a phony "all".  That's about 2 nodes per object.
+struct ObjectGraph {
+  static const int kNumHeaders = 1000;
+  static const int kHeadersPerObject = 8;
+  static const int kLibrarySize = 500;
+
+  explicit ObjectGraph(int num_objects) : cxx_("cxx") {
+    Edge* all = state_.AddEdge(state_.phony_rule_);
+    Edge* lib = nullptr;
+    for (int i = 0; i < num_objects; ++i) {
+      if (i % kLibrarySize == 0) {
+        lib = state_.AddEdge(&cxx_);
+        std::string lib_name = "lib" + std::to_string(i / kLibrarySize) + ".a";
+        state_.AddOut(lib, lib_name, 0);
+        state_.AddIn(all, lib_name, 0);
+      }
+      std::string n = std::to_string(i);
+      Edge* cxx = state_.AddEdge(&cxx_);
+      state_.AddIn(cxx, "src/" + n + ".cc", 0);
+      for (int h = 0; h < kHeadersPerObject; ++h) {
+        int header = (i * 7 + h * 131) % kNumHeaders;
+        state_.AddIn(cxx, "include/" + std::to_string(header) + ".h", 0);
+      }
+      cxx->implicit_deps_ = kHeadersPerObject;
+      state_.AddOut(cxx, "obj/" + n + ".o", 0);
+      state_.AddIn(lib, "obj/" + n + ".o", 0);
+    }
+    state_.AddOut(all, "all", 0);
+  }
+
+  Rule cxx_;
+  State state_;
+};
+
+}  // namespace
+
+/// A no-op build: all outputs are up to date and there's no build log, so
+/// the time is spent walking the graph and looking at node state.
+static void BM_RecomputeDirtyNoop(benchmark::State& state) {
+  ObjectGraph graph(state.range(0));
+  UpToDateDiskInterface disk_interface;
+  DependencyScan scan(&graph.state_, nullptr, &disk_interface);
+  Node* all = graph.state_.LookupNode("all");
+  std::string err;
+
+  for (auto _ : state) {
+    graph.state_.Reset();
+    auto start = now();
+    bool ok = scan.RecomputeDirty(all, &err);
+    state.SetIterationTime(now() - start);
+    if (!ok || all->dirty()) {
+      state.SkipWithError(ok ? "graph is dirty" : err.c_str());
+      return;
+    }
+  }
+  state.counters["nodes"] = graph.state_.paths_.size();
+}
+BENCHMARK(BM_RecomputeDirtyNoop)
+    ->Unit(benchmark::kMillisecond)
+    ->UseManualTime()
+    ->Arg(10000)
+    ->Arg(500000);
+
+static void BM_StateReset(benchmark::State& state) {
+  ObjectGraph graph(state.range(0));
+
+  for (auto _ : state)
+    graph.state_.Reset();
+  state.counters["nodes"] = graph.state_.paths_.size();
+}
+BENCHMARK(BM_StateReset)
+    ->Unit(benchmark::kMillisecond)
+    ->Arg(10000)
+    ->Arg(500000);
+
+/// A link step with |num_inputs| objects in its response file, which
+/// makes up almost all of the hashed command.
+struct LinkEdge {
+  explicit LinkEdge(int num_inputs) : link_("link") {
+    EvalString command;
+    command.AddText("link @");
+    command.AddSpecial("out");
+    command.AddText(".rsp -o ");
+    command.AddSpecial("out");
+    link_.AddBinding("command", command);
+    EvalString rspfile_content;
+    rspfile_content.AddSpecial("in");
+    link_.AddBinding("rspfile_content", rspfile_content);
+
+    edge_ = state_.AddEdge(&link_);
+    for (int i = 0; i < num_inputs; ++i)
+      state_.AddIn(edge_, "obj/dir" + std::to_string(i % 100) + "/file" +
+                              std::to_string(i) + ".o",
+                   0);
+    state_.AddOut(edge_, "out/libbig.so", 0);
+  }
+
+  Rule link_;
+  State state_;
+  Edge* edge_;
+};
+
+static void BM_HashCommandString(benchmark::State& state) {
+  LinkEdge link(state.range(0));
+  uint64_t hash = 0;
+  for (auto _ : state)
+    hash ^= BuildLog::HashCommand(link.edge_->EvaluateCommand(true));
+  benchmark::DoNotOptimize(hash);
+}
+BENCHMARK(BM_HashCommandString)
+    ->Unit(benchmark::kMicrosecond)
+    ->Arg(100)
+    ->Arg(100000);
+
+static void BM_HashCommandStreaming(benchmark::State& state) {
+  LinkEdge link(state.range(0));
+  uint64_t hash = 0;
+  for (auto _ : state)
+    hash ^= link.edge_->HashCommand();
+  benchmark::DoNotOptimize(hash);
+}
+BENCHMARK(BM_HashCommandStreaming)
+    ->Unit(benchmark::kMicrosecond)
+    ->Arg(100)
+    ->Arg(100000);
+
+BENCHMARK_MAIN();
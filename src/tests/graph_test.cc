@@ -14,6 +14,7 @@
 
 #include <ninja/graph.h>
 #include <ninja/build.h>
+#include <ninja/build_log.h>
 
 #include "test.h"
 
@@ -305,6 +306,45 @@ TEST_F(GraphTest, DepfileOverrideParent) {
   EXPECT_EQ("depfile is y", edge->GetBinding("command"));
 }
 
+// Check that hashing a command piece by piece matches hashing its string.
+TEST_F(GraphTest, HashCommand) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"var = some value\n"
+"rule link\n"
+"  command = link $var @$out.rsp -o $out\n"
+"  rspfile = $out.rsp\n"
+"  rspfile_content = $in_newline $extra\n"
+"rule concat\n"
+"  command = concat $in > $out\n"
+"build a$ b.out: link in1 \"in 2\" in3 | implicit\n"
+"  extra = --flag\n"
+"build c: concat\n"
+"build d: concat in1 in$$4\n"));
+  for (const char* output : { "a b.out", "c", "d" }) {
+    Edge* edge = GetNode(output)->in_edge();
+    EXPECT_EQ(BuildLog::HashCommand(edge->EvaluateCommand(true)),
+              edge->HashCommand())
+        << output;
+  }
+  EXPECT_NE(GetNode("c")->in_edge()->HashCommand(),
+            GetNode("d")->in_edge()->HashCommand());
+}
+
+// Check that only the command sees a replaced $rspfile.
+TEST_F(GraphTest, EvaluateCommandWithRspfile) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule link\n"
+"  command = link @$rspfile -o $out\n"
+"  rspfile = $out.rsp\n"
+"  rspfile_content = $in $rspfile\n"
+"build out: link in1 in2\n"));
+  Edge* edge = GetNode("out")->in_edge();
+  EXPECT_EQ("link @/proc/self/fd/3 -o out",
+            edge->EvaluateCommandWithRspfile("/proc/self/fd/3"));
+  EXPECT_EQ("link @out.rsp -o out", edge->EvaluateCommand());
+  EXPECT_EQ("in1 in2 out.rsp", edge->GetBinding("rspfile_content"));
+}
+
 // Verify that building a nested phony rule prints "no work to do"
 TEST_F(GraphTest, NestedPhonyPrintsDone) {
   AssertParse(&state_,
@@ -13,9 +13,17 @@
 // limitations under the License.
 
 #include <ninja/build_log.h>
+#include <ninja/hash_map.h>
 
 #include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 
@@ -30,7 +38,90 @@ void RandomCommand(char** s) {
     (*s)[i] = (char)random(32, 127);
 }
 
-int main() {
+/// Paths shaped like those in a large build: object files spread over a
+/// tree of nested directories below a common build directory.
+std::vector<std::string> RandomPaths(int count) {
+  std::vector<std::string> dirs = { "out/Release/obj/" };
+  while ((int)dirs.size() < count / 50) {
+    const std::string& parent = dirs[random(0, (int)dirs.size() - 1)];
+    dirs.push_back(parent + std::string(random(3, 15), (char)random('a', 'z')) +
+                   "_" + std::to_string(dirs.size()) + "/");
+  }
+  std::vector<std::string> paths;
+  for (int i = 0; i < count; ++i) {
+    paths.push_back(dirs[random(0, (int)dirs.size() - 1)] + "file" +
+                    std::to_string(i) + ".o");
+  }
+  return paths;
+}
+
+/// Read one path per line, e.g. the output of "ninja -t targets all".
+std::vector<std::string> ReadPaths(const char* filename) {
+  std::vector<std::string> paths;
+  FILE* f = fopen(filename, "r");
+  if (!f) {
+    perror(filename);
+    exit(1);
+  }
+  char line[4096];
+  while (fgets(line, sizeof(line), f)) {
+    std::string path = line;
+    if (!path.empty() && path.back() == '\n')
+      path.pop_back();
+    // Keep only the path of "path: rule" lines.
+    path = path.substr(0, path.rfind(": "));
+    if (!path.empty())
+      paths.push_back(path);
+  }
+  fclose(f);
+  return paths;
+}
+
+double Now() {
+  return std::chrono::duration_cast<std::chrono::duration<double>>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+template <typename Map>
+void BenchMap(const char* name, const std::vector<std::string>& paths,
+              const std::vector<std::string>& lookups) {
+  Map map;
+  double start = Now();
+  for (size_t i = 0; i < paths.size(); ++i)
+    map[paths[i]] = (int)i;
+  double insert_time = Now() - start;
+
+  start = Now();
+  long found = 0;
+  for (const std::string& path : lookups) {
+    auto i = map.find(path);
+    if (i != map.end())
+      found += i->second;
+  }
+  double lookup_time = Now() - start;
+
+  printf("%-24s insert %6.1f ns  lookup %6.1f ns  (%ld)\n", name,
+         insert_time * 1e9 / paths.size(), lookup_time * 1e9 / lookups.size(),
+         found);
+}
+
+void BenchMaps(std::vector<std::string> paths) {
+  // Insert in one order, look up in another, as a build does.
+  std::sort(paths.begin(), paths.end());
+  paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+  std::vector<std::string> lookups = paths;
+  std::shuffle(lookups.begin(), lookups.end(), std::mt19937(rand()));
+  std::shuffle(paths.begin(), paths.end(), std::mt19937(rand()));
+  printf("%zu unique paths\n", paths.size());
+
+  BenchMap<std::unordered_map<std::string_view, int, ninja::MurmurHash2Hash>>(
+      "unordered_map/Murmur2", paths, lookups);
+  BenchMap<ninja::ExternalStringHashMap<int>::Type>("ExternalStringHashMap",
+                                                    paths, lookups);
+}
+
+int main(int argc, char** argv) {
   const int N = 20 * 1000 * 1000;
 
   // Leak these, else 10% of the runtime is spent destroying strings.
@@ -58,4 +149,6 @@ int main() {
     }
   }
   printf("\n\n%d collisions after %d runs\n", collision_count, N);
+
+  BenchMaps(argc > 1 ? ReadPaths(argv[1]) : RandomPaths(1000 * 1000));
 }
@@ -0,0 +1,51 @@
+// Copyright 2013 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <ninja/line_printer.h>
+
+#include <ninja/util.h>
+
+#include "test.h"
+
+using namespace ninja;
+
+#ifndef _WIN32
+TEST(LinePrinterTest, WriteElidedMatchesElideMiddle) {
+  LinePrinter printer;
+  // Both parities, with widths from the smallest up to past the cutoff.
+  for (std::string line : { "0123456789abcdefghij", "0123456789abcdefghijk" }) {
+    for (size_t width = 3; width <= line.size() + 6; ++width) {
+      std::string written;
+      {
+        ScopedStdoutCapture capture;
+        printer.WriteElided(line, width);
+        written = capture.Read();
+      }
+      EXPECT_EQ("\r" + ElideMiddle(line, width) + "\x1B[K", written)
+          << "width " << width;
+    }
+  }
+}
+
+TEST(LinePrinterTest, WriteElidedUnknownWidth) {
+  LinePrinter printer;
+  std::string written;
+  {
+    ScopedStdoutCapture capture;
+    printer.WriteElided("0123456789", 0);
+    written = capture.Read();
+  }
+  EXPECT_EQ("\r0123456789\x1B[K", written);
+}
+#endif  // _WIN32
@@ -906,6 +906,48 @@ TEST_F(ParserTest, MultipleOutputsWithDeps) {
       err);
 }
 
+TEST_F(ParserTest, Builtin) {
+  State local_state;
+  ManifestParser parser(&local_state, nullptr);
+  std::string err;
+  EXPECT_TRUE(parser.ParseTest("rule copy\n  command = cp $in $out\n"
+                               "  builtin = copy\n"
+                               "build a b: copy c d | e\n",
+                               &err));
+  EXPECT_EQ("", err);
+
+  EXPECT_FALSE(parser.ParseTest("build f: copy g h\n", &err));
+  EXPECT_EQ("input:2: builtin copy needs as many explicit inputs as explicit "
+            "outputs\n",
+            err);
+
+  err.clear();
+  EXPECT_FALSE(parser.ParseTest("build i: copy j\n  builtin = rm\n", &err));
+  EXPECT_EQ("input:3: unknown builtin 'rm'\n", err);
+}
+
+TEST_F(ParserTest, Batch) {
+  State local_state;
+  ManifestParser parser(&local_state, nullptr);
+  std::string err;
+  EXPECT_TRUE(parser.ParseTest("rule cc\n  command = cc $in -o $out\n"
+                               "  batch = 8\n"
+                               "build a.o b.o: cc a.c b.c\n",
+                               &err));
+  EXPECT_EQ("", err);
+  EXPECT_EQ(8, local_state.edges_[0]->GetBatchSize());
+
+  EXPECT_FALSE(parser.ParseTest("build c.o: cc c.c\n  batch = none\n", &err));
+  EXPECT_EQ("input:3: batch must be a positive number\n", err);
+
+  err.clear();
+  EXPECT_FALSE(parser.ParseTest("build d.o: cc d.c\n  depfile = d.o.d\n",
+                                &err));
+  EXPECT_EQ("input:3: batch can't be combined with builtin, deps, depfile or "
+            "rspfile\n",
+            err);
+}
+
 TEST_F(ParserTest, SubNinja) {
   fs_.Create("test.ninja",
              "var = inner\n"
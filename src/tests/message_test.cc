@@ -70,3 +70,13 @@ TEST(MessageTest, EXPLAIN_ON) {
   ASSERT_EXIT(f(), ::testing::ExitedWithCode(13),
               "ninja explain: the thing happened");
 }
+
+TEST(MessageTest, TRACE_ON) {
+  auto f = [] {
+    ninja::g_tracing = true;
+    ninja::TRACE("the %s happened", "thing");
+    std::exit(13);
+  };
+  ASSERT_EXIT(f(), ::testing::ExitedWithCode(13),
+              "ninja trace: the thing happened");
+}
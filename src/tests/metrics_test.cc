@@ -0,0 +1,100 @@
+// Copyright 2018 Frank Benkstein. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <ninja/metrics.h>
+
+#include <thread>
+#include <vector>
+
+#include "test.h"
+
+using namespace ninja;
+
+namespace {
+
+TEST(HistogramTest, Buckets) {
+  for (uint64_t value : { 0ull, 1ull, 63ull, 64ull, 65ull, 127ull, 128ull,
+                          1000ull, 123456789ull, ~0ull }) {
+    size_t index = Histogram::BucketIndex(value);
+    EXPECT_GE(Histogram::BucketMax(index), value) << value;
+    if (index > 0) {
+      EXPECT_LT(Histogram::BucketMax(index - 1), value) << value;
+    }
+    // Buckets are no wider than 1/32 of their values.
+    uint64_t min = index > 0 ? Histogram::BucketMax(index - 1) + 1 : 0;
+    EXPECT_LE(Histogram::BucketMax(index) - min, min / 32) << value;
+  }
+}
+
+TEST(HistogramTest, Percentiles) {
+  Histogram histogram;
+  EXPECT_EQ(0u, histogram.Percentile(0.5));
+
+  for (uint64_t value = 1; value <= 1000; ++value)
+    histogram.Record(value);
+  EXPECT_EQ(1000u, histogram.count());
+  EXPECT_EQ(500500u, histogram.sum());
+  EXPECT_EQ(1000u, histogram.max());
+
+  EXPECT_GE(histogram.Percentile(0.5), 500u);
+  EXPECT_LE(histogram.Percentile(0.5), 500u + 500u / 32);
+  EXPECT_GE(histogram.Percentile(0.99), 990u);
+  EXPECT_LE(histogram.Percentile(0.99), 1000u);
+  EXPECT_EQ(1000u, histogram.Percentile(1));
+  EXPECT_EQ(1u, histogram.Percentile(0));
+}
+
+TEST(HistogramTest, Merge) {
+  Histogram small, large;
+  small.Record(3);
+  large.Record(3000);
+  large.Record(5000);
+  small.Merge(large);
+  EXPECT_EQ(3u, small.count());
+  EXPECT_EQ(8003u, small.sum());
+  EXPECT_EQ(5000u, small.max());
+  EXPECT_EQ(3u, small.Percentile(0.3));
+}
+
+TEST(MetricsTest, CollectsAllThreads) {
+  Metrics metrics;
+  Metric* metric = metrics.NewMetric("test \"metric\"");
+  { ScopedMetric scoped(metric); }
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 3; ++i) {
+    threads.emplace_back([metric] {
+      for (int j = 0; j < 10; ++j)
+        ScopedMetric scoped(metric);
+    });
+  }
+  for (std::thread& thread : threads)
+    thread.join();
+
+  // The main thread's histogram is still live, the others have exited.
+  EXPECT_EQ(31u, metrics.Collect(metric).count());
+
+  std::string json = metrics.ToJSON();
+  EXPECT_NE(std::string::npos,
+            json.find("{\"name\":\"test \\\"metric\\\"\",\"count\":31,"));
+
+  std::string prom = metrics.ToPrometheus();
+  EXPECT_NE(std::string::npos,
+            prom.find("ninja_metric_duration_seconds_count{metric="
+                      "\"test \\\"metric\\\"\"} 31\n"));
+  EXPECT_NE(std::string::npos,
+            prom.find("# TYPE ninja_metric_duration_seconds summary\n"));
+}
+
+}  // namespace
@@ -0,0 +1,111 @@
+// Copyright 2018 Frank Benkstein. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <ninja/graph.h>
+#include <ninja/state.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+using namespace ninja;
+
+int random(int low, int high) {
+  return int(low + (rand() / double(RAND_MAX)) * (high - low) + 0.5);
+}
+
+std::string RandomName(int min_len, int max_len) {
+  int len = random(min_len, max_len);
+  std::string s;
+  for (int i = 0; i < len; ++i)
+    s += (char)random('a', 'z');
+  return s;
+}
+
+/// A path below one of |dirs| with an object-file like basename.
+std::string RandomPath(const std::vector<std::string>& dirs) {
+  return dirs[random(0, (int)dirs.size() - 1)] + RandomName(4, 20) + ".o";
+}
+
+size_t HeapInUse() {
+#ifdef __GLIBC__
+  return mallinfo2().uordblks;
+#else
+  return 0;
+#endif
+}
+
+double Now() {
+  return std::chrono::duration_cast<std::chrono::duration<double>>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+int main() {
+  const int kNumDirs = 20 * 1000;
+  const int N = 1000 * 1000;
+
+  srand((int)time(nullptr));
+
+  // A directory tree with long shared prefixes, like a typical build dir.
+  std::vector<std::string> dirs = { "out/Release/obj/" };
+  while ((int)dirs.size() < kNumDirs) {
+    const std::string& parent = dirs[random(0, (int)dirs.size() - 1)];
+    dirs.push_back(parent + RandomName(3, 15) + "/");
+  }
+
+  std::vector<std::string> paths;
+  for (int i = 0; i < N; ++i)
+    paths.push_back(RandomPath(dirs));
+  size_t path_bytes = 0;
+  for (const std::string& path : paths)
+    path_bytes += path.size();
+
+  State* state = new State;
+  size_t heap_before = HeapInUse();
+  double start = Now();
+  for (const std::string& path : paths)
+    state->GetNode(path, 0);
+  double insert_time = Now() - start;
+  size_t heap_after = HeapInUse();
+
+  std::shuffle(paths.begin(), paths.end(), std::mt19937(rand()));
+  start = Now();
+  int found = 0;
+  for (const std::string& path : paths)
+    found += state->LookupNode(path) != nullptr;
+  double lookup_time = Now() - start;
+
+  printf("%d nodes in %zu directories, %.1f bytes of path per node\n",
+         state->node_count(), state->directories_.size(),
+         path_bytes / (double)N);
+  if (heap_before != 0) {
+    printf("heap: %.1f bytes per node\n",
+           (heap_after - heap_before) / (double)state->node_count());
+  }
+  printf("GetNode: %.1f ns per insert\n", insert_time * 1e9 / N);
+  printf("LookupNode: %.1f ns per lookup (%d found)\n", lookup_time * 1e9 / N,
+         found);
+
+  // Leak |state|, destroying it isn't what we're measuring.
+}
@@ -0,0 +1,137 @@
+// Copyright 2018 Frank Benkstein. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <benchmark/benchmark.h>
+
+#include <ninja/build.h>
+#include <ninja/eval_env.h>
+#include <ninja/graph.h>
+#include <ninja/state.h>
+
+#include <chrono>
+#include <string>
+
+using namespace ninja;
+
+namespace {
+
+double now() {
+  return std::chrono::duration_cast<std::chrono::duration<double>>(
+             std::chrono::high_resolution_clock::now().time_since_epoch())
+      .count();
+}
+
+/// A header-heavy graph: a generated header that every compile step depends
+/// on, |num_headers| shared headers as implicit inputs of each of the
+/// |num_objects| compile steps and one link step over all objects.
+struct WideGraph {
+  WideGraph(int num_objects, int num_headers) : cxx_("cxx") {
+    Edge* gen = state_.AddEdge(&cxx_);
+    state_.AddIn(gen, "gen.in", 0);
+    state_.AddOut(gen, "gen.h", 0);
+
+    link_ = state_.AddEdge(&cxx_);
+    for (int i = 0; i < num_objects; ++i) {
+      std::string n = std::to_string(i);
+      Edge* cxx = state_.AddEdge(&cxx_);
+      state_.AddIn(cxx, "src" + n + ".cc", 0);
+      state_.AddIn(cxx, "gen.h", 0);
+      for (int h = 0; h < num_headers; ++h)
+        state_.AddIn(cxx, "header" + std::to_string(h) + ".h", 0);
+      cxx->implicit_deps_ = num_headers + 1;
+      state_.AddOut(cxx, "obj" + n + ".o", 0);
+      state_.AddIn(link_, "obj" + n + ".o", 0);
+    }
+    state_.AddOut(link_, "out", 0);
+  }
+
+  /// Mark everything generated as dirty, as after a change of gen.in.
+  void MarkDirty() {
+    state_.Reset();
+    for (const auto& edge : state_.edges_) {
+      for (Node* input : edge->inputs_) {
+        if (!input->in_edge())
+          input->set_dirty(false);
+      }
+      for (Node* output : edge->outputs_)
+        output->MarkDirty();
+    }
+  }
+
+  Node* target() const { return link_->outputs_[0]; }
+
+  Rule cxx_;
+  State state_;
+  Edge* link_;
+};
+
+}  // namespace
+
+static void BM_PlanAddTarget(benchmark::State& state) {
+  WideGraph graph(state.range(0), state.range(1));
+  std::string err;
+
+  for (auto _ : state) {
+    graph.MarkDirty();
+    Plan plan;
+    auto start = now();
+    plan.AddTarget(graph.target(), &err);
+    state.SetIterationTime(now() - start);
+    if (!err.empty()) {
+      state.SkipWithError(err.c_str());
+      return;
+    }
+  }
+}
+BENCHMARK(BM_PlanAddTarget)
+    ->Unit(benchmark::kMillisecond)
+    ->UseManualTime()
+    ->Args({ 1000, 100 })
+    ->Args({ 10000, 1000 })
+    ->Args({ 100000, 10 });
+
+static void BM_PlanEdgeFinished(benchmark::State& state) {
+  WideGraph graph(state.range(0), state.range(1));
+  std::string err;
+
+  for (auto _ : state) {
+    graph.MarkDirty();
+    Plan plan;
+    plan.AddTarget(graph.target(), &err);
+    if (!err.empty()) {
+      state.SkipWithError(err.c_str());
+      return;
+    }
+
+    auto start = now();
+    int finished = 0;
+    while (Edge* edge = plan.FindWork()) {
+      plan.EdgeFinished(edge, Plan::kEdgeSucceeded);
+      ++finished;
+    }
+    state.SetIterationTime(now() - start);
+    if (finished != state.range(0) + 2) {
+      state.SkipWithError("plan did not finish all edges");
+      return;
+    }
+  }
+}
+BENCHMARK(BM_PlanEdgeFinished)
+    ->Unit(benchmark::kMillisecond)
+    ->UseManualTime()
+    ->Args({ 1000, 100 })
+    ->Args({ 10000, 1000 })
+    ->Args({ 100000, 10 });
+
+BENCHMARK_MAIN();
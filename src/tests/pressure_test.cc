@@ -0,0 +1,138 @@
+// Copyright 2018 Frank Benkstein. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <ninja/pressure.h>
+
+#include "test.h"
+
+using namespace ninja;
+
+namespace {
+
+/// A PressureSource returning a fixed sample that tests can change.
+struct FakePressureSource : public PressureSource {
+  FakePressureSource() : available(true), samples(0) {}
+  virtual bool Sample(PressureSample* out) {
+    ++samples;
+    *out = sample;
+    return available;
+  }
+
+  PressureSample sample;
+  bool available;
+  int samples;
+};
+
+}  // namespace
+
+TEST(PressureTest, ParseLine) {
+  const char kContents[] =
+      "some avg10=12.50 avg60=3.00 avg300=0.10 total=123456\n"
+      "full avg10=1.25 avg60=0.00 avg300=0.00 total=789\n";
+  PressureLine line;
+  EXPECT_TRUE(ParsePressureLine(kContents, "some", &line));
+  EXPECT_EQ(12.5, line.avg10);
+  EXPECT_EQ(123456u, line.total);
+
+  EXPECT_TRUE(ParsePressureLine(kContents, "full", &line));
+  EXPECT_EQ(1.25, line.avg10);
+  EXPECT_EQ(789u, line.total);
+}
+
+TEST(PressureTest, ParseLineMissingOrMalformed) {
+  PressureLine line;
+  EXPECT_FALSE(ParsePressureLine("", "some", &line));
+  EXPECT_FALSE(ParsePressureLine(
+      "some avg10=0.00 avg60=0.00 avg300=0.00 total=0\n", "full", &line));
+  EXPECT_FALSE(ParsePressureLine("some avg10=x total=0\n", "some", &line));
+  EXPECT_FALSE(ParsePressureLine("some avg10=1.0\n", "some", &line));
+  EXPECT_FALSE(ParsePressureLine("somewhat avg10=1.0 total=3", "some", &line));
+}
+
+TEST(PressureTest, ShrinkUnderPressure) {
+  FakePressureSource source;
+  ParallelismController controller(1, 16, 20.0, &source);
+  EXPECT_EQ(16, controller.limit());
+
+  source.sample.memory = 50.0;
+  EXPECT_EQ(12, controller.Limit(16, 1000));
+  // Within the sample interval nothing changes.
+  EXPECT_EQ(12, controller.Limit(12, 1100));
+  EXPECT_EQ(1, source.samples);
+
+  EXPECT_EQ(9, controller.Limit(12, 1500));
+  EXPECT_EQ(7, controller.Limit(9, 2000));
+  EXPECT_EQ(6, controller.Limit(7, 2500));
+  EXPECT_EQ(5, controller.Limit(6, 3000));
+  EXPECT_EQ(4, controller.Limit(5, 3500));
+  EXPECT_EQ(3, controller.Limit(4, 4000));
+  EXPECT_EQ(2, controller.Limit(3, 4500));
+  EXPECT_EQ(1, controller.Limit(2, 5000));
+  // Never below the floor.
+  EXPECT_EQ(1, controller.Limit(1, 5500));
+}
+
+TEST(PressureTest, SampleAtTimeZero) {
+  FakePressureSource source;
+  ParallelismController controller(1, 16, 20.0, &source);
+  source.sample.cpu = 50.0;
+  EXPECT_EQ(12, controller.Limit(16, 0));
+  // A first sample at time 0 still starts the interval.
+  EXPECT_EQ(12, controller.Limit(12, 100));
+  EXPECT_EQ(1, source.samples);
+  EXPECT_EQ(9, controller.Limit(12, 500));
+  EXPECT_EQ(2, source.samples);
+}
+
+TEST(PressureTest, GrowOnlyWhenSaturated) {
+  FakePressureSource source;
+  ParallelismController controller(2, 8, 20.0, &source);
+
+  source.sample.io = 100.0;
+  EXPECT_EQ(6, controller.Limit(8, 1000));
+
+  // Low pressure, but not all slots are in use: keep the limit.
+  source.sample.io = 0.0;
+  EXPECT_EQ(6, controller.Limit(3, 1500));
+  // Low pressure and saturated: grow by one up to the ceiling.
+  EXPECT_EQ(7, controller.Limit(6, 2000));
+  EXPECT_EQ(8, controller.Limit(7, 2500));
+  EXPECT_EQ(8, controller.Limit(8, 3000));
+
+  // Between half the threshold and the threshold the limit is stable.
+  source.sample.cpu = 15.0;
+  EXPECT_EQ(8, controller.Limit(8, 3500));
+}
+
+TEST(PressureTest, FloorClamped) {
+  FakePressureSource source;
+  source.sample.cpu = 100.0;
+  // A floor above the ceiling keeps the limit at the ceiling.
+  ParallelismController high(8, 4, 10.0, &source);
+  EXPECT_EQ(4, high.Limit(4, 1000));
+  // A floor below 1 still leaves one job.
+  ParallelismController low(0, 2, 10.0, &source);
+  EXPECT_EQ(1, low.Limit(2, 1000));
+  EXPECT_EQ(1, low.Limit(1, 2000));
+}
+
+TEST(PressureTest, Unavailable) {
+  FakePressureSource source;
+  source.available = false;
+  ParallelismController controller(1, 4, 10.0, &source);
+  EXPECT_EQ(4, controller.Limit(4, 1000));
+  EXPECT_FALSE(controller.available());
+  EXPECT_EQ(4, controller.Limit(4, 2000));
+  EXPECT_EQ(1, source.samples);
+}
@@ -47,4 +47,24 @@ TEST(State, Basic) {
   EXPECT_FALSE(state.GetNode("out", 0)->dirty());
 }
 
+TEST(State, NodeIndices) {
+  State state;
+
+  // Create enough nodes to need more than one chunk of storage.
+  std::vector<Node*> nodes;
+  for (int i = 0; i < State::kNodeChunkSize + 10; ++i)
+    nodes.push_back(state.GetNode("n" + std::to_string(i), 0));
+
+  EXPECT_EQ(State::kNodeChunkSize + 10, state.node_count());
+  for (int i = 0; i < (int)nodes.size(); ++i) {
+    EXPECT_EQ(i, nodes[i]->index());
+    // Nodes never move once created.
+    EXPECT_EQ(nodes[i], state.LookupNode("n" + std::to_string(i)));
+  }
+
+  // Looking up an existing node doesn't allocate a new index.
+  EXPECT_EQ(nodes[0], state.GetNode("n0", 0));
+  EXPECT_EQ(State::kNodeChunkSize + 10, state.node_count());
+}
+
 }  // namespace
@@ -0,0 +1,154 @@
+// Copyright 2018 Frank Benkstein. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <benchmark/benchmark.h>
+
+#include <ninja/spawn_server.h>
+#include <ninja/subprocess.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <memory>
+#include <vector>
+
+using namespace ninja;
+
+namespace {
+
+/// Run |count| commands, at most |parallelism| at a time, like a build
+/// full of tiny edges.
+bool RunCommands(SubprocessSet* subprocs, int count, int parallelism,
+                 bool force_shell) {
+  int started = 0;
+  int finished = 0;
+  while (finished < count) {
+    while (started < count &&
+           static_cast<int>(subprocs->running_.size()) < parallelism) {
+      if (!subprocs->Add("true", false, force_shell))
+        return false;
+      ++started;
+    }
+    subprocs->DoWork();
+    while (std::unique_ptr<Subprocess> subproc = subprocs->NextFinished()) {
+      if (subproc->Finish() != ExitSuccess)
+        return false;
+      ++finished;
+    }
+  }
+  return true;
+}
+
+/// Grow the process by |megabytes| of touched memory, like a large build
+/// graph does.
+std::vector<char> Ballast(int megabytes) {
+  std::vector<char> ballast(size_t(megabytes) << 20);
+  for (size_t i = 0; i < ballast.size(); i += 4096)
+    ballast[i] = 1;
+  return ballast;
+}
+
+}  // namespace
+
+static void BM_SpawnShell(benchmark::State& state) {
+  SubprocessSet subprocs;
+  for (auto _ : state) {
+    if (!RunCommands(&subprocs, 100, state.range(0), true)) {
+      state.SkipWithError("command failed");
+      return;
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * 100);
+}
+BENCHMARK(BM_SpawnShell)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime()
+    ->Arg(1)
+    ->Arg(8);
+
+static void BM_SpawnDirect(benchmark::State& state) {
+  SubprocessSet subprocs;
+  for (auto _ : state) {
+    if (!RunCommands(&subprocs, 100, state.range(0), false)) {
+      state.SkipWithError("command failed");
+      return;
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * 100);
+}
+BENCHMARK(BM_SpawnDirect)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime()
+    ->Arg(1)
+    ->Arg(8);
+
+/// Spawn rate against the size of the parent: directly with posix_spawn(),
+/// and through a spawn server started while the process was small.
+static void BM_SpawnWithRss(benchmark::State& state, bool use_server) {
+  SpawnServer server;
+  if (use_server && !server.Start()) {
+    state.SkipWithError("can't start spawn server");
+    return;
+  }
+  std::vector<char> ballast = Ballast(state.range(0));
+  SubprocessSet subprocs;
+  subprocs.spawn_server_ = use_server ? &server : nullptr;
+  for (auto _ : state) {
+    if (!RunCommands(&subprocs, 100, 1, false)) {
+      state.SkipWithError("command failed");
+      return;
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * 100);
+}
+BENCHMARK_CAPTURE(BM_SpawnWithRss, posix_spawn, false)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime()
+    ->Arg(16)
+    ->Arg(1024)
+    ->Arg(2048);
+BENCHMARK_CAPTURE(BM_SpawnWithRss, spawn_server, true)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime()
+    ->Arg(16)
+    ->Arg(1024)
+    ->Arg(2048);
+
+/// For reference: what posix_spawn() costs where it has to fork.
+static void BM_ForkExecWithRss(benchmark::State& state) {
+  std::vector<char> ballast = Ballast(state.range(0));
+  for (auto _ : state) {
+    for (int i = 0; i < 100; ++i) {
+      pid_t pid = fork();
+      if (pid == 0) {
+        execl("/bin/true", "true", nullptr);
+        _exit(127);
+      }
+      int status;
+      if (pid < 0 || waitpid(pid, &status, 0) < 0 || status != 0) {
+        state.SkipWithError("command failed");
+        return;
+      }
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * 100);
+}
+BENCHMARK(BM_ForkExecWithRss)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime()
+    ->Arg(16)
+    ->Arg(1024)
+    ->Arg(2048);
+
+BENCHMARK_MAIN();
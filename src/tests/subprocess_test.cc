@@ -16,10 +16,16 @@
 
 #include "test.h"
 
+#ifndef _WIN32
+#include <ninja/metrics.h>
+#include <ninja/spawn_server.h>
+#endif
+
 #ifndef _WIN32
 // SetWithLots need setrlimit.
 #include <stdio.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <unistd.h>
 #endif
@@ -76,6 +82,57 @@ TEST_F(SubprocessTest, NoSuchCommand) {
 
 #ifndef _WIN32
 
+// DoWork() with a zero timeout only polls.
+TEST_F(SubprocessTest, DoWorkTimeout) {
+  Subprocess* subproc = subprocs_.Add("sleep 1");
+  ASSERT_NE((Subprocess*)0, subproc);
+
+  EXPECT_FALSE(subprocs_.DoWork(0));
+  EXPECT_FALSE(subproc->Done());
+  EXPECT_FALSE(subprocs_.NextFinished());
+
+  while (!subproc->Done()) {
+    subprocs_.DoWork();
+  }
+
+  EXPECT_EQ(ExitSuccess, subproc->Finish());
+}
+
+// Commands without shell syntax are split and run directly.
+TEST_F(SubprocessTest, DirectExec) {
+  Subprocess* subproc =
+      subprocs_.Add("sh -c 'echo \"$0:$1\"' 'a  b' \"c d\"");
+  ASSERT_NE((Subprocess*)0, subproc);
+
+  while (!subproc->Done()) {
+    subprocs_.DoWork();
+  }
+
+  EXPECT_EQ(ExitSuccess, subproc->Finish());
+  EXPECT_EQ("a  b:c d\n", subproc->GetOutput());
+}
+
+// The shell runs scripts without #!, so those fall back to it.
+TEST_F(SubprocessTest, DirectExecScriptWithoutInterpreter) {
+  const char kScript[] = "SubprocessTest-script";
+  FILE* f = fopen(kScript, "w");
+  ASSERT_TRUE(f);
+  fputs("echo script\n", f);
+  fclose(f);
+  chmod(kScript, 0755);
+
+  Subprocess* subproc = subprocs_.Add(std::string("./") + kScript);
+  ASSERT_NE((Subprocess*)0, subproc);
+
+  while (!subproc->Done()) {
+    subprocs_.DoWork();
+  }
+
+  EXPECT_EQ(ExitSuccess, subproc->Finish());
+  EXPECT_EQ("script\n", subproc->GetOutput());
+  unlink(kScript);
+}
+
 TEST_F(SubprocessTest, InterruptChild) {
   Subprocess* subproc = subprocs_.Add("kill -INT $$");
   ASSERT_NE((Subprocess*)0, subproc);
@@ -262,3 +319,130 @@ TEST_F(SubprocessTest, ReadStdin) {
   ASSERT_EQ(1u, subprocs_.finished_.size());
 }
 #endif  // _WIN32
+
+#ifndef _WIN32
+namespace {
+
+/// Send |command| to a fake worker and wait for the answer.
+Subprocess* RunWorkerRequest(SubprocessSet* subprocs, const char* command) {
+  Subprocess* subproc = subprocs->AddWorkerRequest(NINJA_FAKE_WORKER, command);
+  if (subproc) {
+    while (!subproc->Done())
+      subprocs->DoWork();
+  }
+  return subproc;
+}
+
+}  // anonymous namespace
+
+TEST_F(SubprocessTest, WorkerRequest) {
+  Subprocess* subproc = RunWorkerRequest(&subprocs_, "say hello 'big world'");
+  ASSERT_NE((Subprocess*)0, subproc);
+  EXPECT_FALSE(subproc->worker_lost());
+  EXPECT_EQ(ExitSuccess, subproc->Finish());
+  EXPECT_EQ("hello big world\n", subproc->GetOutput());
+
+  subproc = RunWorkerRequest(&subprocs_, "fail");
+  ASSERT_NE((Subprocess*)0, subproc);
+  EXPECT_FALSE(subproc->worker_lost());
+  EXPECT_EQ(ExitFailure, subproc->Finish());
+  EXPECT_EQ("failed\n", subproc->GetOutput());
+
+  // Commands that need a shell can't be sent to a worker.
+  EXPECT_EQ((Subprocess*)0,
+            subprocs_.AddWorkerRequest(NINJA_FAKE_WORKER, "say hi > out"));
+}
+
+TEST_F(SubprocessTest, WorkerReuse) {
+  // A busy worker doesn't take another request.
+  Subprocess* first = subprocs_.AddWorkerRequest(NINJA_FAKE_WORKER, "pid");
+  Subprocess* second = subprocs_.AddWorkerRequest(NINJA_FAKE_WORKER, "pid");
+  ASSERT_NE((Subprocess*)0, first);
+  ASSERT_NE((Subprocess*)0, second);
+  while (!first->Done() || !second->Done())
+    subprocs_.DoWork();
+  EXPECT_NE(first->GetOutput(), second->GetOutput());
+
+  // An idle one does.
+  Subprocess* third = RunWorkerRequest(&subprocs_, "pid");
+  ASSERT_NE((Subprocess*)0, third);
+  EXPECT_EQ(ExitSuccess, third->Finish());
+  EXPECT_TRUE(third->GetOutput() == first->GetOutput() ||
+              third->GetOutput() == second->GetOutput());
+}
+
+TEST_F(SubprocessTest, WorkerCrash) {
+  Subprocess* subproc = RunWorkerRequest(&subprocs_, "pid");
+  ASSERT_NE((Subprocess*)0, subproc);
+  std::string pid = subproc->GetOutput();
+
+  subproc = RunWorkerRequest(&subprocs_, "crash");
+  ASSERT_NE((Subprocess*)0, subproc);
+  EXPECT_TRUE(subproc->worker_lost());
+  EXPECT_EQ(ExitFailure, subproc->Finish());
+
+  // The next request gets a new worker.
+  subproc = RunWorkerRequest(&subprocs_, "pid");
+  ASSERT_NE((Subprocess*)0, subproc);
+  EXPECT_EQ(ExitSuccess, subproc->Finish());
+  EXPECT_NE(pid, subproc->GetOutput());
+
+  subproc = RunWorkerRequest(&subprocs_, "garble");
+  ASSERT_NE((Subprocess*)0, subproc);
+  EXPECT_TRUE(subproc->worker_lost());
+}
+
+TEST_F(SubprocessTest, WorkerBroken) {
+  // A worker that never answers isn't started again.
+  Subprocess* subproc = subprocs_.AddWorkerRequest("exit 1", "say hi");
+  ASSERT_TRUE(subproc);
+  while (!subproc->Done())
+    subprocs_.DoWork();
+  EXPECT_TRUE(subproc->worker_lost());
+  EXPECT_EQ((Subprocess*)0, subprocs_.AddWorkerRequest("exit 1", "say hi"));
+}
+
+TEST_F(SubprocessTest, WorkerLargeRequest) {
+  // Much more than fits into the socket at once.
+  std::string word(1 << 20, 'x');
+  Subprocess* subproc = RunWorkerRequest(&subprocs_, ("say " + word).c_str());
+  ASSERT_NE((Subprocess*)0, subproc);
+  EXPECT_EQ(ExitSuccess, subproc->Finish());
+  EXPECT_EQ(word + "\n", subproc->GetOutput());
+}
+
+TEST_F(SubprocessTest, WorkerSlowToRead) {
+  // Sending a request doesn't wait for the worker to read it.
+  int64_t start = GetTimeMillis();
+  std::string word(1 << 20, 'x');
+  Subprocess* subproc = subprocs_.AddWorkerRequest("sleep 10", "say " + word);
+  ASSERT_NE((Subprocess*)0, subproc);
+  EXPECT_FALSE(subproc->Done());
+  EXPECT_LT(GetTimeMillis() - start, 5000);
+  EXPECT_FALSE(subprocs_.DoWork(10));
+  EXPECT_FALSE(subproc->Done());
+}
+#endif  // !_WIN32
+
+#ifndef _WIN32
+TEST_F(SubprocessTest, SpawnServer) {
+  SpawnServer server;
+  ASSERT_TRUE(server.Start());
+  subprocs_.spawn_server_ = &server;
+
+  Subprocess* direct = subprocs_.Add("ls /");
+  Subprocess* shell = subprocs_.Add("echo hello && exit 3");
+  Subprocess* interrupted = subprocs_.Add("kill -INT $$");
+  ASSERT_NE((Subprocess*)0, direct);
+  ASSERT_NE((Subprocess*)0, shell);
+  ASSERT_NE((Subprocess*)0, interrupted);
+  while (!direct->Done() || !shell->Done() || !interrupted->Done())
+    subprocs_.DoWork();
+
+  EXPECT_EQ(ExitSuccess, direct->Finish());
+  EXPECT_NE("", direct->GetOutput());
+  EXPECT_EQ(ExitFailure, shell->Finish());
+  EXPECT_EQ("hello\n", shell->GetOutput());
+  EXPECT_EQ(ExitInterrupted, interrupted->Finish());
+}
+#endif  // !_WIN32
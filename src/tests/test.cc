@@ -17,7 +17,12 @@
 #include <algorithm>
 #include <random>
 
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 #include <ninja/build_log.h>
 #include <ninja/graph.h>
@@ -208,3 +213,33 @@ void ScopedTempDir::Cleanup() {
 
   temp_dir_name_.clear();
 }
+
+#ifndef _WIN32
+ScopedStdoutCapture::ScopedStdoutCapture() {
+  file_ = tmpfile();
+  if (!file_)
+    Fatal("tmpfile: %s", strerror(errno));
+  fflush(stdout);
+  saved_fd_ = dup(1);
+  if (saved_fd_ < 0 || dup2(fileno(file_), 1) < 0)
+    Fatal("dup: %s", strerror(errno));
+}
+
+ScopedStdoutCapture::~ScopedStdoutCapture() {
+  fflush(stdout);
+  dup2(saved_fd_, 1);
+  close(saved_fd_);
+  fclose(file_);
+}
+
+std::string ScopedStdoutCapture::Read() {
+  fflush(stdout);
+  // Both descriptors share the file offset, so read without moving it.
+  std::string contents;
+  char buf[4 << 10];
+  ssize_t len;
+  while ((len = pread(fileno(file_), buf, sizeof(buf), contents.size())) > 0)
+    contents.append(buf, len);
+  return contents;
+}
+#endif
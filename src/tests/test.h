@@ -102,4 +102,20 @@ struct ScopedTempDir {
   std::string temp_dir_name_;
 };
 
+#ifndef _WIN32
+/// Redirects stdout, down to file descriptor 1, into a temporary file for
+/// as long as it lives.
+struct ScopedStdoutCapture {
+  ScopedStdoutCapture();
+  ~ScopedStdoutCapture();
+
+  /// Return everything written to stdout so far.
+  std::string Read();
+
+ private:
+  FILE* file_;
+  int saved_fd_;
+};
+#endif
+
 #endif  // NINJA_TEST_H_
@@ -0,0 +1,47 @@
+// Copyright 2018 Frank Benkstein. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <ninja/thread_pool.h>
+
+#include <atomic>
+
+#include "test.h"
+
+using namespace ninja;
+
+namespace {
+
+TEST(ThreadPoolTest, RunsAllTasks) {
+  std::atomic<int> sum(0);
+  {
+    ThreadPool pool(3);
+    for (int i = 1; i <= 100; ++i)
+      pool.Add([&sum, i] { sum += i; });
+  }
+  EXPECT_EQ(5050, sum);
+}
+
+TEST(ThreadPoolTest, OneThreadKeepsOrder) {
+  std::vector<int> order;
+  {
+    ThreadPool pool(1);
+    for (int i = 0; i < 10; ++i)
+      pool.Add([&order, i] { order.push_back(i); });
+  }
+  ASSERT_EQ(10u, order.size());
+  for (int i = 0; i < 10; ++i)
+    EXPECT_EQ(i, order[i]);
+}
+
+}  // namespace
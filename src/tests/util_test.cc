@@ -14,6 +14,11 @@
 
 #include <ninja/util.h>
 
+#include <ninja/hash_map.h>
+#include <ninja/ninja.h>
+
+#include <atomic>
+
 #include "test.h"
 
 using namespace ninja;
@@ -375,6 +380,45 @@ TEST(CanonicalizePath, NotNullTerminated) {
   EXPECT_EQ("file ./file bar/.", std::string(path));
 }
 
+TEST(CanonicalizePath, MatchesScalar) {
+#ifdef _WIN32
+  const char kAlphabet[] = "a./\\";
+#else
+  const char kAlphabet[] = "a./";
+#endif
+  const int kAlphabetSize = sizeof(kAlphabet) - 1;
+  // Long enough parts around the short ones to cross block boundaries.
+  const std::string kAffixes[] = { "", "abcdefghijklmnopqrstu/",
+                                   "../../abcdefghijklmn/o" };
+
+  for (int len = 1; len <= 7; ++len) {
+    int count = 1;
+    for (int i = 0; i < len; ++i)
+      count *= kAlphabetSize;
+    for (int n = 0; n < count; ++n) {
+      std::string middle;
+      for (int i = 0, rest = n; i < len; ++i, rest /= kAlphabetSize)
+        middle += kAlphabet[rest % kAlphabetSize];
+      for (const std::string& prefix : kAffixes) {
+        for (const std::string& suffix : kAffixes) {
+          std::string path = prefix + middle + suffix;
+          std::string expected = path;
+          std::string err;
+          size_t path_len = path.size(), expected_len = expected.size();
+          uint64_t slash_bits, expected_slash_bits;
+          ASSERT_TRUE(CanonicalizePath(&path[0], &path_len, &slash_bits, &err));
+          ASSERT_TRUE(CanonicalizePathScalar(&expected[0], &expected_len,
+                                             &expected_slash_bits, &err));
+          ASSERT_EQ(expected.substr(0, expected_len),
+                    path.substr(0, path_len))
+              << prefix + middle + suffix;
+          ASSERT_EQ(expected_slash_bits, slash_bits);
+        }
+      }
+    }
+  }
+}
+
 TEST(PathEscaping, TortureTest) {
   std::string result;
 
@@ -434,3 +478,122 @@ TEST(ElideMiddle, ElideInTheMiddle) {
   std::string elided = ElideMiddle(input, 10);
   EXPECT_EQ("012...789", elided);
 }
+
+TEST(Cgroup, ParseCpuMax) {
+  EXPECT_EQ(0.0, ParseCgroupCpuMax("max 100000\n"));
+  EXPECT_EQ(8.0, ParseCgroupCpuMax("800000 100000\n"));
+  EXPECT_EQ(0.5, ParseCgroupCpuMax("50000 100000"));
+  EXPECT_EQ(0.0, ParseCgroupCpuMax(""));
+  EXPECT_EQ(0.0, ParseCgroupCpuMax("100000"));
+}
+
+TEST(UsableProcessorCount, Basic) {
+  EXPECT_EQ(0, UsableProcessorCount(0, 0, 0.0));
+  EXPECT_EQ(8, UsableProcessorCount(8, 0, 0.0));
+  EXPECT_EQ(4, UsableProcessorCount(8, 4, 0.0));
+  EXPECT_EQ(4, UsableProcessorCount(0, 4, 0.0));
+  EXPECT_EQ(3, UsableProcessorCount(8, 4, 2.5));
+  EXPECT_EQ(1, UsableProcessorCount(8, 0, 0.2));
+}
+
+TEST(ParallelismGuess, Compute) {
+  ParallelismGuess guess;
+  EXPECT_EQ(2, guess.Compute());
+
+  guess.processors = 128;
+  EXPECT_EQ(130, guess.Compute());
+
+  // A smaller affinity mask or CPU quota wins.
+  guess.affinity = 16;
+  EXPECT_EQ(18, guess.Compute());
+  guess.cpu_quota = 7.5;
+  EXPECT_EQ(10, guess.Compute());
+  guess.cpu_quota = 0.5;
+  EXPECT_EQ(2, guess.Compute());
+  guess.cpu_quota = 8.0;
+
+  // Memory only limits parallelism if we know how much commands need.
+  guess.memory_limit = int64_t(4) << 30;
+  EXPECT_EQ(10, guess.Compute());
+  guess.edge_rss = uint64_t(1) << 30;
+  EXPECT_EQ(4, guess.Compute());
+  guess.edge_rss = uint64_t(8) << 30;
+  EXPECT_EQ(1, guess.Compute());
+}
+
+TEST(ParallelFor, CoversAllOnce) {
+  for (int threads : { 1, 3, 8 }) {
+    std::vector<std::atomic<int>> seen(1000);
+    std::atomic<int> calls(0);
+    ParallelFor(seen.size(), threads, 10, [&](size_t begin, size_t end) {
+      ++calls;
+      for (size_t i = begin; i < end; ++i)
+        ++seen[i];
+    });
+    EXPECT_EQ(threads, calls);
+    for (const auto& count : seen)
+      EXPECT_EQ(1, count);
+  }
+}
+
+TEST(ParallelFor, SmallInput) {
+  // Not enough work for more than one range.
+  int calls = 0;
+  ParallelFor(15, 8, 10, [&](size_t begin, size_t end) {
+    ++calls;
+    EXPECT_EQ(0u, begin);
+    EXPECT_EQ(15u, end);
+  });
+  EXPECT_EQ(1, calls);
+
+  calls = 0;
+  ParallelFor(0, 8, 10, [&](size_t begin, size_t end) {
+    ++calls;
+    EXPECT_EQ(begin, end);
+  });
+  EXPECT_EQ(1, calls);
+}
+
+TEST(SplitShellCommand, Words) {
+  std::vector<std::string> args;
+  EXPECT_TRUE(SplitShellCommand("cc -c  foo.c\t-o foo.o ", &args));
+  EXPECT_EQ((std::vector<std::string>{ "cc", "-c", "foo.c", "-o", "foo.o" }),
+            args);
+
+  EXPECT_TRUE(SplitShellCommand("cc 'a b'\"c d\"e '' @x.rsp -Wl,-z,now", &args));
+  EXPECT_EQ((std::vector<std::string>{ "cc", "a bc de", "", "@x.rsp",
+                                       "-Wl,-z,now" }),
+            args);
+}
+
+TEST(SplitShellCommand, NeedsShell) {
+  std::vector<std::string> args;
+  for (const char* command :
+       { "", "  ", "a && b", "a; b", "a | b", "cc > out", "cc $FOO",
+         "cc \"$FOO\"", "cc 'unterminated", "cc a\\ b", "cc *.c",
+         "cc ~/x", "cc {a,b}", "FOO=1 cc", "cd dir", "echo -e x",
+         "exec cc", "a\nb" }) {
+    EXPECT_FALSE(SplitShellCommand(command, &args)) << command;
+  }
+}
+
+TEST(StreamingHash64, KnownValues) {
+  // Reference values of XXH64 with seed 0.
+  EXPECT_EQ(0xEF46DB3751D8E999ull, StreamingHash64::Hash(""));
+  EXPECT_EQ(0x44BC2CF5AD770999ull, StreamingHash64::Hash("abc"));
+}
+
+TEST(StreamingHash64, Pieces) {
+  std::string input;
+  for (int i = 0; i < 1000; ++i)
+    input.push_back('a' + i % 26);
+  uint64_t expected = StreamingHash64::Hash(input);
+
+  // Piece sizes below, at and above the stripe size.
+  for (size_t piece : { 1, 7, 31, 32, 33, 100 }) {
+    StreamingHash64 hash;
+    for (size_t i = 0; i < input.size(); i += piece)
+      hash.Update(std::string_view(input).substr(i, piece));
+    EXPECT_EQ(expected, hash.Digest()) << piece;
+  }
+}